@@ -0,0 +1,512 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
+
+#include "backend-bitmap.h"
+#include "log.h"
+#include "utils.h"
+
+
+backend_bitmap::backend_bitmap(backend *const b, const std::string & filename, const uint32_t cluster_blocks, const bool backend_empty):
+	backend("bitmap:" + filename),
+	b(b),
+	filename(filename),
+	cluster_blocks(std::max(cluster_blocks, uint32_t(1))),
+	backend_empty(backend_empty)
+{
+}
+
+backend_bitmap::~backend_bitmap()
+{
+#if !defined(__MINGW32__)
+	if (mapping) {
+		msync(mapping, mapping_size, MS_SYNC);
+		munmap(mapping, mapping_size);
+	}
+#endif
+
+	if (fd != -1)
+		close(fd);
+
+	delete b;
+}
+
+bool backend_bitmap::begin()
+{
+#if defined(__MINGW32__)
+	DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "not supported on this platform");
+	return false;
+#else
+	if (b->begin() == false)
+		return false;
+
+	block_size   = b->get_block_size();
+	n_blocks     = b->get_size_in_blocks();
+	n_clusters   = (n_blocks + cluster_blocks - 1) / cluster_blocks;
+	mapping_size = header_size + (n_clusters + 7) / 8;
+
+	fd = open(filename.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "cannot open: %s", strerror(errno));
+		return false;
+	}
+
+	struct stat st { };
+	if (fstat(fd, &st) == -1) {
+		DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "cannot fstat: %s", strerror(errno));
+		return false;
+	}
+
+	bool is_new = st.st_size == 0;
+	if (is_new) {
+		if (ftruncate(fd, mapping_size) == -1) {
+			DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "cannot resize to %zu bytes: %s", mapping_size, strerror(errno));
+			return false;
+		}
+	}
+	else if (size_t(st.st_size) != mapping_size) {
+		DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "file is %zu bytes, expected %zu: was it made for another backend?", size_t(st.st_size), mapping_size);
+		return false;
+	}
+
+	void *p = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "cannot mmap: %s", strerror(errno));
+		return false;
+	}
+	mapping = reinterpret_cast<uint8_t *>(p);
+	bitmap  = &mapping[header_size];
+
+	bitmap_header *const h = reinterpret_cast<bitmap_header *>(mapping);
+	if (is_new) {
+		memcpy(h->magic, "iESPBMAP", sizeof h->magic);
+		h->version        = 1;
+		h->cluster_blocks = cluster_blocks;
+		h->n_blocks       = n_blocks;
+		h->block_size     = block_size;
+
+		// unless told otherwise, the backend may already contain data: everything is allocated then
+		memset(bitmap, backend_empty ? 0x00 : 0xff, mapping_size - header_size);
+		if (msync(mapping, mapping_size, MS_SYNC) == -1) {
+			DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "cannot msync: %s", strerror(errno));
+			return false;
+		}
+
+		DOLOG(logging::ll_info, "backend_bitmap::begin", identifier, "created a new bitmap, backend %s", backend_empty ? "is empty" : "is considered to be fully allocated");
+	}
+	else if (memcmp(h->magic, "iESPBMAP", sizeof h->magic) != 0 || h->version != 1 || h->cluster_blocks != cluster_blocks || h->n_blocks != n_blocks || h->block_size != block_size) {
+		DOLOG(logging::ll_error, "backend_bitmap::begin", identifier, "header does not match backend (cluster size %u, %" PRIu64 " blocks of %" PRIu64 " bytes)", cluster_blocks, n_blocks, block_size);
+		return false;
+	}
+
+	uint64_t count = 0;
+	for(uint64_t c=0; c<n_clusters; c++)
+		count += is_allocated(c);
+	n_allocated = count;
+
+	DOLOG(logging::ll_info, "backend_bitmap::begin", identifier, "%" PRIu64 " of %" PRIu64 " clusters of %u blocks allocated", count, n_clusters, cluster_blocks);
+
+	return true;
+#endif
+}
+
+std::string backend_bitmap::get_serial() const
+{
+	return b->get_serial();
+}
+
+uint64_t backend_bitmap::get_size_in_blocks() const
+{
+	return b->get_size_in_blocks();
+}
+
+uint64_t backend_bitmap::get_block_size() const
+{
+	return b->get_block_size();
+}
+
+uint8_t backend_bitmap::get_free_space_percentage()
+{
+	if (n_clusters == 0)
+		return 0;
+
+	return 100 - n_allocated * 100 / n_clusters;
+}
+
+uint32_t backend_bitmap::get_discard_granularity() const
+{
+	return std::max(cluster_blocks, b->get_discard_granularity());
+}
+
+// may only be called with 'bitmap_lock' held (or before the backend is used)
+bool backend_bitmap::is_allocated(const uint64_t cluster)
+{
+	return bitmap[cluster / 8] & (1 << (cluster & 7));
+}
+
+// 'sync_bitmap': make the changed part of the bitmap durable (for FUA writes)
+bool backend_bitmap::set_allocated(const uint64_t block_nr, const uint32_t n_blocks, const bool sync_bitmap)
+{
+	uint64_t first = block_nr / cluster_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / cluster_blocks;
+	uint64_t first_changed = UINT64_MAX;
+	uint64_t last_changed  = 0;
+
+	std::unique_lock<std::mutex> lck(bitmap_lock);
+	for(uint64_t c=first; c<=last; c++) {
+		if (is_allocated(c) == false) {
+			bitmap[c / 8] |= 1 << (c & 7);
+			n_allocated++;
+
+			first_changed = std::min(first_changed, c);
+			last_changed  = c;
+		}
+	}
+
+#if !defined(__MINGW32__)
+	if (sync_bitmap && first_changed != UINT64_MAX) {
+		static const size_t page_size = sysconf(_SC_PAGESIZE);
+		size_t start = (header_size + first_changed / 8) & ~(page_size - 1);
+		size_t end   = header_size + last_changed / 8 + 1;
+		if (msync(&mapping[start], end - start, MS_SYNC) == -1) {
+			DOLOG(logging::ll_error, "backend_bitmap::set_allocated", identifier, "cannot msync: %s", strerror(errno));
+			return false;
+		}
+	}
+#endif
+
+	return true;
+}
+
+// only clusters that are completely inside the range become free
+void backend_bitmap::clear_allocated(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t first = (block_nr + cluster_blocks - 1) / cluster_blocks;
+	uint64_t end   = block_nr + n_blocks == this->n_blocks ? n_clusters : (block_nr + n_blocks) / cluster_blocks;
+
+	std::unique_lock<std::mutex> lck(bitmap_lock);
+	for(uint64_t c=first; c<end; c++) {
+		if (is_allocated(c)) {
+			bitmap[c / 8] &= ~(1 << (c & 7));
+			n_allocated--;
+		}
+	}
+}
+
+// a write that covers part of a free cluster: the rest of it is read from
+// the backend afterwards and must be zero there
+bool backend_bitmap::zero_edge(const uint64_t block_nr, const uint32_t n_blocks, const bool fua)
+{
+	if (fua == false)
+		return b->write_zeroes(block_nr, n_blocks);
+
+	uint8_t *zero = new uint8_t[n_blocks * block_size]();
+	bool     rc   = b->write_fua(block_nr, n_blocks, zero);
+	delete [] zero;
+
+	return rc;
+}
+
+bool backend_bitmap::zero_cluster_edges(const uint64_t block_nr, const uint32_t n_blocks, const bool fua)
+{
+	if (cluster_blocks == 1)
+		return true;
+
+	uint64_t first = block_nr / cluster_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / cluster_blocks;
+	bool     first_free = false;
+	bool     last_free  = false;
+	{
+		std::unique_lock<std::mutex> lck(bitmap_lock);
+		first_free = is_allocated(first) == false;
+		last_free  = is_allocated(last ) == false;
+	}
+
+	uint64_t first_start = first * cluster_blocks;
+	if (first_free && block_nr > first_start) {
+		if (zero_edge(first_start, block_nr - first_start, fua) == false)
+			return false;
+	}
+
+	uint64_t end      = block_nr + n_blocks;
+	uint64_t last_end = std::min((last + 1) * cluster_blocks, this->n_blocks);
+	if (last_free && end < last_end) {
+		if (zero_edge(end, last_end - end, fua) == false)
+			return false;
+	}
+
+	return true;
+}
+
+// caller must hold the range lock
+bool backend_bitmap::read_locked(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	// runs of allocated (true) and free blocks
+	std::vector<std::pair<bool, uint32_t> > runs;
+	{
+		std::unique_lock<std::mutex> lck(bitmap_lock);
+
+		uint64_t cur = block_nr;
+		uint64_t end = block_nr + n_blocks;
+		while(cur < end) {
+			uint64_t c         = cur / cluster_blocks;
+			uint64_t next      = std::min((c + 1) * cluster_blocks, end);
+			bool     allocated = is_allocated(c);
+
+			if (runs.empty() == false && runs.back().first == allocated)
+				runs.back().second += next - cur;
+			else
+				runs.push_back({ allocated, next - cur });
+
+			cur = next;
+		}
+	}
+
+	uint32_t offset = 0;
+	for(auto & r: runs) {
+		if (r.first) {
+			if (b->read(block_nr + offset, r.second, &data[offset * block_size]) == false)
+				return false;
+		}
+		else {
+			memset(&data[offset * block_size], 0x00, r.second * block_size);
+		}
+
+		offset += r.second;
+	}
+
+	return true;
+}
+
+// caller must hold the range lock, cluster aligned
+bool backend_bitmap::write_locked(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua)
+{
+	if (zero_cluster_edges(block_nr, n_blocks, fua) == false)
+		return false;
+
+	// the bit goes first: an 'allocated' bit for a block that was not written is harmless, the other way around is not
+	if (set_allocated(block_nr, n_blocks, fua) == false)
+		return false;
+
+	if (fua)
+		return b->write_fua(block_nr, n_blocks, data);
+
+	return b->write(block_nr, n_blocks, data);
+}
+
+bool backend_bitmap::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+		rc = read_locked(block_nr, n_blocks, data);
+	}
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	return rc;
+}
+
+bool backend_bitmap::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	uint64_t first = block_nr / cluster_blocks * cluster_blocks;
+	uint64_t end   = (block_nr + n_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = write_locked(block_nr, n_blocks, data, false);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_bitmap::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	uint64_t first = block_nr / cluster_blocks * cluster_blocks;
+	uint64_t end   = (block_nr + n_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = write_locked(block_nr, n_blocks, data, true);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_bitmap::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t first = block_nr / cluster_blocks * cluster_blocks;
+	uint64_t end   = (block_nr + n_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = zero_cluster_edges(block_nr, n_blocks, false) && set_allocated(block_nr, n_blocks, false) && b->write_zeroes(block_nr, n_blocks);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_bitmap::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+	uint64_t first = block_nr / cluster_blocks * cluster_blocks;
+	uint64_t end   = (block_nr + n_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = zero_cluster_edges(block_nr, n_blocks, false) && set_allocated(block_nr, n_blocks, false) && b->write_same(block_nr, n_blocks, pattern);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_bitmap::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t first = block_nr / cluster_blocks * cluster_blocks;
+	uint64_t end   = (block_nr + n_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = b->trim(block_nr, n_blocks);
+		if (rc)
+			clear_allocated(block_nr, n_blocks);
+	}
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_bitmap::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	uint64_t first = block_nr / cluster_blocks * cluster_blocks;
+	uint64_t end   = (block_nr + n_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+
+	size_t   n_bytes = n_blocks * block_size;
+	uint8_t *buffer  = new uint8_t[n_bytes];
+	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
+
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+
+		if (read_locked(block_nr, n_blocks, buffer) == false)
+			result = cmpwrite_result_t::CWR_READ_ERROR;
+		else if (memcmp(buffer, data_compare, n_bytes) != 0) {
+			DOLOG(logging::ll_debug, "backend_bitmap::cmpwrite", identifier, "data does not match");
+			result = cmpwrite_result_t::CWR_MISMATCH;
+		}
+		else if (write_locked(block_nr, n_blocks, data_write, false) == false)
+			result = cmpwrite_result_t::CWR_WRITE_ERROR;
+		else {
+			bs.bytes_written += n_bytes;
+			bs.n_writes++;
+		}
+	}
+
+	delete [] buffer;
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_bytes;
+	bs.n_reads++;
+
+	return result;
+}
+
+bool backend_bitmap::sync()
+{
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+#if !defined(__MINGW32__)
+	if (msync(mapping, mapping_size, MS_SYNC) == -1) {
+		DOLOG(logging::ll_error, "backend_bitmap::sync", identifier, "cannot msync: %s", strerror(errno));
+		return false;
+	}
+#endif
+
+	return b->sync();
+}
+
+void backend_bitmap::get_and_reset_stats(backend_stats_t *const target)
+{
+	backend::get_and_reset_stats(target);
+	merge_child_stats(b, target);
+}
+
+bool backend_bitmap::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	return b->prefetch(block_nr, n_blocks, wait, fits);
+}
+
+bool backend_bitmap::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	std::unique_lock<std::mutex> lck(bitmap_lock);
+
+	uint64_t c         = block_nr / cluster_blocks;
+	bool     allocated = is_allocated(c);
+	uint64_t limit     = std::min(block_nr + max_n, n_blocks);
+
+	c++;
+	while(c * cluster_blocks < limit) {
+		// skip whole bytes that have the same state
+		if ((c & 7) == 0 && bitmap[c / 8] == (allocated ? 0xff : 0x00)) {
+			c += 8;
+			continue;
+		}
+
+		if (is_allocated(c) != allocated)
+			break;
+
+		c++;
+	}
+
+	*status = allocated ? LS_MAPPED : LS_DEALLOCATED;
+	*n_same = std::max(std::min(c * cluster_blocks, limit), block_nr + 1) - block_nr;
+
+	return true;
+}
+
+bool backend_bitmap::has_write_cache() const
+{
+	return b->has_write_cache();
+}
+
+bool backend_bitmap::get_write_cache() const
+{
+	return b->get_write_cache();
+}
+
+bool backend_bitmap::set_write_cache(const bool enable)
+{
+	return b->set_write_cache(enable);
+}
@@ -0,0 +1,79 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "backend.h"
+
+
+// Keeps track of which clusters (groups of blocks) of the backend it wraps
+// were written, in a memory-mapped sidecar file. Clusters that were never
+// written or that were trimmed are read as zeros without accessing the
+// backend. Also gives GET LBA STATUS and the free-space percentage for
+// backends that cannot tell themselves (NBD, block devices).
+class backend_bitmap : public backend
+{
+private:
+	struct bitmap_header {
+		char     magic[8];  // "iESPBMAP"
+		uint32_t version;
+		uint32_t cluster_blocks;
+		uint64_t n_blocks;
+		uint64_t block_size;
+	};
+
+	static constexpr const size_t header_size = 4096;  // bitmap starts at a page boundary
+
+	backend *const    b              { nullptr };  // owned
+	const std::string filename;
+	const uint32_t    cluster_blocks { 1       };
+	const bool        backend_empty  { false   };  // for a new bitmap: nothing was written yet
+	uint64_t          block_size     { 0       };
+	uint64_t          n_blocks       { 0       };
+	uint64_t          n_clusters     { 0       };
+	int               fd             { -1      };
+	uint8_t          *mapping        { nullptr };
+	size_t            mapping_size   { 0       };
+	uint8_t          *bitmap         { nullptr };  // in 'mapping'
+	std::mutex        bitmap_lock;
+	std::atomic_uint64_t n_allocated { 0       };  // clusters
+
+	bool     is_allocated   (const uint64_t cluster);
+	bool     set_allocated  (const uint64_t block_nr, const uint32_t n_blocks, const bool sync_bitmap);
+	void     clear_allocated(const uint64_t block_nr, const uint32_t n_blocks);
+	bool     zero_edge      (const uint64_t block_nr, const uint32_t n_blocks, const bool fua);
+	bool     zero_cluster_edges(const uint64_t block_nr, const uint32_t n_blocks, const bool fua);
+	bool     read_locked    (const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);
+	bool     write_locked   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua);
+
+public:
+	backend_bitmap(backend *const b, const std::string & filename, const uint32_t cluster_blocks, const bool backend_empty);
+	virtual ~backend_bitmap();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+	void get_and_reset_stats(backend_stats_t *const target) override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_same    (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+
+	bool has_write_cache() const override;
+	bool get_write_cache() const override;
+	bool set_write_cache(const bool enable) override;
+};
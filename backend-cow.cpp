@@ -0,0 +1,847 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+
+#include "backend-cow.h"
+#include "log.h"
+#include "utils.h"
+
+
+std::atomic_uint32_t cow_snapshot_requests { 0 };
+
+static bool pread_all(const int fd, uint8_t *const data, const size_t n, const uint64_t offset)
+{
+	for(size_t done=0; done<n;) {
+		ssize_t rc = pread(fd, &data[done], n - done, offset + done);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return false;
+		done += rc;
+	}
+
+	return true;
+}
+
+static bool pwrite_all(const int fd, const uint8_t *const data, const size_t n, const uint64_t offset)
+{
+	for(size_t done=0; done<n;) {
+		ssize_t rc = pwrite(fd, &data[done], n - done, offset + done);
+		if (rc == -1 && errno == EINTR)
+			continue;
+		if (rc <= 0)
+			return false;
+		done += rc;
+	}
+
+	return true;
+}
+
+static bool sync_fd(const int fd)
+{
+#if defined(__APPLE__)
+	return fsync(fd) == 0;
+#else
+	return fdatasync(fd) == 0;
+#endif
+}
+
+backend_cow::backend_cow(backend *const base, const std::string & overlay_file, const uint32_t cluster_blocks, const int64_t revert_to):
+	backend("cow:" + overlay_file),
+	base(base),
+	overlay_file(overlay_file),
+	journal_file(overlay_file + ".map"),
+	cluster_blocks(std::max(cluster_blocks, uint32_t(1))),
+	revert_to(revert_to)
+{
+}
+
+backend_cow::~backend_cow()
+{
+#if !defined(__MINGW32__)
+	if (data_fd != -1) {
+		sync_fd(data_fd);
+		close(data_fd);
+	}
+
+	if (journal_fd != -1) {
+		sync_fd(journal_fd);
+		close(journal_fd);
+	}
+#endif
+
+	delete view;
+	delete base;
+}
+
+bool backend_cow::begin()
+{
+#if defined(__MINGW32__)
+	DOLOG(logging::ll_error, "backend_cow::begin", identifier, "not supported on this platform");
+	return false;
+#else
+	if (base->begin() == false)
+		return false;
+
+	block_size   = base->get_block_size();
+	n_blocks     = base->get_size_in_blocks();
+	n_clusters   = (n_blocks + cluster_blocks - 1) / cluster_blocks;
+	cluster_size = cluster_blocks * block_size;
+
+	if (n_clusters >= pc_mask) {
+		DOLOG(logging::ll_error, "backend_cow::begin", identifier, "too many clusters (%" PRIu64 "), use a larger cluster size", n_clusters);
+		return false;
+	}
+
+	view = new radix_map(n_clusters);
+
+	data_fd = open(overlay_file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (data_fd == -1) {
+		DOLOG(logging::ll_error, "backend_cow::begin", identifier, "cannot open %s: %s", overlay_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	if (replay_journal() == false)
+		return false;
+
+	seen_requests = cow_snapshot_requests.load();
+
+	return true;
+#endif
+}
+
+// rebuilds the map from the journal: the last record for each cluster and
+// generation counts, the newest generation of a cluster is what is read
+bool backend_cow::replay_journal()
+{
+	journal_fd = open(journal_file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (journal_fd == -1) {
+		DOLOG(logging::ll_error, "backend_cow::replay_journal", identifier, "cannot open %s: %s", journal_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st { };
+	if (fstat(journal_fd, &st) == -1) {
+		DOLOG(logging::ll_error, "backend_cow::replay_journal", identifier, "cannot fstat: %s", strerror(errno));
+		return false;
+	}
+
+	if (st.st_size == 0) {
+		if (revert_to > 0) {
+			DOLOG(logging::ll_error, "backend_cow::replay_journal", identifier, "there are no snapshots to revert to");
+			return false;
+		}
+
+		return rewrite_journal({ });
+	}
+
+	journal_header h { };
+	if (pread_all(journal_fd, reinterpret_cast<uint8_t *>(&h), sizeof h, 0) == false || memcmp(h.magic, "iESPCOW1", sizeof h.magic) != 0 || h.version != 1 ||
+		h.cluster_blocks != cluster_blocks || h.n_blocks != n_blocks || h.block_size != block_size) {
+		DOLOG(logging::ll_error, "backend_cow::replay_journal", identifier, "header does not match (cluster size %u, %" PRIu64 " blocks of %" PRIu64 " bytes)", cluster_blocks, n_blocks, block_size);
+		return false;
+	}
+
+	// (generation << gen_shift | cluster) -> overlay cluster + 1 or zero_pc
+	std::unordered_map<uint64_t, uint64_t> latest;
+	uint32_t newest    = 1;
+	uint64_t n_records = 0;
+	bool     torn      = false;
+
+	std::vector<map_record> records(4096);
+	for(uint64_t offset = sizeof h; offset < uint64_t(st.st_size) && torn == false;) {
+		size_t n = std::min(records.size(), size_t((st.st_size - offset) / sizeof(map_record)));
+		if (n == 0) {  // partial record at the end
+			torn = true;
+			break;
+		}
+
+		if (pread_all(journal_fd, reinterpret_cast<uint8_t *>(records.data()), n * sizeof(map_record), offset) == false) {
+			DOLOG(logging::ll_error, "backend_cow::replay_journal", identifier, "cannot read: %s", strerror(errno));
+			return false;
+		}
+
+		for(size_t i=0; i<n; i++) {
+			const map_record & r = records[i];
+			if (r.type < R_MAP || r.type > R_SNAPSHOT || r.gen == 0 || r.gen > max_gen || r.cluster >= n_clusters || (r.type == R_MAP && r.pc >= pc_mask - 1)) {
+				torn = true;
+				break;
+			}
+
+			n_records++;
+			newest = std::max(newest, r.gen);
+
+			if (r.type == R_SNAPSHOT || (revert_to >= 0 && r.gen > revert_to))
+				continue;
+
+			latest[(uint64_t(r.gen) << gen_shift) | r.cluster] = r.type == R_MAP ? r.pc + 1 : zero_pc;
+		}
+
+		offset += n * sizeof(map_record);
+	}
+
+	if (torn)
+		DOLOG(logging::ll_warning, "backend_cow::replay_journal", identifier, "journal ends in an incomplete record, probably from a crash");
+
+	if (revert_to >= 0) {
+		if (revert_to >= newest) {
+			DOLOG(logging::ll_error, "backend_cow::replay_journal", identifier, "snapshot %" PRId64 " does not exist, the newest is %u", revert_to, newest - 1);
+			return false;
+		}
+
+		cur_gen = revert_to + 1;
+		DOLOG(logging::ll_warning, "backend_cow::replay_journal", identifier, "reverting to snapshot %" PRId64 ", %u newer generation(s) are removed", revert_to, newest - cur_gen);
+	}
+	else {
+		cur_gen = newest;
+	}
+
+	std::vector<std::pair<uint64_t, uint64_t> > entries(latest.begin(), latest.end());
+	std::sort(entries.begin(), entries.end());  // oldest generation first
+
+	std::vector<bool> used;
+	for(auto & e: entries) {
+		uint64_t cluster = e.first & pc_mask;
+		uint64_t current = view->get(cluster);
+		if (current == 0 || (current >> gen_shift) <= (e.first >> gen_shift))
+			view->set(cluster, (e.first & ~pc_mask) | e.second);
+
+		if (e.second != zero_pc) {
+			uint64_t pc = e.second - 1;
+			if (pc >= used.size())
+				used.resize(pc + 1);
+			used[pc] = true;
+		}
+	}
+
+	next_pc     = used.size();
+	n_allocated = 0;
+	std::vector<uint64_t> unused;
+	for(uint64_t pc=0; pc<next_pc; pc++) {
+		if (used[pc])
+			n_allocated++;
+		else
+			unused.push_back(pc);
+	}
+	free_pcs = unused;
+	std::reverse(free_pcs.begin(), free_pcs.end());  // lowest first
+
+	DOLOG(logging::ll_info, "backend_cow::replay_journal", identifier, "generation %u (%u snapshots), %" PRIu64 " clusters of %u blocks in the overlay, map: %zu kB", cur_gen, cur_gen - 1, n_allocated, cluster_blocks, view->get_memory_usage() / 1024);
+
+	// reverted: the overlay clusters of the removed generations are free now
+	if (revert_to >= 0) {
+		if (ftruncate(data_fd, next_pc * cluster_size) == -1)
+			DOLOG(logging::ll_warning, "backend_cow::replay_journal", identifier, "cannot truncate overlay: %s", strerror(errno));
+		punch(unused);
+	}
+
+	if (revert_to >= 0 || torn || n_records > entries.size() * 2 + 65536)
+		return rewrite_journal(entries);
+
+	journal_offset = sizeof h + n_records * sizeof(map_record);
+
+	return true;
+}
+
+// replaces the journal by one with only 'entries' (atomically, via rename)
+bool backend_cow::rewrite_journal(const std::vector<std::pair<uint64_t, uint64_t> > & entries)
+{
+	std::string temp_file = journal_file + ".new";
+	int fd = open(temp_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		DOLOG(logging::ll_error, "backend_cow::rewrite_journal", identifier, "cannot create %s: %s", temp_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	journal_header h { };
+	memcpy(h.magic, "iESPCOW1", sizeof h.magic);
+	h.version        = 1;
+	h.cluster_blocks = cluster_blocks;
+	h.n_blocks       = n_blocks;
+	h.block_size     = block_size;
+
+	std::vector<map_record> records;
+	records.push_back({ R_SNAPSHOT, cur_gen, 0, 0 });
+	for(auto & e: entries) {
+		map_record r { };
+		r.type    = e.second == zero_pc ? R_ZERO : R_MAP;
+		r.gen     = e.first >> gen_shift;
+		r.cluster = e.first & pc_mask;
+		r.pc      = e.second == zero_pc ? 0 : e.second - 1;
+		records.push_back(r);
+	}
+
+	bool ok = pwrite_all(fd, reinterpret_cast<const uint8_t *>(&h), sizeof h, 0) &&
+		pwrite_all(fd, reinterpret_cast<const uint8_t *>(records.data()), records.size() * sizeof(map_record), sizeof h) &&
+		fsync(fd) == 0;
+	close(fd);
+
+	if (ok == false || rename(temp_file.c_str(), journal_file.c_str()) == -1) {
+		DOLOG(logging::ll_error, "backend_cow::rewrite_journal", identifier, "cannot write %s: %s", temp_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	if (journal_fd != -1)
+		close(journal_fd);
+
+	journal_fd = open(journal_file.c_str(), O_RDWR);
+	if (journal_fd == -1) {
+		DOLOG(logging::ll_error, "backend_cow::rewrite_journal", identifier, "cannot open %s: %s", journal_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	journal_offset = sizeof h + records.size() * sizeof(map_record);
+
+	return true;
+}
+
+// must be called with 'map_lock' held
+bool backend_cow::journal_append(const std::vector<map_record> & records, const bool do_sync)
+{
+	if (records.empty())
+		return true;
+
+	size_t n_bytes = records.size() * sizeof(map_record);
+	if (pwrite_all(journal_fd, reinterpret_cast<const uint8_t *>(records.data()), n_bytes, journal_offset) == false) {
+		DOLOG(logging::ll_error, "backend_cow::journal_append", identifier, "cannot write: %s", strerror(errno));
+		return false;
+	}
+	journal_offset += n_bytes;
+
+	if (do_sync && sync_fd(journal_fd) == false) {
+		DOLOG(logging::ll_error, "backend_cow::journal_append", identifier, "cannot sync: %s", strerror(errno));
+		return false;
+	}
+
+	return true;
+}
+
+// must be called with 'map_lock' held
+uint64_t backend_cow::allocate_pc()
+{
+	n_allocated++;
+
+	if (free_pcs.empty())
+		return next_pc++;
+
+	uint64_t pc = free_pcs.back();
+	free_pcs.pop_back();
+
+	return pc;
+}
+
+void backend_cow::punch(const std::vector<uint64_t> & pcs)
+{
+#if defined(linux)
+	for(size_t i=0; i<pcs.size();) {
+		size_t j = i + 1;
+		while(j < pcs.size() && pcs[j] == pcs[j - 1] + 1)
+			j++;
+
+		if (fallocate(data_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pcs[i] * cluster_size, (j - i) * cluster_size) == -1) {
+			DOLOG(logging::ll_debug, "backend_cow::punch", identifier, "cannot punch hole: %s", strerror(errno));
+			break;
+		}
+
+		i = j;
+	}
+#endif
+}
+
+void backend_cow::check_snapshot_request()
+{
+	uint32_t requests = cow_snapshot_requests;
+	if (seen_requests.exchange(requests) != requests)
+		take_snapshot();
+}
+
+bool backend_cow::take_snapshot()
+{
+	std::unique_lock<std::shared_mutex> s_lck(snapshot_lock);  // no writes in progress
+
+	// the snapshot must be complete on disk before anything is written to the new generation
+	if (sync_fd(data_fd) == false) {
+		DOLOG(logging::ll_error, "backend_cow::take_snapshot", identifier, "cannot sync overlay: %s", strerror(errno));
+		return false;
+	}
+
+	std::unique_lock<std::mutex> lck(map_lock);
+	if (cur_gen >= max_gen) {
+		DOLOG(logging::ll_error, "backend_cow::take_snapshot", identifier, "too many snapshots");
+		return false;
+	}
+
+	if (journal_append({ { R_SNAPSHOT, cur_gen + 1, 0, 0 } }, true) == false)
+		return false;
+
+	cur_gen++;
+
+	free_pcs.insert(free_pcs.end(), pending_free.begin(), pending_free.end());
+	pending_free.clear();
+
+	DOLOG(logging::ll_info, "backend_cow::take_snapshot", identifier, "snapshot %u taken, %" PRIu64 " clusters in the overlay", cur_gen - 1, n_allocated);
+
+	return true;
+}
+
+// a write changes whole clusters
+void backend_cow::lock_range(const uint64_t block_nr, const uint32_t n_blocks, uint64_t *const start, uint32_t *const n) const
+{
+	uint64_t first = block_nr / cluster_blocks * cluster_blocks;
+	uint64_t end   = (block_nr + n_blocks + cluster_blocks - 1) / cluster_blocks * cluster_blocks;
+
+	*start = first;
+	*n     = end - first;
+}
+
+// caller must hold the range lock
+bool backend_cow::read_locked(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	enum run_kind_t { RK_BASE, RK_OVERLAY, RK_ZERO };
+
+	struct run {
+		run_kind_t kind;
+		uint64_t   block_nr;
+		uint32_t   n_blocks;
+		uint64_t   offset;  // in the overlay file
+	};
+
+	std::vector<run> runs;
+	{
+		std::unique_lock<std::mutex> lck(map_lock);
+
+		uint64_t cur = block_nr;
+		uint64_t end = block_nr + n_blocks;
+		while(cur < end) {
+			uint64_t c    = cur / cluster_blocks;
+			uint64_t next = std::min((c + 1) * cluster_blocks, end);
+			uint64_t e    = view->get(c);
+			uint64_t pc   = e & pc_mask;
+
+			run r { RK_BASE, cur, uint32_t(next - cur), 0 };
+			if (pc == zero_pc)
+				r.kind = RK_ZERO;
+			else if (pc) {
+				r.kind   = RK_OVERLAY;
+				r.offset = (pc - 1) * cluster_size + (cur - c * cluster_blocks) * block_size;
+			}
+
+			if (runs.empty() == false && runs.back().kind == r.kind && (r.kind != RK_OVERLAY || runs.back().offset + runs.back().n_blocks * block_size == r.offset))
+				runs.back().n_blocks += r.n_blocks;
+			else
+				runs.push_back(r);
+
+			cur = next;
+		}
+	}
+
+	for(auto & r: runs) {
+		uint8_t *p = &data[(r.block_nr - block_nr) * block_size];
+
+		if (r.kind == RK_ZERO)
+			memset(p, 0x00, r.n_blocks * block_size);
+		else if (r.kind == RK_BASE) {
+			if (base->read(r.block_nr, r.n_blocks, p) == false)
+				return false;
+		}
+		else if (pread_all(data_fd, p, r.n_blocks * block_size, r.offset) == false) {
+			DOLOG(logging::ll_error, "backend_cow::read_locked", identifier, "cannot read overlay: %s", strerror(errno));
+			return false;
+		}
+	}
+
+	return true;
+}
+
+// caller must hold the range lock (whole clusters) and 'snapshot_lock'
+// (shared); clusters of this generation are overwritten in place, others
+// get a new place in the overlay (filled with their old contents when the
+// write does not cover them completely)
+bool backend_cow::write_locked(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua)
+{
+	struct io {
+		uint64_t       offset;
+		const uint8_t *p;
+		size_t         n;
+	};
+
+	std::vector<io>       ios;
+	std::list<std::vector<uint8_t> > buffers;
+	std::vector<std::pair<uint64_t, uint64_t> > new_entries;  // cluster, overlay cluster
+
+	auto release = [&]() {
+		std::unique_lock<std::mutex> lck(map_lock);
+		for(auto & e: new_entries) {
+			free_pcs.push_back(e.second);
+			n_allocated--;
+		}
+	};
+
+	uint64_t cur = block_nr;
+	uint64_t end = block_nr + n_blocks;
+	while(cur < end) {
+		uint64_t c             = cur / cluster_blocks;
+		uint64_t cluster_start = c * cluster_blocks;
+		uint64_t cluster_n     = std::min(cluster_start + cluster_blocks, this->n_blocks) - cluster_start;
+		uint64_t next          = std::min(cluster_start + cluster_n, end);
+		const uint8_t *src     = &data[(cur - block_nr) * block_size];
+
+		uint64_t e   = 0;
+		uint32_t gen = 0;
+		{
+			std::unique_lock<std::mutex> lck(map_lock);
+			e   = view->get(c);
+			gen = cur_gen;
+		}
+
+		io w { };
+		if ((e >> gen_shift) == gen && (e & pc_mask) != zero_pc && (e & pc_mask) != 0) {
+			w = { ((e & pc_mask) - 1) * cluster_size + (cur - cluster_start) * block_size, src, (next - cur) * block_size };
+		}
+		else {
+			uint64_t pc = 0;
+			{
+				std::unique_lock<std::mutex> lck(map_lock);
+				pc = allocate_pc();
+			}
+			new_entries.push_back({ c, pc });
+
+			if (next - cur == cluster_n)
+				w = { pc * cluster_size, src, cluster_n * block_size };
+			else {
+				buffers.emplace_back(cluster_n * block_size);
+				uint8_t *buffer = buffers.back().data();
+				if (read_locked(cluster_start, cluster_n, buffer) == false) {
+					release();
+					return false;
+				}
+
+				memcpy(&buffer[(cur - cluster_start) * block_size], src, (next - cur) * block_size);
+				w = { pc * cluster_size, buffer, cluster_n * block_size };
+			}
+		}
+
+		if (ios.empty() == false && ios.back().offset + ios.back().n == w.offset && ios.back().p + ios.back().n == w.p)
+			ios.back().n += w.n;
+		else
+			ios.push_back(w);
+
+		cur = next;
+	}
+
+	for(auto & w: ios) {
+		if (pwrite_all(data_fd, w.p, w.n, w.offset) == false) {
+			DOLOG(logging::ll_error, "backend_cow::write_locked", identifier, "cannot write overlay: %s", strerror(errno));
+			release();
+			return false;
+		}
+	}
+
+	// the data before the map: a crash in between only leaks the clusters
+	if (fua && sync_fd(data_fd) == false) {
+		DOLOG(logging::ll_error, "backend_cow::write_locked", identifier, "cannot sync overlay: %s", strerror(errno));
+		release();
+		return false;
+	}
+
+	std::unique_lock<std::mutex> lck(map_lock);
+
+	std::vector<map_record> records;
+	for(auto & e: new_entries) {
+		view->set(e.first, (uint64_t(cur_gen) << gen_shift) | (e.second + 1));
+		records.push_back({ R_MAP, cur_gen, e.first, e.second });
+	}
+
+	return journal_append(records, fua);
+}
+
+// caller must hold the range lock and 'snapshot_lock' (shared); whole
+// clusters become "zero" in the map, the edges are written
+bool backend_cow::zero_locked(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t end        = block_nr + n_blocks;
+	uint64_t first_full = (block_nr + cluster_blocks - 1) / cluster_blocks;
+	uint64_t end_full   = end == this->n_blocks ? n_clusters : end / cluster_blocks;
+
+	if (first_full >= end_full) {
+		std::vector<uint8_t> zero(n_blocks * block_size);
+		return write_locked(block_nr, n_blocks, zero.data(), false);
+	}
+
+	uint64_t head = first_full * cluster_blocks - block_nr;
+	if (head) {
+		std::vector<uint8_t> zero(head * block_size);
+		if (write_locked(block_nr, head, zero.data(), false) == false)
+			return false;
+	}
+
+	uint64_t tail_start = std::min(end_full * cluster_blocks, end);
+	if (tail_start < end) {
+		std::vector<uint8_t> zero((end - tail_start) * block_size);
+		if (write_locked(tail_start, end - tail_start, zero.data(), false) == false)
+			return false;
+	}
+
+	std::vector<uint64_t> freed;
+	bool ok = true;
+	{
+		std::unique_lock<std::mutex> lck(map_lock);
+
+		std::vector<map_record> records;
+		for(uint64_t c=first_full; c<end_full; c++) {
+			uint64_t e  = view->get(c);
+			uint64_t pc = e & pc_mask;
+			if (pc == zero_pc)
+				continue;
+
+			// only clusters of this generation are not in a snapshot
+			if (pc && (e >> gen_shift) == cur_gen) {
+				pending_free.push_back(pc - 1);
+				freed.push_back(pc - 1);
+				n_allocated--;
+			}
+
+			view->set(c, (uint64_t(cur_gen) << gen_shift) | zero_pc);
+			records.push_back({ R_ZERO, cur_gen, c, 0 });
+		}
+
+		ok = journal_append(records, false);
+
+		// before a sync() can make them available again
+		std::sort(freed.begin(), freed.end());
+		punch(freed);
+	}
+
+	return ok;
+}
+
+std::string backend_cow::get_serial() const
+{
+	return "cow-" + base->get_serial();
+}
+
+uint64_t backend_cow::get_size_in_blocks() const
+{
+	return n_blocks;
+}
+
+uint64_t backend_cow::get_block_size() const
+{
+	return base->get_block_size();
+}
+
+uint8_t backend_cow::get_free_space_percentage()
+{
+	std::unique_lock<std::mutex> lck(map_lock);
+	if (n_clusters == 0)
+		return 0;
+
+	return 100 - std::min(n_allocated, n_clusters) * 100 / n_clusters;
+}
+
+uint32_t backend_cow::get_discard_granularity() const
+{
+	return cluster_blocks;
+}
+
+// clusters freed since the previous sync can be reused once the journal
+// that says so is on disk
+bool backend_cow::sync()
+{
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	if (sync_fd(data_fd) == false) {
+		DOLOG(logging::ll_error, "backend_cow::sync", identifier, "cannot sync overlay: %s", strerror(errno));
+		return false;
+	}
+
+	std::unique_lock<std::mutex> lck(map_lock);
+	if (sync_fd(journal_fd) == false) {
+		DOLOG(logging::ll_error, "backend_cow::sync", identifier, "cannot sync journal: %s", strerror(errno));
+		return false;
+	}
+
+	free_pcs.insert(free_pcs.end(), pending_free.begin(), pending_free.end());
+	pending_free.clear();
+
+	return true;
+}
+
+bool backend_cow::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_cow::read", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+		rc = read_locked(block_nr, n_blocks, data);
+	}
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	return rc;
+}
+
+bool backend_cow::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_cow::write", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	check_snapshot_request();
+
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+
+	bool rc = false;
+	{
+		std::shared_lock<std::shared_mutex> s_lck(snapshot_lock);
+		range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+		rc = write_locked(block_nr, n_blocks, data, false);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_cow::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	check_snapshot_request();
+
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+
+	bool rc = false;
+	{
+		std::shared_lock<std::shared_mutex> s_lck(snapshot_lock);
+		range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+		rc = write_locked(block_nr, n_blocks, data, true);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_cow::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	check_snapshot_request();
+
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+
+	bool rc = false;
+	{
+		std::shared_lock<std::shared_mutex> s_lck(snapshot_lock);
+		range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+		rc = zero_locked(block_nr, n_blocks);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_cow::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	check_snapshot_request();
+
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+
+	bool rc = false;
+	{
+		std::shared_lock<std::shared_mutex> s_lck(snapshot_lock);
+		range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+		rc = zero_locked(block_nr, n_blocks);
+	}
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_cow::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	check_snapshot_request();
+
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+
+	size_t               n_bytes = n_blocks * block_size;
+	std::vector<uint8_t> buffer(n_bytes);
+	cmpwrite_result_t    result  = cmpwrite_result_t::CWR_OK;
+
+	{
+		std::shared_lock<std::shared_mutex> s_lck(snapshot_lock);
+		range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+
+		if (read_locked(block_nr, n_blocks, buffer.data()) == false)
+			result = cmpwrite_result_t::CWR_READ_ERROR;
+		else if (memcmp(buffer.data(), data_compare, n_bytes) != 0)
+			result = cmpwrite_result_t::CWR_MISMATCH;
+		else if (write_locked(block_nr, n_blocks, data_write, false) == false)
+			result = cmpwrite_result_t::CWR_WRITE_ERROR;
+		else {
+			bs.bytes_written += n_bytes;
+			bs.n_writes++;
+		}
+	}
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_bytes;
+	bs.n_reads++;
+
+	return result;
+}
+
+// clusters that are not in the overlay have the status of the base
+bool backend_cow::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	uint64_t limit = std::min(block_nr + max_n, n_blocks);
+	uint64_t c     = block_nr / cluster_blocks;
+	uint64_t kind  = 0;  // 0: base, 1: overlay, 2: zero
+	{
+		std::unique_lock<std::mutex> lck(map_lock);
+
+		auto kind_of = [this](const uint64_t cluster) -> uint64_t {
+			uint64_t pc = view->get(cluster) & pc_mask;
+			return pc == zero_pc ? 2 : (pc ? 1 : 0);
+		};
+
+		kind = kind_of(c);
+		c++;
+		while(c * cluster_blocks < limit && kind_of(c) == kind)
+			c++;
+	}
+
+	uint64_t end = std::max(std::min(c * cluster_blocks, limit), block_nr + 1);
+
+	if (kind == 0)
+		return base->get_lba_status(block_nr, end - block_nr, status, n_same);
+
+	*status = kind == 1 ? LS_MAPPED : LS_DEALLOCATED;
+	*n_same = end - block_nr;
+
+	return true;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+#include "radix-map.h"
+
+
+// incremented (e.g. from a signal handler) to let every backend_cow take a
+// snapshot; they do so before their next write
+extern std::atomic_uint32_t cow_snapshot_requests;
+
+// Copy-on-write overlay over a read-only base backend. Written clusters go
+// to a sparse overlay file, an in-memory radix tree maps each cluster to
+// its place there (or to "zeroes", or to nothing: then it is read from the
+// base). Every change of the map is appended to a journal next to the
+// overlay. Taking a snapshot only starts a new generation: clusters that
+// were written in an older one are copied on their next write instead of
+// being overwritten, so the old generation stays intact and iESP can be
+// started on it again later ('revert_to').
+class backend_cow : public backend
+{
+private:
+	enum record_type_t : uint32_t { R_MAP = 1, R_ZERO = 2, R_SNAPSHOT = 3 };
+
+	struct journal_header {
+		char     magic[8];  // "iESPCOW1"
+		uint32_t version;
+		uint32_t cluster_blocks;
+		uint64_t n_blocks;
+		uint64_t block_size;
+	};
+
+	struct map_record {
+		uint32_t type;  // record_type_t
+		uint32_t gen;
+		uint64_t cluster;
+		uint64_t pc;  // R_MAP: cluster in the overlay file
+	};
+
+	// an entry in the map: generation << gen_shift | (overlay cluster + 1 or zero_pc)
+	static constexpr const int      gen_shift = 44;
+	static constexpr const uint64_t pc_mask   = (uint64_t(1) << gen_shift) - 1;
+	static constexpr const uint64_t zero_pc   = pc_mask;
+	static constexpr const uint32_t max_gen   = (uint32_t(1) << (64 - gen_shift)) - 1;
+
+	backend *const    base           { nullptr };  // owned, only read from
+	const std::string overlay_file;
+	const std::string journal_file;
+	const uint32_t    cluster_blocks { 1       };
+	const int64_t     revert_to      { -1      };  // generation, -1: the newest
+	uint64_t          block_size     { 0       };
+	uint64_t          n_blocks       { 0       };
+	uint64_t          n_clusters     { 0       };
+	uint64_t          cluster_size   { 0       };  // in bytes
+	int               data_fd        { -1      };
+	int               journal_fd     { -1      };
+	std::atomic_uint32_t seen_requests { 0     };  // of cow_snapshot_requests
+
+	std::mutex        map_lock;  // protects the members below
+	radix_map        *view           { nullptr };  // the newest entry of each cluster
+	uint32_t          cur_gen        { 1       };
+	uint64_t          journal_offset { 0       };
+	uint64_t          next_pc        { 0       };  // end of the overlay file, in clusters
+	std::vector<uint64_t> free_pcs;
+	std::vector<uint64_t> pending_free;  // become free when the journal is synced
+	uint64_t          n_allocated    { 0       };  // clusters in the overlay file
+
+	std::shared_mutex snapshot_lock;  // writes shared, take_snapshot exclusive
+
+	bool     replay_journal   ();
+	bool     rewrite_journal  (const std::vector<std::pair<uint64_t, uint64_t> > & entries);
+	bool     journal_append   (const std::vector<map_record> & records, const bool do_sync);
+	uint64_t allocate_pc      ();
+	void     punch            (const std::vector<uint64_t> & pcs);
+	void     check_snapshot_request();
+	void     lock_range       (const uint64_t block_nr, const uint32_t n_blocks, uint64_t *const start, uint32_t *const n) const;
+	bool     read_locked      (const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);
+	bool     write_locked     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua);
+	bool     zero_locked      (const uint64_t block_nr, const uint32_t n_blocks);
+
+public:
+	// 'revert_to': start on that snapshot (0: the base itself), newer ones are removed
+	backend_cow(backend *const base, const std::string & overlay_file, const uint32_t cluster_blocks, const int64_t revert_to);
+	virtual ~backend_cow();
+
+	bool begin() override;
+
+	// freezes the current generation, O(1)
+	bool take_snapshot();
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+};
@@ -0,0 +1,487 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+#include "backend-discard.h"
+#include "log.h"
+#include "utils.h"
+
+
+backend_discard::backend_discard(backend *const b, const uint64_t max_bytes_per_s):
+	backend(myformat("discard:%" PRIu64, max_bytes_per_s)),
+	b(b),
+	block_size(b->get_block_size()),
+	granularity(std::max(b->get_discard_granularity(), uint32_t(1))),
+	max_blocks_per_s(max_bytes_per_s ? std::max(max_bytes_per_s / b->get_block_size(), uint64_t(1)) : 0)
+{
+}
+
+backend_discard::~backend_discard()
+{
+	stop_flag = true;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		discarder_cv.notify_all();
+	}
+
+	if (discarder) {
+		discarder->join();
+		delete discarder;
+	}
+
+	// whatever is left, without rate limit
+	uint64_t n_done = 0;
+	bool     ok     = true;
+	do {
+		ok = discard_next(max_step, &n_done);
+	}
+	while(ok && n_done > 0);
+
+	if (pending.empty() == false)
+		DOLOG(logging::ll_error, "backend_discard::~backend_discard", identifier, "%zu ranges could not be discarded", pending.size());
+
+	delete b;
+}
+
+bool backend_discard::begin()
+{
+	if (b->begin() == false)
+		return false;
+
+	DOLOG(logging::ll_info, "backend_discard::begin", identifier, "at most %" PRIu64 " blocks per second (0 = no limit), granularity %u blocks", max_blocks_per_s, granularity);
+
+	discarder = new std::thread(&backend_discard::discarder_thread, this);
+
+	return true;
+}
+
+std::string backend_discard::get_serial() const
+{
+	return b->get_serial();
+}
+
+uint64_t backend_discard::get_size_in_blocks() const
+{
+	return b->get_size_in_blocks();
+}
+
+uint64_t backend_discard::get_block_size() const
+{
+	return block_size;
+}
+
+uint8_t backend_discard::get_free_space_percentage()
+{
+	return b->get_free_space_percentage();
+}
+
+uint32_t backend_discard::get_discard_granularity() const
+{
+	return granularity;
+}
+
+void backend_discard::discarder_thread()
+{
+	// a tenth of the budget of a second per step so that the rate is smooth
+	const uint32_t step = max_blocks_per_s ? uint32_t(std::clamp(max_blocks_per_s / 10, uint64_t(granularity), uint64_t(max_step))) : max_step;
+
+	while(stop_flag == false) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+			discarder_cv.wait(lck, [this] { return stop_flag || pending.empty() == false; });
+		}
+
+		if (stop_flag)
+			break;
+
+		uint64_t start  = get_micros();
+		uint64_t n_done = 0;
+		bool     ok     = discard_next(step, &n_done);
+
+		uint64_t budget = max_blocks_per_s ? n_done * 1000000 / max_blocks_per_s : 0;  // in uS
+		if (ok == false)
+			budget = std::max(budget, uint64_t(1000000));  // the ranges stay pending, retry later
+
+		uint64_t took = get_micros() - start;
+		if (budget > took) {
+			std::unique_lock<std::mutex> lck(lock);
+			discarder_cv.wait_for(lck, std::chrono::microseconds(budget - took), [this] { return stop_flag.load(); });
+		}
+	}
+}
+
+// discards (at most 'max_n' blocks of) the first pending range
+bool backend_discard::discard_next(const uint32_t max_n, uint64_t *const n_done)
+{
+	uint64_t start = 0;
+	uint64_t end   = 0;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		if (pending.empty()) {
+			*n_done = 0;
+			return true;
+		}
+
+		start = pending.begin()->first;
+		end   = std::min(pending.begin()->second, start + max_n);
+
+		// let a step that does not reach the end of the range end on a granule, so
+		// that the backend can release whole units
+		uint64_t aligned_end = end / granularity * granularity;
+		if (end < pending.begin()->second && aligned_end > start)
+			end = aligned_end;
+	}
+
+	range_lock_guard lck_range(&locks, start, end - start, range_lock::rl_exclusive);
+	*n_done = end - start;
+
+	return discard_locked(start, end - start, false);
+}
+
+// may only be called with the range locked (exclusive)
+// passes the pending parts of the range on to the backend; with 'fua' they
+// are on stable storage when this returns
+bool backend_discard::discard_locked(const uint64_t block_nr, const uint32_t n_blocks, const bool fua)
+{
+	std::vector<std::pair<uint64_t, uint64_t> > todo;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		todo = get_pending(block_nr, block_nr + n_blocks);
+	}
+
+	for(auto & r: todo) {
+		uint32_t n     = r.second - r.first;
+		uint64_t start = get_micros();
+		bool     ok    = fua ? b->trim_fua(r.first, n) : b->trim(r.first, n);
+		if (ok == false) {
+			DOLOG(logging::ll_warning, "backend_discard::discard_locked", identifier, "trim of block %" PRIu64 ", %u blocks failed, writing zeroes", r.first, n);
+			ok = b->write_zeroes(r.first, n) && (fua == false || b->sync());
+		}
+		bs.io_wait += get_micros() - start;
+
+		if (ok == false) {
+			DOLOG(logging::ll_error, "backend_discard::discard_locked", identifier, "cannot discard block %" PRIu64 ", %u blocks", r.first, n);
+			return false;
+		}
+
+		std::unique_lock<std::mutex> lck(lock);
+		remove_pending(r.first, r.second);
+	}
+
+	return true;
+}
+
+// may only be called with 'lock' held
+// the parts of [block_nr, end) that are pending
+std::vector<std::pair<uint64_t, uint64_t> > backend_discard::get_pending(const uint64_t block_nr, const uint64_t end)
+{
+	std::vector<std::pair<uint64_t, uint64_t> > out;
+
+	auto it = pending.upper_bound(block_nr);
+	if (it != pending.begin() && std::prev(it)->second > block_nr)
+		it--;
+
+	for(; it != pending.end() && it->first < end; it++)
+		out.push_back({ std::max(it->first, block_nr), std::min(it->second, end) });
+
+	return out;
+}
+
+// may only be called with 'lock' held
+void backend_discard::add_pending(uint64_t block_nr, uint64_t end)
+{
+	// merge with the ranges it overlaps or touches
+	auto it = pending.upper_bound(block_nr);
+	if (it != pending.begin() && std::prev(it)->second >= block_nr)
+		it--;
+
+	while(it != pending.end() && it->first <= end) {
+		block_nr = std::min(block_nr, it->first);
+		end      = std::max(end, it->second);
+		it       = pending.erase(it);
+	}
+
+	pending.insert({ block_nr, end });
+}
+
+// may only be called with 'lock' held
+void backend_discard::remove_pending(const uint64_t block_nr, const uint64_t end)
+{
+	auto it = pending.upper_bound(block_nr);
+	if (it != pending.begin() && std::prev(it)->second > block_nr)
+		it--;
+
+	while(it != pending.end() && it->first < end) {
+		uint64_t range_start = it->first;
+		uint64_t range_end   = it->second;
+		it = pending.erase(it);
+
+		if (range_start < block_nr)
+			pending.insert({ range_start, block_nr });
+		if (range_end > end)
+			pending.insert({ end, range_end });
+	}
+}
+
+bool backend_discard::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_discard::read", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	std::vector<std::pair<uint64_t, uint64_t> > zero;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		zero = get_pending(block_nr, block_nr + n_blocks);
+	}
+
+	bool rc = true;
+	if (zero.size() != 1 || zero[0].first != block_nr || zero[0].second != block_nr + n_blocks) {  // not all of it pending
+		uint64_t start = get_micros();
+		rc = b->read(block_nr, n_blocks, data);
+		bs.io_wait += get_micros() - start;
+	}
+
+	for(auto & r: zero)
+		memset(&data[(r.first - block_nr) * block_size], 0x00, (r.second - r.first) * block_size);
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	return rc;
+}
+
+bool backend_discard::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write(block_nr, n_blocks, data);
+	if (rc) {
+		std::unique_lock<std::mutex> lck(lock);
+		remove_pending(block_nr, block_nr + n_blocks);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_discard::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write_fua(block_nr, n_blocks, data);
+	if (rc) {
+		std::unique_lock<std::mutex> lck(lock);
+		remove_pending(block_nr, block_nr + n_blocks);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_discard::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write_zeroes(block_nr, n_blocks);
+	if (rc) {
+		std::unique_lock<std::mutex> lck(lock);
+		remove_pending(block_nr, block_nr + n_blocks);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_discard::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write_same(block_nr, n_blocks, pattern);
+	if (rc) {
+		std::unique_lock<std::mutex> lck(lock);
+		remove_pending(block_nr, block_nr + n_blocks);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_discard::copy(const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks)
+{
+	{
+		range_lock_copy_guard lck_range(&locks, src_block_nr, dst_block_nr, n_blocks);
+
+		bool src_pending = false;
+		{
+			std::unique_lock<std::mutex> lck(lock);
+			src_pending = get_pending(src_block_nr, src_block_nr + n_blocks).empty() == false;
+		}
+
+		// the backend would copy what is still there instead of zeros
+		if (src_pending == false) {
+			bool rc = b->copy(src_block_nr, dst_block_nr, n_blocks);
+			if (rc) {
+				std::unique_lock<std::mutex> lck(lock);
+				remove_pending(dst_block_nr, dst_block_nr + n_blocks);
+			}
+
+			ts_last_acces     = get_micros();
+			bs.bytes_written += n_blocks * block_size;
+			bs.n_writes++;
+
+			return rc;
+		}
+	}
+
+	return backend::copy(src_block_nr, dst_block_nr, n_blocks);
+}
+
+bool backend_discard::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_debug, "backend_discard::trim", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	if (n_blocks == 0)
+		return true;
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		add_pending(block_nr, block_nr + n_blocks);
+		discarder_cv.notify_one();
+	}
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return true;
+}
+
+// not deferred: only this range is passed on, other pending ones stay queued
+bool backend_discard::trim_fua(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_debug, "backend_discard::trim_fua", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	if (n_blocks == 0)
+		return true;
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		add_pending(block_nr, block_nr + n_blocks);
+	}
+
+	bool rc = discard_locked(block_nr, n_blocks, true);
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_discard::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	// the backend must compare against the zeros that a read would return
+	if (discard_locked(block_nr, n_blocks, false) == false)
+		return CWR_READ_ERROR;
+
+	auto rc = b->cmpwrite(block_nr, n_blocks, data_write, data_compare);
+
+	ts_last_acces = get_micros();
+	bs.n_reads++;
+	bs.n_writes++;
+
+	return rc;
+}
+
+// passes the ranges that are pending at this moment on to the backend (not
+// rate limited) before syncing it, so that a trim before a sync survives a
+// crash like a write does
+bool backend_discard::sync()
+{
+	std::vector<std::pair<uint64_t, uint64_t> > todo;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		todo.assign(pending.begin(), pending.end());
+	}
+
+	bool ok = true;
+	for(auto & r: todo) {
+		for(uint64_t block_nr = r.first; block_nr < r.second && ok; block_nr += max_step) {
+			uint32_t n = std::min(r.second - block_nr, uint64_t(max_step));
+			range_lock_guard lck_range(&locks, block_nr, n, range_lock::rl_exclusive);
+			ok = discard_locked(block_nr, n, false);
+		}
+	}
+
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	if (ok == false) {
+		DOLOG(logging::ll_error, "backend_discard::sync", identifier, "pending ranges could not be discarded");
+		return false;
+	}
+
+	return b->sync();
+}
+
+void backend_discard::get_and_reset_stats(backend_stats_t *const target)
+{
+	backend::get_and_reset_stats(target);
+	merge_child_stats(b, target);
+}
+
+bool backend_discard::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	return b->prefetch(block_nr, n_blocks, wait, fits);
+}
+
+bool backend_discard::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	uint64_t n = max_n;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		auto it = pending.upper_bound(block_nr);
+		if (it != pending.begin() && std::prev(it)->second > block_nr) {
+			*status = LS_DEALLOCATED;
+			*n_same = std::min(std::prev(it)->second - block_nr, max_n);
+			return true;
+		}
+
+		if (it != pending.end())
+			n = std::min(n, it->first - block_nr);
+	}
+
+	return b->get_lba_status(block_nr, n, status, n_same);
+}
+
+bool backend_discard::has_write_cache() const
+{
+	return b->has_write_cache();
+}
+
+bool backend_discard::get_write_cache() const
+{
+	return b->get_write_cache();
+}
+
+bool backend_discard::set_write_cache(const bool enable)
+{
+	return b->set_write_cache(enable);
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.h"
+
+
+// Completes trims right away and passes them on to the backend it wraps in
+// the background, at most 'max_blocks_per_s' per second, so that the large
+// UNMAP lists a guest sends after deleting files do not compete with other
+// I/O. Ranges that were not discarded yet are read as zeros. They are kept
+// in RAM only, a sync passes all of them on first: when iESP is killed, the
+// ones trimmed after the last sync read as their old contents again.
+class backend_discard : public backend
+{
+private:
+	static constexpr const uint32_t max_step = 65536;  // blocks per backend trim
+
+	backend *const   b                { nullptr };  // owned
+	const uint64_t   block_size       { 0       };
+	const uint32_t   granularity      { 1       };  // of 'b'
+	const uint64_t   max_blocks_per_s { 0       };  // 0: no limit
+	std::atomic_bool stop_flag        { false   };
+
+	std::mutex       lock;  // protects the members below
+	std::map<uint64_t, uint64_t> pending;  // first block -> first block after the range; never overlapping or adjacent
+	std::condition_variable discarder_cv;
+
+	std::thread     *discarder        { nullptr };
+
+	void discarder_thread();
+	bool discard_next    (const uint32_t max_n, uint64_t *const n_done);
+	bool discard_locked  (const uint64_t block_nr, const uint32_t n_blocks, const bool fua);
+	std::vector<std::pair<uint64_t, uint64_t> > get_pending(const uint64_t block_nr, const uint64_t end);
+	void add_pending     (uint64_t block_nr, uint64_t end);
+	void remove_pending  (const uint64_t block_nr, const uint64_t end);
+
+public:
+	backend_discard(backend *const b, const uint64_t max_bytes_per_s);
+	virtual ~backend_discard();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+	void get_and_reset_stats(backend_stats_t *const target) override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim_fua      (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_same    (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool copy          (const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+
+	bool has_write_cache() const override;
+	bool get_write_cache() const override;
+	bool set_write_cache(const bool enable) override;
+};
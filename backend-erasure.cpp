@@ -0,0 +1,1022 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <list>
+#include <unistd.h>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
+
+#include "backend-erasure.h"
+#include "gf256.h"
+#include "log.h"
+#include "utils.h"
+
+
+// inverts the n x n matrix 'a' (row major) in place, Gauss-Jordan
+static bool gf_invert_matrix(std::vector<uint8_t> & a, const uint32_t n)
+{
+	std::vector<uint8_t> inv(n * n);
+	for(uint32_t i=0; i<n; i++)
+		inv[i * n + i] = 1;
+
+	for(uint32_t col=0; col<n; col++) {
+		uint32_t pivot = col;
+		while(pivot < n && a[pivot * n + col] == 0)
+			pivot++;
+		if (pivot == n)
+			return false;
+
+		if (pivot != col) {
+			for(uint32_t i=0; i<n; i++) {
+				std::swap(a  [pivot * n + i], a  [col * n + i]);
+				std::swap(inv[pivot * n + i], inv[col * n + i]);
+			}
+		}
+
+		uint8_t f = gf_inv(a[col * n + col]);
+		for(uint32_t i=0; i<n; i++) {
+			a  [col * n + i] = gf_mul(a  [col * n + i], f);
+			inv[col * n + i] = gf_mul(inv[col * n + i], f);
+		}
+
+		for(uint32_t row=0; row<n; row++) {
+			uint8_t g = a[row * n + col];
+			if (row == col || g == 0)
+				continue;
+
+			for(uint32_t i=0; i<n; i++) {
+				a  [row * n + i] ^= gf_mul(a  [col * n + i], g);
+				inv[row * n + i] ^= gf_mul(inv[col * n + i], g);
+			}
+		}
+	}
+
+	a = inv;
+
+	return true;
+}
+
+backend_erasure::backend_erasure(const std::vector<backend *> & children, const uint32_t m, const uint32_t unit, const std::string & state_file):
+	backend(myformat("erasure:%zu:%u:%u", children.size(), m, unit)),
+	children(children),
+	k(children.size() - m),
+	m(m),
+	unit(std::max(unit, uint32_t(1))),
+	block_size(children.at(0)->get_block_size()),
+	state_file(state_file)
+{
+	// any k rows of [ I ; C ] are independent when C is a Cauchy matrix:
+	// C[i][j] = 1 / (x_i + y_j) with x_i = k + i and y_j = j all different
+	parity_coef.resize(m * k);
+	for(uint32_t i=0; i<m; i++) {
+		for(uint32_t j=0; j<k; j++)
+			parity_coef[i * k + j] = gf_inv((k + i) ^ j);
+	}
+}
+
+backend_erasure::~backend_erasure()
+{
+	stop_flag = true;
+	{
+		std::unique_lock<std::mutex> lck(state_lock);
+		stop_cv.notify_all();
+	}
+
+	if (rebuilder) {
+		rebuilder->join();
+		delete rebuilder;
+	}
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		worker_cv.notify_all();
+	}
+
+	for(auto & th: workers) {
+		th->join();
+		delete th;
+	}
+
+#if !defined(__MINGW32__)
+	if (state_hdr) {
+		msync(state_hdr, state_size, MS_SYNC);
+		munmap(state_hdr, state_size);
+	}
+#endif
+
+	if (state_fd != -1)
+		close(state_fd);
+
+	for(auto & b: children)
+		delete b;
+}
+
+bool backend_erasure::begin()
+{
+	if (m == 0 || k == 0 || children.size() > 64) {
+		DOLOG(logging::ll_error, "backend_erasure::begin", identifier, "invalid geometry: %u data + %u parity children (at most 64 in total)", k, m);
+		return false;
+	}
+
+	uint64_t child_size = UINT64_MAX;
+
+	for(auto & b: children) {
+		if (b->begin() == false)
+			return false;
+
+		if (b->get_block_size() != block_size) {
+			DOLOG(logging::ll_error, "backend_erasure::begin", identifier, "all children must have the same block size (%" PRIu64 " and %" PRIu64 ")", block_size, b->get_block_size());
+			return false;
+		}
+
+		child_size = std::min(child_size, b->get_size_in_blocks());
+	}
+
+	// only whole stripes
+	n_stripes = child_size / unit;
+	size      = n_stripes * unit * k;
+	if (size == 0) {
+		DOLOG(logging::ll_error, "backend_erasure::begin", identifier, "children are smaller than the chunk size");
+		return false;
+	}
+
+	DOLOG(logging::ll_info, "backend_erasure::begin", identifier, "%u data + %u parity children, chunks of %u blocks, %" PRIu64 " blocks in total, GF kernel: %s", k, m, unit, size, gf_get_kernel().c_str());
+
+	if (state_begin() == false)
+		return false;
+
+	for(size_t i=0; i<children.size() * 2; i++)
+		workers.push_back(new std::thread(&backend_erasure::worker_thread, this));
+
+	rebuilder = new std::thread(&backend_erasure::rebuilder_thread, this);
+
+	ts_last_stats = get_micros();
+
+	return true;
+}
+
+bool backend_erasure::state_begin()
+{
+	if (state_file.empty())
+		return true;
+
+#if defined(__MINGW32__)
+	DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "a state file is not supported on this platform");
+	return false;
+#else
+	state_fd = open(state_file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (state_fd == -1) {
+		DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "cannot open %s: %s", state_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st { };
+	if (fstat(state_fd, &st) == -1) {
+		DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "cannot fstat: %s", strerror(errno));
+		return false;
+	}
+
+	bool is_new = st.st_size == 0;
+	if (is_new) {
+		if (ftruncate(state_fd, state_size) == -1) {
+			DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "cannot resize to %zu bytes: %s", state_size, strerror(errno));
+			return false;
+		}
+	}
+	else if (size_t(st.st_size) != state_size) {
+		DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "file is %zu bytes, expected %zu", size_t(st.st_size), state_size);
+		return false;
+	}
+
+	void *p = mmap(nullptr, state_size, PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+	if (p == MAP_FAILED) {
+		DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "cannot mmap: %s", strerror(errno));
+		return false;
+	}
+
+	state_hdr = reinterpret_cast<state_header *>(p);
+
+	if (is_new) {
+		memcpy(state_hdr->magic, "iESPERS1", sizeof state_hdr->magic);
+		state_hdr->n_children = children.size();
+		state_hdr->m          = m;
+		state_hdr->unit       = unit;
+		state_hdr->n_stripes  = n_stripes;
+
+		if (msync(state_hdr, state_size, MS_SYNC) == -1) {
+			DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "cannot msync: %s", strerror(errno));
+			return false;
+		}
+
+		return true;
+	}
+
+	if (memcmp(state_hdr->magic, "iESPERS1", sizeof state_hdr->magic) != 0 || state_hdr->n_children != children.size() || state_hdr->m != m || state_hdr->unit != unit || state_hdr->n_stripes != n_stripes) {
+		DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "header does not match (%zu children, %u parity, chunks of %u blocks, %" PRIu64 " stripes)", children.size(), m, unit, n_stripes);
+		return false;
+	}
+
+	// stale children get the writes, but are only read after the rebuilder
+	// has reconstructed all their chunks
+	for(size_t i=0; i<children.size(); i++) {
+		if (state_hdr->stale[i]) {
+			stale |= uint64_t(1) << i;
+			DOLOG(logging::ll_warning, "backend_erasure::state_begin", identifier, "child %zu failed before, it will be rebuilt", i);
+		}
+	}
+
+	if (n_lost() > int(m))
+		DOLOG(logging::ll_error, "backend_erasure::state_begin", identifier, "%d children are stale, at most %u can be rebuilt: DATA IS LOST", n_lost(), m);
+
+	return true;
+#endif
+}
+
+void backend_erasure::set_stale(const size_t nr, const bool is_stale)
+{
+	uint64_t bit = uint64_t(1) << nr;
+	if (is_stale)
+		stale |= bit;
+	else
+		stale &= ~bit;
+
+#if !defined(__MINGW32__)
+	std::unique_lock<std::mutex> lck(state_lock);
+	if (state_hdr) {
+		state_hdr->stale[nr] = is_stale;
+		if (msync(state_hdr, state_size, MS_SYNC) == -1)
+			DOLOG(logging::ll_error, "backend_erasure::set_stale", identifier, "cannot msync: %s", strerror(errno));
+	}
+#endif
+}
+
+std::string backend_erasure::get_serial() const
+{
+	return "erasure-" + children.at(0)->get_serial();
+}
+
+uint64_t backend_erasure::get_size_in_blocks() const
+{
+	return size;
+}
+
+uint64_t backend_erasure::get_block_size() const
+{
+	return block_size;
+}
+
+uint8_t backend_erasure::get_free_space_percentage()
+{
+	uint8_t rc = 100;
+	for(size_t i=0; i<children.size(); i++) {
+		if (is_failed(i) == false)
+			rc = std::min(rc, children[i]->get_free_space_percentage());
+	}
+
+	return rc;
+}
+
+// only trims of whole stripes free space, the rest is written with zeroes
+uint32_t backend_erasure::get_discard_granularity() const
+{
+	return unit * k;
+}
+
+void backend_erasure::worker_thread()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(;;) {
+		worker_cv.wait(lck, [this] { return stop_flag || queue.empty() == false; });
+		if (queue.empty())  // stop_flag
+			break;
+
+		job *j = queue.front();
+		queue.pop_front();
+		lck.unlock();
+
+		j->ok = execute(j);
+
+		{
+			std::unique_lock<std::mutex> r_lck(j->r->lock);
+			if (--j->r->n_pending == 0)
+				j->r->cv.notify_all();
+		}
+
+		lck.lock();
+	}
+}
+
+bool backend_erasure::execute(job *const j)
+{
+	backend *const b = children.at(j->child);
+
+	switch(j->op) {
+		case EO_READ:
+			return b->read(j->block_nr, j->n_blocks, j->data);
+		case EO_WRITE:
+			return b->write(j->block_nr, j->n_blocks, j->data);
+		case EO_WRITE_FUA:
+			return b->write_fua(j->block_nr, j->n_blocks, j->data);
+		case EO_WRITE_ZEROES:
+			return b->write_zeroes(j->block_nr, j->n_blocks);
+		case EO_TRIM:  // the parity of these stripes assumes zeroes
+			return b->trim(j->block_nr, j->n_blocks) || b->write_zeroes(j->block_nr, j->n_blocks);
+		case EO_SYNC:
+			return b->sync();
+	}
+
+	return false;
+}
+
+// the first job is done by the calling thread, the others by the workers;
+// a child that fails a job is marked as failed
+bool backend_erasure::run(std::vector<job> & jobs)
+{
+	if (jobs.empty())
+		return true;
+
+	request r;
+	r.n_pending = jobs.size() - 1;
+
+	if (jobs.size() > 1) {
+		std::unique_lock<std::mutex> lck(lock);
+		for(size_t i=1; i<jobs.size(); i++) {
+			jobs[i].r = &r;
+			queue.push_back(&jobs[i]);
+		}
+		worker_cv.notify_all();
+	}
+
+	jobs[0].ok = execute(&jobs[0]);
+
+	{
+		std::unique_lock<std::mutex> lck(r.lock);
+		r.cv.wait(lck, [&r] { return r.n_pending == 0; });
+	}
+
+	bool rc = true;
+	for(auto & j: jobs) {
+		if (j.ok == false) {
+			fail_child(j.child);
+			rc = false;
+		}
+	}
+
+	return rc;
+}
+
+// the chunks rotate over the children so that the parity is spread
+size_t backend_erasure::child_of(const uint64_t stripe, const uint32_t chunk) const
+{
+	return (stripe + chunk) % children.size();
+}
+
+// the child misses writes from now on: it is stale before the write that
+// failed completes
+void backend_erasure::fail_child(const size_t nr)
+{
+	uint64_t bit = uint64_t(1) << nr;
+	if (failed.fetch_or(bit) & bit)
+		return;
+
+	set_stale(nr, true);
+
+	int n_failed = n_lost();
+	DOLOG(logging::ll_error, "backend_erasure::fail_child", identifier, "child %zu failed, %d of %u failed now%s", nr, n_failed, m, n_failed > int(m) ? ": DATA IS LOST" : "");
+}
+
+bool backend_erasure::is_failed(const size_t nr) const
+{
+	return failed & (uint64_t(1) << nr);
+}
+
+bool backend_erasure::is_readable(const size_t nr) const
+{
+	return ((failed | stale) & (uint64_t(1) << nr)) == 0;
+}
+
+int backend_erasure::n_lost() const
+{
+	return __builtin_popcountll(failed | stale);
+}
+
+std::vector<backend_erasure::segment> backend_erasure::segments(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data) const
+{
+	std::vector<segment> out;
+
+	for(uint32_t done=0; done<n_blocks;) {
+		uint64_t cur      = block_nr + done;
+		uint64_t chunk_nr = cur / unit;
+
+		segment s;
+		s.stripe   = chunk_nr / k;
+		s.chunk    = chunk_nr % k;
+		s.offset   = cur % unit;
+		s.n_blocks = std::min(n_blocks - done, unit - s.offset);
+		s.data     = data ? &data[done * block_size] : nullptr;
+		out.push_back(s);
+
+		done += s.n_blocks;
+	}
+
+	return out;
+}
+
+// a write changes the parity of the rows it touches in all chunks, so the
+// locks are on whole stripes
+void backend_erasure::lock_range(const uint64_t block_nr, const uint32_t n_blocks, uint64_t *const start, uint32_t *const n) const
+{
+	uint64_t stripe_blocks = uint64_t(unit) * k;
+	uint64_t first         = block_nr / stripe_blocks * stripe_blocks;
+	uint64_t end           = (block_nr + n_blocks + stripe_blocks - 1) / stripe_blocks * stripe_blocks;
+
+	*start = first;
+	*n     = end - first;
+}
+
+// 'out' has k pointers, one per data chunk: those that are not nullptr are
+// filled with 'n_rows' rows from 'row'; chunks that cannot be read are
+// decoded from k others
+bool backend_erasure::read_rows(const uint64_t stripe, const uint32_t row, const uint32_t n_rows, uint8_t *const *const out)
+{
+	const size_t n_bytes = size_t(n_rows) * block_size;
+	const size_t n       = children.size();
+
+	std::vector<uint8_t *>            chunks(n);
+	std::vector<std::vector<uint8_t>> scratch(n);
+	std::vector<bool>                 have(n);
+	std::vector<bool>                 tried(n);
+	std::vector<uint32_t>             missing;
+
+	auto read_chunks = [&](const std::vector<uint32_t> & which) {
+		std::vector<job> jobs;
+		for(auto c: which) {
+			tried[c] = true;
+
+			size_t child = child_of(stripe, c);
+			if (is_readable(child) == false)
+				continue;
+
+			job j;
+			j.op       = EO_READ;
+			j.child    = child;
+			j.block_nr = stripe * unit + row;
+			j.n_blocks = n_rows;
+			j.data     = chunks[c];
+			jobs.push_back(j);
+		}
+
+		run(jobs);
+
+		for(auto & j: jobs) {
+			if (j.ok) {
+				for(uint32_t c=0; c<n; c++) {
+					if (chunks[c] == j.data)
+						have[c] = true;
+				}
+			}
+		}
+	};
+
+	std::vector<uint32_t> wanted;
+	for(uint32_t c=0; c<k; c++) {
+		if (out[c]) {
+			chunks[c] = out[c];
+			wanted.push_back(c);
+		}
+	}
+
+	read_chunks(wanted);
+
+	for(auto c: wanted) {
+		if (have[c] == false)
+			missing.push_back(c);
+	}
+
+	if (missing.empty())
+		return true;
+
+	n_degraded++;
+
+	// degraded: get other chunks until there are k
+	for(;;) {
+		uint32_t n_have = std::count(have.begin(), have.end(), true);
+		if (n_have >= k)
+			break;
+
+		std::vector<uint32_t> extra;
+		for(uint32_t c=0; c<n && n_have + extra.size() < k; c++) {
+			if (tried[c] == false && is_readable(child_of(stripe, c))) {
+				if (chunks[c] == nullptr) {
+					scratch[c].resize(n_bytes);
+					chunks[c] = scratch[c].data();
+				}
+				extra.push_back(c);
+			}
+		}
+
+		if (extra.empty()) {
+			DOLOG(logging::ll_error, "backend_erasure::read_rows", identifier, "stripe %" PRIu64 ": only %u of %u chunks readable", stripe, n_have, k);
+			return false;
+		}
+
+		read_chunks(extra);
+	}
+
+	// data chunk c = sum over the available chunks a_t of D[c][t] * a_t,
+	// with D the inverse of the rows of the generator of those chunks
+	std::vector<uint32_t> avail;
+	for(uint32_t c=0; c<n && avail.size() < k; c++) {
+		if (have[c])
+			avail.push_back(c);
+	}
+
+	std::vector<uint8_t> matrix(k * k);
+	for(uint32_t t=0; t<k; t++) {
+		if (avail[t] < k)
+			matrix[t * k + avail[t]] = 1;
+		else
+			memcpy(&matrix[t * k], &parity_coef[(avail[t] - k) * k], k);
+	}
+
+	if (gf_invert_matrix(matrix, k) == false) {
+		DOLOG(logging::ll_error, "backend_erasure::read_rows", identifier, "decoding matrix is singular");
+		return false;
+	}
+
+	for(auto c: missing) {
+		for(uint32_t t=0; t<k; t++)
+			gf_mul_region(matrix[c * k + t], chunks[avail[t]], out[c], n_bytes, t > 0);
+	}
+
+	return true;
+}
+
+bool backend_erasure::read_locked(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	auto segs = segments(block_nr, n_blocks, data);
+
+	std::vector<job> jobs;
+	for(auto & s: segs) {
+		size_t child = child_of(s.stripe, s.chunk);
+		if (is_readable(child) == false)
+			continue;
+
+		job j;
+		j.op       = EO_READ;
+		j.child    = child;
+		j.block_nr = s.stripe * unit + s.offset;
+		j.n_blocks = s.n_blocks;
+		j.data     = s.data;
+		jobs.push_back(j);
+	}
+
+	if (run(jobs) && jobs.size() == segs.size())
+		return true;
+
+	// reconstruct what is on failed children
+	for(auto & s: segs) {
+		if (is_readable(child_of(s.stripe, s.chunk)))
+			continue;
+
+		std::vector<uint8_t *> out(k);
+		out[s.chunk] = s.data;
+		if (read_rows(s.stripe, s.offset, s.n_blocks, out.data()) == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool backend_erasure::write_locked(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua)
+{
+	auto segs = segments(block_nr, n_blocks, const_cast<uint8_t *>(data));
+
+	std::vector<job>                  jobs;
+	std::list<std::vector<uint8_t> > buffers;  // must stay where they are until run()
+
+	for(size_t first=0; first<segs.size();) {
+		uint64_t stripe = segs[first].stripe;
+		size_t   last   = first;
+		while(last + 1 < segs.size() && segs[last + 1].stripe == stripe)
+			last++;
+
+		// the rows that are touched in this stripe
+		uint32_t row_start = unit;
+		uint32_t row_end   = 0;
+		for(size_t i=first; i<=last; i++) {
+			row_start = std::min(row_start, segs[i].offset);
+			row_end   = std::max(row_end,   segs[i].offset + segs[i].n_blocks);
+		}
+		uint32_t n_rows  = row_end - row_start;
+		size_t   n_bytes = size_t(n_rows) * block_size;
+
+		// data chunks: directly from the caller when the write covers all
+		// rows of it, else read first and then overlay the new data
+		std::vector<uint8_t *> chunks(k);
+		std::vector<uint8_t *> to_read(k);
+		std::vector<const segment *> seg_of(k);
+		bool full = true;
+		for(size_t i=first; i<=last; i++)
+			seg_of[segs[i].chunk] = &segs[i];
+
+		for(uint32_t c=0; c<k; c++) {
+			const segment *s = seg_of[c];
+			if (s && s->offset == row_start && s->n_blocks == n_rows) {
+				chunks[c] = s->data;
+				continue;
+			}
+
+			buffers.emplace_back(n_bytes);
+			chunks[c]  = buffers.back().data();
+			to_read[c] = chunks[c];
+			full       = false;
+		}
+
+		if (full)
+			n_full_writes++;
+		else {
+			n_rmw_writes++;
+
+			if (read_rows(stripe, row_start, n_rows, to_read.data()) == false)
+				return false;
+
+			for(uint32_t c=0; c<k; c++) {
+				const segment *s = seg_of[c];
+				if (s && to_read[c])
+					memcpy(&to_read[c][(s->offset - row_start) * block_size], s->data, s->n_blocks * block_size);
+			}
+		}
+
+		for(uint32_t i=0; i<m; i++) {
+			buffers.emplace_back(n_bytes);
+			uint8_t *parity = buffers.back().data();
+
+			for(uint32_t c=0; c<k; c++)
+				gf_mul_region(parity_coef[i * k + c], chunks[c], parity, n_bytes, c > 0);
+
+			job j;
+			j.op       = fua ? EO_WRITE_FUA : EO_WRITE;
+			j.child    = child_of(stripe, k + i);
+			j.block_nr = stripe * unit + row_start;
+			j.n_blocks = n_rows;
+			j.data     = parity;
+			jobs.push_back(j);
+		}
+
+		for(size_t i=first; i<=last; i++) {
+			job j;
+			j.op       = fua ? EO_WRITE_FUA : EO_WRITE;
+			j.child    = child_of(stripe, segs[i].chunk);
+			j.block_nr = stripe * unit + segs[i].offset;
+			j.n_blocks = segs[i].n_blocks;
+			j.data     = segs[i].data;
+			jobs.push_back(j);
+		}
+
+		first = last + 1;
+	}
+
+	// failed children are skipped: their part can be decoded from the rest
+	// (stale children do get it, their chunks are valid once rebuilt)
+	jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [this](const job & j) { return is_failed(j.child); }), jobs.end());
+
+	run(jobs);
+
+	if (n_lost() > int(m)) {
+		DOLOG(logging::ll_error, "backend_erasure::write_locked", identifier, "more than %u children failed", m);
+		return false;
+	}
+
+	return true;
+}
+
+// whole stripes are zeroed/trimmed on the children (parity of zeroes is
+// zeroes; children of which trimmed blocks may not read as zeroes get a
+// write of zeroes instead), the rest is a write of zeroes
+bool backend_erasure::zero_locked(const uint64_t block_nr, const uint32_t n_blocks, const op_t op)
+{
+	uint64_t stripe_blocks = uint64_t(unit) * k;
+	uint64_t first_full    = (block_nr + stripe_blocks - 1) / stripe_blocks;
+	uint64_t end_full      = (block_nr + n_blocks) / stripe_blocks;
+
+	if (first_full >= end_full) {
+		std::vector<uint8_t> zero(n_blocks * block_size);
+		return write_locked(block_nr, n_blocks, zero.data(), false);
+	}
+
+	uint64_t head = first_full * stripe_blocks - block_nr;
+	uint64_t tail = block_nr + n_blocks - end_full * stripe_blocks;
+
+	if (head) {
+		std::vector<uint8_t> zero(head * block_size);
+		if (write_locked(block_nr, head, zero.data(), false) == false)
+			return false;
+	}
+
+	std::vector<job> jobs;
+	for(size_t i=0; i<children.size(); i++) {
+		if (is_failed(i))
+			continue;
+
+		job j;
+		j.op       = op == EO_TRIM && children[i]->trim_reads_zeroes() == false ? EO_WRITE_ZEROES : op;
+		j.child    = i;
+		j.block_nr = first_full * unit;
+		j.n_blocks = (end_full - first_full) * unit;
+		jobs.push_back(j);
+	}
+
+	run(jobs);
+
+	if (n_lost() > int(m))
+		return false;
+
+	if (tail) {
+		std::vector<uint8_t> zero(tail * block_size);
+		if (write_locked(end_full * stripe_blocks, tail, zero.data(), false) == false)
+			return false;
+	}
+
+	return true;
+}
+
+void backend_erasure::log_stats()
+{
+	uint64_t now  = get_micros();
+	uint64_t prev = ts_last_stats;
+	if (now - prev < stats_interval * 1000000ull || ts_last_stats.compare_exchange_strong(prev, now) == false)
+		return;
+
+	DOLOG(logging::ll_info, "backend_erasure::log_stats", identifier, "full-stripe writes: %" PRIu64 ", read-modify-writes: %" PRIu64 ", degraded reads: %" PRIu64 ", failed children: %d",
+		n_full_writes.exchange(0), n_rmw_writes.exchange(0), n_degraded.exchange(0), n_lost());
+}
+
+bool backend_erasure::sync()
+{
+	std::vector<job> jobs;
+	for(size_t i=0; i<children.size(); i++) {
+		if (is_failed(i))
+			continue;
+
+		job j;
+		j.op    = EO_SYNC;
+		j.child = i;
+		jobs.push_back(j);
+	}
+
+	run(jobs);
+
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	return n_lost() <= int(m);
+}
+
+// reconstructs every chunk of child 'nr' from the other children, stripe
+// by stripe with the stripe locked so that writes can continue meanwhile
+bool backend_erasure::rebuild_child(const size_t nr)
+{
+	DOLOG(logging::ll_info, "backend_erasure::rebuild_child", identifier, "rebuilding child %zu", nr);
+
+	const size_t n       = children.size();
+	const size_t n_bytes = size_t(unit) * block_size;
+	std::vector<std::vector<uint8_t> > buffers(k, std::vector<uint8_t>(n_bytes));
+	std::vector<uint8_t> parity(n_bytes);
+
+	for(uint64_t stripe=0; stripe<n_stripes; stripe++) {
+		if (stop_flag || is_failed(nr))
+			return false;
+
+		uint64_t lock_start = 0;
+		uint32_t lock_n     = 0;
+		lock_range(stripe * unit * k, 1, &lock_start, &lock_n);
+		range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+
+		uint32_t chunk = (nr + n - stripe % n) % n;  // inverse of child_of()
+
+		std::vector<uint8_t *> out(k);
+		if (chunk < k)
+			out[chunk] = buffers[chunk].data();
+		else {
+			for(uint32_t c=0; c<k; c++)
+				out[c] = buffers[c].data();
+		}
+
+		if (read_rows(stripe, 0, unit, out.data()) == false)
+			return false;
+
+		job j;
+		j.op       = EO_WRITE;
+		j.child    = nr;
+		j.block_nr = stripe * unit;
+		j.n_blocks = unit;
+		if (chunk < k)
+			j.data = buffers[chunk].data();
+		else {
+			for(uint32_t c=0; c<k; c++)
+				gf_mul_region(parity_coef[(chunk - k) * k + c], buffers[c].data(), parity.data(), n_bytes, c > 0);
+			j.data = parity.data();
+		}
+
+		std::vector<job> jobs { j };
+		if (run(jobs) == false)
+			return false;
+	}
+
+	std::vector<job> jobs(1);
+	jobs[0].op    = EO_SYNC;
+	jobs[0].child = nr;
+	if (run(jobs) == false)
+		return false;
+
+	set_stale(nr, false);
+
+	DOLOG(logging::ll_info, "backend_erasure::rebuild_child", identifier, "child %zu is rebuilt, %" PRIu64 " stripes", nr, n_stripes);
+
+	return true;
+}
+
+void backend_erasure::rebuilder_thread()
+{
+	std::vector<uint64_t> next_probe(children.size());
+	std::vector<uint8_t>  buffer(block_size);
+
+	while(stop_flag == false) {
+		{
+			std::unique_lock<std::mutex> lck(state_lock);
+			stop_cv.wait_for(lck, std::chrono::seconds(1), [this] { return stop_flag.load(); });
+		}
+
+		for(size_t i=0; i<children.size() && stop_flag == false; i++) {
+			if (is_failed(i) && get_micros() >= next_probe[i]) {
+				next_probe[i] = get_micros() + probe_interval * 1000000ull;
+
+				if (children[i]->read(0, 1, buffer.data())) {
+					DOLOG(logging::ll_info, "backend_erasure::rebuilder_thread", identifier, "child %zu responds again", i);
+					failed &= ~(uint64_t(1) << i);  // gets the writes from now on, is read once rebuilt
+				}
+			}
+
+			if (is_failed(i) == false && (stale & (uint64_t(1) << i)))
+				rebuild_child(i);
+		}
+	}
+}
+
+bool backend_erasure::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_erasure::write", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+	range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+
+	uint64_t start = get_micros();
+	bool     rc    = write_locked(block_nr, n_blocks, data, false);
+
+	ts_last_acces     = get_micros();
+	bs.io_wait       += ts_last_acces - start;
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	log_stats();
+
+	return rc;
+}
+
+bool backend_erasure::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+	range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+
+	uint64_t start = get_micros();
+	bool     rc    = write_locked(block_nr, n_blocks, data, true);
+
+	ts_last_acces     = get_micros();
+	bs.io_wait       += ts_last_acces - start;
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_erasure::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+	range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+
+	bool rc = zero_locked(block_nr, n_blocks, EO_WRITE_ZEROES);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_erasure::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+	range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+
+	bool rc = zero_locked(block_nr, n_blocks, EO_TRIM);
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+bool backend_erasure::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_erasure::read", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+	range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_shared);
+
+	uint64_t start = get_micros();
+	bool     rc    = read_locked(block_nr, n_blocks, data);
+
+	ts_last_acces  = get_micros();
+	bs.io_wait    += ts_last_acces - start;
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	log_stats();
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_erasure::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	uint64_t lock_start = 0;
+	uint32_t lock_n     = 0;
+	lock_range(block_nr, n_blocks, &lock_start, &lock_n);
+	range_lock_guard lck(&locks, lock_start, lock_n, range_lock::rl_exclusive);
+
+	cmpwrite_result_t    result = cmpwrite_result_t::CWR_OK;
+	std::vector<uint8_t> buffer(n_blocks * block_size);
+	uint64_t             start  = get_micros();
+
+	if (read_locked(block_nr, n_blocks, buffer.data()) == false)
+		result = cmpwrite_result_t::CWR_READ_ERROR;
+	else if (memcmp(buffer.data(), data_compare, buffer.size()) != 0)
+		result = cmpwrite_result_t::CWR_MISMATCH;
+	else if (write_locked(block_nr, n_blocks, data_write, false) == false)
+		result = cmpwrite_result_t::CWR_WRITE_ERROR;
+
+	ts_last_acces  = get_micros();
+	bs.io_wait    += ts_last_acces - start;
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+	if (result == cmpwrite_result_t::CWR_OK) {
+		bs.bytes_written += n_blocks * block_size;
+		bs.n_writes++;
+	}
+
+	return result;
+}
+
+bool backend_erasure::has_write_cache() const
+{
+	for(auto & b: children) {
+		if (b->has_write_cache() == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool backend_erasure::get_write_cache() const
+{
+	for(auto & b: children) {
+		if (b->get_write_cache())
+			return true;
+	}
+
+	return false;
+}
+
+bool backend_erasure::set_write_cache(const bool enable)
+{
+	bool rc = true;
+	for(auto & b: children)
+		rc &= b->set_write_cache(enable);
+
+	return rc;
+}
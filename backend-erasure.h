@@ -0,0 +1,143 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.h"
+
+
+// Reed-Solomon over k + m children: each stripe is k data chunks of 'unit'
+// blocks plus m parity chunks, rotated over the children per stripe. Any k
+// of them are enough to get the data back, so m children may fail. A write
+// that covers the same rows of all k data chunks (e.g. a whole stripe) is
+// encoded directly from the buffer of the caller; otherwise the missing
+// rows are read first (read-modify-write). Reads from a failed child are
+// reconstructed from the other chunks of those rows. A child that failed
+// is stale (kept in the state file, if any, so that also after a restart)
+// until it responded again and all its chunks were rebuilt from the others.
+class backend_erasure : public backend
+{
+private:
+	enum op_t { EO_READ, EO_WRITE, EO_WRITE_FUA, EO_WRITE_ZEROES, EO_TRIM, EO_SYNC };
+
+	struct request {
+		std::mutex              lock;
+		std::condition_variable cv;
+		int                     n_pending { 0 };
+	};
+
+	struct job {
+		op_t      op       { EO_READ  };
+		size_t    child    { 0       };
+		uint64_t  block_nr { 0       };  // of the child
+		uint32_t  n_blocks { 0       };
+		uint8_t  *data     { nullptr };
+		bool      ok       { false   };
+		request  *r        { nullptr };
+	};
+
+	// the part of a request that is in one chunk
+	struct segment {
+		uint64_t  stripe   { 0       };
+		uint32_t  chunk    { 0       };  // 0...k-1
+		uint32_t  offset   { 0       };  // row in the chunk
+		uint32_t  n_blocks { 0       };
+		uint8_t  *data     { nullptr };
+	};
+
+	struct state_header {
+		char     magic[8];  // "iESPERS1"
+		uint32_t n_children;
+		uint32_t m;
+		uint32_t unit;
+		uint32_t reserved;
+		uint64_t n_stripes;
+		uint8_t  stale[64];  // per child: missed writes, must be rebuilt
+	};
+
+	static constexpr const size_t state_size     = 4096;
+	static constexpr const int    stats_interval = 10;  // seconds
+	static constexpr const int    probe_interval = 10;  // seconds between attempts to bring back a failed child
+
+	const std::vector<backend *> children;  // owned
+	const uint32_t       k          { 0 };
+	const uint32_t       m          { 0 };
+	const uint32_t       unit       { 0 };  // in blocks
+	const uint64_t       block_size { 0 };
+	uint64_t             n_stripes  { 0 };
+	uint64_t             size       { 0 };  // in blocks
+	std::vector<uint8_t> parity_coef;  // m x k (Cauchy matrix)
+	const std::string    state_file;  // empty: in RAM only
+	std::atomic_uint64_t failed     { 0 };  // bit per child: does not respond, gets no I/O
+	std::atomic_uint64_t stale      { 0 };  // bit per child: is not read from (decoded instead) until rebuilt
+	std::atomic_bool     stop_flag  { false };
+
+	std::mutex           state_lock;  // protects the mapping
+	int                  state_fd      { -1      };
+	state_header        *state_hdr     { nullptr };  // mmapped 'state_file'
+	std::condition_variable stop_cv;  // wakes up the rebuilder
+	std::thread         *rebuilder     { nullptr };
+
+	std::atomic_uint64_t n_full_writes { 0 };
+	std::atomic_uint64_t n_rmw_writes  { 0 };
+	std::atomic_uint64_t n_degraded    { 0 };
+	std::atomic_uint64_t ts_last_stats { 0 };
+
+	std::mutex           lock;  // protects the queue
+	std::condition_variable worker_cv;
+	std::deque<job *>    queue;
+	std::vector<std::thread *> workers;
+
+	void   worker_thread();
+	bool   execute     (job *const j);
+	bool   run         (std::vector<job> & jobs);
+	size_t child_of    (const uint64_t stripe, const uint32_t chunk) const;
+	void   fail_child  (const size_t nr);
+	bool   is_failed   (const size_t nr) const;
+	bool   is_readable (const size_t nr) const;
+	int    n_lost      () const;  // children that are failed or stale
+	bool   state_begin ();
+	void   set_stale   (const size_t nr, const bool is_stale);
+	bool   rebuild_child(const size_t nr);
+	void   rebuilder_thread();
+	std::vector<segment> segments(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data) const;
+	void   lock_range  (const uint64_t block_nr, const uint32_t n_blocks, uint64_t *const start, uint32_t *const n) const;
+	bool   read_rows   (const uint64_t stripe, const uint32_t row, const uint32_t n_rows, uint8_t *const *const out);
+	bool   read_locked (const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);
+	bool   write_locked(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua);
+	bool   zero_locked (const uint64_t block_nr, const uint32_t n_blocks, const op_t op);
+	void   log_stats   ();
+
+public:
+	// k data + m parity children, all with the same block size; 'state_file':
+	// which children are stale (empty: in RAM only)
+	backend_erasure(const std::vector<backend *> & children, const uint32_t m, const uint32_t unit, const std::string & state_file);
+	virtual ~backend_erasure();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+
+	bool has_write_cache() const override;
+	bool get_write_cache() const override;
+	bool set_write_cache(const bool enable) override;
+};
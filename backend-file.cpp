@@ -1,7 +1,17 @@
+#include <algorithm>
 #include <cinttypes>
 #include <cstring>
+#include <vector>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/uio.h>
+#endif
+#if defined(linux)
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 
 #include "backend-file.h"
 #include "gen.h"
@@ -31,6 +41,19 @@ bool backend_file::begin()
 		return false;
 	}
 
+	struct stat st { };
+	if (fstat(fd, &st) == 0) {
+#if defined(SEEK_HOLE)
+		if (S_ISREG(st.st_mode) && st.st_blocks * 512 < st.st_size) {
+			DOLOG(logging::ll_info, "backend_file", identifier, "file is sparse");
+			is_sparse = true;
+		}
+#endif
+#if defined(S_ISBLK)
+		is_block_device = S_ISBLK(st.st_mode);
+#endif
+	}
+
 	return true;
 }
 
@@ -52,7 +75,13 @@ uint64_t backend_file::get_block_size() const
 #endif
 }
 
-bool backend_file::sync()
+// a punched hole reads as zeroes, without fallocate() trim writes zeroes
+bool backend_file::trim_reads_zeroes() const
+{
+	return true;
+}
+
+bool backend_file::flush()
 {
 	bool ok    = false;
 	auto start = get_micros();
@@ -65,13 +94,46 @@ bool backend_file::sync()
 #endif
 	auto end = get_micros();
 	if (!ok)
-		DOLOG(logging::ll_error, "backend_file::sync", identifier, "failed: %s", strerror(errno));
+		DOLOG(logging::ll_error, "backend_file::flush", identifier, "failed: %s", strerror(errno));
+
+	bs.io_wait += end-start;
+
+	return ok;
+}
+
+bool backend_file::sync()
+{
+	std::unique_lock<std::mutex> lck(sync_lock);
+
+	// a flush that is running now may have started before the data of the caller
+	// was written: wait for the next one. all callers that arrive while a flush
+	// runs, share that next one
+	uint64_t epoch = sync_started + 1;
+
+	while(sync_completed < epoch) {
+		if (sync_busy) {
+			sync_cv.wait(lck);
+			continue;
+		}
+
+		sync_busy = true;
+		uint64_t current = ++sync_started;
+
+		lck.unlock();
+		bool ok = flush();
+		lck.lock();
+
+		sync_busy      = false;
+		sync_completed = current;
+		if (!ok)
+			sync_failed = current;
+		sync_cv.notify_all();
+	}
 
 	bs.n_syncs++;
-	bs.io_wait   += end-start;
 	ts_last_acces = get_micros();
 
-	return ok;
+	return sync_failed < epoch;
 }
 
 bool backend_file::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
@@ -87,9 +149,8 @@ bool backend_file::write(const uint64_t block_nr, const uint32_t n_blocks, const
 	if (rc != -1)
 		rc = ::write(fd, data, n_bytes);
 #else
-	auto lock_list = lock_range(block_nr, 1);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
 	ssize_t rc = pwrite(fd, data, n_bytes, offset);
-	unlock_range(lock_list);
 #endif
 	auto end = get_micros();
 	if (rc == -1)
@@ -101,26 +162,58 @@ bool backend_file::write(const uint64_t block_nr, const uint32_t n_blocks, const
 	return rc == ssize_t(n_bytes);
 }
 
-bool backend_file::trim(const uint64_t block_nr, const uint32_t n_blocks)
+bool backend_file::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
 {
+#if defined(linux) && defined(RWF_DSYNC)
+	if (use_rwf_dsync == false)
+		return backend::write_fua(block_nr, n_blocks, data);
+
 	auto   block_size = get_block_size();
 	off_t  offset     = block_nr * block_size;
 	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_file::write_fua", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	auto   start      = get_micros();
+	ssize_t rc        = -1;
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+		// only this range is flushed instead of everything that is dirty in the file
+		iovec iov { const_cast<uint8_t *>(data), n_bytes };
+		rc = pwritev2(fd, &iov, 1, offset, RWF_DSYNC);
+	}
+	auto end = get_micros();
+
+	if (rc == -1 && (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)) {  // old kernel or filesystem
+		DOLOG(logging::ll_info, "backend_file::write_fua", identifier, "RWF_DSYNC not supported (%s), using write + sync", strerror(errno));
+		use_rwf_dsync = false;
+		return backend::write_fua(block_nr, n_blocks, data);
+	}
+
+	if (rc == -1)
+		DOLOG(logging::ll_error, "backend_file::write_fua", identifier, "ERROR writing: %s", strerror(errno));
+	ts_last_acces     = end;
+	bs.io_wait       += end-start;
+	bs.bytes_written += n_bytes;
+	bs.n_writes++;
+	return rc == ssize_t(n_bytes);
+#else
+	return backend::write_fua(block_nr, n_blocks, data);
+#endif
+}
+
+bool backend_file::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	auto   block_size = get_block_size();
+	off_t  offset     = block_nr * block_size;
 	DOLOG(logging::ll_debug, "backend_file::trim", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
 	auto   start      = get_micros();
 #if defined(linux)
+	size_t n_bytes    = n_blocks * block_size;
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
 	int rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, n_bytes);
+	if (rc == 0)
+		is_sparse = true;
 #else
-	// no locking! write() takes care of that itself!
-	// so trim() is not "atomic" at all
-	int rc = 0;
-	uint8_t *zero = new uint8_t[block_size]();
-	for(uint32_t i=0; i<n_blocks; i++) {
-		if (write(block_nr + i, 1, zero) == false) {
-			rc = -1;
-			break;
-		}
-	}
+	int rc = write_zeroes(block_nr, n_blocks) ? 0 : -1;
 #endif
 	auto end = get_micros();
 	if (rc == -1)
@@ -131,6 +224,240 @@ bool backend_file::trim(const uint64_t block_nr, const uint32_t n_blocks)
 	return rc == 0;
 }
 
+// may only be called with the range locked
+bool backend_file::write_pattern(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+#if defined(__MINGW32__)
+	return false;
+#else
+	constexpr const uint32_t max_iov = 1024;  // IOV_MAX on Linux and macOS
+
+	auto     block_size = get_block_size();
+	off_t    offset     = block_nr * block_size;
+	size_t   n_bytes    = n_blocks * block_size;
+	uint32_t n_iov      = std::min(n_blocks, max_iov);
+	iovec   *iov        = new iovec[n_iov];
+	for(uint32_t i=0; i<n_iov; i++)
+		iov[i] = { const_cast<uint8_t *>(pattern), block_size };
+
+	// every iovec points to the same buffer so that a large range needs only one block of memory
+	size_t done = 0;
+	while(done < n_bytes) {
+		size_t  in_block = done % block_size;
+		ssize_t rc       = -1;
+		if (in_block)  // continue after a short write
+			rc = pwrite(fd, &pattern[in_block], block_size - in_block, offset + done);
+		else
+			rc = pwritev(fd, iov, std::min(size_t(n_iov), (n_bytes - done) / block_size), offset + done);
+		if (rc <= 0) {
+			DOLOG(logging::ll_error, "backend_file::write_pattern", identifier, "ERROR writing: %s", rc == -1 ? strerror(errno) : "short write");
+			break;
+		}
+		done += rc;
+	}
+
+	delete [] iov;
+
+	return done == n_bytes;
+#endif
+}
+
+bool backend_file::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+#if defined(__MINGW32__)
+	return backend::write_zeroes(block_nr, n_blocks);
+#else
+	auto   block_size = get_block_size();
+	off_t  offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_file::write_zeroes", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	auto   start      = get_micros();
+	bool   ok         = false;
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+#if defined(linux)
+		if (is_block_device) {
+			uint64_t range[2] { uint64_t(offset), n_bytes };
+			ok = ioctl(fd, BLKZEROOUT, range) == 0;
+			if (!ok)
+				DOLOG(logging::ll_debug, "backend_file::write_zeroes", identifier, "BLKZEROOUT failed: %s", strerror(errno));
+		}
+		else if (use_zero_range) {
+			// the blocks stay allocated, unlike with trim
+			ok = fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, n_bytes) == 0;
+			if (!ok && (errno == EOPNOTSUPP || errno == ENOSYS)) {  // filesystem cannot do it
+				DOLOG(logging::ll_info, "backend_file::write_zeroes", identifier, "FALLOC_FL_ZERO_RANGE not supported (%s), writing zeroes", strerror(errno));
+				use_zero_range = false;
+			}
+		}
+#endif
+		if (!ok) {
+			uint8_t *zero = new uint8_t[block_size]();
+			ok = write_pattern(block_nr, n_blocks, zero);
+			delete [] zero;
+		}
+	}
+	auto end = get_micros();
+	ts_last_acces     = end;
+	bs.io_wait       += end-start;
+	bs.bytes_written += n_bytes;
+	bs.n_writes++;
+	return ok;
+#endif
+}
+
+bool backend_file::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+#if defined(__MINGW32__)
+	return backend::write_same(block_nr, n_blocks, pattern);
+#else
+	auto   block_size = get_block_size();
+	off_t  offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_file::write_same", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	auto   start      = get_micros();
+	bool   ok         = false;
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+		ok = write_pattern(block_nr, n_blocks, pattern);
+	}
+	auto end = get_micros();
+	ts_last_acces     = end;
+	bs.io_wait       += end-start;
+	bs.bytes_written += n_bytes;
+	bs.n_writes++;
+	return ok;
+#endif
+}
+
+bool backend_file::copy(const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks)
+{
+#if defined(__MINGW32__)
+	return backend::copy(src_block_nr, dst_block_nr, n_blocks);
+#else
+	auto   block_size = get_block_size();
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_file::copy", identifier, "block %" PRIu64 " to %" PRIu64 ", %d blocks, block size: %" PRIu64, src_block_nr, dst_block_nr, n_blocks, block_size);
+	auto   start      = get_micros();
+	bool   ok         = false;
+	{
+		range_lock_copy_guard lck(&locks, src_block_nr, dst_block_nr, n_blocks);
+#if defined(linux)
+		off_t src_offset = src_block_nr * block_size;
+		off_t dst_offset = dst_block_nr * block_size;
+
+		// the kernel refuses overlapping ranges within one file
+		bool overlap = std::max(src_block_nr, dst_block_nr) - std::min(src_block_nr, dst_block_nr) < n_blocks;
+
+		if (use_reflink && !overlap && !is_block_device) {
+			// btrfs, XFS: the blocks get shared, nothing is copied at all
+			file_clone_range fcr { fd, uint64_t(src_offset), n_bytes, uint64_t(dst_offset) };
+			ok = ioctl(fd, FICLONERANGE, &fcr) == 0;
+			if (!ok && errno != EINVAL) {  // EINVAL: not aligned to the filesystem block size
+				DOLOG(logging::ll_info, "backend_file::copy", identifier, "FICLONERANGE not supported (%s)", strerror(errno));
+				use_reflink = false;
+			}
+		}
+
+		if (!ok && use_copy_range && !overlap && !is_block_device) {
+			// in-kernel copy, NFS and SMB can even do it server-side
+			loff_t in  = src_offset;
+			loff_t out = dst_offset;
+			size_t done = 0;
+			while(done < n_bytes) {
+				ssize_t rc = copy_file_range(fd, &in, fd, &out, n_bytes - done, 0);
+				if (rc <= 0) {
+					if (rc == -1 && (errno == ENOSYS || errno == EOPNOTSUPP || errno == EXDEV)) {
+						DOLOG(logging::ll_info, "backend_file::copy", identifier, "copy_file_range not supported (%s)", strerror(errno));
+						use_copy_range = false;
+					}
+					break;
+				}
+				done += rc;
+			}
+			ok = done == n_bytes;
+		}
+#endif
+		if (!ok)
+			ok = copy_rw(src_block_nr, dst_block_nr, n_blocks);
+	}
+	auto end = get_micros();
+	if (!ok)
+		DOLOG(logging::ll_error, "backend_file::copy", identifier, "failed copying block %" PRIu64 " to %" PRIu64 " (%u blocks)", src_block_nr, dst_block_nr, n_blocks);
+	ts_last_acces     = end;
+	bs.io_wait       += end-start;
+	bs.bytes_read    += n_bytes;
+	bs.n_reads++;
+	bs.bytes_written += n_bytes;
+	bs.n_writes++;
+	return ok;
+#endif
+}
+
+#if !defined(__MINGW32__)
+// may only be called with the ranges locked
+bool backend_file::copy_rw(const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks)
+{
+	constexpr const uint32_t max_chunk_n = 256;
+	auto     block_size = get_block_size();
+	uint32_t chunk_n    = std::min(n_blocks, max_chunk_n);
+	std::vector<uint8_t> buffer(chunk_n * block_size);
+	// see backend::copy
+	bool     backwards  = dst_block_nr > src_block_nr && dst_block_nr - src_block_nr < n_blocks;
+
+	for(uint32_t i=0; i<n_blocks;) {
+		uint32_t current_n = std::min(chunk_n, n_blocks - i);
+		uint32_t offset    = backwards ? n_blocks - i - current_n : i;
+		size_t   n_bytes   = current_n * block_size;
+
+		ssize_t rc = pread(fd, buffer.data(), n_bytes, (src_block_nr + offset) * block_size);
+		if (rc == ssize_t(n_bytes))
+			rc = pwrite(fd, buffer.data(), n_bytes, (dst_block_nr + offset) * block_size);
+		if (rc != ssize_t(n_bytes)) {
+			DOLOG(logging::ll_error, "backend_file::copy_rw", identifier, "I/O error: %s", rc == -1 ? strerror(errno) : "short read/write");
+			return false;
+		}
+
+		i += current_n;
+	}
+
+	return true;
+}
+#endif
+
+// into the page cache of the OS
+bool backend_file::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	auto   block_size = get_block_size();
+	off_t  offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_file::prefetch", identifier, "block %" PRIu64 " (%lu), %d blocks, wait: %d", block_nr, offset, n_blocks, wait);
+
+	*fits = false;
+
+#if defined(linux)
+	// only count on memory that is not in use at all
+	long   free_pages = sysconf(_SC_AVPHYS_PAGES);
+	long   page_size  = sysconf(_SC_PAGESIZE);
+	if (free_pages > 0 && page_size > 0)
+		*fits = n_bytes <= uint64_t(free_pages) * page_size / 2;
+
+	auto   start      = get_micros();
+	// readahead() returns when the data is in, the advice right away
+	int    rc         = wait ? readahead(fd, offset, n_bytes) : posix_fadvise(fd, offset, n_bytes, POSIX_FADV_WILLNEED);
+	if (wait)
+		bs.io_wait   += get_micros() - start;
+	if (rc != 0) {
+		DOLOG(logging::ll_debug, "backend_file::prefetch", identifier, "readahead failed: %s", strerror(wait ? errno : rc));
+		*fits = false;
+	}
+#elif defined(POSIX_FADV_WILLNEED)
+	posix_fadvise(fd, offset, n_bytes, POSIX_FADV_WILLNEED);
+#endif
+
+	return true;
+}
+
 bool backend_file::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
 {
 	auto     block_size = get_block_size();
@@ -146,9 +473,12 @@ bool backend_file::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_
 	else
 		DOLOG(logging::ll_error, "backend_file::read", identifier, "lseek failed: %s", strerror(errno));
 #else
-	auto lock_list = lock_range(block_nr, n_blocks);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+#if defined(SEEK_HOLE)
+	ssize_t rc = is_sparse ? read_sparse(data, n_bytes, offset) : pread(fd, data, n_bytes, offset);
+#else
 	ssize_t rc = pread(fd, data, n_bytes, offset);
-	unlock_range(lock_list);
+#endif
 #endif
 	auto end = get_micros();
 	if (rc == -1)
@@ -162,83 +492,147 @@ bool backend_file::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_
 	return rc == ssize_t(n_bytes);
 }
 
-backend::cmpwrite_result_t backend_file::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+#if defined(SEEK_HOLE)
+// holes are zero-filled here instead of being read via the filesystem
+ssize_t backend_file::read_sparse(uint8_t *const data, const size_t n_bytes, const off_t offset)
 {
-	auto block_size = get_block_size();
+	off_t pos = offset;
+	off_t end = offset + n_bytes;
 
-	DOLOG(logging::ll_debug, "backend_file::cmpwrite", identifier, "block %" PRIu64 " (%lu), %d blocks (%zu), block size: %" PRIu64, block_nr, block_nr * block_size, n_blocks, n_blocks * block_size, block_size);
+	while(pos < end) {
+		off_t data_start = lseek(fd, pos, SEEK_DATA);
+		if (data_start == -1) {
+			if (errno != ENXIO)  // ENXIO: only a hole after 'pos'
+				return pread(fd, data, n_bytes, offset);
+			data_start = end;
+		}
 
-	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
-	uint8_t          *buffer = new uint8_t[block_size]();
-	auto              start  = get_micros();
-#if defined(__MINGW32__)
-	std::unique_lock<std::mutex> lck(io_lock);
+		if (data_start > pos) {
+			off_t hole_end = std::min(data_start, end);
+			memset(&data[pos - offset], 0x00, hole_end - pos);
+			pos = hole_end;
+			continue;
+		}
+
+		off_t data_end = lseek(fd, pos, SEEK_HOLE);
+		if (data_end == -1 || data_end > end)
+			data_end = end;
+
+		ssize_t rc = pread(fd, &data[pos - offset], data_end - pos, pos);
+		if (rc != data_end - pos)
+			return rc == -1 ? -1 : pos - offset + rc;
+
+		pos = data_end;
+	}
+
+	return n_bytes;
+}
+#endif
+
+bool backend_file::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+#if defined(SEEK_HOLE)
+	auto  block_size = get_block_size();
+	off_t offset     = block_nr * block_size;
+
+	off_t data_start = lseek(fd, offset, SEEK_DATA);
+	if (data_start == -1 && errno == ENXIO) {  // hole up to the end of the file
+		*status = LS_DEALLOCATED;
+		*n_same = max_n;
+		return true;
+	}
+
+	if (data_start == -1) {
+		DOLOG(logging::ll_debug, "backend_file::get_lba_status", identifier, "SEEK_DATA failed: %s", strerror(errno));
+		return backend::get_lba_status(block_nr, max_n, status, n_same);
+	}
+
+	// a block that is partially allocated counts as mapped
+	uint64_t n_hole = (data_start - offset) / block_size;
+	if (n_hole > 0) {
+		*status = LS_DEALLOCATED;
+		*n_same = std::min(n_hole, max_n);
+		return true;
+	}
+
+	off_t data_end = lseek(fd, std::max(offset, data_start), SEEK_HOLE);
+	if (data_end == -1) {
+		DOLOG(logging::ll_debug, "backend_file::get_lba_status", identifier, "SEEK_HOLE failed: %s", strerror(errno));
+		return backend::get_lba_status(block_nr, max_n, status, n_same);
+	}
+
+	*status = LS_MAPPED;
+	*n_same = std::clamp(uint64_t(data_end - offset + block_size - 1) / block_size, uint64_t(1), max_n);
+
+	return true;
 #else
-	auto lock_list  = lock_range(block_nr, n_blocks);
+	return backend::get_lba_status(block_nr, max_n, status, n_same);
 #endif
+}
+
+backend::cmpwrite_result_t backend_file::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	auto   block_size = get_block_size();
+	off_t  offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+
+	DOLOG(logging::ll_debug, "backend_file::cmpwrite", identifier, "block %" PRIu64 " (%lu), %d blocks (%zu), block size: %" PRIu64, block_nr, offset, n_blocks, n_bytes, block_size);
 
-	// DO
-	for(uint32_t i=0; i<n_blocks; i++ ) {
-		// read
-		off_t   offset = (block_nr + i) * block_size;
+	// VMFS sends a steady stream of these (heartbeats, locks): do not allocate every time
+	thread_local std::vector<uint8_t> buffer;
+	if (buffer.size() < n_bytes)
+		buffer.resize(n_bytes);
+
+	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
+	auto              start  = get_micros();
+	{
 #if defined(__MINGW32__)
+		std::unique_lock<std::mutex> lck(io_lock);
 		int rc = lseek(fd, offset, SEEK_SET);
 		if (rc != -1)
-			rc = ::read(fd, buffer, block_size);
+			rc = ::read(fd, buffer.data(), n_bytes);
 #else
-		ssize_t rc     = pread(fd, buffer, block_size, offset);
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+		ssize_t rc = pread(fd, buffer.data(), n_bytes, offset);
 #endif
-		if (rc != ssize_t(block_size)) {
+		if (rc != ssize_t(n_bytes)) {
 			if (rc == -1)
 				DOLOG(logging::ll_error, "backend_file::cmpwrite", identifier, "error reading: %s", strerror(errno));
 			else
-				DOLOG(logging::ll_error, "backend_file::cmpwrite", identifier, "short read, requested: %zu, received: %zd", block_size, rc);
+				DOLOG(logging::ll_error, "backend_file::cmpwrite", identifier, "short read, requested: %zu, received: %zd", n_bytes, ssize_t(rc));
 			result = cmpwrite_result_t::CWR_READ_ERROR;
-			break;
 		}
-		bs.bytes_read += block_size;
-
-		// compare
-		if (memcmp(buffer, &data_compare[i * block_size], block_size) != 0) {
-			DOLOG(logging::ll_warning, "backend_file::cmpwrite", identifier, "data does not match");  // is this really a warning?
+		else if (memcmp(buffer.data(), data_compare, n_bytes) != 0) {
+			DOLOG(logging::ll_debug, "backend_file::cmpwrite", identifier, "data does not match");
 			result = cmpwrite_result_t::CWR_MISMATCH;
-			break;
 		}
-	}
-
-	if (result == cmpwrite_result_t::CWR_OK) {
-		// write
+		else {
 #if defined(__MINGW32__)
-		int rc = lseek(fd, block_nr * block_size, SEEK_SET);
-		if (rc != -1)
-			rc = ::write(fd, data_write, n_blocks * block_size);
+			rc = lseek(fd, offset, SEEK_SET);
+			if (rc != -1)
+				rc = ::write(fd, data_write, n_bytes);
 #else
-		ssize_t rc = pwrite(fd, data_write, n_blocks * block_size, block_nr * block_size);
+			rc = pwrite(fd, data_write, n_bytes, offset);
 #endif
-		if (rc != ssize_t(n_blocks * block_size)) {
-			if (rc == -1)
-				DOLOG(logging::ll_error, "backend_file::cmpwrite", identifier, "error writing: %s", strerror(errno));
-			else
-				DOLOG(logging::ll_error, "backend_file::cmpwrite", identifier, "short write, sent: %zu, written: %zd", n_blocks * block_size, rc);
-			result = cmpwrite_result_t::CWR_WRITE_ERROR;
-		}
-		else {
-			bs.bytes_written += block_size;
-
-			ts_last_acces = get_micros();
+			if (rc != ssize_t(n_bytes)) {
+				if (rc == -1)
+					DOLOG(logging::ll_error, "backend_file::cmpwrite", identifier, "error writing: %s", strerror(errno));
+				else
+					DOLOG(logging::ll_error, "backend_file::cmpwrite", identifier, "short write, sent: %zu, written: %zd", n_bytes, ssize_t(rc));
+				result = cmpwrite_result_t::CWR_WRITE_ERROR;
+			}
 		}
 	}
 
-	auto end    = get_micros();
-	bs.io_wait += end-start;
+	auto end = get_micros();
+	ts_last_acces  = end;
+	bs.io_wait    += end-start;
+	bs.bytes_read += n_bytes;
 	bs.n_reads++;
-	bs.n_writes++;
-
-	delete [] buffer;
-
-#if !defined(__MINGW32__)
-	unlock_range(lock_list);
-#endif
+	if (result == cmpwrite_result_t::CWR_OK) {
+		bs.bytes_written += n_bytes;
+		bs.n_writes++;
+	}
 
 	return result;
 }
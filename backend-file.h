@@ -1,3 +1,6 @@
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
 
 #include "backend.h"
@@ -12,6 +15,24 @@ private:
 	// because mingw does not do pread/pwrite and multiple threads can access backend_file
 	std::mutex        io_lock;
 #endif
+	// group commit: concurrent sync() calls share one fdatasync()
+	std::mutex        sync_lock;
+	std::condition_variable sync_cv;
+	uint64_t          sync_started   { 0     };  // epoch of the most recently started flush
+	uint64_t          sync_completed { 0     };
+	uint64_t          sync_failed    { 0     };  // epoch of the most recent flush that failed
+	bool              sync_busy      { false };
+	std::atomic_bool  use_rwf_dsync  { true  };  // FUA writes with pwritev2(RWF_DSYNC)
+	std::atomic_bool  is_sparse      { false };  // has holes: reads skip them
+	std::atomic_bool  use_zero_range { true  };  // write_zeroes with FALLOC_FL_ZERO_RANGE
+	bool              is_block_device{ false };  // write_zeroes with BLKZEROOUT
+	std::atomic_bool  use_reflink    { true  };  // copy with FICLONERANGE
+	std::atomic_bool  use_copy_range { true  };  // copy with copy_file_range
+
+	bool    flush();
+	bool    write_pattern(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern);
+	bool    copy_rw(const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks);
+	ssize_t read_sparse(uint8_t *const data, const size_t n_bytes, const off_t offset);
 
 public:
 	backend_file(const std::string & filename);
@@ -23,10 +44,19 @@ public:
 	uint64_t    get_size_in_blocks() const override;
 	uint64_t    get_block_size()     const override;
 
+	bool        trim_reads_zeroes()  const override;
+
 	bool sync() override;
 
 	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
 	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
 	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
 	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_same    (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool copy          (const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
 };
@@ -0,0 +1,196 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <vector>
+
+#include "backend-golden.h"
+#include "backend-readcache.h"
+#include "log.h"
+#include "utils.h"
+
+
+golden_image::golden_image(backend *const base, readcache_pool *const pool, const uint32_t chunk_blocks):
+	b(new backend_readcache(base, pool)),
+	chunk_blocks(std::max(chunk_blocks, uint32_t(1)))
+{
+}
+
+golden_image::~golden_image()
+{
+	DOLOG(logging::ll_info, "golden_image", b->get_serial(), "%" PRIu64 " reads, %" PRIu64 " of which were in the cache and %" PRIu64 " waited for another clone", n_reads.load(), n_hits.load(), n_waits.load());
+
+	delete b;
+}
+
+bool golden_image::begin()
+{
+	std::unique_lock<std::mutex> lck(lock);
+	if (started)
+		return true;
+
+	started = b->begin();
+
+	return started;
+}
+
+std::string golden_image::get_serial() const
+{
+	return b->get_serial();
+}
+
+uint64_t golden_image::get_size_in_blocks() const
+{
+	return b->get_size_in_blocks();
+}
+
+uint64_t golden_image::get_block_size() const
+{
+	return b->get_block_size();
+}
+
+// whole chunks are read (via the cache) so that a clone that reads another
+// part of a chunk that was just read finds it in the cache too. only misses
+// are coordinated: what is in the cache is read by all clones in parallel
+bool golden_image::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	if (n_blocks == 0)
+		return true;
+
+	n_reads++;
+
+	if (b->read_cached(block_nr, n_blocks, data)) {
+		n_hits++;
+		return true;
+	}
+
+	const uint64_t first = block_nr / chunk_blocks;
+	const uint64_t last  = (block_nr + n_blocks - 1) / chunk_blocks;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		bool waited = false;
+		for(;;) {
+			auto it = in_flight.lower_bound(first);
+			if (it == in_flight.end() || *it > last)
+				break;
+
+			waited = true;
+			in_flight_cv.wait(lck);
+		}
+
+		n_waits += waited;
+
+		for(uint64_t c=first; c<=last; c++)
+			in_flight.insert(c);
+	}
+
+	const uint64_t start      = first * chunk_blocks;
+	const uint64_t end        = std::min((last + 1) * chunk_blocks, b->get_size_in_blocks());
+	const uint64_t block_size = b->get_block_size();
+
+	bool rc = false;
+	if (start == block_nr && end == block_nr + n_blocks)
+		rc = b->read(block_nr, n_blocks, data);
+	else {
+		std::vector<uint8_t> buffer((end - start) * block_size);
+		rc = b->read(start, end - start, buffer.data());
+		if (rc)
+			memcpy(data, &buffer[(block_nr - start) * block_size], n_blocks * block_size);
+	}
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		in_flight.erase(in_flight.find(first), in_flight.upper_bound(last));
+	}
+
+	in_flight_cv.notify_all();
+
+	return rc;
+}
+
+bool golden_image::get_lba_status(const uint64_t block_nr, const uint64_t max_n, backend::lba_status_t *const status, uint64_t *const n_same)
+{
+	return b->get_lba_status(block_nr, max_n, status, n_same);
+}
+
+backend_golden::backend_golden(std::shared_ptr<golden_image> image):
+	backend("golden"),
+	image(image)
+{
+}
+
+backend_golden::~backend_golden()
+{
+}
+
+bool backend_golden::begin()
+{
+	return image->begin();
+}
+
+std::string backend_golden::get_serial() const
+{
+	return image->get_serial();
+}
+
+uint64_t backend_golden::get_size_in_blocks() const
+{
+	return image->get_size_in_blocks();
+}
+
+uint64_t backend_golden::get_block_size() const
+{
+	return image->get_block_size();
+}
+
+bool backend_golden::sync()
+{
+	return true;
+}
+
+bool backend_golden::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_error, "backend_golden::write", identifier, "the golden image is read-only");
+
+	return false;
+}
+
+bool backend_golden::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_error, "backend_golden::trim", identifier, "the golden image is read-only");
+
+	return false;
+}
+
+bool backend_golden::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_error, "backend_golden::write_zeroes", identifier, "the golden image is read-only");
+
+	return false;
+}
+
+backend::cmpwrite_result_t backend_golden::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	DOLOG(logging::ll_error, "backend_golden::cmpwrite", identifier, "the golden image is read-only");
+
+	return backend::cmpwrite_result_t::CWR_WRITE_ERROR;
+}
+
+bool backend_golden::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	uint64_t start = get_micros();
+	bool     rc    = image->read(block_nr, n_blocks, data);
+
+	bs.io_wait    += get_micros() - start;
+	bs.bytes_read += n_blocks * get_block_size();
+	bs.n_reads++;
+	ts_last_acces  = get_micros();
+
+	return rc;
+}
+
+bool backend_golden::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	return image->get_lba_status(block_nr, max_n, status, n_same);
+}
@@ -0,0 +1,75 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "backend.h"
+
+
+class backend_readcache;
+class readcache_pool;
+
+// A read-only base image shared by linked clones (each a backend_cow over a
+// backend_golden). There is one read cache for all of them and a chunk is
+// read by one clone at a time: the others wait for it and then find it in
+// the cache, so when they all boot at the same time every block of the
+// image comes from the disk only once.
+class golden_image
+{
+private:
+	backend_readcache *const b        { nullptr };  // owned; the base behind a read cache
+	const uint32_t       chunk_blocks { 1       };
+
+	std::mutex           lock;  // protects the members below
+	std::condition_variable in_flight_cv;
+	std::set<uint64_t>   in_flight;  // chunks being read
+	bool                 started      { false   };
+
+	std::atomic_uint64_t n_reads      { 0       };
+	std::atomic_uint64_t n_hits       { 0       };  // reads that were all in the cache
+	std::atomic_uint64_t n_waits      { 0       };  // reads that waited for another clone
+
+public:
+	// 'base' is owned, 'pool' is not
+	golden_image(backend *const base, readcache_pool *const pool, const uint32_t chunk_blocks);
+	virtual ~golden_image();
+
+	bool begin();  // only the first call does something
+
+	std::string get_serial()         const;
+	uint64_t    get_size_in_blocks() const;
+	uint64_t    get_block_size()     const;
+
+	bool read          (const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, backend::lba_status_t *const status, uint64_t *const n_same);
+};
+
+// The view of one clone on a golden_image; refuses writes.
+class backend_golden : public backend
+{
+private:
+	std::shared_ptr<golden_image> image;
+
+public:
+	backend_golden(std::shared_ptr<golden_image> image);
+	virtual ~backend_golden();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	bool sync() override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+};
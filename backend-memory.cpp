@@ -0,0 +1,201 @@
+#include <cinttypes>
+#include <cstring>
+#include <unistd.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
+
+#include "backend-memory.h"
+#include "log.h"
+#include "utils.h"
+
+
+backend_memory::backend_memory(const uint64_t size, const bool use_hugepages):
+	backend(myformat("memory:%" PRIu64, size)),
+	size(size),
+	use_hugepages(use_hugepages)
+{
+}
+
+backend_memory::~backend_memory()
+{
+#if !defined(__MINGW32__)
+	if (is_mmapped)
+		munmap(data, mapping_size);
+	else
+#endif
+		delete [] data;
+}
+
+bool backend_memory::begin()
+{
+	mapping_size = size;
+
+#if defined(__MINGW32__)
+	data = new uint8_t[mapping_size]();
+#else
+	page_size = sysconf(_SC_PAGESIZE);
+
+#if defined(linux)
+	if (use_hugepages) {
+		constexpr const size_t huge_page_size = 2 * 1024 * 1024;
+		size_t huge_mapping_size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+
+		void *p = mmap(nullptr, huge_mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB, -1, 0);
+		if (p == MAP_FAILED)
+			DOLOG(logging::ll_warning, "backend_memory::begin", identifier, "cannot allocate huge pages (%s), falling back to transparent huge pages", strerror(errno));
+		else {
+			data         = reinterpret_cast<uint8_t *>(p);
+			mapping_size = huge_mapping_size;
+			page_size    = huge_page_size;
+		}
+	}
+#endif
+
+	if (data == nullptr) {
+		// MAP_NORESERVE + anonymous: nothing is allocated until it is written to
+		void *p = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED) {
+			DOLOG(logging::ll_error, "backend_memory::begin", identifier, "cannot allocate %zu bytes: %s", mapping_size, strerror(errno));
+			return false;
+		}
+
+		data = reinterpret_cast<uint8_t *>(p);
+#if defined(linux)
+		if (use_hugepages)
+			madvise(data, mapping_size, MADV_HUGEPAGE);
+#endif
+	}
+
+	is_mmapped = true;
+#endif
+
+	return true;
+}
+
+uint64_t backend_memory::get_size_in_blocks() const
+{
+	return size / get_block_size();
+}
+
+uint64_t backend_memory::get_block_size() const
+{
+	return 4096;
+}
+
+std::string backend_memory::get_serial() const
+{
+	return identifier;
+}
+
+bool backend_memory::sync()
+{
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	return true;
+}
+
+bool backend_memory::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	*fits = true;  // it is all in RAM already
+
+	return true;
+}
+
+bool backend_memory::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	auto   block_size = get_block_size();
+	size_t offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_memory::write", identifier, "block %" PRIu64 " (%zu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+		memcpy(&this->data[offset], data, n_bytes);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_bytes;
+	bs.n_writes++;
+
+	return true;
+}
+
+void backend_memory::zero_range(const uint64_t offset, const uint64_t n_bytes)
+{
+#if defined(linux)
+	// give whole pages back to the OS; they read as zeros afterwards
+	uint64_t page_start = (offset + page_size - 1) & ~uint64_t(page_size - 1);
+	uint64_t page_end   = (offset + n_bytes) & ~uint64_t(page_size - 1);
+
+	if (is_mmapped && page_end > page_start && madvise(&data[page_start], page_end - page_start, MADV_DONTNEED) == 0) {
+		memset(&data[offset], 0x00, page_start - offset);
+		memset(&data[page_end], 0x00, offset + n_bytes - page_end);
+		return;
+	}
+#endif
+
+	memset(&data[offset], 0x00, n_bytes);
+}
+
+bool backend_memory::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	auto   block_size = get_block_size();
+	size_t offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_memory::trim", identifier, "block %" PRIu64 " (%zu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+		zero_range(offset, n_bytes);
+	}
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return true;
+}
+
+bool backend_memory::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	auto   block_size = get_block_size();
+	size_t offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_memory::read", identifier, "block %" PRIu64 " (%zu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	{
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+		memcpy(data, &this->data[offset], n_bytes);
+	}
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_bytes;
+	bs.n_reads++;
+
+	return true;
+}
+
+backend::cmpwrite_result_t backend_memory::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	auto   block_size = get_block_size();
+	size_t offset     = block_nr * block_size;
+	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_memory::cmpwrite", identifier, "block %" PRIu64 " (%zu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+
+	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
+
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	if (memcmp(&data[offset], data_compare, n_bytes) != 0) {
+		DOLOG(logging::ll_debug, "backend_memory::cmpwrite", identifier, "data does not match");
+		result = cmpwrite_result_t::CWR_MISMATCH;
+	}
+	else {
+		memcpy(&data[offset], data_write, n_bytes);
+		bs.bytes_written += n_bytes;
+	}
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_bytes;
+	bs.n_reads++;
+	bs.n_writes++;
+
+	return result;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <string>
+
+#include "backend.h"
+
+
+// RAM-disk: sparse (pages are only allocated when written to) and
+// trim() gives the memory back to the OS
+class backend_memory : public backend
+{
+private:
+	const uint64_t size          { 0       };  // in bytes
+	const bool     use_hugepages { false   };
+	uint8_t       *data          { nullptr };
+	size_t         mapping_size  { 0       };
+	size_t         page_size     { 4096    };
+	bool           is_mmapped    { false   };
+
+	void zero_range(const uint64_t offset, const uint64_t n_bytes);
+
+public:
+	backend_memory(const uint64_t size, const bool use_hugepages);
+	virtual ~backend_memory();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	bool sync() override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+};
@@ -0,0 +1,861 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
+
+#include "backend-mirror.h"
+#include "log.h"
+#include "utils.h"
+
+
+backend_mirror::backend_mirror(const std::vector<backend *> & children, const int quorum, const std::string & drl_file, const uint64_t region_size):
+	backend(myformat("mirror:%zu", children.size())),
+	quorum(std::max(quorum, 0)),
+	drl_file(drl_file),
+	region_size(region_size)
+{
+	for(auto & b: children) {
+		leg *l = new leg();
+		l->b = b;
+		legs.push_back(l);
+	}
+}
+
+backend_mirror::~backend_mirror()
+{
+	stop_flag = true;
+
+	if (resyncer) {
+		{
+			std::unique_lock<std::mutex> lck(drl_lock);
+			stop_cv.notify_all();
+		}
+		resyncer->join();
+		delete resyncer;
+	}
+
+	// the workers first finish what is queued
+	for(auto & l: legs) {
+		{
+			std::unique_lock<std::mutex> lck(l->lock);
+			l->cv.notify_all();
+		}
+
+		for(auto & th: l->workers) {
+			th->join();
+			delete th;
+		}
+	}
+
+	drl_clean();
+
+#if !defined(__MINGW32__)
+	if (drl_mapping) {
+		msync(drl_mapping, drl_mapping_size, MS_SYNC);
+		munmap(drl_mapping, drl_mapping_size);
+	}
+#endif
+
+	if (drl_fd != -1)
+		close(drl_fd);
+
+	for(auto & l: legs) {
+		delete l->b;
+		delete l;
+	}
+}
+
+bool backend_mirror::begin()
+{
+	if (legs.size() > max_legs) {
+		DOLOG(logging::ll_error, "backend_mirror::begin", identifier, "at most %u legs", max_legs);
+		return false;
+	}
+
+	size = UINT64_MAX;
+
+	for(auto & l: legs) {
+		if (l->b->begin() == false)
+			return false;
+
+		if (block_size == 0)
+			block_size = l->b->get_block_size();
+		else if (l->b->get_block_size() != block_size) {
+			DOLOG(logging::ll_error, "backend_mirror::begin", identifier, "all legs must have the same block size (%" PRIu64 " and %" PRIu64 ")", block_size, l->b->get_block_size());
+			return false;
+		}
+
+		size = std::min(size, l->b->get_size_in_blocks());
+	}
+
+	region_blocks = std::max(region_size / block_size, uint64_t(1));
+	n_regions     = (size + region_blocks - 1) / region_blocks;
+
+	if (drl_begin() == false)
+		return false;
+
+	DOLOG(logging::ll_info, "backend_mirror::begin", identifier, "%zu legs, quorum %d (0 = all), %" PRIu64 " blocks, DRL regions of %u blocks", legs.size(), quorum, size, region_blocks);
+
+	for(size_t i=0; i<legs.size(); i++) {
+		for(int k=0; k<workers_per_leg; k++)
+			legs[i]->workers.push_back(new std::thread(&backend_mirror::worker_thread, this, i));
+	}
+
+	ts_last_stats = get_micros();
+
+	resyncer = new std::thread(&backend_mirror::resyncer_thread, this);
+
+	return true;
+}
+
+// a new DRL is all clean: the legs must be identical when they are first
+// used together (e.g. empty)
+bool backend_mirror::drl_begin()
+{
+	size_t bits_size = (n_regions + 7) / 8;
+
+	if (drl_file.empty()) {
+		drl_ram.resize(bits_size);
+		drl_bits = drl_ram.data();
+		return true;
+	}
+
+#if defined(__MINGW32__)
+	DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "a DRL file is not supported on this platform");
+	return false;
+#else
+	drl_mapping_size = drl_header_size + bits_size;
+
+	drl_fd = open(drl_file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (drl_fd == -1) {
+		DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "cannot open %s: %s", drl_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st { };
+	if (fstat(drl_fd, &st) == -1) {
+		DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "cannot fstat: %s", strerror(errno));
+		return false;
+	}
+
+	bool is_new = st.st_size == 0;
+	if (is_new) {
+		if (ftruncate(drl_fd, drl_mapping_size) == -1) {
+			DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "cannot resize to %zu bytes: %s", drl_mapping_size, strerror(errno));
+			return false;
+		}
+	}
+	else if (size_t(st.st_size) != drl_mapping_size) {
+		DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "file is %zu bytes, expected %zu: was it made for another mirror?", size_t(st.st_size), drl_mapping_size);
+		return false;
+	}
+
+	void *p = mmap(nullptr, drl_mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, drl_fd, 0);
+	if (p == MAP_FAILED) {
+		DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "cannot mmap: %s", strerror(errno));
+		return false;
+	}
+	drl_mapping = reinterpret_cast<uint8_t *>(p);
+	drl_bits    = &drl_mapping[drl_header_size];
+	drl_hdr     = reinterpret_cast<drl_header *>(drl_mapping);
+
+	if (is_new) {
+		memcpy(drl_hdr->magic, "iESPDRL1", sizeof drl_hdr->magic);
+		drl_hdr->n_legs        = legs.size();
+		drl_hdr->region_blocks = region_blocks;
+		drl_hdr->n_regions     = n_regions;
+
+		if (msync(drl_mapping, drl_mapping_size, MS_SYNC) == -1) {
+			DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "cannot msync: %s", strerror(errno));
+			return false;
+		}
+
+		return true;
+	}
+
+	if (memcmp(drl_hdr->magic, "iESPDRL1", sizeof drl_hdr->magic) != 0 || drl_hdr->n_legs != legs.size() || drl_hdr->region_blocks != region_blocks || drl_hdr->n_regions != n_regions) {
+		DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "header does not match (%zu legs, %" PRIu64 " regions of %u blocks)", legs.size(), n_regions, region_blocks);
+		return false;
+	}
+
+	// legs that were dropped get probed and resynced by the resyncer
+	int source = -1;
+	for(size_t i=0; i<legs.size(); i++) {
+		if (drl_hdr->stale[i]) {
+			legs[i]->active  = false;
+			legs[i]->in_sync = false;
+			DOLOG(logging::ll_warning, "backend_mirror::drl_begin", identifier, "leg %zu was dropped before, it will be resynced", i);
+		}
+		else if (source == -1) {
+			source = i;
+		}
+	}
+
+	if (source == -1) {
+		DOLOG(logging::ll_error, "backend_mirror::drl_begin", identifier, "all legs are stale, using leg 0");
+		legs[0]->active  = true;
+		legs[0]->in_sync = true;
+		drl_hdr->stale[0] = 0;
+		source = 0;
+	}
+
+	uint64_t n_dirty = 0;
+	for(uint64_t r=0; r<n_regions; r++)
+		n_dirty += drl_is_dirty(r);
+
+	// dirty regions without stale legs: iESP stopped with writes in flight;
+	// those regions may differ between the legs
+	if (n_dirty) {
+		DOLOG(logging::ll_warning, "backend_mirror::drl_begin", identifier, "%" PRIu64 " dirty regions, resyncing them from leg %d", n_dirty, source);
+
+		for(size_t i=0; i<legs.size(); i++) {
+			if (int(i) != source)
+				legs[i]->in_sync = false;
+		}
+	}
+
+	return true;
+#endif
+}
+
+// may only be called with 'drl_lock' held (or before the backend is used)
+bool backend_mirror::drl_is_dirty(const uint64_t region)
+{
+	return drl_bits[region / 8] & (1 << (region & 7));
+}
+
+// before a write: the regions become dirty, on disk
+bool backend_mirror::drl_mark(const uint64_t block_nr, const uint64_t n_blocks)
+{
+	uint64_t first = block_nr / region_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / region_blocks;
+	uint64_t first_changed = UINT64_MAX;
+	uint64_t last_changed  = 0;
+
+	std::unique_lock<std::mutex> lck(drl_lock);
+	for(uint64_t r=first; r<=last; r++) {
+		drl_writes[r]++;
+
+		if (drl_is_dirty(r) == false) {
+			drl_bits[r / 8] |= 1 << (r & 7);
+
+			first_changed = std::min(first_changed, r);
+			last_changed  = r;
+		}
+	}
+
+#if !defined(__MINGW32__)
+	if (drl_mapping && first_changed != UINT64_MAX) {
+		static const size_t page_size = sysconf(_SC_PAGESIZE);
+		size_t start = (drl_header_size + first_changed / 8) & ~(page_size - 1);
+		size_t end   = drl_header_size + last_changed / 8 + 1;
+		if (msync(&drl_mapping[start], end - start, MS_SYNC) == -1) {
+			DOLOG(logging::ll_error, "backend_mirror::drl_mark", identifier, "cannot msync: %s", strerror(errno));
+			return false;
+		}
+	}
+#endif
+
+	return true;
+}
+
+// the write is on all legs that it was sent to
+void backend_mirror::drl_release(const uint64_t block_nr, const uint64_t n_blocks)
+{
+	uint64_t first = block_nr / region_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / region_blocks;
+
+	std::unique_lock<std::mutex> lck(drl_lock);
+	for(uint64_t r=first; r<=last; r++) {
+		auto it = drl_writes.find(r);
+		if (--it->second == 0)
+			drl_writes.erase(it);
+	}
+}
+
+// regions without writes in flight become clean again, but only when all
+// legs are there; lazily: after a crash this only means a bit more resync.
+// the legs are checked with 'drl_lock' held: drop_leg() takes it too, so
+// that a write that failed on a leg (and is released after the drop) can
+// not be cleaned away before the drop is seen
+void backend_mirror::drl_clean()
+{
+	std::unique_lock<std::mutex> lck(drl_lock);
+
+	for(auto & l: legs) {
+		if (l->active == false || l->in_sync == false)
+			return;
+	}
+
+	bool changed = false;
+	for(uint64_t r=0; r<n_regions; r++) {
+		if (drl_bits[r / 8] == 0) {
+			r |= 7;
+			continue;
+		}
+
+		if (drl_is_dirty(r) && drl_writes.find(r) == drl_writes.end()) {
+			drl_bits[r / 8] &= ~(1 << (r & 7));
+			changed = true;
+		}
+	}
+
+#if !defined(__MINGW32__)
+	if (drl_mapping && changed)
+		msync(drl_mapping, drl_mapping_size, MS_ASYNC);
+#endif
+}
+
+void backend_mirror::set_stale(const size_t nr, const bool stale)
+{
+#if !defined(__MINGW32__)
+	std::unique_lock<std::mutex> lck(drl_lock);
+	if (drl_hdr) {
+		drl_hdr->stale[nr] = stale;
+		if (msync(drl_mapping, drl_header_size, MS_SYNC) == -1)
+			DOLOG(logging::ll_error, "backend_mirror::set_stale", identifier, "cannot msync: %s", strerror(errno));
+	}
+#endif
+}
+
+void backend_mirror::drop_leg(const size_t nr, const char *const why)
+{
+	leg *const l = legs[nr];
+
+	{
+		std::unique_lock<std::mutex> lck(drl_lock);  // see drl_clean()
+		l->in_sync = false;
+		if (l->active.exchange(false) == false)
+			return;
+	}
+
+	l->next_probe = get_micros() + probe_interval * 1000000ull;
+	set_stale(nr, true);
+
+	DOLOG(logging::ll_error, "backend_mirror::drop_leg", identifier, "leg %zu dropped: %s", nr, why);
+}
+
+bool backend_mirror::overlaps(const std::shared_ptr<request> & a, const uint64_t block_nr, const uint64_t n_blocks) const
+{
+	return a->block_nr < block_nr + n_blocks && block_nr < a->block_nr + a->n_blocks;
+}
+
+// are there writes for the range that this leg did not do yet?
+bool backend_mirror::has_pending(leg *const l, const uint64_t block_nr, const uint64_t n_blocks)
+{
+	std::unique_lock<std::mutex> lck(l->lock);
+
+	for(auto & r: l->queue) {
+		if (r->op != MO_SYNC && overlaps(r, block_nr, n_blocks))
+			return true;
+	}
+
+	for(auto & r: l->running) {
+		if (r->op != MO_SYNC && overlaps(r, block_nr, n_blocks))
+			return true;
+	}
+
+	return false;
+}
+
+// a request is only started when no earlier one for the same blocks is
+// queued or running, so that every leg ends up with the same data
+void backend_mirror::worker_thread(const size_t nr)
+{
+	leg *const l = legs[nr];
+
+	std::unique_lock<std::mutex> lck(l->lock);
+
+	for(;;) {
+		auto it = l->queue.end();
+
+		for(auto cur = l->queue.begin(); cur != l->queue.end() && it == l->queue.end(); cur++) {
+			bool blocked = false;
+
+			for(auto & r: l->running)
+				blocked |= overlaps(r, (*cur)->block_nr, (*cur)->n_blocks);
+			for(auto earlier = l->queue.begin(); earlier != cur && blocked == false; earlier++)
+				blocked |= overlaps(*earlier, (*cur)->block_nr, (*cur)->n_blocks);
+
+			if (blocked == false)
+				it = cur;
+		}
+
+		if (it == l->queue.end()) {
+			if (stop_flag && l->queue.empty())
+				break;
+
+			l->cv.wait(lck);
+			continue;
+		}
+
+		std::shared_ptr<request> r = *it;
+		l->queue.erase(it);
+		l->running.push_back(r);
+		lck.unlock();
+
+		bool ok = l->active && execute(l->b, *r);
+		if (ok == false)
+			drop_leg(nr, "write failed");
+
+		lck.lock();
+		l->running.erase(std::find(l->running.begin(), l->running.end(), r));
+		l->cv.notify_all();
+		lck.unlock();
+
+		bool last = false;
+		{
+			std::unique_lock<std::mutex> r_lck(r->lock);
+			if (ok)
+				r->n_ok++;
+			else
+				r->n_failed++;
+			last = r->n_ok + r->n_failed == r->n_todo;
+			r->cv.notify_all();
+		}
+
+		if (last && r->drl)
+			drl_release(r->block_nr, r->n_blocks);
+
+		lck.lock();
+	}
+}
+
+bool backend_mirror::execute(backend *const b, const request & r)
+{
+	switch(r.op) {
+		case MO_WRITE:
+			return b->write(r.block_nr, r.n_blocks, r.data);
+		case MO_WRITE_FUA:
+			return b->write_fua(r.block_nr, r.n_blocks, r.data);
+		case MO_WRITE_ZEROES:
+			return b->write_zeroes(r.block_nr, r.n_blocks);
+		case MO_WRITE_SAME:
+			return b->write_same(r.block_nr, r.n_blocks, r.data);
+		case MO_TRIM:
+			return b->trim(r.block_nr, r.n_blocks);
+		case MO_SYNC:
+			return b->sync();
+	}
+
+	return false;
+}
+
+// sends a request to all active legs (or only to 'only_leg', for a resync)
+// and waits for the quorum; true when at least one leg has it
+bool backend_mirror::submit(const op_t op, const uint64_t block_nr, const uint64_t n_blocks, const uint8_t *const data, const size_t data_size, const int only_leg)
+{
+	std::vector<size_t> targets;
+	for(size_t i=0; i<legs.size(); i++) {
+		if (only_leg == -1 ? legs[i]->active.load() : int(i) == only_leg)
+			targets.push_back(i);
+	}
+
+	if (targets.empty()) {
+		DOLOG(logging::ll_error, "backend_mirror::submit", identifier, "no legs left");
+		return false;
+	}
+
+	auto r = std::make_shared<request>();
+	r->op       = op;
+	r->block_nr = block_nr;
+	r->n_blocks = n_blocks;
+	r->n_todo   = targets.size();
+
+	int need = quorum == 0 ? targets.size() : std::min(quorum, int(targets.size()));
+	if (need < int(targets.size()) && data) {  // the caller's buffer is gone when the others run
+		r->copy.assign(data, data + data_size);
+		r->data = r->copy.data();
+	}
+	else {
+		r->data = data;
+	}
+
+	if (op != MO_SYNC && only_leg == -1) {
+		if (drl_mark(block_nr, n_blocks) == false)
+			return false;
+		r->drl = true;
+	}
+
+	for(auto & nr: targets) {
+		leg *const l = legs[nr];
+		std::unique_lock<std::mutex> lck(l->lock);
+		l->queue.push_back(r);
+		l->cv.notify_one();
+	}
+
+	std::unique_lock<std::mutex> lck(r->lock);
+	r->cv.wait(lck, [r, need] { return r->n_ok >= need || r->n_ok + r->n_failed == r->n_todo; });
+
+	return r->n_ok > 0;
+}
+
+// the leg with the fewest reads in flight and the lowest latency, that has
+// all writes for the range
+int backend_mirror::pick_leg(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	for(;;) {
+		int    best       = -1;
+		double best_score = 0.;
+		bool   any        = false;
+
+		for(size_t i=0; i<legs.size(); i++) {
+			leg *const l = legs[i];
+			if (l->active == false || l->in_sync == false)
+				continue;
+
+			any = true;
+
+			if (has_pending(l, block_nr, n_blocks))
+				continue;
+
+			double score = (l->in_flight + 1.) * (l->latency + 1.);
+			if (best == -1 || score < best_score) {
+				best       = i;
+				best_score = score;
+			}
+		}
+
+		if (best != -1 || any == false)
+			return best;
+
+		// all have a write for it queued (quorum < number of legs)
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+}
+
+bool backend_mirror::read_locked(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	for(;;) {
+		int nr = pick_leg(block_nr, n_blocks);
+		if (nr == -1) {
+			DOLOG(logging::ll_error, "backend_mirror::read_locked", identifier, "no legs left");
+			return false;
+		}
+
+		leg *const l = legs[nr];
+
+		l->in_flight++;
+		uint64_t start = get_micros();
+		bool     rc    = l->b->read(block_nr, n_blocks, data);
+		uint64_t took  = get_micros() - start;
+		l->in_flight--;
+
+		uint64_t old = l->latency;
+		l->latency = old ? (old * 7 + took) / 8 : took;
+
+		if (rc)
+			return true;
+
+		drop_leg(nr, "read failed");
+	}
+}
+
+// copies the dirty regions to a leg that was dropped or missed writes
+bool backend_mirror::resync_leg(const size_t nr)
+{
+	leg *const l = legs[nr];
+
+	DOLOG(logging::ll_info, "backend_mirror::resync_leg", identifier, "resyncing leg %zu", nr);
+
+	std::vector<uint8_t> buffer(region_blocks * block_size);
+	uint64_t n_copied = 0;
+
+	for(uint64_t r=0; r<n_regions && stop_flag == false && l->active; r++) {
+		{
+			std::unique_lock<std::mutex> lck(drl_lock);
+			if (drl_is_dirty(r) == false)
+				continue;
+		}
+
+		uint64_t start = r * region_blocks;
+		uint32_t n     = std::min(uint64_t(region_blocks), size - start);
+
+		range_lock_guard lck(&locks, start, n, range_lock::rl_exclusive);
+
+		if (read_locked(start, n, buffer.data()) == false)
+			return false;
+
+		if (submit(MO_WRITE, start, n, buffer.data(), n * block_size, nr) == false)
+			return false;
+
+		n_copied++;
+	}
+
+	if (stop_flag || l->active == false)
+		return false;
+
+	l->in_sync = true;
+	set_stale(nr, false);
+
+	DOLOG(logging::ll_info, "backend_mirror::resync_leg", identifier, "leg %zu is in sync again, %" PRIu64 " regions copied", nr, n_copied);
+
+	return true;
+}
+
+void backend_mirror::resyncer_thread()
+{
+	std::vector<uint8_t> buffer(block_size);
+
+	while(stop_flag == false) {
+		{
+			std::unique_lock<std::mutex> lck(drl_lock);
+			stop_cv.wait_for(lck, std::chrono::seconds(1), [this] { return stop_flag.load(); });
+		}
+
+		for(size_t i=0; i<legs.size() && stop_flag == false; i++) {
+			leg *const l = legs[i];
+
+			if (l->active == false && get_micros() >= l->next_probe) {
+				l->next_probe = get_micros() + probe_interval * 1000000ull;
+
+				if (l->b->read(0, 1, buffer.data())) {
+					DOLOG(logging::ll_info, "backend_mirror::resyncer_thread", identifier, "leg %zu responds again", i);
+					l->active = true;  // gets the writes from now on, is read once resynced
+				}
+			}
+
+			if (l->active && l->in_sync == false)
+				resync_leg(i);
+		}
+
+		drl_clean();
+		log_leg_stats();
+	}
+}
+
+void backend_mirror::log_leg_stats()
+{
+	uint64_t now = get_micros();
+	if (now - ts_last_stats < stats_interval * 1000000ull)
+		return;
+
+	double dtook = (now - ts_last_stats) / 1000000.;
+	double dkB   = dtook * 1024;
+	ts_last_stats = now;
+
+	for(size_t i=0; i<legs.size(); i++) {
+		leg *const      l  = legs[i];
+		backend_stats_t cs { };
+		l->b->get_and_reset_stats(&cs);
+
+		DOLOG(logging::ll_info, "backend_mirror::log_leg_stats", identifier, "leg %zu (%s): IOPS: %.2f, read: %.2f kB/s, written: %.2f kB/s, read latency: %" PRIu64 " us",
+			i, l->active ? (l->in_sync ? "ok" : "resyncing") : "dropped",
+			(cs.n_reads + cs.n_writes) / dtook, cs.bytes_read / dkB, cs.bytes_written / dkB, l->latency.load());
+	}
+}
+
+std::string backend_mirror::get_serial() const
+{
+	return "mirror-" + legs.at(0)->b->get_serial();
+}
+
+uint64_t backend_mirror::get_size_in_blocks() const
+{
+	return size;
+}
+
+uint64_t backend_mirror::get_block_size() const
+{
+	return block_size;
+}
+
+uint8_t backend_mirror::get_free_space_percentage()
+{
+	uint8_t rc = 100;
+	for(auto & l: legs) {
+		if (l->active)
+			rc = std::min(rc, l->b->get_free_space_percentage());
+	}
+
+	return rc;
+}
+
+uint32_t backend_mirror::get_discard_granularity() const
+{
+	uint32_t rc = 1;
+	for(auto & l: legs)
+		rc = std::max(rc, l->b->get_discard_granularity());
+
+	return rc;
+}
+
+bool backend_mirror::sync()
+{
+	bool rc = submit(MO_SYNC, 0, size, nullptr, 0);
+
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	return rc;
+}
+
+// overlapping writes are serialized so that they end up in the same order
+// on every leg
+bool backend_mirror::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_mirror::write", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	uint64_t start = get_micros();
+	bool     rc    = submit(MO_WRITE, block_nr, n_blocks, data, n_blocks * block_size);
+
+	ts_last_acces     = get_micros();
+	bs.io_wait       += ts_last_acces - start;
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_mirror::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	uint64_t start = get_micros();
+	bool     rc    = submit(MO_WRITE_FUA, block_nr, n_blocks, data, n_blocks * block_size);
+
+	ts_last_acces     = get_micros();
+	bs.io_wait       += ts_last_acces - start;
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_mirror::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = submit(MO_WRITE_ZEROES, block_nr, n_blocks, nullptr, 0);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_mirror::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = submit(MO_WRITE_SAME, block_nr, n_blocks, pattern, block_size);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_mirror::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = submit(MO_TRIM, block_nr, n_blocks, nullptr, 0);
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+bool backend_mirror::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_mirror::read", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	uint64_t start = get_micros();
+	bool     rc    = read_locked(block_nr, n_blocks, data);
+
+	ts_last_acces  = get_micros();
+	bs.io_wait    += ts_last_acces - start;
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_mirror::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	cmpwrite_result_t    result = cmpwrite_result_t::CWR_OK;
+	std::vector<uint8_t> buffer(n_blocks * block_size);
+	uint64_t             start  = get_micros();
+
+	if (read_locked(block_nr, n_blocks, buffer.data()) == false)
+		result = cmpwrite_result_t::CWR_READ_ERROR;
+	else if (memcmp(buffer.data(), data_compare, buffer.size()) != 0)
+		result = cmpwrite_result_t::CWR_MISMATCH;
+	else if (submit(MO_WRITE, block_nr, n_blocks, data_write, buffer.size()) == false)
+		result = cmpwrite_result_t::CWR_WRITE_ERROR;
+
+	ts_last_acces  = get_micros();
+	bs.io_wait    += ts_last_acces - start;
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+	if (result == cmpwrite_result_t::CWR_OK) {
+		bs.bytes_written += n_blocks * block_size;
+		bs.n_writes++;
+	}
+
+	return result;
+}
+
+bool backend_mirror::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	int nr = pick_leg(block_nr, 1);
+	if (nr == -1)
+		return false;
+
+	return legs[nr]->b->get_lba_status(block_nr, max_n, status, n_same);
+}
+
+bool backend_mirror::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	int nr = pick_leg(block_nr, n_blocks);
+	if (nr == -1)
+		return false;
+
+	return legs[nr]->b->prefetch(block_nr, n_blocks, wait, fits);
+}
+
+bool backend_mirror::has_write_cache() const
+{
+	for(auto & l: legs) {
+		if (l->b->has_write_cache() == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool backend_mirror::get_write_cache() const
+{
+	for(auto & l: legs) {
+		if (l->b->get_write_cache())
+			return true;
+	}
+
+	return false;
+}
+
+bool backend_mirror::set_write_cache(const bool enable)
+{
+	bool rc = true;
+	for(auto & l: legs)
+		rc &= l->b->set_write_cache(enable);
+
+	return rc;
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "backend.h"
+
+
+// RAID-1: every write goes to all legs (the children) in parallel and
+// completes when 'quorum' of them (0: all) have it; the others finish in
+// the background. Reads go to the leg with the fewest reads in flight
+// times its (moving average) latency. A leg that fails is dropped. The
+// dirty-region log (DRL) has a bit per region that is set (on disk,
+// before the write starts) while writes to it are in flight or while a
+// leg is missing; after a crash or when a dropped leg returns, only those
+// regions are copied to it.
+class backend_mirror : public backend
+{
+private:
+	enum op_t { MO_WRITE, MO_WRITE_FUA, MO_WRITE_ZEROES, MO_WRITE_SAME, MO_TRIM, MO_SYNC };
+
+	// a write(-like) request, for all legs
+	struct request {
+		op_t           op        { MO_WRITE };
+		uint64_t       block_nr  { 0       };
+		uint64_t       n_blocks  { 0       };  // MO_SYNC: the whole device
+		const uint8_t *data      { nullptr };  // the caller's buffer or 'copy'
+		std::vector<uint8_t> copy;  // when the caller does not wait for all legs
+		std::mutex     lock;
+		std::condition_variable cv;
+		int            n_todo    { 0       };
+		int            n_ok      { 0       };
+		int            n_failed  { 0       };
+		bool           drl       { false   };  // regions were marked in the DRL
+	};
+
+	struct leg {
+		backend              *b         { nullptr };  // owned
+		std::atomic_bool      active    { true    };  // gets the writes
+		std::atomic_bool      in_sync   { true    };  // may be read from
+		std::atomic_int       in_flight { 0       };  // reads
+		std::atomic_uint64_t  latency   { 0       };  // moving average of reads, in uS
+		std::atomic_uint64_t  next_probe{ 0       };  // when a dropped leg is tried again
+		std::mutex            lock;  // protects the queue and 'running'
+		std::condition_variable cv;
+		std::deque<std::shared_ptr<request> > queue;
+		std::vector<std::shared_ptr<request> > running;
+		std::vector<std::thread *> workers;
+	};
+
+	struct drl_header {
+		char     magic[8];  // "iESPDRL1"
+		uint32_t n_legs;
+		uint32_t region_blocks;
+		uint64_t n_regions;
+		uint8_t  stale[32];  // per leg: was dropped, needs a resync
+	};
+
+	static constexpr const size_t   drl_header_size  = 4096;
+	static constexpr const int      workers_per_leg  = 2;
+	static constexpr const int      probe_interval   = 10;  // seconds between attempts to bring back a dropped leg
+	static constexpr const int      stats_interval   = 10;
+	static constexpr const uint32_t max_legs         = 32;
+
+	std::vector<leg *>   legs;
+	const int            quorum        { 0       };
+	const std::string    drl_file;  // empty: in RAM only
+	const uint64_t       region_size   { 0       };  // in bytes
+	uint64_t             block_size    { 0       };
+	uint64_t             size          { 0       };  // in blocks
+	uint32_t             region_blocks { 0       };
+	uint64_t             n_regions     { 0       };
+	std::atomic_bool     stop_flag     { false   };
+	std::atomic_uint64_t ts_last_stats { 0       };
+
+	std::mutex           drl_lock;  // protects the members below
+	int                  drl_fd        { -1      };
+	uint8_t             *drl_mapping   { nullptr };
+	size_t               drl_mapping_size { 0    };
+	uint8_t             *drl_bits      { nullptr };  // in 'drl_mapping' or 'drl_ram'
+	std::vector<uint8_t> drl_ram;
+	std::unordered_map<uint64_t, uint32_t> drl_writes;  // region -> writes in flight
+	drl_header          *drl_hdr       { nullptr };
+
+	std::condition_variable stop_cv;  // wakes up the resyncer
+	std::thread         *resyncer      { nullptr };
+
+	bool drl_begin    ();
+	bool drl_is_dirty (const uint64_t region);
+	bool drl_mark     (const uint64_t block_nr, const uint64_t n_blocks);
+	void drl_release  (const uint64_t block_nr, const uint64_t n_blocks);
+	void drl_clean    ();
+	void set_stale    (const size_t nr, const bool stale);
+
+	void drop_leg     (const size_t nr, const char *const why);
+	bool overlaps     (const std::shared_ptr<request> & a, const uint64_t block_nr, const uint64_t n_blocks) const;
+	bool has_pending  (leg *const l, const uint64_t block_nr, const uint64_t n_blocks);
+	void worker_thread(const size_t nr);
+	bool execute      (backend *const b, const request & r);
+	bool submit       (const op_t op, const uint64_t block_nr, const uint64_t n_blocks, const uint8_t *const data, const size_t data_size, const int only_leg = -1);
+	int  pick_leg     (const uint64_t block_nr, const uint32_t n_blocks);
+	bool read_locked  (const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);
+	bool resync_leg   (const size_t nr);
+	void resyncer_thread();
+	void log_leg_stats();
+
+public:
+	// 'quorum': number of legs that must have a write before it completes (0: all)
+	backend_mirror(const std::vector<backend *> & children, const int quorum, const std::string & drl_file, const uint64_t region_size);
+	virtual ~backend_mirror();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_same    (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+
+	bool has_write_cache() const override;
+	bool get_write_cache() const override;
+	bool set_write_cache(const bool enable) override;
+};
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cstring>
@@ -6,6 +7,7 @@
 #if defined(__MINGW32__)
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#define SHUT_RDWR SD_BOTH
 #else
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -14,6 +16,7 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #endif
 
 #include "backend-nbd.h"
@@ -21,10 +24,65 @@
 #include "utils.h"
 
 
+// see https://github.com/NetworkBlockDevice/nbd/blob/master/doc/proto.md
+#define NBD_OLDSTYLE_MAGIC        0x00420281861253ull
+#define NBD_IHAVEOPT              0x49484156454F5054ull
+#define NBD_OPT_REPLY_MAGIC       0x0003e889045565a9ull
+#define NBD_REQUEST_MAGIC         0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC    0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
+
+// handshake flags (server) and client flags
+#define NBD_FLAG_FIXED_NEWSTYLE   (1 << 0)
+#define NBD_FLAG_NO_ZEROES        (1 << 1)
+
+// transmission flags
+#define NBD_FLAG_HAS_FLAGS        (1 << 0)
+#define NBD_FLAG_READ_ONLY        (1 << 1)
+#define NBD_FLAG_SEND_FLUSH       (1 << 2)
+#define NBD_FLAG_SEND_FUA         (1 << 3)
+#define NBD_FLAG_SEND_TRIM        (1 << 5)
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)
+#define NBD_FLAG_CAN_MULTI_CONN   (1 << 8)
+#define NBD_FLAG_SEND_CACHE       (1 << 10)
+
+#define NBD_OPT_EXPORT_NAME       1
+#define NBD_OPT_GO                7
+#define NBD_OPT_STRUCTURED_REPLY  8
+#define NBD_OPT_SET_META_CONTEXT  10
+
+#define NBD_REP_ACK               1
+#define NBD_REP_INFO              3
+#define NBD_REP_META_CONTEXT      4
+#define NBD_REP_FLAG_ERROR        (1u << 31)
+#define NBD_REP_ERR_UNSUP         (NBD_REP_FLAG_ERROR | 1)
+
+#define NBD_INFO_EXPORT           0
+#define NBD_INFO_BLOCK_SIZE       3
+
 #define NBD_CMD_READ              0
 #define NBD_CMD_WRITE             1
+#define NBD_CMD_DISC              2
 #define NBD_CMD_FLUSH             3
 #define NBD_CMD_TRIM              4
+#define NBD_CMD_CACHE             5
+#define NBD_CMD_WRITE_ZEROES      6
+#define NBD_CMD_BLOCK_STATUS      7
+
+#define NBD_CMD_FLAG_FUA          (1 << 0)
+#define NBD_CMD_FLAG_NO_HOLE      (1 << 1)
+#define NBD_CMD_FLAG_REQ_ONE      (1 << 3)
+
+#define NBD_REPLY_FLAG_DONE       (1 << 0)
+
+#define NBD_REPLY_TYPE_NONE         0
+#define NBD_REPLY_TYPE_OFFSET_DATA  1
+#define NBD_REPLY_TYPE_OFFSET_HOLE  2
+#define NBD_REPLY_TYPE_BLOCK_STATUS 5
+#define NBD_REPLY_TYPE_ERROR_BIT    (1 << 15)
+
+#define NBD_STATE_HOLE            (1 << 0)
+#define NBD_STATE_ZERO            (1 << 1)
 
 #define NBD_EPERM		  1  // Operation not permitted.
 #define NBD_EIO		          5  // Input/output error.
@@ -33,33 +91,331 @@
 #define NBD_ENOSPC		  28  // No space left on device.
 #define NBD_EOVERFLOW		  75  // Value too large.
 #define NBD_ENOTSUP		  95  // Operation not supported.
-#define NBD_ESHUTDOWN		  108  // Server is in the
+#define NBD_ESHUTDOWN		  108  // Server is in the process of being shut down.
+
+static std::string make_identifier(const std::string & host, const int port, const std::string & unix_socket, const std::string & export_name)
+{
+	std::string out = unix_socket.empty() ? myformat("%s:%d", host.c_str(), port) : "unix:" + unix_socket;
+	if (export_name.empty() == false)
+		out += "/" + export_name;
+
+	return out;
+}
 
-backend_nbd::backend_nbd(const std::string & host, const int port):
-	backend(myformat("%s:%d", host.c_str(), port)),
+backend_nbd::backend_nbd(const std::string & host, const int port, const std::string & unix_socket, const std::string & export_name, const int n_connections, const uint32_t max_in_flight, const uint32_t request_timeout_ms, const uint32_t max_backoff_ms):
+	backend(make_identifier(host, port, unix_socket, export_name)),
 	host(host), port(port),
-	fd(-1)
+	unix_socket(unix_socket),
+	export_name(export_name),
+	n_connections(std::max(1, n_connections)),
+	max_in_flight(std::max(uint32_t(1), max_in_flight)),
+	request_timeout_ms(request_timeout_ms),
+	max_backoff_ms(std::max(uint32_t(100), max_backoff_ms))
 {
 }
 
 backend_nbd::~backend_nbd()
 {
-	if (fd != -1)
-		close(fd);
+	stop_flag = true;
+
+	{
+		std::unique_lock<std::mutex> lck(stop_lock);
+		stop_cv.notify_all();  // interrupts pause()
+	}
+
+	for(auto & c: connections) {
+		if (c->reader) {
+			{
+				std::unique_lock<std::mutex> lck(c->lock);
+				if (c->fd != -1)
+					shutdown(c->fd, SHUT_RDWR);  // wakes up the reader thread
+				c->cv.notify_all();
+			}
+
+			c->reader->join();
+			delete c->reader;
+		}
+
+		if (c->fd != -1)
+			close(c->fd);
+
+		delete c;
+	}
 }
 
 bool backend_nbd::begin()
 {
-	return connect(false);
+	for(int i=0; i<n_connections; i++) {
+		int fd = connect(false);
+		if (fd == -1)
+			return false;
+
+		nbd_connection *c = new nbd_connection;
+		c->fd        = fd;
+		c->connected = true;
+		c->slots.resize(max_in_flight, nullptr);
+		for(uint32_t slot=0; slot<max_in_flight; slot++)
+			c->free_slots.push_back(max_in_flight - 1 - slot);
+		connections.push_back(c);
+	}
+
+	for(auto & c: connections)
+		c->reader = new std::thread(&backend_nbd::reader_thread, this, c);
+
+	DOLOG(logging::ll_info, "backend_nbd::begin", identifier, "%d connection(s), up to %u requests in flight per connection, request timeout: %u ms", n_connections, max_in_flight, request_timeout_ms);
+	DOLOG(logging::ll_info, "backend_nbd::begin", identifier, "transmission flags: %04x, structured replies: %s, block status: %s, max payload: %u", transmission_flags, structured_replies ? "yes" : "no", has_block_status ? "yes" : "no", max_payload);
+
+	if (n_connections > 1 && supports(NBD_FLAG_CAN_MULTI_CONN) == false)
+		DOLOG(logging::ll_info, "backend_nbd::begin", identifier, "server does not advertise multi-conn consistency, flushes are sent on every connection");
+
+	return true;
+}
+
+// the flags are only meaningful if the server says it sends them: old
+// servers that do not, get flushes like before
+bool backend_nbd::supports(const uint16_t flag) const
+{
+	if ((transmission_flags & NBD_FLAG_HAS_FLAGS) == 0)
+		return flag == NBD_FLAG_SEND_FLUSH;
+
+	return transmission_flags & flag;
+}
+
+static bool send_option(const int fd, const uint32_t option, const std::vector<uint8_t> & data)
+{
+	struct __attribute__ ((packed)) {
+		uint64_t magic;
+		uint32_t option;
+		uint32_t length;
+	} header { };
+
+	header.magic  = my_HTONLL(NBD_IHAVEOPT);
+	header.option = htonl(option);
+	header.length = htonl(data.size());
+
+	if (WRITE(fd, reinterpret_cast<const uint8_t *>(&header), sizeof header) != sizeof header)
+		return false;
+
+	return data.empty() || WRITE(fd, data.data(), data.size()) == ssize_t(data.size());
+}
+
+static bool receive_option_reply(const int fd, const uint32_t option, uint32_t *const type, std::vector<uint8_t> *const data)
+{
+	uint8_t header[20] { };
+	if (READ(fd, header, sizeof header) != sizeof header)
+		return false;
+
+	if (get_uint64_t(&header[0]) != NBD_OPT_REPLY_MAGIC || get_uint32_t(&header[8]) != option)
+		return false;
+
+	*type           = get_uint32_t(&header[12]);
+	uint32_t length = get_uint32_t(&header[16]);
+	if (length > 65536)  // sanity check, option replies are small
+		return false;
+
+	data->resize(length);
+
+	return length == 0 || READ(fd, data->data(), length) == ssize_t(length);
+}
+
+static void put_uint32_t(std::vector<uint8_t> *const target, const uint32_t v)
+{
+	for(int i=24; i>=0; i -= 8)
+		target->push_back(v >> i);
+}
+
+static void put_string(std::vector<uint8_t> *const target, const std::string & s)
+{
+	put_uint32_t(target, s.size());
+	target->insert(target->end(), s.begin(), s.end());
 }
 
-bool backend_nbd::connect(const bool retry)
+// NBD_OPT_GO: selects the export and asks for its size, flags and block size constraints
+bool backend_nbd::negotiate_go(const int fd, bool *const unsupported)
 {
-	if (fd != -1)
+	std::vector<uint8_t> request;
+	put_string(&request, export_name);
+	request.push_back(0);  // 1 information request
+	request.push_back(1);
+	request.push_back(NBD_INFO_BLOCK_SIZE >> 8);
+	request.push_back(NBD_INFO_BLOCK_SIZE & 255);
+
+	*unsupported = false;
+
+	if (send_option(fd, NBD_OPT_GO, request) == false)
+		return false;
+
+	for(;;) {
+		uint32_t type = 0;
+		std::vector<uint8_t> reply;
+		if (receive_option_reply(fd, NBD_OPT_GO, &type, &reply) == false) {
+			DOLOG(logging::ll_error, "backend_nbd::negotiate_go", identifier, "problem receiving NBD_OPT_GO reply");
+			return false;
+		}
+
+		if (type == NBD_REP_ACK)
+			return true;
+
+		if (type == NBD_REP_INFO && reply.size() >= 2) {
+			uint16_t info_type = (reply[0] << 8) | reply[1];
+
+			if (info_type == NBD_INFO_EXPORT && reply.size() >= 12) {
+				dev_size           = get_uint64_t(&reply[2]);
+				transmission_flags = (reply[10] << 8) | reply[11];
+			}
+			else if (info_type == NBD_INFO_BLOCK_SIZE && reply.size() >= 14) {
+				uint32_t maximum = get_uint32_t(&reply[10]);
+				if (maximum >= get_block_size())
+					max_payload = maximum - maximum % get_block_size();
+			}
+		}
+		else if (type & NBD_REP_FLAG_ERROR) {
+			*unsupported = type == NBD_REP_ERR_UNSUP;
+			if (*unsupported == false)
+				DOLOG(logging::ll_error, "backend_nbd::negotiate_go", identifier, "server refused export \"%s\" (%08x)", export_name.c_str(), type);
+			return false;
+		}
+	}
+}
+
+bool backend_nbd::negotiate(const int fd)
+{
+	uint8_t hello[16] { };
+	if (READ(fd, hello, sizeof hello) != sizeof hello) {
+		DOLOG(logging::ll_error, "backend_nbd::negotiate", identifier, "NBD_HELLO receive failed");
+		return false;
+	}
+
+	if (memcmp(hello, "NBDMAGIC", 8) != 0) {
+		DOLOG(logging::ll_error, "backend_nbd::negotiate", identifier, "NBD_HELLO magic failed");
+		return false;
+	}
+
+	uint64_t magic2 = get_uint64_t(&hello[8]);
+
+	if (magic2 == NBD_OLDSTYLE_MAGIC) {
+		uint8_t rest[8 + 4 + 124] { };
+		if (READ(fd, rest, sizeof rest) != sizeof rest) {
+			DOLOG(logging::ll_error, "backend_nbd::negotiate", identifier, "NBD_HELLO receive failed");
+			return false;
+		}
+
+		if (export_name.empty() == false)
+			DOLOG(logging::ll_warning, "backend_nbd::negotiate", identifier, "oldstyle server, export name is ignored");
+
+		dev_size           = get_uint64_t(&rest[0]);
+		transmission_flags = get_uint32_t(&rest[8]) & 0xffff;
+
 		return true;
+	}
+
+	if (magic2 != NBD_IHAVEOPT) {
+		DOLOG(logging::ll_error, "backend_nbd::negotiate", identifier, "unknown NBD handshake");
+		return false;
+	}
+
+	uint8_t handshake_flags_bytes[2] { };
+	if (READ(fd, handshake_flags_bytes, sizeof handshake_flags_bytes) != sizeof handshake_flags_bytes)
+		return false;
+	uint16_t handshake_flags = (handshake_flags_bytes[0] << 8) | handshake_flags_bytes[1];
+
+	uint32_t client_flags = handshake_flags & (NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+	uint32_t client_flags_net = htonl(client_flags);
+	if (WRITE(fd, reinterpret_cast<const uint8_t *>(&client_flags_net), sizeof client_flags_net) != sizeof client_flags_net)
+		return false;
+
+	bool go_unsupported = true;
+
+	// without "fixed newstyle" the server may drop the connection on unknown options
+	if (client_flags & NBD_FLAG_FIXED_NEWSTYLE) {
+		uint32_t type = 0;
+		std::vector<uint8_t> reply;
+
+		if (send_option(fd, NBD_OPT_STRUCTURED_REPLY, { }) == false || receive_option_reply(fd, NBD_OPT_STRUCTURED_REPLY, &type, &reply) == false)
+			return false;
+		structured_replies = type == NBD_REP_ACK;
+
+		has_block_status = false;
+
+		if (structured_replies) {
+			std::vector<uint8_t> request;
+			put_string(&request, export_name);
+			put_uint32_t(&request, 1);  // 1 query
+			put_string(&request, "base:allocation");
+
+			if (send_option(fd, NBD_OPT_SET_META_CONTEXT, request) == false)
+				return false;
+
+			for(;;) {
+				if (receive_option_reply(fd, NBD_OPT_SET_META_CONTEXT, &type, &reply) == false)
+					return false;
+
+				if (type == NBD_REP_META_CONTEXT && reply.size() >= 4) {
+					meta_context_id  = get_uint32_t(&reply[0]);
+					has_block_status = true;
+				}
+				else if (type == NBD_REP_ACK || (type & NBD_REP_FLAG_ERROR))
+					break;
+			}
+		}
+
+		if (negotiate_go(fd, &go_unsupported))
+			return true;
 
-	do {
-		// LOOP until connected, logging message, exponential backoff?
+		if (go_unsupported == false)
+			return false;
+	}
+
+	// NBD_OPT_EXPORT_NAME: no reply on failure, the server just disconnects
+	std::vector<uint8_t> name(export_name.begin(), export_name.end());
+	if (send_option(fd, NBD_OPT_EXPORT_NAME, name) == false)
+		return false;
+
+	uint8_t reply[8 + 2 + 124] { };
+	size_t  reply_size = (client_flags & NBD_FLAG_NO_ZEROES) ? 10 : sizeof reply;
+	if (READ(fd, reply, reply_size) != ssize_t(reply_size)) {
+		DOLOG(logging::ll_error, "backend_nbd::negotiate", identifier, "server refused export \"%s\"", export_name.c_str());
+		return false;
+	}
+
+	dev_size           = get_uint64_t(&reply[0]);
+	transmission_flags = (reply[8] << 8) | reply[9];
+	// structured replies and meta contexts are only valid with NBD_OPT_GO
+	structured_replies = false;
+	has_block_status   = false;
+
+	return true;
+}
+
+int backend_nbd::connect_once()
+{
+	int fd = -1;
+
+	if (unix_socket.empty() == false) {
+#if defined(__MINGW32__)
+		DOLOG(logging::ll_error, "backend_nbd::connect_once", identifier, "UNIX domain sockets are not supported on this platform");
+#else
+		sockaddr_un addr { };
+		addr.sun_family = AF_UNIX;
+		if (unix_socket.size() >= sizeof addr.sun_path) {
+			DOLOG(logging::ll_error, "backend_nbd::connect_once", identifier, "path of UNIX domain socket is too long");
+			return -1;
+		}
+		strcpy(addr.sun_path, unix_socket.c_str());
+
+		if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+			DOLOG(logging::ll_error, "backend_nbd::connect_once", identifier, "Failed to create socket");
+			return -1;
+		}
+
+		if (::connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof addr) == -1) {
+			DOLOG(logging::ll_error, "backend_nbd::connect_once", identifier, "Failed to connect: %s", strerror(errno));
+			close(fd);
+			return -1;
+		}
+#endif
+	}
+	else {
 		addrinfo *res     = nullptr;
 
 		addrinfo hints { };
@@ -71,19 +427,18 @@ bool backend_nbd::connect(const bool retry)
 
 		int rc = getaddrinfo(host.c_str(), port_str, &hints, &res);
 		if (rc != 0) {
-			DOLOG(logging::ll_error, "backend_nbd::connect", identifier, "Cannot resolve \"%s\"", host.c_str());
-			sleep(1);
-			continue;
+			DOLOG(logging::ll_error, "backend_nbd::connect_once", identifier, "Cannot resolve \"%s\"", host.c_str());
+			return -1;
 		}
 
 		for(addrinfo *p = res; p != NULL; p = p->ai_next) {
 			if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-				DOLOG(logging::ll_error, "backend_nbd::connect", identifier, "Failed to create socket");
+				DOLOG(logging::ll_error, "backend_nbd::connect_once", identifier, "Failed to create socket");
 				continue;
 			}
 
 			if (::connect(fd, p->ai_addr, p->ai_addrlen) == -1) {
-				DOLOG(logging::ll_error, "backend_nbd::connect", identifier, "Failed to connect");
+				DOLOG(logging::ll_error, "backend_nbd::connect_once", identifier, "Failed to connect");
 				close(fd);
 				fd = -1;
 				continue;
@@ -94,38 +449,45 @@ bool backend_nbd::connect(const bool retry)
 
 		freeaddrinfo(res);
 
-		struct __attribute__ ((packed)) {
-			uint8_t  magic1[8];
-			uint8_t  magic2[8];
-			uint64_t size;
-			uint32_t flags;
-			uint8_t  padding[124];
-		} nbd_hello { };
+		if (fd != -1)
+			socket_set_nodelay(fd);
+	}
 
-		if (fd != -1) {
-			if (READ(fd, reinterpret_cast<uint8_t *>(&nbd_hello), sizeof nbd_hello) != sizeof nbd_hello) {
-				DOLOG(logging::ll_error, "backend_nbd::connect", identifier, "NBD_HELLO receive failed");
-				close(fd);
-				fd = -1;
-			}
+	if (fd != -1 && negotiate(fd) == false) {
+		close(fd);
+		fd = -1;
+	}
 
-			dev_size = my_NTOHLL(nbd_hello.size);
-		}
+	return fd;
+}
 
-		if (fd != -1 && memcmp(nbd_hello.magic1, "NBDMAGIC", 8) != 0) {
-			DOLOG(logging::ll_error, "backend_nbd::connect", identifier, "NBD_HELLO magic failed");
-			close(fd);
-			fd = -1;
-		}
+// sleeps, unless the object is being destroyed; returns false in that case
+bool backend_nbd::pause(const uint32_t ms)
+{
+	std::unique_lock<std::mutex> lck(stop_lock);
 
-		if (fd != -1)
-			socket_set_nodelay(fd);
-	}
-	while(fd == -1 && retry);
+	return stop_cv.wait_for(lck, std::chrono::milliseconds(ms), [this] { return stop_flag.load(); }) == false;
+}
 
-	DOLOG(logging::ll_debug, "backend_nbd::connect", identifier, "Connected to NBD server");
+int backend_nbd::connect(const bool retry)
+{
+	uint32_t backoff_ms = 100;
 
-	return fd != -1;
+	for(;;) {
+		int fd = connect_once();
+		if (fd != -1) {
+			DOLOG(logging::ll_debug, "backend_nbd::connect", identifier, "Connected to NBD server");
+			return fd;
+		}
+
+		if (retry == false)
+			return -1;
+
+		// exponential backoff so that a server that is down is not hammered
+		if (pause(backoff_ms) == false)
+			return -1;
+		backoff_ms = std::min(backoff_ms * 2, max_backoff_ms);
+	}
 }
 
 uint64_t backend_nbd::get_size_in_blocks() const
@@ -138,112 +500,445 @@ uint64_t backend_nbd::get_block_size() const
 	return 4096;
 }
 
-bool backend_nbd::invoke_nbd(const uint32_t command, const uint64_t offset, const uint32_t n_bytes, uint8_t *const data)
+static std::string nbd_error_to_string(const int error)
 {
-	auto start = get_micros();
+	if (error == NBD_EPERM)
+		return "NBD_EPERM";
+	if (error == NBD_EIO)
+		return "NBD_EIO";
+	if (error == NBD_ENOMEM)
+		return "NBD_ENOMEM";
+	if (error == NBD_EINVAL)
+		return "NBD_EINVAL";
+	if (error == NBD_ENOSPC)
+		return "NBD_ENOSPC";
+	if (error == NBD_EOVERFLOW)
+		return "NBD_EOVERFLOW";
+	if (error == NBD_ENOTSUP)
+		return "NBD_ENOTSUP";
+	if (error == NBD_ESHUTDOWN)
+		return "NBD_ESHUTDOWN";
+
+	return myformat("%d", error);
+}
 
-	do {
-		if (!connect(true)) {
-			DOLOG(logging::ll_debug, "backend_nbd::invoke_nbd", identifier, "(re-)connect");
-			sleep(1);
-			continue;
+// may only be called with the write_lock of the connection held; on failure
+// the connection is shut down, the reader thread will then reconnect
+bool backend_nbd::send_request(nbd_connection *const c, const nbd_request *const r)
+{
+	struct __attribute__ ((packed)) {
+		uint32_t magic;
+		uint16_t flags;
+		uint16_t type;
+		uint64_t handle;
+		uint64_t offset;
+		uint32_t length;
+	} nbd_request { };
+
+	nbd_request.magic  = htonl(NBD_REQUEST_MAGIC);
+	nbd_request.flags  = htons(r->flags);
+	nbd_request.type   = htons(r->command);
+	nbd_request.handle = r->handle;  // opaque for the server, no byte-swapping required
+	nbd_request.offset = my_HTONLL(r->offset);
+	nbd_request.length = htonl(r->n_bytes);
+
+	bool ok = WRITE(c->fd, reinterpret_cast<const uint8_t *>(&nbd_request), sizeof nbd_request) == sizeof nbd_request;
+	if (ok && r->command == NBD_CMD_WRITE)
+		ok = WRITE(c->fd, r->data, r->n_bytes) == ssize_t(r->n_bytes);
+
+	if (!ok) {
+		DOLOG(logging::ll_error, "backend_nbd::send_request", identifier, "problem sending request");
+		shutdown(c->fd, SHUT_RDWR);
+	}
+
+	return ok;
+}
+
+// replaces the socket of a connection; requests that were in flight or were
+// queued while the connection was down, are sent again on the new one
+bool backend_nbd::set_connection(nbd_connection *const c, const int fd)
+{
+	std::unique_lock<std::mutex> wlck(c->write_lock);
+	std::unique_lock<std::mutex> lck(c->lock);
+
+	// checked with the lock held, see ~backend_nbd()
+	if (stop_flag && fd != -1) {
+		close(fd);
+		return false;
+	}
+
+	if (c->fd != -1)
+		close(c->fd);
+
+	c->fd        = fd;
+	c->connected = fd != -1;
+	c->generation++;
+	if (fd == -1 && c->down_since == 0)
+		c->down_since = get_micros();
+	else if (fd != -1)
+		c->down_since = 0;
+
+	if (fd != -1) {
+		uint32_t n_replayed = 0;
+
+		for(uint32_t slot=0; slot<max_in_flight; slot++) {
+			nbd_request *r = c->slots[slot];
+			if (r == nullptr)
+				continue;
+
+			// a partial reply may have been received before the connection dropped
+			r->error         = 0;
+			r->status_length = 0;
+			r->status_flags  = 0;
+
+			if (send_request(c, r) == false)
+				break;
+			n_replayed++;
 		}
 
-		struct __attribute__ ((packed)) {
-			uint32_t magic;
-			uint32_t type;
-			uint64_t handle;
-			uint64_t offset;
-			uint32_t length;
-		} nbd_request { };
+		if (n_replayed)
+			DOLOG(logging::ll_info, "backend_nbd::set_connection", identifier, "sent %u request(s) again", n_replayed);
+	}
 
-		nbd_request.magic  = ntohl(0x25609513);
-		nbd_request.type   = htonl(command);
-		nbd_request.offset = my_HTONLL(offset);
-		nbd_request.length = htonl(n_bytes);
+	c->cv.notify_all();
 
-		if (WRITE(fd, reinterpret_cast<const uint8_t *>(&nbd_request), sizeof nbd_request) != sizeof nbd_request) {
-			DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "backend_nbd::invoke_nbd: problem sending request");
-			close(fd);
-			fd = -1;
-			sleep(1);
-			continue;
+	return true;
+}
+
+static bool discard(const int fd, uint32_t n)
+{
+	uint8_t buffer[512];
+
+	while(n > 0) {
+		uint32_t cur_n = std::min(n, uint32_t(sizeof buffer));
+		if (READ(fd, buffer, cur_n) != ssize_t(cur_n))
+			return false;
+		n -= cur_n;
+	}
+
+	return true;
+}
+
+// reads the payload of one chunk of a structured reply, data goes directly
+// into the buffer of the caller
+bool backend_nbd::read_structured_chunk(const int fd, nbd_request *const r, const uint16_t type, const uint32_t length)
+{
+	if (type == NBD_REPLY_TYPE_NONE)
+		return length == 0;
+
+	if (type == NBD_REPLY_TYPE_OFFSET_DATA || type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+		uint8_t header[12] { };
+		size_t  header_size = type == NBD_REPLY_TYPE_OFFSET_DATA ? 8 : 12;
+		if (r->command != NBD_CMD_READ || length < header_size || READ(fd, header, header_size) != ssize_t(header_size))
+			return false;
+
+		uint64_t offset  = get_uint64_t(&header[0]);
+		uint32_t n_bytes = type == NBD_REPLY_TYPE_OFFSET_DATA ? length - 8 : get_uint32_t(&header[8]);
+		if (offset < r->offset || offset + n_bytes > r->offset + r->n_bytes) {
+			DOLOG(logging::ll_error, "backend_nbd::read_structured_chunk", identifier, "chunk outside of requested range");
+			return false;
 		}
 
-		if (command == NBD_CMD_WRITE) {
-			if (WRITE(fd, reinterpret_cast<const uint8_t *>(data), n_bytes) != ssize_t(n_bytes)) {
-				DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "backend_nbd::invoke_nbd: problem sending payload");
-				close(fd);
-				fd = -1;
-				sleep(1);
+		if (type == NBD_REPLY_TYPE_OFFSET_HOLE) {
+			memset(&r->data[offset - r->offset], 0x00, n_bytes);
+			return true;
+		}
+
+		return READ(fd, &r->data[offset - r->offset], n_bytes) == ssize_t(n_bytes);
+	}
+
+	if (type == NBD_REPLY_TYPE_BLOCK_STATUS) {
+		uint8_t first[12] { };  // context id, then the first extent (length, flags)
+		if (length < sizeof first || READ(fd, first, sizeof first) != sizeof first)
+			return false;
+
+		if (get_uint32_t(&first[0]) == meta_context_id) {
+			r->status_length = get_uint32_t(&first[4]);
+			r->status_flags  = get_uint32_t(&first[8]);
+		}
+
+		return discard(fd, length - sizeof first);
+	}
+
+	if (type & NBD_REPLY_TYPE_ERROR_BIT) {
+		uint8_t error[4] { };
+		if (length < sizeof error || READ(fd, error, sizeof error) != sizeof error)
+			return false;
+
+		r->error = get_uint32_t(error);
+		if (r->error == 0)  // servers must not send this, but be safe
+			r->error = NBD_EIO;
+
+		return discard(fd, length - sizeof error);
+	}
+
+	// unknown chunk types that are not errors can be ignored
+	return discard(fd, length);
+}
+
+void backend_nbd::reader_thread(nbd_connection *const c)
+{
+	int fd = c->fd;
+
+	while(!stop_flag) {
+		if (fd == -1) {
+			fd = connect(true);
+			if (fd == -1)
 				continue;
-			}
+
+			DOLOG(logging::ll_info, "backend_nbd::reader_thread", identifier, "reconnected to NBD server");
+			if (set_connection(c, fd) == false)
+				break;
 		}
 
+		// simple and structured reply headers start the same: magic, 4 bytes, handle
 		struct __attribute__ ((packed)) {
 			uint32_t magic;
-			uint32_t error;
+			uint32_t error;  // structured reply: flags (16 bit), type (16 bit)
 			uint64_t handle;
+			uint32_t length;  // structured replies only
 		} nbd_reply;
 
-		if (READ(fd, reinterpret_cast<uint8_t *>(&nbd_reply), sizeof nbd_reply) != sizeof nbd_reply) {
-			DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "backend_nbd::invoke_nbd: problem receiving reply header");
-			close(fd);
-			fd = -1;
-			sleep(1);
-			continue;
+		bool     ok         = true;
+		bool     structured = false;
+		uint32_t magic      = 0;
+
+		if (READ(fd, reinterpret_cast<uint8_t *>(&nbd_reply), 16) != 16) {
+			if (!stop_flag)
+				DOLOG(logging::ll_error, "backend_nbd::reader_thread", identifier, "problem receiving reply header");
+			ok = false;
 		}
+		else {
+			magic      = ntohl(nbd_reply.magic);
+			structured = magic == NBD_STRUCTURED_REPLY_MAGIC;
 
-		if (ntohl(nbd_reply.magic) != 0x67446698) {
-			DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "backend_nbd::invoke_nbd: bad reply header %08x", nbd_reply.magic);
-			close(fd);
+			if (magic != NBD_SIMPLE_REPLY_MAGIC && !structured) {
+				DOLOG(logging::ll_error, "backend_nbd::reader_thread", identifier, "bad reply header %08x", magic);
+				ok = false;
+			}
+			else if (structured && READ(fd, reinterpret_cast<uint8_t *>(&nbd_reply.length), sizeof nbd_reply.length) != sizeof nbd_reply.length) {
+				DOLOG(logging::ll_error, "backend_nbd::reader_thread", identifier, "problem receiving reply header");
+				ok = false;
+			}
+		}
+
+		nbd_request *r = nullptr;
+		uint32_t  slot = 0;
+
+		if (ok) {
+			uint64_t handle = nbd_reply.handle;  // opaque for the server, no byte-swapping required
+			slot = handle & 0xffffffff;
+
+			std::unique_lock<std::mutex> lck(c->lock);
+			if (slot < max_in_flight && c->slots[slot] && c->slots[slot]->handle == handle) {
+				r = c->slots[slot];
+				r->busy = true;  // see invoke_nbd()
+			}
+			else {
+				DOLOG(logging::ll_error, "backend_nbd::reader_thread", identifier, "reply for unknown handle %016" PRIx64, handle);
+				ok = false;
+			}
+		}
+
+		bool done = true;
+
+		if (ok && structured) {
+			uint32_t flags_type = ntohl(nbd_reply.error);
+			done = (flags_type >> 16) & NBD_REPLY_FLAG_DONE;
+
+			ok = read_structured_chunk(fd, r, flags_type & 0xffff, ntohl(nbd_reply.length));
+			if (!ok)
+				DOLOG(logging::ll_error, "backend_nbd::reader_thread", identifier, "problem receiving structured reply");
+		}
+		else if (ok) {
+			r->error = ntohl(nbd_reply.error);
+
+			// the payload goes directly into the buffer of the caller
+			if (r->error == 0 && r->command == NBD_CMD_READ && READ(fd, r->data, r->n_bytes) != ssize_t(r->n_bytes)) {
+				DOLOG(logging::ll_error, "backend_nbd::reader_thread", identifier, "problem receiving payload");
+				ok = false;
+			}
+		}
+
+		if (r) {
+			std::unique_lock<std::mutex> lck(c->lock);
+			r->busy = false;
+
+			if (ok && done) {
+				r->done = true;
+
+				c->slots[slot] = nullptr;
+				c->free_slots.push_back(slot);
+				c->cv.notify_one();
+			}
+
+			r->cv.notify_one();
+		}
+
+		if (!ok) {
+			set_connection(c, -1);
 			fd = -1;
-			sleep(1);
-			continue;
+
+			// prevents a busy loop when a server accepts and then drops connections
+			pause(100);
 		}
+	}
+}
 
-		int error = ntohl(nbd_reply.error);
-		if (error) {
-			std::string error_str;
-			if (error == NBD_EPERM)
-				error_str = "NBD_EPERM";
-			else if (error == NBD_EIO)
-				error_str = "NBD_EIO";
-			else if (error == NBD_ENOMEM)
-				error_str = "NBD_ENOMEM";
-			else if (error == NBD_ENOSPC)
-				error_str = "NBD_EINVAL";
-			else if (error == NBD_EINVAL)
-				error_str = "NBD_ENOSPC";
-			else if (error == NBD_EOVERFLOW)
-				error_str = "NBD_EOVERFLOW";
-			else if (error == NBD_ENOTSUP)
-				error_str = "NBD_ENOTSUP";
-			else if (error == NBD_ESHUTDOWN)
-				error_str = "NBD_ESHUTDOWN";
-			else
-				error_str = myformat("%d", error);
-
-			DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "backend_nbd::invoke_nbd: NBD server indicated error: %s", error_str.c_str());
+// returns false when the deadline has passed
+bool backend_nbd::wait_for(std::condition_variable & cv, std::unique_lock<std::mutex> & lck, const std::chrono::steady_clock::time_point & deadline) const
+{
+	if (request_timeout_ms == 0) {
+		cv.wait(lck);
+		return true;
+	}
+
+	return cv.wait_until(lck, deadline) == std::cv_status::no_timeout;
+}
+
+// round-robin, skipping connections that are down
+backend_nbd::nbd_connection *backend_nbd::pick_connection()
+{
+	uint32_t first = next_connection++;
+
+	for(size_t i=0; i<connections.size(); i++) {
+		nbd_connection *c = connections[(first + i) % connections.size()];
+		if (c->connected)
+			return c;
+	}
+
+	return connections[first % connections.size()];
+}
+
+bool backend_nbd::invoke_nbd(const uint16_t command, const uint64_t offset, const uint32_t n_bytes, uint8_t *const data, nbd_connection *const use_connection, const uint16_t flags, nbd_request *const result)
+{
+	auto start    = get_micros();
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(request_timeout_ms);
+
+	nbd_request local;
+	nbd_request & r = result ? *result : local;
+	r.command = command;
+	r.flags   = flags;
+	r.offset  = offset;
+	r.n_bytes = n_bytes;
+	r.data    = data;
+
+	nbd_connection *c = use_connection ? use_connection : pick_connection();
+
+	// wait for a free slot; when the connection is down, the request is
+	// queued in it and sent by the reader thread after reconnecting
+	std::unique_lock<std::mutex> lck(c->lock);
+
+	// don't let every request wait for the full timeout when the server is gone
+	if (request_timeout_ms && c->down_since && get_micros() - c->down_since > request_timeout_ms * uint64_t(1000)) {
+		DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "connection is down for more than %u ms, failing request", request_timeout_ms);
+		return false;
+	}
+
+	while(c->free_slots.empty() && !stop_flag) {
+		if (wait_for(c->cv, lck, deadline) == false && c->free_slots.empty()) {
+			DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "timeout waiting for a free request slot");
 			return false;
 		}
+	}
+	if (stop_flag)
+		return false;
+
+	uint32_t slot = c->free_slots.back();
+	c->free_slots.pop_back();
+	c->slots[slot] = &r;
+
+	r.handle    = (uint64_t(c->sequence++) << 32) | slot;
+	r.done      = false;
+	r.busy      = false;
+	r.error     = 0;
+	r.status_length = 0;
+	r.status_flags  = 0;
+
+	uint64_t generation = c->generation;
+	lck.unlock();
+
+	{
+		std::unique_lock<std::mutex> wlck(c->write_lock);
+
+		// if the connection was replaced in the mean time, the
+		// request was already sent by set_connection()
+		if (c->generation == generation && c->fd != -1)
+			send_request(c, &r);
+	}
 
-		if (command == NBD_CMD_READ) {
-			if (READ(fd, data, n_bytes) != ssize_t(n_bytes)) {
-				DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "backend_nbd::invoke_nbd: problem receiving payload");
-				close(fd);
-				fd = -1;
-				sleep(1);
-				continue;
-			}
+	lck.lock();
+	bool timed_out = false;
+	while(!r.done) {
+		if (wait_for(r.cv, lck, deadline) || r.done)
+			continue;
+
+		// the stream is in an unknown state now: a reply may still
+		// come in, so let the connection start over
+		if (c->fd != -1)
+			shutdown(c->fd, SHUT_RDWR);
+
+		// 'data' is on the stack or owned by the caller
+		while(r.busy)
+			r.cv.wait(lck);
+
+		if (r.done == false) {
+			c->slots[slot] = nullptr;
+			c->free_slots.push_back(slot);
+			c->cv.notify_one();
+			timed_out = true;
+			break;
 		}
 	}
-	while(fd == -1);
+	lck.unlock();
 
 	auto end    = get_micros();
 	bs.io_wait += end-start;
 
-	return fd != -1;
+	if (timed_out) {
+		DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "request timed out after %u ms", request_timeout_ms);
+		return false;
+	}
+
+	if (r.error) {
+		DOLOG(logging::ll_error, "backend_nbd::invoke_nbd", identifier, "NBD server indicated error: %s", nbd_error_to_string(r.error).c_str());
+		return false;
+	}
+
+	return true;
+}
+
+// reads and writes larger than what the server accepts are split up
+bool backend_nbd::invoke_nbd_rw(const uint16_t command, const uint64_t offset, const uint32_t n_bytes, uint8_t *const data, const uint16_t flags)
+{
+	for(uint32_t done=0; done<n_bytes;) {
+		uint32_t cur_n = std::min(n_bytes - done, max_payload);
+
+		if (invoke_nbd(command, offset + done, cur_n, &data[done], nullptr, flags) == false)
+			return false;
+
+		done += cur_n;
+	}
+
+	return true;
+}
+
+// commands without payload (zeroes, trim, cache) for ranges that do not fit
+// in the 32 bit length of a request
+bool backend_nbd::invoke_nbd_range(const uint16_t command, const uint64_t offset, const uint64_t n_bytes, const uint16_t flags)
+{
+	constexpr const uint64_t max_n = 1 << 30;
+
+	for(uint64_t done=0; done<n_bytes;) {
+		uint64_t cur_n = std::min(n_bytes - done, max_n);
+
+		if (invoke_nbd(command, offset + done, cur_n, nullptr, nullptr, flags) == false)
+			return false;
+
+		done += cur_n;
+	}
+
+	return true;
 }
 
 bool backend_nbd::sync()
@@ -251,7 +946,19 @@ bool backend_nbd::sync()
 	bs.n_syncs++;
 	ts_last_acces = get_micros();
 
-	return invoke_nbd(NBD_CMD_FLUSH, 0, 0, nullptr);
+	if (supports(NBD_FLAG_SEND_FLUSH) == false)
+		return true;
+
+	// with multi-conn, a flush on any connection covers all of them
+	if (supports(NBD_FLAG_CAN_MULTI_CONN))
+		return invoke_nbd(NBD_CMD_FLUSH, 0, 0, nullptr);
+
+	// a flush only covers the writes that were completed on the same connection
+	bool ok = true;
+	for(auto & c: connections)
+		ok &= invoke_nbd(NBD_CMD_FLUSH, 0, 0, nullptr, c);
+
+	return ok;
 }
 
 bool backend_nbd::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
@@ -260,10 +967,8 @@ bool backend_nbd::write(const uint64_t block_nr, const uint32_t n_blocks, const
 	off_t  offset     = block_nr * block_size;
 	size_t n_bytes    = n_blocks * block_size;
 	DOLOG(logging::ll_debug, "backend_nbd::write", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
-	auto   lock_list  = lock_range(block_nr, n_blocks);
-	bool   rc         = invoke_nbd(NBD_CMD_WRITE, offset, n_bytes, const_cast<uint8_t *>(data));
-
-	unlock_range(lock_list);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	bool   rc         = invoke_nbd_rw(NBD_CMD_WRITE, offset, n_bytes, const_cast<uint8_t *>(data));
 
 	ts_last_acces = get_micros();
 	bs.bytes_written += n_bytes;
@@ -272,17 +977,103 @@ bool backend_nbd::write(const uint64_t block_nr, const uint32_t n_blocks, const
 	return rc;
 }
 
-bool backend_nbd::trim(const uint64_t block_nr, const uint32_t n_blocks)
+bool backend_nbd::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
 {
+	if (supports(NBD_FLAG_SEND_FUA) == false)
+		return backend::write_fua(block_nr, n_blocks, data);
+
 	auto   block_size = get_block_size();
 	off_t  offset     = block_nr * block_size;
 	size_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_nbd::write_fua", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	bool   rc         = invoke_nbd_rw(NBD_CMD_WRITE, offset, n_bytes, const_cast<uint8_t *>(data), NBD_CMD_FLAG_FUA);
+
+	ts_last_acces = get_micros();
+	bs.bytes_written += n_bytes;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_nbd::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	if (supports(NBD_FLAG_SEND_WRITE_ZEROES) == false)
+		return backend::write_zeroes(block_nr, n_blocks);
+
+	auto     block_size = get_block_size();
+	off_t    offset     = block_nr * block_size;
+	uint64_t n_bytes    = n_blocks * block_size;
+	DOLOG(logging::ll_debug, "backend_nbd::write_zeroes", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	// a WRITE SAME without UNMAP asks for the blocks to stay allocated
+	bool rc = invoke_nbd_range(NBD_CMD_WRITE_ZEROES, offset, n_bytes, NBD_CMD_FLAG_NO_HOLE);
+
+	ts_last_acces = get_micros();
+	bs.bytes_written += n_bytes;
+	bs.n_writes++;
+
+	return rc;
+}
+
+// writes zeroes to the range, except where BLOCK_STATUS says that it reads
+// as zeroes already; may only be called with the range locked exclusively
+bool backend_nbd::zero_locked(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	constexpr const uint32_t max_chunk_n = 256;
+	auto                 block_size = get_block_size();
+	std::vector<uint8_t> zero(std::min(n_blocks, max_chunk_n) * block_size);
+
+	for(uint32_t i=0; i<n_blocks;) {
+		uint32_t n       = std::min(uint64_t(n_blocks - i), uint64_t(0xffffffff) / block_size);
+		bool     is_zero = false;
+
+		nbd_request r;
+		if (has_block_status && invoke_nbd(NBD_CMD_BLOCK_STATUS, (block_nr + i) * block_size, n * block_size, nullptr, nullptr, NBD_CMD_FLAG_REQ_ONE, &r) && r.status_length >= block_size) {
+			n       = std::min(uint64_t(n), uint64_t(r.status_length / block_size));
+			is_zero = r.status_flags & NBD_STATE_ZERO;
+		}
+
+		for(uint32_t j=0; j<n && is_zero == false;) {
+			uint32_t cur_n = std::min(n - j, max_chunk_n);
+			if (invoke_nbd_rw(NBD_CMD_WRITE, (block_nr + i + j) * block_size, cur_n * block_size, zero.data()) == false)
+				return false;
+
+			bs.bytes_written += cur_n * block_size;
+			j += cur_n;
+		}
+
+		i += n;
+	}
+
+	return true;
+}
+
+bool backend_nbd::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	auto     block_size = get_block_size();
+	off_t    offset     = block_nr * block_size;
+	uint64_t n_bytes    = n_blocks * block_size;
 	DOLOG(logging::ll_debug, "backend_nbd::trim", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
-	auto   lock_list  = lock_range(block_nr, n_blocks);
 
-	bool rc = invoke_nbd(NBD_CMD_TRIM, offset, n_bytes, nullptr);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
 
-	unlock_range(lock_list);
+	// LBPRZ is advertised: a trimmed range must read as zeroes afterwards
+	bool rc = false;
+	if (supports(NBD_FLAG_SEND_WRITE_ZEROES)) {
+		// deliberately without NBD_CMD_FLAG_NO_HOLE: the server may
+		// deallocate the range, which is what a trim is for
+		rc = invoke_nbd_range(NBD_CMD_WRITE_ZEROES, offset, n_bytes, 0);
+	}
+	else if (supports(NBD_FLAG_SEND_TRIM)) {
+		// NBD_CMD_TRIM frees the space but leaves the contents undefined
+		rc = invoke_nbd_range(NBD_CMD_TRIM, offset, n_bytes) && zero_locked(block_nr, n_blocks);
+	}
+	else {
+		// also an oldstyle server (no NBD_FLAG_HAS_FLAGS): it may not know TRIM
+		rc = zero_locked(block_nr, n_blocks);
+	}
 
 	ts_last_acces = get_micros();
 	bs.n_trims   += n_blocks;
@@ -297,11 +1088,9 @@ bool backend_nbd::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t
 	off_t  offset     = offset_in;
 	size_t n_bytes    = n_blocks * block_size;
 	DOLOG(logging::ll_debug, "backend_nbd::read", identifier, "block %" PRIu64 " (%lu), %d blocks, block size: %" PRIu64, block_nr, offset, n_blocks, block_size);
-	auto   lock_list  = lock_range(block_nr, n_blocks);
-
-	bool rc = invoke_nbd(NBD_CMD_READ, offset, n_bytes, data);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
 
-	unlock_range(lock_list);
+	bool rc = invoke_nbd_rw(NBD_CMD_READ, offset, n_bytes, data);
 
 	ts_last_acces  = get_micros();
 	bs.bytes_read += n_bytes;
@@ -310,56 +1099,94 @@ bool backend_nbd::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t
 	return rc;
 }
 
-backend::cmpwrite_result_t backend_nbd::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+// NBD_CMD_CACHE: the server (e.g. nbdkit with the cache filter) reads the
+// range into its cache. the reply comes when it is done, so there is nothing
+// to do without waiting.
+bool backend_nbd::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
 {
-	auto lock_list  = lock_range(block_nr, n_blocks);
+	*fits = false;
+
+	if (wait == false || supports(NBD_FLAG_SEND_CACHE) == false)
+		return true;
+
 	auto block_size = get_block_size();
+	DOLOG(logging::ll_debug, "backend_nbd::prefetch", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
 
-	DOLOG(logging::ll_debug, "backend_nbd::cmpwrite", identifier, "block %" PRIu64 " (%lu), %d blocks (%zu), block size: %" PRIu64, block_nr, block_nr * block_size, n_blocks, n_blocks * block_size, block_size);
+	bool rc = invoke_nbd_range(NBD_CMD_CACHE, block_nr * block_size, uint64_t(n_blocks) * block_size);
 
-	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
-	uint8_t          *buffer = new uint8_t[block_size]();
-
-	// DO
-	for(uint32_t i=0; i<n_blocks; i++) {
-		// read
-		off_t offset = (block_nr + i) * block_size;
-		bool  rc     = invoke_nbd(NBD_CMD_READ, offset, block_size, buffer);
-		if (rc == false) {
-			DOLOG(logging::ll_error, "backend_nbd::cmpwrite", identifier, "error reading");
-			result = cmpwrite_result_t::CWR_READ_ERROR;
-			break;
-		}
-		bs.bytes_read += block_size;
+	ts_last_acces = get_micros();
 
-		// compare
-		if (memcmp(buffer, &data_compare[i * block_size], block_size) != 0) {
-			DOLOG(logging::ll_warning, "backend_nbd::cmpwrite", identifier, "data mismatch");
-			result = cmpwrite_result_t::CWR_MISMATCH;
-			break;
-		}
+	return rc;
+}
+
+bool backend_nbd::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	if (has_block_status == false || max_n == 0)
+		return backend::get_lba_status(block_nr, max_n, status, n_same);
+
+	auto     block_size = get_block_size();
+	uint64_t n_blocks   = std::min(max_n, uint64_t(0xffffffff) / block_size);
+
+	nbd_request r;
+	if (invoke_nbd(NBD_CMD_BLOCK_STATUS, block_nr * block_size, n_blocks * block_size, nullptr, nullptr, NBD_CMD_FLAG_REQ_ONE, &r) == false)
+		return false;
+
+	// an extent that does not cover a whole block is reported as mapped
+	if (r.status_length < block_size) {
+		*status = LS_MAPPED;
+		*n_same = 1;
+	}
+	else {
+		*status = (r.status_flags & NBD_STATE_HOLE) ? LS_DEALLOCATED : LS_MAPPED;
+		*n_same = std::min(n_blocks, uint64_t(r.status_length / block_size));
 	}
 
-	delete [] buffer;
+	ts_last_acces = get_micros();
+
+	return true;
+}
+
+backend::cmpwrite_result_t backend_nbd::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	auto     block_size = get_block_size();
+	uint64_t offset     = block_nr * block_size;
+	uint32_t n_bytes    = n_blocks * block_size;
+
+	DOLOG(logging::ll_debug, "backend_nbd::cmpwrite", identifier, "block %" PRIu64 " (%" PRIu64 "), %d blocks (%u), block size: %" PRIu64, block_nr, offset, n_blocks, n_bytes, block_size);
+
+	// as in backend_file: one read for the whole range, in a buffer that is reused
+	thread_local std::vector<uint8_t> buffer;
+	if (buffer.size() < n_bytes)
+		buffer.resize(n_bytes);
+
+	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
+
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
 
-	if (result == cmpwrite_result_t::CWR_OK) {
-		// write
-		bool rc = invoke_nbd(NBD_CMD_WRITE, block_nr * block_size, n_blocks * block_size, const_cast<uint8_t *>(data_write));
-		if (rc == false) {
+	if (invoke_nbd_rw(NBD_CMD_READ, offset, n_bytes, buffer.data()) == false) {
+		DOLOG(logging::ll_error, "backend_nbd::cmpwrite", identifier, "error reading");
+		result = cmpwrite_result_t::CWR_READ_ERROR;
+	}
+	else {
+		bs.bytes_read += n_bytes;
+
+		if (memcmp(buffer.data(), data_compare, n_bytes) != 0) {
+			DOLOG(logging::ll_debug, "backend_nbd::cmpwrite", identifier, "data does not match");
+			result = cmpwrite_result_t::CWR_MISMATCH;
+		}
+		else if (invoke_nbd_rw(NBD_CMD_WRITE, offset, n_bytes, const_cast<uint8_t *>(data_write)) == false) {
 			DOLOG(logging::ll_error, "backend_nbd::cmpwrite", identifier, "ERROR writing");
 			result = cmpwrite_result_t::CWR_WRITE_ERROR;
 		}
 		else {
-			bs.bytes_written += block_size;
+			bs.bytes_written += n_bytes;
+			bs.n_writes++;
 
 			ts_last_acces = get_micros();
 		}
 	}
 
-	unlock_range(lock_list);
-
 	bs.n_reads++;
-	bs.n_writes++;
 
 	return result;
 }
@@ -1,4 +1,10 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "backend.h"
 
@@ -6,16 +12,76 @@
 class backend_nbd : public backend
 {
 private:
+	// lives on the stack of the caller of invoke_nbd()
+	struct nbd_request {
+		uint16_t command   { 0       };
+		uint16_t flags     { 0       };  // NBD_CMD_FLAG_*
+		uint64_t offset    { 0       };
+		uint32_t n_bytes   { 0       };
+		uint8_t *data      { nullptr };  // payload to send or buffer to receive into
+		uint64_t handle    { 0       };
+		bool     done      { false   };
+		bool     busy      { false   };  // reader thread is receiving into 'data'
+		int      error     { 0       };  // as returned by the NBD server
+		uint32_t status_length { 0   };  // first extent of a NBD_CMD_BLOCK_STATUS reply
+		uint32_t status_flags  { 0   };
+		std::condition_variable cv;
+	};
+
+	struct nbd_connection {
+		int                        fd         { -1      };
+		std::atomic_bool           connected  { false   };  // fd != -1, readable without the lock
+		uint64_t                   generation { 0       };  // incremented on each (dis)connect
+		uint64_t                   down_since { 0       };  // get_micros() of the disconnect
+		std::mutex                 write_lock;  // serializes the transmission of requests
+		std::mutex                 lock;  // protects the rest; take after write_lock
+		std::condition_variable    cv;  // a slot became free or the connection is back
+		std::vector<nbd_request *> slots;  // requests waiting for a reply (or for a reconnect), index is in the handle
+		std::vector<uint32_t>      free_slots;
+		uint32_t                   sequence   { 0       };
+		std::thread               *reader     { nullptr };
+	};
+
 	const std::string host;
-	const int         port     { 0  };
-	int               fd       { -1 };
-	uint64_t          dev_size { 0  };
+	const int         port          { 0  };
+	const std::string unix_socket;  // if not empty, used instead of host/port
+	const std::string export_name;
+	const int         n_connections { 1  };
+	const uint32_t    max_in_flight { 1  };  // per connection
+	const uint32_t    request_timeout_ms { 0 };  // 0 = wait forever
+	const uint32_t    max_backoff_ms     { 0 };  // between reconnect attempts
+	uint64_t          dev_size      { 0  };
+	// as negotiated with the server
+	uint16_t          transmission_flags { 0 };
+	bool              structured_replies { false };
+	bool              has_block_status   { false };  // "base:allocation" meta context
+	uint32_t          meta_context_id    { 0 };
+	uint32_t          max_payload        { 32 * 1024 * 1024 };
+	std::atomic_bool  stop_flag     { false };
+	std::mutex        stop_lock;
+	std::condition_variable stop_cv;
+	std::atomic_uint32_t next_connection { 0 };
+	std::vector<nbd_connection *> connections;
 
-	bool connect   (const bool retry);
-	bool invoke_nbd(const uint32_t command, const uint64_t offset, const uint32_t n_bytes, uint8_t *const data);
+	int  connect       (const bool retry);
+	int  connect_once  ();
+	bool pause         (const uint32_t ms);
+	bool negotiate     (const int fd);
+	bool negotiate_go  (const int fd, bool *const unsupported);
+	bool supports      (const uint16_t flag) const;
+	void reader_thread (nbd_connection *const c);
+	bool read_structured_chunk(const int fd, nbd_request *const r, const uint16_t type, const uint32_t length);
+	bool set_connection(nbd_connection *const c, const int fd);
+	bool send_request  (nbd_connection *const c, const nbd_request *const r);
+	bool wait_for      (std::condition_variable & cv, std::unique_lock<std::mutex> & lck, const std::chrono::steady_clock::time_point & deadline) const;
+	nbd_connection *pick_connection();
+	bool invoke_nbd    (const uint16_t command, const uint64_t offset, const uint32_t n_bytes, uint8_t *const data, nbd_connection *const use_connection = nullptr, const uint16_t flags = 0, nbd_request *const result = nullptr);
+	bool invoke_nbd_rw (const uint16_t command, const uint64_t offset, const uint32_t n_bytes, uint8_t *const data, const uint16_t flags = 0);
+	bool invoke_nbd_range(const uint16_t command, const uint64_t offset, const uint64_t n_bytes, const uint16_t flags = 0);
+	bool zero_locked   (const uint64_t block_nr, const uint32_t n_blocks);
 
 public:
-	backend_nbd(const std::string & host, const int port);
+	backend_nbd(const std::string & host, const int port, const std::string & unix_socket, const std::string & export_name, const int n_connections, const uint32_t max_in_flight, const uint32_t request_timeout_ms, const uint32_t max_backoff_ms);
 	virtual ~backend_nbd();
 
 	bool begin() override;
@@ -30,4 +96,9 @@ public:
 	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
 	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
 	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
 };
@@ -0,0 +1,140 @@
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <thread>
+
+#include "backend-null.h"
+#include "log.h"
+#include "random.h"
+#include "utils.h"
+
+
+backend_null::backend_null(const uint64_t size, const uint32_t latency_us, const uint32_t jitter_us):
+	backend(myformat("null:%" PRIu64, size)),
+	size(size),
+	latency_us(latency_us),
+	jitter_us(jitter_us)
+{
+}
+
+backend_null::~backend_null()
+{
+}
+
+bool backend_null::begin()
+{
+	return true;
+}
+
+uint64_t backend_null::get_size_in_blocks() const
+{
+	return size / get_block_size();
+}
+
+uint64_t backend_null::get_block_size() const
+{
+	return 4096;
+}
+
+std::string backend_null::get_serial() const
+{
+	return identifier;
+}
+
+void backend_null::delay()
+{
+	if (latency_us == 0 && jitter_us == 0)
+		return;
+
+	uint64_t wait_us = latency_us;
+
+	if (jitter_us) {
+		// getrandom() per request would be too costly
+		thread_local uint64_t state = 0;
+		if (state == 0) {
+			if (my_getrandom(&state, sizeof state) == false || state == 0)
+				state = get_micros() | 1;
+		}
+
+		// xorshift64
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+
+		wait_us += state % (uint64_t(jitter_us) + 1);
+	}
+
+	auto start = get_micros();
+	std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+	bs.io_wait += get_micros() - start;
+}
+
+bool backend_null::sync()
+{
+	delay();
+
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	return true;
+}
+
+bool backend_null::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_null::write", identifier, "block %" PRIu64 ", %d blocks", block_nr, n_blocks);
+	delay();
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * get_block_size();
+	bs.n_writes++;
+
+	return true;
+}
+
+bool backend_null::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_debug, "backend_null::trim", identifier, "block %" PRIu64 ", %d blocks", block_nr, n_blocks);
+	delay();
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return true;
+}
+
+bool backend_null::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_null::read", identifier, "block %" PRIu64 ", %d blocks", block_nr, n_blocks);
+	size_t n_bytes = n_blocks * get_block_size();
+	memset(data, 0x00, n_bytes);
+	delay();
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_bytes;
+	bs.n_reads++;
+
+	return true;
+}
+
+backend::cmpwrite_result_t backend_null::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	DOLOG(logging::ll_debug, "backend_null::cmpwrite", identifier, "block %" PRIu64 ", %d blocks", block_nr, n_blocks);
+	size_t n_bytes = n_blocks * get_block_size();
+	delay();
+
+	ts_last_acces = get_micros();
+	bs.n_reads++;
+	bs.n_writes++;
+
+	// the medium always reads as zeros
+	for(size_t i=0; i<n_bytes; i++) {
+		if (data_compare[i]) {
+			DOLOG(logging::ll_debug, "backend_null::cmpwrite", identifier, "data does not match");
+			return cmpwrite_result_t::CWR_MISMATCH;
+		}
+	}
+
+	bs.bytes_written += n_bytes;
+
+	return cmpwrite_result_t::CWR_OK;
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+
+#include "backend.h"
+
+
+// reads return zeros, writes are discarded: for measuring the overhead
+// of the iSCSI/SCSI layers without any storage in the path
+class backend_null : public backend
+{
+private:
+	const uint64_t size       { 0 };  // in bytes
+	const uint32_t latency_us { 0 };  // artificial latency per request
+	const uint32_t jitter_us  { 0 };  // 0...jitter_us is added to latency_us
+
+	void delay();
+
+public:
+	backend_null(const uint64_t size, const uint32_t latency_us, const uint32_t jitter_us);
+	virtual ~backend_null();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	bool sync() override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+};
@@ -0,0 +1,571 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <vector>
+
+#include "backend-readcache.h"
+#include "log.h"
+#include "utils.h"
+
+
+readcache_pool::readcache_pool(const size_t cache_size):
+	shard_size(std::max(cache_size / n_shards, size_t(65536))),
+	kin(shard_size / 4)  // the value suggested in the 2Q paper
+{
+}
+
+readcache_pool::~readcache_pool()
+{
+	if (prefetcher) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+			stop_flag = true;
+			prefetch_cv.notify_all();
+		}
+		prefetcher->join();
+		delete prefetcher;
+	}
+
+	for(auto & s: shards) {
+		for(auto & e: s.entries)
+			delete [] e.second.data;
+	}
+}
+
+bool readcache_pool::begin()
+{
+	DOLOG(logging::ll_info, "readcache_pool::begin", "-", "%d shards of %zu bytes", n_shards, shard_size);
+
+	prefetcher = new std::thread(&readcache_pool::prefetcher_thread, this);
+
+	return true;
+}
+
+uint16_t readcache_pool::attach()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	return next_id++;
+}
+
+// forgets everything of 'cache': it is going away
+void readcache_pool::detach(backend_readcache *const cache)
+{
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		prefetch_queue.erase(std::remove_if(prefetch_queue.begin(), prefetch_queue.end(), [cache](const prefetch_request & r) { return r.cache == cache; }), prefetch_queue.end());
+
+		prefetch_cv.wait(lck, [this, cache] { return prefetching != cache; });
+	}
+
+	for(auto & s: shards) {
+		std::unique_lock<std::mutex> lck(s.lock);
+
+		for(auto it = s.entries.begin(); it != s.entries.end();) {
+			if (it->second.owner != cache) {
+				++it;
+				continue;
+			}
+
+			if (it->second.queue == Q_AM)
+				s.am.erase(it->second.it);
+			else {
+				s.a1in.erase(it->second.it);
+				s.a1in_bytes -= it->second.size;
+			}
+			s.bytes -= it->second.size;
+			delete [] it->second.data;
+			it = s.entries.erase(it);
+		}
+	}
+}
+
+readcache_pool::shard & readcache_pool::get_shard(const uint64_t key)
+{
+	return shards[key % n_shards];
+}
+
+bool readcache_pool::lookup(const uint64_t key, uint8_t *const data)
+{
+	shard & s = get_shard(key);
+	std::unique_lock<std::mutex> lck(s.lock);
+
+	auto it = s.entries.find(key);
+	if (it == s.entries.end())
+		return false;
+
+	if (it->second.queue == Q_AM)  // A1in is a FIFO: a hit there does not change anything
+		s.am.splice(s.am.begin(), s.am, it->second.it);
+
+	memcpy(data, it->second.data, it->second.size);
+
+	return true;
+}
+
+bool readcache_pool::is_cached(const uint64_t key)
+{
+	shard & s = get_shard(key);
+	std::unique_lock<std::mutex> lck(s.lock);
+
+	return s.entries.find(key) != s.entries.end();
+}
+
+// may only be called with the lock of 's' held
+void readcache_pool::evict(shard & s)
+{
+	uint64_t victim = 0;
+
+	if (s.a1in_bytes > kin || s.am.empty()) {
+		victim = s.a1in.back();
+		s.a1in.pop_back();
+
+		// remember it: if it is read again soon, it goes into Am; as many
+		// as half of the blocks that fit in the shard
+		s.a1out.push_front(victim);
+		s.a1out_index[victim] = s.a1out.begin();
+		if (s.a1out.size() > s.entries.size() / 2 + 1) {
+			s.a1out_index.erase(s.a1out.back());
+			s.a1out.pop_back();
+		}
+	}
+	else {
+		victim = s.am.back();
+		s.am.pop_back();
+	}
+
+	auto it = s.entries.find(victim);
+	if (it->second.queue == Q_A1IN)
+		s.a1in_bytes -= it->second.size;
+	s.bytes -= it->second.size;
+	it->second.owner->bs.n_cache_evictions++;
+	delete [] it->second.data;
+	s.entries.erase(it);
+}
+
+void readcache_pool::insert(backend_readcache *const owner, const uint64_t key, const uint8_t *const data, const uint32_t size)
+{
+	shard & s = get_shard(key);
+	std::unique_lock<std::mutex> lck(s.lock);
+
+	if (s.entries.find(key) != s.entries.end())  // a concurrent read was first
+		return;
+
+	cache_entry e;
+	e.owner = owner;
+	e.data  = new uint8_t[size];
+	e.size  = size;
+	memcpy(e.data, data, size);
+
+	auto ghost = s.a1out_index.find(key);
+	if (ghost != s.a1out_index.end()) {
+		s.a1out.erase(ghost->second);
+		s.a1out_index.erase(ghost);
+
+		s.am.push_front(key);
+		e.queue = Q_AM;
+		e.it    = s.am.begin();
+	}
+	else {
+		s.a1in.push_front(key);
+		e.queue = Q_A1IN;
+		e.it    = s.a1in.begin();
+		s.a1in_bytes += size;
+	}
+
+	s.entries.insert({ key, e });
+	s.bytes += size;
+
+	while(s.bytes > shard_size)
+		evict(s);
+}
+
+void readcache_pool::invalidate(const uint64_t key)
+{
+	shard & s = get_shard(key);
+	std::unique_lock<std::mutex> lck(s.lock);
+
+	auto it = s.entries.find(key);
+	if (it == s.entries.end())
+		return;
+
+	if (it->second.queue == Q_AM)
+		s.am.erase(it->second.it);
+	else {
+		s.a1in.erase(it->second.it);
+		s.a1in_bytes -= it->second.size;
+	}
+	s.bytes -= it->second.size;
+	delete [] it->second.data;
+	s.entries.erase(it);
+}
+
+void readcache_pool::prefetcher_thread()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	while(stop_flag == false) {
+		prefetch_cv.wait(lck, [this] { return stop_flag || prefetch_queue.empty() == false; });
+		if (stop_flag)
+			break;
+
+		prefetch_request r = prefetch_queue.front();
+		prefetch_queue.pop_front();
+		prefetching = r.cache;
+		lck.unlock();
+
+		if (r.cache->fill(r.block_nr, r.n_blocks) == false)
+			DOLOG(logging::ll_warning, "readcache_pool::prefetcher_thread", r.cache->identifier, "prefetch of block %" PRIu64 ", %u blocks failed", r.block_nr, r.n_blocks);
+
+		lck.lock();
+		prefetching = nullptr;
+		prefetch_cv.notify_all();  // detach() may be waiting
+	}
+}
+
+// returns false when the queue is full
+bool readcache_pool::queue_prefetch(backend_readcache *const cache, const uint64_t block_nr, const uint32_t n_blocks)
+{
+	std::unique_lock<std::mutex> lck(lock);
+	if (prefetch_queue.size() >= max_prefetch_queue)
+		return false;
+
+	prefetch_queue.push_back({ cache, block_nr, n_blocks });
+	prefetch_cv.notify_all();
+
+	return true;
+}
+
+/*--------------------------------------------------------------------------*/
+
+backend_readcache::backend_readcache(backend *const b, readcache_pool *const pool):
+	backend("read-cache"),
+	b(b),
+	pool(pool),
+	block_size(b->get_block_size())
+{
+}
+
+backend_readcache::~backend_readcache()
+{
+	stop_flag = true;  // a prefetch of this cache that is in progress stops early
+	pool->detach(this);
+
+	delete b;
+}
+
+bool backend_readcache::begin()
+{
+	if (b->begin() == false)
+		return false;
+
+	id = pool->attach();
+
+	return true;
+}
+
+std::string backend_readcache::get_serial() const
+{
+	return b->get_serial();
+}
+
+uint64_t backend_readcache::get_size_in_blocks() const
+{
+	return b->get_size_in_blocks();
+}
+
+uint64_t backend_readcache::get_block_size() const
+{
+	return block_size;
+}
+
+uint8_t backend_readcache::get_free_space_percentage()
+{
+	return b->get_free_space_percentage();
+}
+
+uint32_t backend_readcache::get_discard_granularity() const
+{
+	return b->get_discard_granularity();
+}
+
+void backend_readcache::invalidate(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	for(uint32_t i=0; i<n_blocks; i++)
+		pool->invalidate(get_key(block_nr + i));
+}
+
+bool backend_readcache::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_readcache::read", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	std::vector<bool> hit(n_blocks);
+	uint32_t          n_hits = 0;
+	for(uint32_t i=0; i<n_blocks; i++) {
+		hit[i] = pool->lookup(get_key(block_nr + i), &data[i * block_size]);
+		n_hits += hit[i];
+	}
+
+	bool rc = true;
+
+	// read the missing blocks, in runs, and add them
+	uint32_t i = 0;
+	while(i < n_blocks && rc) {
+		if (hit[i]) {
+			i++;
+			continue;
+		}
+
+		uint32_t n = 1;
+		while(i + n < n_blocks && hit[i + n] == false)
+			n++;
+
+		uint64_t start = get_micros();
+		rc = b->read(block_nr + i, n, &data[i * block_size]);
+		bs.io_wait += get_micros() - start;
+
+		if (rc) {
+			for(uint32_t j=i; j<i + n; j++)
+				pool->insert(this, get_key(block_nr + j), &data[j * block_size], block_size);
+		}
+
+		i += n;
+	}
+
+	ts_last_acces      = get_micros();
+	bs.bytes_read     += n_blocks * block_size;
+	bs.n_reads++;
+	bs.n_cache_hits   += n_hits;
+	bs.n_cache_misses += n_blocks - n_hits;
+
+	return rc;
+}
+
+// does not go to the backend: only succeeds when every block is cached
+bool backend_readcache::read_cached(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	for(uint32_t i=0; i<n_blocks; i++) {
+		if (pool->lookup(get_key(block_nr + i), &data[i * block_size]) == false)
+			return false;
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_read    += n_blocks * block_size;
+	bs.n_reads++;
+	bs.n_cache_hits  += n_blocks;
+
+	return true;
+}
+
+// reads the blocks of the range that are not in the cache yet into it
+bool backend_readcache::fill(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	constexpr const uint32_t max_chunk_n = 256;
+	std::vector<uint8_t> buffer(std::min(n_blocks, max_chunk_n) * block_size);
+	bool rc = true;
+
+	for(uint32_t i=0; i<n_blocks && rc && stop_flag == false;) {
+		uint32_t chunk_n = std::min(n_blocks - i, max_chunk_n);
+		range_lock_guard lck(&locks, block_nr + i, chunk_n, range_lock::rl_shared);
+
+		for(uint32_t j=0; j<chunk_n && rc;) {
+			if (pool->is_cached(get_key(block_nr + i + j))) {
+				j++;
+				continue;
+			}
+
+			uint32_t n = 1;
+			while(j + n < chunk_n && pool->is_cached(get_key(block_nr + i + j + n)) == false)
+				n++;
+
+			uint64_t start = get_micros();
+			rc = b->read(block_nr + i + j, n, buffer.data());
+			bs.io_wait += get_micros() - start;
+
+			if (rc) {
+				for(uint32_t k=0; k<n; k++)
+					pool->insert(this, get_key(block_nr + i + j + k), &buffer[k * block_size], block_size);
+				bs.n_cache_misses += n;
+			}
+
+			j += n;
+		}
+
+		i += chunk_n;
+	}
+
+	ts_last_acces = get_micros();
+
+	return rc;
+}
+
+// into the cache when the range fits in the part of the pool for blocks that
+// were read once (A1in), else it is left to the backend
+bool backend_readcache::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	DOLOG(logging::ll_debug, "backend_readcache::prefetch", identifier, "block %" PRIu64 ", %u blocks, wait: %d", block_nr, n_blocks, wait);
+
+	if (n_blocks * block_size > pool->kin * readcache_pool::n_shards)
+		return b->prefetch(block_nr, n_blocks, wait, fits);
+
+	*fits = true;
+
+	if (wait)
+		return fill(block_nr, n_blocks);
+
+	if (pool->queue_prefetch(this, block_nr, n_blocks) == false) {
+		DOLOG(logging::ll_debug, "backend_readcache::prefetch", identifier, "prefetch queue full");
+		*fits = false;
+	}
+
+	return true;
+}
+
+bool backend_readcache::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write(block_nr, n_blocks, data);
+	invalidate(block_nr, n_blocks);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_readcache::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write_fua(block_nr, n_blocks, data);
+	invalidate(block_nr, n_blocks);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_readcache::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write_zeroes(block_nr, n_blocks);
+	invalidate(block_nr, n_blocks);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_readcache::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->write_same(block_nr, n_blocks, pattern);
+	invalidate(block_nr, n_blocks);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_readcache::copy(const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks)
+{
+	range_lock_copy_guard lck(&locks, src_block_nr, dst_block_nr, n_blocks);
+
+	// let the backend offload it; only the destination changes
+	bool rc = b->copy(src_block_nr, dst_block_nr, n_blocks);
+	invalidate(dst_block_nr, n_blocks);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_readcache::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->trim(block_nr, n_blocks);
+	invalidate(block_nr, n_blocks);
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+bool backend_readcache::trim_fua(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	bool rc = b->trim_fua(block_nr, n_blocks);
+	invalidate(block_nr, n_blocks);
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_readcache::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	auto rc = b->cmpwrite(block_nr, n_blocks, data_write, data_compare);
+	invalidate(block_nr, n_blocks);
+
+	ts_last_acces = get_micros();
+	bs.n_reads++;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_readcache::sync()
+{
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	return b->sync();
+}
+
+void backend_readcache::get_and_reset_stats(backend_stats_t *const target)
+{
+	backend::get_and_reset_stats(target);
+	merge_child_stats(b, target);
+}
+
+bool backend_readcache::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	return b->get_lba_status(block_nr, max_n, status, n_same);
+}
+
+bool backend_readcache::has_write_cache() const
+{
+	return b->has_write_cache();
+}
+
+bool backend_readcache::get_write_cache() const
+{
+	return b->get_write_cache();
+}
+
+bool backend_readcache::set_write_cache(const bool enable)
+{
+	return b->set_write_cache(enable);
+}
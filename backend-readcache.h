@@ -0,0 +1,140 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "backend.h"
+
+
+class backend_readcache;
+
+// The RAM and the prefetch thread of the read caches of all LUNs (of all
+// targets): a busy LUN gets more of it than an idle one. Uses the 2Q
+// replacement policy (Johnson & Shasha): blocks read once go to a FIFO
+// ("A1in") and only get into the LRU ("Am") when they are read again
+// shortly after they left it ("A1out" remembers those), so that a large
+// sequential scan does not push out the blocks that are really hot.
+class readcache_pool
+{
+	friend class backend_readcache;
+
+private:
+	enum queue_t { Q_A1IN, Q_AM };
+
+	// a key is the id of the cache (upper 16 bits) and the block number
+	struct cache_entry {
+		backend_readcache             *owner { nullptr };
+		uint8_t                       *data  { nullptr };
+		uint32_t                       size  { 0       };
+		queue_t                        queue { Q_A1IN  };
+		std::list<uint64_t>::iterator  it;  // position in its queue
+	};
+
+	struct shard {
+		std::mutex                                 lock;
+		std::unordered_map<uint64_t, cache_entry>  entries;
+		std::list<uint64_t>                        a1in;  // FIFO, newest in front
+		std::list<uint64_t>                        am;  // LRU, most recently used in front
+		std::list<uint64_t>                        a1out;  // keys only, newest in front
+		std::unordered_map<uint64_t, std::list<uint64_t>::iterator> a1out_index;
+		size_t                                     bytes      { 0 };
+		size_t                                     a1in_bytes { 0 };
+	};
+
+	struct prefetch_request {
+		backend_readcache *cache    { nullptr };
+		uint64_t           block_nr { 0       };
+		uint32_t           n_blocks { 0       };
+	};
+
+	static constexpr const int    n_shards           = 16;
+	static constexpr const size_t max_prefetch_queue = 64;  // ranges; more are dropped
+
+	const size_t     shard_size  { 0       };  // in bytes
+	const size_t     kin         { 0       };  // A1in target size, in bytes
+	shard            shards[n_shards];
+
+	std::mutex       lock;  // protects the members below
+	std::condition_variable prefetch_cv;
+	std::deque<prefetch_request> prefetch_queue;
+	backend_readcache *prefetching { nullptr };  // the one the prefetcher is busy with
+	uint16_t         next_id     { 1       };
+	std::atomic_bool stop_flag   { false   };
+	std::thread     *prefetcher  { nullptr };
+
+	shard & get_shard (const uint64_t key);
+	bool    lookup    (const uint64_t key, uint8_t *const data);
+	bool    is_cached (const uint64_t key);
+	void    insert    (backend_readcache *const owner, const uint64_t key, const uint8_t *const data, const uint32_t size);
+	void    evict     (shard & s);
+	void    invalidate(const uint64_t key);
+	void    prefetcher_thread();
+
+	uint16_t attach   ();
+	void    detach    (backend_readcache *const cache);
+	bool    queue_prefetch(backend_readcache *const cache, const uint64_t block_nr, const uint32_t n_blocks);
+
+public:
+	readcache_pool(const size_t cache_size);
+	virtual ~readcache_pool();
+
+	bool begin();
+};
+
+// Keeps recently read blocks in RAM (of the pool), shared by all sessions.
+// Writes go straight to the backend and invalidate the cached copies.
+// Prefetches that need not wait are done by the thread of the pool.
+class backend_readcache : public backend
+{
+	friend class readcache_pool;
+
+private:
+	backend        *const b    { nullptr };  // owned
+	readcache_pool *const pool { nullptr };
+	const uint64_t  block_size { 0       };
+	uint16_t        id         { 0       };  // in the pool
+	std::atomic_bool stop_flag { false   };
+
+	uint64_t get_key (const uint64_t block_nr) const { return (uint64_t(id) << 48) | block_nr; }
+	bool    fill      (const uint64_t block_nr, const uint32_t n_blocks);
+	void    invalidate(const uint64_t block_nr, const uint32_t n_blocks);
+
+public:
+	backend_readcache(backend *const b, readcache_pool *const pool);
+	virtual ~backend_readcache();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+	void get_and_reset_stats(backend_stats_t *const target) override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	bool read_cached(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);  // false when not all of it is in the cache
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim_fua      (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_same    (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool copy          (const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+
+	bool has_write_cache() const override;
+	bool get_write_cache() const override;
+	bool set_write_cache(const bool enable) override;
+};
@@ -0,0 +1,633 @@
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#if !defined(__MINGW32__)
+#include <sys/mman.h>
+#endif
+
+#include "backend-file.h"
+#include "backend-stream.h"
+#include "log.h"
+#include "utils.h"
+
+
+backend_stream::backend_stream(backend *const remote, const std::string & local_file, const std::string & present_file, const uint32_t chunk_blocks, const uint32_t readahead, const uint64_t max_bytes_per_s):
+	backend("stream:" + local_file),
+	remote(remote),
+	local_file(local_file),
+	present_file(present_file),
+	chunk_blocks(std::max(chunk_blocks, uint32_t(1))),
+	readahead(readahead),
+	max_bytes_per_s(max_bytes_per_s)
+{
+}
+
+backend_stream::~backend_stream()
+{
+	stop_flag = true;
+	{
+		std::unique_lock<std::mutex> lck(present_lock);
+		streamer_cv.notify_all();
+	}
+
+	if (streamer) {
+		streamer->join();
+		delete streamer;
+	}
+
+	if (local && mapping)
+		persist();
+
+	DOLOG(logging::ll_info, "backend_stream", identifier, "%" PRIu64 " of %" PRIu64 " chunks local, fetched %" PRIu64 " (%" PRIu64 " on demand)", n_present, n_chunks, n_fetched.load(), n_on_demand.load());
+
+#if !defined(__MINGW32__)
+	if (mapping)
+		munmap(mapping, mapping_size);
+#endif
+
+	if (fd != -1)
+		close(fd);
+
+	delete local;
+	delete remote;
+}
+
+bool backend_stream::begin()
+{
+#if defined(__MINGW32__)
+	DOLOG(logging::ll_error, "backend_stream::begin", identifier, "not supported on this platform");
+	return false;
+#else
+	if (remote->begin() == false)
+		return false;
+
+	block_size   = remote->get_block_size();
+	n_blocks     = remote->get_size_in_blocks();
+	n_chunks     = (n_blocks + chunk_blocks - 1) / chunk_blocks;
+	mapping_size = header_size + (n_chunks + 7) / 8;
+
+	// the local copy: a sparse file of the size of the remote image
+	int local_fd = open(local_file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (local_fd == -1) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot open %s: %s", local_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	struct stat st { };
+	if (fstat(local_fd, &st) == -1) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot fstat %s: %s", local_file.c_str(), strerror(errno));
+		close(local_fd);
+		return false;
+	}
+
+	if (S_ISREG(st.st_mode) && st.st_size == 0 && ftruncate(local_fd, n_blocks * block_size) == -1) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot resize %s: %s", local_file.c_str(), strerror(errno));
+		close(local_fd);
+		return false;
+	}
+
+	close(local_fd);
+
+	local = new backend_file(local_file);
+	if (local->begin() == false)
+		return false;
+
+	if (local->get_block_size() != block_size || local->get_size_in_blocks() < n_blocks) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "local copy does not match the geometry of the remote image");
+		return false;
+	}
+
+	fd = open(present_file.c_str(), O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot open %s: %s", present_file.c_str(), strerror(errno));
+		return false;
+	}
+
+	if (fstat(fd, &st) == -1) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot fstat: %s", strerror(errno));
+		return false;
+	}
+
+	bool is_new = st.st_size == 0;
+	if (is_new) {
+		if (ftruncate(fd, mapping_size) == -1) {
+			DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot resize to %zu bytes: %s", mapping_size, strerror(errno));
+			return false;
+		}
+	}
+	else if (size_t(st.st_size) != mapping_size) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "%s is %zu bytes, expected %zu: was it made for another image?", present_file.c_str(), size_t(st.st_size), mapping_size);
+		return false;
+	}
+
+	void *p = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot mmap: %s", strerror(errno));
+		return false;
+	}
+	mapping = reinterpret_cast<uint8_t *>(p);
+
+	present_header *const h = reinterpret_cast<present_header *>(mapping);
+	if (is_new) {
+		memcpy(h->magic, "iESPSTRM", sizeof h->magic);
+		h->version      = 1;
+		h->chunk_blocks = chunk_blocks;
+		h->n_blocks     = n_blocks;
+		h->block_size   = block_size;
+
+		if (msync(mapping, mapping_size, MS_SYNC) == -1) {
+			DOLOG(logging::ll_error, "backend_stream::begin", identifier, "cannot msync: %s", strerror(errno));
+			return false;
+		}
+	}
+	else if (memcmp(h->magic, "iESPSTRM", sizeof h->magic) != 0 || h->version != 1 || h->chunk_blocks != chunk_blocks || h->n_blocks != n_blocks || h->block_size != block_size) {
+		DOLOG(logging::ll_error, "backend_stream::begin", identifier, "header does not match the image (chunk size %u, %" PRIu64 " blocks of %" PRIu64 " bytes)", chunk_blocks, n_blocks, block_size);
+		return false;
+	}
+
+	present.assign(&mapping[header_size], &mapping[mapping_size]);
+	for(uint64_t c=0; c<n_chunks; c++)
+		n_present += is_present(c);
+
+	DOLOG(logging::ll_info, "backend_stream::begin", identifier, "%" PRIu64 " of %" PRIu64 " chunks of %u blocks are local, streaming the rest at %" PRIu64 " bytes per second (0 = no limit)", n_present, n_chunks, chunk_blocks, max_bytes_per_s);
+
+	streamer = new std::thread(&backend_stream::streamer_thread, this);
+
+	return true;
+#endif
+}
+
+std::string backend_stream::get_serial() const
+{
+	return remote->get_serial();
+}
+
+uint64_t backend_stream::get_size_in_blocks() const
+{
+	return n_blocks;
+}
+
+uint64_t backend_stream::get_block_size() const
+{
+	return block_size;
+}
+
+uint8_t backend_stream::get_free_space_percentage()
+{
+	return local->get_free_space_percentage();
+}
+
+// trims of partial chunks that are not local yet need a fetch first
+uint32_t backend_stream::get_discard_granularity() const
+{
+	return chunk_blocks;
+}
+
+// may only be called with 'present_lock' held (or before the backend is used)
+bool backend_stream::is_present(const uint64_t chunk) const
+{
+	return present[chunk / 8] & (1 << (chunk & 7));
+}
+
+bool backend_stream::all_present(const uint64_t first, const uint64_t last)
+{
+	std::unique_lock<std::mutex> lck(present_lock);
+
+	for(uint64_t c=first; c<=last; c++) {
+		if (is_present(c) == false)
+			return false;
+	}
+
+	return true;
+}
+
+// only in RAM, persist() puts it in the file after syncing the local copy
+void backend_stream::set_present(const uint64_t first, const uint64_t last)
+{
+	std::unique_lock<std::mutex> lck(present_lock);
+
+	for(uint64_t c=first; c<=last; c++) {
+		if (is_present(c) == false) {
+			present[c / 8] |= 1 << (c & 7);
+			n_present++;
+
+			dirty_first = std::min(dirty_first, c / 8);
+			dirty_last  = std::max(dirty_last,  c / 8);
+		}
+	}
+}
+
+bool backend_stream::persist()
+{
+	std::unique_lock<std::mutex> plck(persist_lock);
+
+	uint64_t first = 0;
+	uint64_t last  = 0;
+	std::vector<uint8_t> copy;
+	{
+		std::unique_lock<std::mutex> lck(present_lock);
+		if (dirty_first == UINT64_MAX) {
+			lck.unlock();
+			return local->sync();
+		}
+
+		first = dirty_first;
+		last  = dirty_last;
+		copy.assign(present.begin() + first, present.begin() + last + 1);
+
+		dirty_first = UINT64_MAX;
+		dirty_last  = 0;
+	}
+
+	// the data of these chunks must be on disk before the bits are
+	if (local->sync() == false) {
+		std::unique_lock<std::mutex> lck(present_lock);
+		dirty_first = std::min(dirty_first, first);
+		dirty_last  = std::max(dirty_last,  last );
+		return false;
+	}
+
+	memcpy(&mapping[header_size + first], copy.data(), copy.size());
+
+#if !defined(__MINGW32__)
+	static const size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t start = (header_size + first) & ~(page_size - 1);
+	size_t end   = header_size + last + 1;
+	if (msync(&mapping[start], end - start, MS_SYNC) == -1) {
+		DOLOG(logging::ll_error, "backend_stream::persist", identifier, "cannot msync: %s", strerror(errno));
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+// caller must hold the range lock (exclusive) of these chunks; copies the
+// ones that are not local yet, in runs
+bool backend_stream::fetch_locked(const uint64_t first, const uint64_t last)
+{
+	const uint64_t max_n = std::max(max_fetch / (chunk_blocks * block_size), uint64_t(1));  // chunks per remote read
+
+	std::vector<uint8_t> buffer;
+
+	uint64_t c = first;
+	while(c <= last) {
+		if (all_present(c, c)) {
+			c++;
+			continue;
+		}
+
+		uint64_t n = 1;
+		while(c + n <= last && n < max_n && all_present(c + n, c + n) == false)
+			n++;
+
+		uint64_t block_nr = c * chunk_blocks;
+		uint32_t n_fetch  = std::min((c + n) * chunk_blocks, n_blocks) - block_nr;
+		buffer.resize(n_fetch * block_size);
+
+		if (remote->read(block_nr, n_fetch, buffer.data()) == false) {
+			DOLOG(logging::ll_error, "backend_stream::fetch_locked", identifier, "cannot fetch block %" PRIu64 " (%u blocks)", block_nr, n_fetch);
+			return false;
+		}
+
+		// holes in the image stay holes locally
+		bool ok = is_zero(buffer.data(), buffer.size()) ? local->trim(block_nr, n_fetch) : local->write(block_nr, n_fetch, buffer.data());
+		if (ok == false)
+			return false;
+
+		set_present(c, c + n - 1);
+		n_fetched += n;
+
+		c += n;
+	}
+
+	return true;
+}
+
+bool backend_stream::fetch(const uint64_t first, const uint64_t last, const bool on_demand)
+{
+	uint64_t start = first * chunk_blocks;
+	uint64_t end   = std::min((last + 1) * chunk_blocks, n_blocks);
+
+	range_lock_guard lck(&locks, start, end - start, range_lock::rl_exclusive);
+
+	if (on_demand && all_present(first, last) == false)
+		n_on_demand += last - first + 1;
+
+	return fetch_locked(first, last);
+}
+
+// asks the streamer to fetch these chunks before it continues where it was
+void backend_stream::want(const uint64_t first, const uint64_t last)
+{
+	constexpr const size_t max_wanted = 4096;
+
+	std::unique_lock<std::mutex> lck(present_lock);
+
+	bool added = false;
+	for(uint64_t c=first; c<=last && c<n_chunks && wanted.size() < max_wanted; c++) {
+		if (is_present(c) == false) {
+			wanted.push_back(c);
+			added = true;
+		}
+	}
+
+	if (added)
+		streamer_cv.notify_all();
+}
+
+void backend_stream::streamer_thread()
+{
+	const uint64_t chunk_bytes = chunk_blocks * block_size;
+	// a tenth of the budget of a second per step so that the rate is smooth
+	const uint64_t step        = std::max(std::min(max_fetch / chunk_bytes, max_bytes_per_s ? max_bytes_per_s / 10 / chunk_bytes : UINT64_MAX), uint64_t(1));
+	uint64_t       last_persist = get_micros();
+
+	while(stop_flag == false) {
+		uint64_t first      = UINT64_MAX;
+		uint64_t n          = 0;
+		bool     is_wanted  = false;
+		bool     done       = false;
+		{
+			std::unique_lock<std::mutex> lck(present_lock);
+
+			while(wanted.empty() == false && first == UINT64_MAX) {
+				uint64_t c = wanted.front();
+				wanted.pop_front();
+				if (is_present(c) == false) {
+					first     = c;
+					is_wanted = true;
+				}
+			}
+
+			if (first == UINT64_MAX) {
+				// all chunks before the cursor are local, those never go away
+				while(cursor < n_chunks && is_present(cursor))
+					cursor++;
+
+				if (cursor < n_chunks)
+					first = cursor;
+				else
+					done = true;
+			}
+
+			if (first != UINT64_MAX) {
+				n = 1;
+				while(n < step && first + n < n_chunks && is_present(first + n) == false)
+					n++;
+			}
+		}
+
+		if (done) {
+			persist();
+			DOLOG(logging::ll_info, "backend_stream::streamer_thread", identifier, "all %" PRIu64 " chunks are local now", n_chunks);
+			break;
+		}
+
+		uint64_t start = get_micros();
+		bool     ok    = fetch(first, first + n - 1, false);
+
+		if (get_micros() - last_persist >= 1000000) {
+			persist();
+			last_persist = get_micros();
+		}
+
+		// the limit is for the background copy, not for the read ahead
+		uint64_t budget = max_bytes_per_s && is_wanted == false ? n * chunk_bytes * 1000000 / max_bytes_per_s : 0;  // in uS
+		if (ok == false)
+			budget = std::max(budget, uint64_t(1000000));  // remote unreachable? retry later
+
+		uint64_t took = get_micros() - start;
+		if (budget > took) {
+			std::unique_lock<std::mutex> lck(present_lock);
+			streamer_cv.wait_for(lck, std::chrono::microseconds(budget - took), [this] { return stop_flag || wanted.empty() == false; });
+		}
+	}
+}
+
+bool backend_stream::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	uint64_t first = block_nr / chunk_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / chunk_blocks;
+
+	bool rc = false;
+	if (all_present(first, last)) {
+		range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+		rc = local->read(block_nr, n_blocks, data);
+	}
+	else {
+		uint64_t start = get_micros();
+		rc = fetch(first, last, true);
+		bs.io_wait += get_micros() - start;
+
+		if (rc) {
+			range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+			rc = local->read(block_nr, n_blocks, data);
+		}
+	}
+
+	// a sequential reader that gets near the end of what was read ahead triggers the next part
+	if (readahead && last + 1 < n_chunks && all_present(last + 1, last + 1) == false)
+		want(last + 1, last + readahead);
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	return rc;
+}
+
+// caller must hold the range lock (whole chunks); partially written chunks
+// are fetched first, all of them are local afterwards
+bool backend_stream::write_locked(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua)
+{
+	uint64_t first = block_nr / chunk_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / chunk_blocks;
+
+	if (block_nr % chunk_blocks && fetch_locked(first, first) == false)
+		return false;
+	if ((block_nr + n_blocks) % chunk_blocks && block_nr + n_blocks < this->n_blocks && fetch_locked(last, last) == false)
+		return false;
+
+	bool rc = fua ? local->write_fua(block_nr, n_blocks, data) : local->write(block_nr, n_blocks, data);
+	if (rc == false)
+		return false;
+
+	set_present(first, last);
+
+	return fua ? persist() : true;
+}
+
+bool backend_stream::zero_locked(const uint64_t block_nr, const uint32_t n_blocks, const bool trim)
+{
+	uint64_t first = block_nr / chunk_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / chunk_blocks;
+
+	if (block_nr % chunk_blocks && fetch_locked(first, first) == false)
+		return false;
+	if ((block_nr + n_blocks) % chunk_blocks && block_nr + n_blocks < this->n_blocks && fetch_locked(last, last) == false)
+		return false;
+
+	bool rc = trim ? local->trim(block_nr, n_blocks) : local->write_zeroes(block_nr, n_blocks);
+	if (rc)
+		set_present(first, last);
+
+	return rc;
+}
+
+bool backend_stream::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	uint64_t first = block_nr / chunk_blocks * chunk_blocks;
+	uint64_t end   = std::min((block_nr + n_blocks + chunk_blocks - 1) / chunk_blocks * chunk_blocks, this->n_blocks);
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = write_locked(block_nr, n_blocks, data, false);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_stream::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	uint64_t first = block_nr / chunk_blocks * chunk_blocks;
+	uint64_t end   = std::min((block_nr + n_blocks + chunk_blocks - 1) / chunk_blocks * chunk_blocks, this->n_blocks);
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = write_locked(block_nr, n_blocks, data, true);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_stream::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t first = block_nr / chunk_blocks * chunk_blocks;
+	uint64_t end   = std::min((block_nr + n_blocks + chunk_blocks - 1) / chunk_blocks * chunk_blocks, this->n_blocks);
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = zero_locked(block_nr, n_blocks, false);
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_stream::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	uint64_t first = block_nr / chunk_blocks * chunk_blocks;
+	uint64_t end   = std::min((block_nr + n_blocks + chunk_blocks - 1) / chunk_blocks * chunk_blocks, this->n_blocks);
+
+	bool rc = false;
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+		rc = zero_locked(block_nr, n_blocks, true);
+	}
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_stream::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	uint64_t first = block_nr / chunk_blocks * chunk_blocks;
+	uint64_t end   = std::min((block_nr + n_blocks + chunk_blocks - 1) / chunk_blocks * chunk_blocks, this->n_blocks);
+
+	size_t   n_bytes = n_blocks * block_size;
+	uint8_t *buffer  = new uint8_t[n_bytes];
+	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
+
+	{
+		range_lock_guard lck(&locks, first, end - first, range_lock::rl_exclusive);
+
+		if (fetch_locked(first / chunk_blocks, (end - 1) / chunk_blocks) == false || local->read(block_nr, n_blocks, buffer) == false)
+			result = cmpwrite_result_t::CWR_READ_ERROR;
+		else if (memcmp(buffer, data_compare, n_bytes) != 0) {
+			DOLOG(logging::ll_debug, "backend_stream::cmpwrite", identifier, "data does not match");
+			result = cmpwrite_result_t::CWR_MISMATCH;
+		}
+		else if (write_locked(block_nr, n_blocks, data_write, false) == false)
+			result = cmpwrite_result_t::CWR_WRITE_ERROR;
+		else {
+			bs.bytes_written += n_bytes;
+			bs.n_writes++;
+		}
+	}
+
+	delete [] buffer;
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_bytes;
+	bs.n_reads++;
+
+	return result;
+}
+
+// the local copy is synced before the list of chunks that are local
+bool backend_stream::sync()
+{
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	return persist();
+}
+
+// what is local is described by the local file, the rest by the remote image
+bool backend_stream::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	uint64_t limit = std::min(block_nr + max_n, n_blocks);
+	uint64_t c     = block_nr / chunk_blocks;
+	bool     is_local = false;
+	{
+		std::unique_lock<std::mutex> lck(present_lock);
+		is_local = is_present(c);
+
+		c++;
+		while(c * chunk_blocks < limit && is_present(c) == is_local)
+			c++;
+	}
+
+	uint64_t n = std::max(std::min(c * chunk_blocks, limit), block_nr + 1) - block_nr;
+
+	return is_local ? local->get_lba_status(block_nr, n, status, n_same) : remote->get_lba_status(block_nr, n, status, n_same);
+}
+
+// without 'wait' the streamer fetches the range next
+bool backend_stream::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	uint64_t first = block_nr / chunk_blocks;
+	uint64_t last  = (block_nr + n_blocks - 1) / chunk_blocks;
+
+	if (wait == false) {
+		want(first, last);
+		*fits = false;
+		return true;
+	}
+
+	if (fetch(first, last, true) == false)
+		return false;
+
+	return local->prefetch(block_nr, n_blocks, wait, fits);
+}
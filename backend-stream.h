@@ -0,0 +1,100 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.h"
+
+
+// Serves a local (sparse) copy of a remote image right away: chunks that are
+// not local yet are fetched from the remote backend (NBD) when they are
+// read, the chunks after them are read ahead in the background, and a
+// background thread copies the rest at a limited rate. Which chunks are
+// local is kept in a memory-mapped sidecar file, that is only updated after
+// the local file is synced so that a crash never marks a chunk as local of
+// which the data was not on disk yet. Writes only go to the local copy.
+class backend_stream : public backend
+{
+private:
+	struct present_header {
+		char     magic[8];  // "iESPSTRM"
+		uint32_t version;
+		uint32_t chunk_blocks;
+		uint64_t n_blocks;
+		uint64_t block_size;
+	};
+
+	static constexpr const size_t   header_size = 4096;  // bitmap starts at a page boundary
+	static constexpr const uint32_t max_fetch   = 4 * 1024 * 1024;  // bytes per remote read
+
+	backend *const    remote           { nullptr };  // owned
+	backend          *local            { nullptr };  // owned
+	const std::string local_file;
+	const std::string present_file;
+	const uint32_t    chunk_blocks     { 1       };
+	const uint32_t    readahead        { 0       };  // chunks
+	const uint64_t    max_bytes_per_s  { 0       };  // 0: no limit
+	uint64_t          block_size       { 0       };
+	uint64_t          n_blocks         { 0       };
+	uint64_t          n_chunks         { 0       };
+	int               fd               { -1      };  // of 'present_file'
+	uint8_t          *mapping          { nullptr };
+	size_t            mapping_size     { 0       };
+	std::atomic_bool  stop_flag        { false   };
+
+	std::mutex        present_lock;  // protects the members below
+	std::vector<uint8_t> present;  // in RAM, ahead of the file
+	uint64_t          dirty_first      { UINT64_MAX };  // range of bytes of 'present' that is not in the file yet
+	uint64_t          dirty_last       { 0       };
+	uint64_t          n_present        { 0       };
+	uint64_t          cursor           { 0       };  // next chunk for the streamer
+	std::deque<uint64_t> wanted;  // chunks to read ahead, before the streamer continues
+	std::condition_variable streamer_cv;
+
+	std::mutex        persist_lock;
+	std::thread      *streamer         { nullptr };
+
+	std::atomic_uint64_t n_fetched     { 0       };  // chunks
+	std::atomic_uint64_t n_on_demand   { 0       };  // of them, for a read or a partial write
+
+	bool     is_present     (const uint64_t chunk) const;
+	bool     all_present    (const uint64_t first, const uint64_t last);
+	void     set_present    (const uint64_t first, const uint64_t last);
+	bool     persist        ();
+	bool     fetch_locked   (const uint64_t first, const uint64_t last);
+	bool     fetch          (const uint64_t first, const uint64_t last, const bool on_demand);
+	void     want           (const uint64_t first, const uint64_t last);
+	void     streamer_thread();
+	bool     write_locked   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua);
+	bool     zero_locked    (const uint64_t block_nr, const uint32_t n_blocks, const bool trim);
+
+public:
+	// 'remote' is owned; 'local_file' is created (sparse) when it does not exist
+	backend_stream(backend *const remote, const std::string & local_file, const std::string & present_file, const uint32_t chunk_blocks, const uint32_t readahead, const uint64_t max_bytes_per_s);
+	virtual ~backend_stream();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+};
@@ -0,0 +1,480 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+
+#include "backend-stripe.h"
+#include "log.h"
+#include "utils.h"
+
+
+backend_stripe::backend_stripe(const std::vector<backend *> & children, const uint32_t unit):
+	backend(myformat("stripe:%zu:%u", children.size(), unit)),
+	children(children),
+	unit(std::max(unit, uint32_t(1))),
+	block_size(children.at(0)->get_block_size()),
+	child_totals(children.size()),
+	child_logged(children.size())
+{
+}
+
+backend_stripe::~backend_stripe()
+{
+	stop_flag = true;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		worker_cv.notify_all();
+	}
+
+	for(auto & th: workers) {
+		th->join();
+		delete th;
+	}
+
+	for(auto & b: children)
+		delete b;
+}
+
+bool backend_stripe::begin()
+{
+	uint64_t child_size = UINT64_MAX;
+
+	for(auto & b: children) {
+		if (b->begin() == false)
+			return false;
+
+		if (b->get_block_size() != block_size) {
+			DOLOG(logging::ll_error, "backend_stripe::begin", identifier, "all children must have the same block size (%" PRIu64 " and %" PRIu64 ")", block_size, b->get_block_size());
+			return false;
+		}
+
+		child_size = std::min(child_size, b->get_size_in_blocks());
+	}
+
+	// only whole units
+	size = child_size / unit * unit * children.size();
+	if (size == 0) {
+		DOLOG(logging::ll_error, "backend_stripe::begin", identifier, "children are smaller than the stripe unit");
+		return false;
+	}
+
+	DOLOG(logging::ll_info, "backend_stripe::begin", identifier, "%zu children, unit of %u blocks, %" PRIu64 " blocks in total", children.size(), unit, size);
+
+	for(size_t i=0; i<children.size() * 2; i++)
+		workers.push_back(new std::thread(&backend_stripe::worker_thread, this));
+
+	ts_last_stats = get_micros();
+
+	return true;
+}
+
+std::string backend_stripe::get_serial() const
+{
+	return "stripe-" + children.at(0)->get_serial();
+}
+
+uint64_t backend_stripe::get_size_in_blocks() const
+{
+	return size;
+}
+
+uint64_t backend_stripe::get_block_size() const
+{
+	return block_size;
+}
+
+uint8_t backend_stripe::get_free_space_percentage()
+{
+	uint8_t rc = 100;
+	for(auto & b: children)
+		rc = std::min(rc, b->get_free_space_percentage());
+
+	return rc;
+}
+
+uint32_t backend_stripe::get_discard_granularity() const
+{
+	uint32_t rc = 1;
+	for(auto & b: children)
+		rc = std::max(rc, b->get_discard_granularity());
+
+	return rc;
+}
+
+void backend_stripe::worker_thread()
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	for(;;) {
+		worker_cv.wait(lck, [this] { return stop_flag || queue.empty() == false; });
+		if (queue.empty())  // stop_flag
+			break;
+
+		job j = queue.front();
+		queue.pop_front();
+		lck.unlock();
+
+		bool fits = true;
+		bool ok   = execute(j, &fits);
+
+		{
+			std::unique_lock<std::mutex> r_lck(j.r->lock);
+			j.r->ok   &= ok;
+			j.r->fits &= fits;
+			if (--j.r->n_pending == 0)
+				j.r->cv.notify_all();
+		}
+
+		lck.lock();
+	}
+}
+
+bool backend_stripe::execute(const job & j, bool *const fits)
+{
+	backend *const b = children.at(j.child);
+
+	switch(j.op) {
+		case O_READ:
+			return b->read(j.block_nr, j.n_blocks, j.data);
+		case O_WRITE:
+			return b->write(j.block_nr, j.n_blocks, j.data);
+		case O_WRITE_FUA:
+			return b->write_fua(j.block_nr, j.n_blocks, j.data);
+		case O_WRITE_ZEROES:
+			return b->write_zeroes(j.block_nr, j.n_blocks);
+		case O_WRITE_SAME:
+			return b->write_same(j.block_nr, j.n_blocks, j.pattern);
+		case O_TRIM:
+			return b->trim(j.block_nr, j.n_blocks);
+		case O_SYNC:
+			return b->sync();
+		case O_PREFETCH:
+			return b->prefetch(j.block_nr, j.n_blocks, j.wait, fits);
+	}
+
+	return false;
+}
+
+// one job per unit; consecutive units on the same child are merged when
+// they are also consecutive in the buffer (or there is no buffer, e.g. trim)
+std::vector<backend_stripe::job> backend_stripe::split(const op_t op, const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	std::vector<job>    jobs;
+	std::vector<size_t> last(children.size(), SIZE_MAX);  // index in 'jobs' of the last one for each child
+
+	for(uint32_t done=0; done<n_blocks;) {
+		uint64_t cur     = block_nr + done;
+		uint64_t unit_nr = cur / unit;
+		uint32_t in_unit = cur % unit;
+
+		job j;
+		j.op       = op;
+		j.child    = unit_nr % children.size();
+		j.block_nr = unit_nr / children.size() * unit + in_unit;
+		j.n_blocks = std::min(n_blocks - done, unit - in_unit);
+		j.data     = data ? &data[done * block_size] : nullptr;
+
+		size_t prev = last[j.child];
+		if (prev != SIZE_MAX && jobs[prev].block_nr + jobs[prev].n_blocks == j.block_nr &&
+			(data == nullptr || jobs[prev].data + jobs[prev].n_blocks * block_size == j.data)) {
+			jobs[prev].n_blocks += j.n_blocks;
+		}
+		else {
+			last[j.child] = jobs.size();
+			jobs.push_back(j);
+		}
+
+		done += j.n_blocks;
+	}
+
+	return jobs;
+}
+
+// the first job is done by the calling thread, the others by the workers
+bool backend_stripe::run(std::vector<job> & jobs, bool *const fits)
+{
+	bool first_fits = true;
+
+	if (jobs.empty())
+		return true;
+
+	if (jobs.size() == 1) {
+		bool rc = execute(jobs[0], &first_fits);
+		if (fits)
+			*fits = first_fits;
+		return rc;
+	}
+
+	request r;
+	r.n_pending = jobs.size() - 1;
+
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		for(size_t i=1; i<jobs.size(); i++) {
+			jobs[i].r = &r;
+			queue.push_back(jobs[i]);
+		}
+		worker_cv.notify_all();
+	}
+
+	bool rc = execute(jobs[0], &first_fits);
+
+	std::unique_lock<std::mutex> lck(r.lock);
+	r.cv.wait(lck, [&r] { return r.n_pending == 0; });
+
+	if (fits)
+		*fits = first_fits && r.fits;
+
+	return rc && r.ok;
+}
+
+// adds what the children did since the previous call to their totals
+void backend_stripe::collect_child_stats()
+{
+	std::unique_lock<std::mutex> lck(stats_lock);
+
+	for(size_t i=0; i<children.size(); i++) {
+		backend_stats_t cs { };
+		children[i]->get_and_reset_stats(&cs);
+		add_backend_stats(&child_totals[i], cs);
+	}
+}
+
+void backend_stripe::log_child_stats()
+{
+	uint64_t now  = get_micros();
+	uint64_t prev = ts_last_stats;
+	if (now - prev < stats_interval * 1000000ull || ts_last_stats.compare_exchange_strong(prev, now) == false)
+		return;
+
+	collect_child_stats();
+
+	double dtook = (now - prev) / 1000000.;
+	double dkB   = dtook * 1024;
+
+	std::unique_lock<std::mutex> lck(stats_lock);
+
+	for(size_t i=0; i<children.size(); i++) {
+		const backend_stats_t & cur  = child_totals[i];
+		const backend_stats_t & last = child_logged[i];
+
+		DOLOG(logging::ll_info, "backend_stripe::log_child_stats", identifier, "child %zu: IOPS: %.2f, read: %.2f kB/s, written: %.2f kB/s, io-wait: %.2f%%",
+			i, (cur.n_reads + cur.n_writes - last.n_reads - last.n_writes) / dtook, (cur.bytes_read - last.bytes_read) / dkB, (cur.bytes_written - last.bytes_written) / dkB, uint32_t(cur.io_wait - last.io_wait) * 100 / (dtook * 1000000));
+	}
+
+	child_logged = child_totals;
+}
+
+void backend_stripe::get_and_reset_stats(backend_stats_t *const target)
+{
+	backend::get_and_reset_stats(target);
+	collect_child_stats();
+}
+
+backend_stats_t *backend_stripe::get_child_stats(const size_t child)
+{
+	return &child_totals.at(child);
+}
+
+bool backend_stripe::sync()
+{
+	std::vector<job> jobs;
+	for(size_t i=0; i<children.size(); i++) {
+		job j;
+		j.op    = O_SYNC;
+		j.child = i;
+		jobs.push_back(j);
+	}
+
+	bool rc = run(jobs);
+
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	return rc;
+}
+
+bool backend_stripe::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_stripe::write", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);  // exclusive is for cmpwrite
+
+	auto     jobs  = split(O_WRITE, block_nr, n_blocks, const_cast<uint8_t *>(data));
+	uint64_t start = get_micros();
+	bool     rc    = run(jobs);
+
+	ts_last_acces     = get_micros();
+	bs.io_wait       += ts_last_acces - start;
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	log_child_stats();
+
+	return rc;
+}
+
+bool backend_stripe::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	auto     jobs  = split(O_WRITE_FUA, block_nr, n_blocks, const_cast<uint8_t *>(data));
+	uint64_t start = get_micros();
+	bool     rc    = run(jobs);
+
+	ts_last_acces     = get_micros();
+	bs.io_wait       += ts_last_acces - start;
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_stripe::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	auto jobs = split(O_WRITE_ZEROES, block_nr, n_blocks, nullptr);
+	bool rc   = run(jobs);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_stripe::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	auto jobs = split(O_WRITE_SAME, block_nr, n_blocks, nullptr);
+	for(auto & j: jobs)
+		j.pattern = pattern;
+	bool rc   = run(jobs);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return rc;
+}
+
+bool backend_stripe::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	auto jobs = split(O_TRIM, block_nr, n_blocks, nullptr);
+	bool rc   = run(jobs);
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return rc;
+}
+
+bool backend_stripe::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_stripe::read", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_shared);
+
+	auto     jobs  = split(O_READ, block_nr, n_blocks, data);
+	uint64_t start = get_micros();
+	bool     rc    = run(jobs);
+
+	ts_last_acces  = get_micros();
+	bs.io_wait    += ts_last_acces - start;
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	log_child_stats();
+
+	return rc;
+}
+
+// the range can be on multiple children: it is locked here so that the
+// read, compare and write together are atomic
+backend::cmpwrite_result_t backend_stripe::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
+	uint64_t          start  = get_micros();
+
+	auto jobs = split(O_READ, block_nr, n_blocks, nullptr);
+	if (jobs.size() == 1)
+		result = children.at(jobs[0].child)->cmpwrite(jobs[0].block_nr, n_blocks, data_write, data_compare);
+	else {
+		std::vector<uint8_t> buffer(n_blocks * block_size);
+		jobs = split(O_READ, block_nr, n_blocks, buffer.data());
+
+		if (run(jobs) == false)
+			result = cmpwrite_result_t::CWR_READ_ERROR;
+		else if (memcmp(buffer.data(), data_compare, buffer.size()) != 0)
+			result = cmpwrite_result_t::CWR_MISMATCH;
+		else {
+			jobs = split(O_WRITE, block_nr, n_blocks, const_cast<uint8_t *>(data_write));
+			if (run(jobs) == false)
+				result = cmpwrite_result_t::CWR_WRITE_ERROR;
+		}
+	}
+
+	ts_last_acces  = get_micros();
+	bs.io_wait    += ts_last_acces - start;
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+	if (result == cmpwrite_result_t::CWR_OK) {
+		bs.bytes_written += n_blocks * block_size;
+		bs.n_writes++;
+	}
+
+	return result;
+}
+
+// the status of the unit 'block_nr' is in; the caller asks again for the rest
+bool backend_stripe::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	uint64_t unit_nr = block_nr / unit;
+	uint32_t in_unit = block_nr % unit;
+	backend *b       = children.at(unit_nr % children.size());
+
+	return b->get_lba_status(unit_nr / children.size() * unit + in_unit, std::min(max_n, uint64_t(unit - in_unit)), status, n_same);
+}
+
+bool backend_stripe::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	auto jobs = split(O_PREFETCH, block_nr, n_blocks, nullptr);
+	for(auto & j: jobs)
+		j.wait = wait;
+
+	return run(jobs, fits);
+}
+
+bool backend_stripe::has_write_cache() const
+{
+	for(auto & b: children) {
+		if (b->has_write_cache() == false)
+			return false;
+	}
+
+	return true;
+}
+
+bool backend_stripe::get_write_cache() const
+{
+	for(auto & b: children) {
+		if (b->get_write_cache())
+			return true;
+	}
+
+	return false;
+}
+
+bool backend_stripe::set_write_cache(const bool enable)
+{
+	bool rc = true;
+	for(auto & b: children)
+		rc &= b->set_write_cache(enable);
+
+	return rc;
+}
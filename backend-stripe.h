@@ -0,0 +1,103 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.h"
+
+
+// RAID-0: the blocks are spread over the children in units of 'unit'
+// blocks (unit 0 on child 0, unit 1 on child 1, ...). A request that
+// touches more than one child is split into a sub-request per unit; these
+// are done in parallel by a pool of threads, each reading/writing directly
+// in the buffer of the caller. Requests within one unit (most small I/O)
+// are done by the calling thread itself.
+class backend_stripe : public backend
+{
+private:
+	enum op_t { O_READ, O_WRITE, O_WRITE_FUA, O_WRITE_ZEROES, O_WRITE_SAME, O_TRIM, O_SYNC, O_PREFETCH };
+
+	struct request {
+		std::mutex              lock;
+		std::condition_variable cv;
+		int                     n_pending { 0    };
+		bool                    ok        { true };
+		bool                    fits      { true };  // O_PREFETCH
+	};
+
+	// a part of a request that is on one child
+	struct job {
+		op_t           op       { O_READ  };
+		size_t         child    { 0       };
+		uint64_t       block_nr { 0       };  // of the child
+		uint32_t       n_blocks { 0       };
+		uint8_t       *data     { nullptr };  // in the buffer of the caller
+		const uint8_t *pattern  { nullptr };  // O_WRITE_SAME
+		bool           wait     { false   };  // O_PREFETCH
+		request       *r        { nullptr };
+	};
+
+	static constexpr const int stats_interval = 10;  // seconds between the per child statistics in the log
+
+	const std::vector<backend *> children;  // owned
+	const uint32_t   unit       { 0       };  // in blocks
+	const uint64_t   block_size { 0       };
+	uint64_t         size       { 0       };  // in blocks, of the whole set
+	std::atomic_bool stop_flag  { false   };
+	std::atomic_uint64_t ts_last_stats { 0 };
+
+	std::mutex       stats_lock;  // protects the counters below
+	std::vector<backend_stats_t> child_totals;  // per child, since the start
+	std::vector<backend_stats_t> child_logged;  // 'child_totals' at the last log line
+
+	std::mutex       lock;  // protects the queue
+	std::condition_variable worker_cv;
+	std::deque<job>  queue;
+	std::vector<std::thread *> workers;
+
+	void worker_thread();
+	bool execute      (const job & j, bool *const fits);
+	std::vector<job> split(const op_t op, const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);
+	bool run          (std::vector<job> & jobs, bool *const fits = nullptr);
+	void collect_child_stats();
+	void log_child_stats();
+
+public:
+	// all children must have the same block size
+	backend_stripe(const std::vector<backend *> & children, const uint32_t unit);
+	virtual ~backend_stripe();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+	void get_and_reset_stats(backend_stats_t *const target) override;
+
+	// the counters of a child since the start (for SNMP); the pointer stays valid
+	backend_stats_t *get_child_stats(const size_t child);
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_same    (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+
+	bool has_write_cache() const override;
+	bool get_write_cache() const override;
+	bool set_write_cache(const bool enable) override;
+};
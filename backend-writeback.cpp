@@ -0,0 +1,529 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstring>
+#include <numeric>
+
+#include "backend-writeback.h"
+#include "log.h"
+#include "utils.h"
+
+
+backend_writeback::backend_writeback(backend *const b, const size_t cache_size, const uint32_t max_age_ms, const int dirty_ratio):
+	backend(myformat("write-back:%zu", cache_size)),
+	b(b),
+	block_size(b->get_block_size()),
+	max_blocks(std::max(cache_size / b->get_block_size(), size_t(1))),
+	max_age_us(max_age_ms * uint64_t(1000)),
+	dirty_limit(max_blocks * std::clamp(dirty_ratio, 1, 100) / 100)
+{
+}
+
+backend_writeback::~backend_writeback()
+{
+	stop_flag = true;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		flusher_cv.notify_all();
+		space_cv.notify_all();
+	}
+
+	if (flusher) {
+		flusher->join();
+		delete flusher;
+	}
+
+	if (flush_all() == false)
+		DOLOG(logging::ll_error, "backend_writeback::~backend_writeback", identifier, "%zu dirty blocks could not be written back", dirty.size());
+
+	for(auto & e: dirty)
+		delete [] e.second.data;
+
+	delete b;
+}
+
+bool backend_writeback::begin()
+{
+	if (b->begin() == false)
+		return false;
+
+	DOLOG(logging::ll_info, "backend_writeback::begin", identifier, "%zu blocks, write back after %" PRIu64 " ms or above %zu dirty blocks", max_blocks, max_age_us / 1000, dirty_limit);
+
+	flusher = new std::thread(&backend_writeback::flusher_thread, this);
+
+	return true;
+}
+
+std::string backend_writeback::get_serial() const
+{
+	return b->get_serial();
+}
+
+uint64_t backend_writeback::get_size_in_blocks() const
+{
+	return b->get_size_in_blocks();
+}
+
+uint64_t backend_writeback::get_block_size() const
+{
+	return block_size;
+}
+
+uint8_t backend_writeback::get_free_space_percentage()
+{
+	return b->get_free_space_percentage();
+}
+
+uint32_t backend_writeback::get_discard_granularity() const
+{
+	return b->get_discard_granularity();
+}
+
+void backend_writeback::flusher_thread()
+{
+	const auto interval = std::chrono::microseconds(std::max(max_age_us / 4, uint64_t(10000)));
+
+	while(stop_flag == false) {
+		{
+			std::unique_lock<std::mutex> lck(lock);
+			if ((dirty.size() <= dirty_limit && n_waiting == 0) || flush_failed)
+				flusher_cv.wait_for(lck, interval);
+		}
+
+		if (stop_flag)
+			break;
+
+		flush_background();
+	}
+}
+
+// may only be called with 'lock' held
+// runs of adjacent dirty blocks, 'ages' receives the dirty_since of the oldest block in each run
+std::vector<std::pair<uint64_t, uint32_t> > backend_writeback::get_runs(std::vector<uint64_t> *const ages)
+{
+	constexpr const uint32_t max_run = 1024;  // blocks
+	std::vector<std::pair<uint64_t, uint32_t> > runs;
+
+	for(auto & e: dirty) {
+		if (runs.empty() == false && runs.back().first + runs.back().second == e.first && runs.back().second < max_run) {
+			runs.back().second++;
+			if (ages)
+				ages->back() = std::min(ages->back(), e.second.dirty_since);
+		}
+		else {
+			runs.push_back({ e.first, 1 });
+			if (ages)
+				ages->push_back(e.second.dirty_since);
+		}
+	}
+
+	return runs;
+}
+
+// may only be called with 'lock' held
+void backend_writeback::drop(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	auto it = dirty.lower_bound(block_nr);
+	while(it != dirty.end() && it->first < block_nr + n_blocks) {
+		delete [] it->second.data;
+		it = dirty.erase(it);
+	}
+}
+
+bool backend_writeback::flush_run(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	// collect what is dirty now (may have changed since the run was selected)
+	uint8_t *buffer = new uint8_t[n_blocks * block_size];
+	std::vector<std::pair<uint64_t, uint32_t> > parts;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		for(auto it = dirty.lower_bound(block_nr); it != dirty.end() && it->first < block_nr + n_blocks; it++) {
+			memcpy(&buffer[(it->first - block_nr) * block_size], it->second.data, block_size);
+
+			if (parts.empty() == false && parts.back().first + parts.back().second == it->first)
+				parts.back().second++;
+			else
+				parts.push_back({ it->first, 1 });
+		}
+	}
+
+	bool     ok    = true;
+	uint64_t start = get_micros();
+	for(auto & p: parts) {
+		if (b->write(p.first, p.second, &buffer[(p.first - block_nr) * block_size]) == false) {
+			DOLOG(logging::ll_error, "backend_writeback::flush_run", identifier, "failed to write back %u blocks at %" PRIu64, p.second, p.first);
+			ok = false;
+			break;
+		}
+	}
+	bs.io_wait += get_micros() - start;
+
+	delete [] buffer;
+
+	std::unique_lock<std::mutex> lck(lock);
+	flush_failed = !ok;
+	if (ok)
+		drop(block_nr, n_blocks);  // nothing can have been written in the mean time
+	space_cv.notify_all();
+
+	return ok;
+}
+
+bool backend_writeback::flush_all()
+{
+	std::unique_lock<std::mutex> lck_flush(flush_lock);
+
+	std::vector<std::pair<uint64_t, uint32_t> > runs;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		runs = get_runs(nullptr);
+	}
+
+	bool ok = true;
+	for(auto & r: runs)
+		ok &= flush_run(r.first, r.second);
+
+	return ok;
+}
+
+// writes back runs that are too old and, when there are too many dirty blocks, the oldest runs
+bool backend_writeback::flush_background()
+{
+	std::unique_lock<std::mutex> lck_flush(flush_lock);
+
+	std::vector<std::pair<uint64_t, uint32_t> > selected;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+
+		std::vector<uint64_t> ages;
+		auto runs = get_runs(&ages);
+
+		std::vector<size_t> order(runs.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&ages](const size_t a, const size_t b) { return ages[a] < ages[b]; });
+
+		uint64_t now     = get_micros();
+		size_t   n_dirty = dirty.size();
+		// writers waiting for space: make as much room as possible
+		size_t   target  = n_waiting ? 0 : (n_dirty > dirty_limit ? dirty_limit / 2 : n_dirty);
+
+		for(auto i: order) {
+			if (n_dirty <= target && ages[i] + max_age_us > now)
+				break;
+
+			selected.push_back(runs[i]);
+			n_dirty -= runs[i].second;
+		}
+	}
+
+	bool ok = true;
+	for(auto & r: selected)
+		ok &= flush_run(r.first, r.second);
+
+	return ok;
+}
+
+bool backend_writeback::sync()
+{
+	bs.n_syncs++;
+	ts_last_acces = get_micros();
+
+	bool ok = flush_all();
+	if (ok == false)
+		DOLOG(logging::ll_error, "backend_writeback::sync", identifier, "failed to write back dirty blocks");
+
+	return b->sync() && ok;
+}
+
+void backend_writeback::get_and_reset_stats(backend_stats_t *const target)
+{
+	backend::get_and_reset_stats(target);
+	merge_child_stats(b, target);
+}
+
+bool backend_writeback::write_through(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua)
+{
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	uint64_t start = get_micros();
+	bool     rc    = fua ? b->write_fua(block_nr, n_blocks, data) : b->write(block_nr, n_blocks, data);
+	bs.io_wait += get_micros() - start;
+
+	if (rc) {  // the cached copies are older
+		std::unique_lock<std::mutex> lck(lock);
+		drop(block_nr, n_blocks);
+		space_cv.notify_all();
+	}
+
+	return rc;
+}
+
+bool backend_writeback::write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::write", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	if (write_back == false || n_blocks > max_blocks)
+		return write_through(block_nr, n_blocks, data, false);
+
+	{
+		// wait without holding the range lock: the flusher may need it
+		// concurrent writers can make the cache overshoot a little
+		std::unique_lock<std::mutex> lck(lock);
+		while(dirty.size() + n_blocks > max_blocks && flush_failed == false && stop_flag == false) {
+			n_waiting++;
+			flusher_cv.notify_one();
+			space_cv.wait(lck);
+			n_waiting--;
+		}
+
+		if (dirty.size() + n_blocks > max_blocks) {
+			lck.unlock();
+			return write_through(block_nr, n_blocks, data, false);
+		}
+	}
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	uint64_t now = get_micros();
+
+	std::unique_lock<std::mutex> lck(lock);
+	for(uint32_t i=0; i<n_blocks; i++) {
+		auto & e = dirty[block_nr + i];
+		if (e.data == nullptr) {
+			e.data        = new uint8_t[block_size];
+			e.dirty_since = now;
+		}
+		memcpy(e.data, &data[i * block_size], block_size);
+	}
+
+	if (dirty.size() > dirty_limit)
+		flusher_cv.notify_one();
+
+	return true;
+}
+
+bool backend_writeback::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::write_fua", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return write_through(block_nr, n_blocks, data, true);
+}
+
+bool backend_writeback::trim(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::trim", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		drop(block_nr, n_blocks);
+		space_cv.notify_all();
+	}
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return b->trim(block_nr, n_blocks);
+}
+
+bool backend_writeback::trim_fua(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::trim_fua", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		drop(block_nr, n_blocks);
+		space_cv.notify_all();
+	}
+
+	ts_last_acces = get_micros();
+	bs.n_trims   += n_blocks;
+
+	return b->trim_fua(block_nr, n_blocks);
+}
+
+bool backend_writeback::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::write_zeroes", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		drop(block_nr, n_blocks);
+		space_cv.notify_all();
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return b->write_zeroes(block_nr, n_blocks);
+}
+
+bool backend_writeback::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::write_same", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		drop(block_nr, n_blocks);
+		space_cv.notify_all();
+	}
+
+	ts_last_acces     = get_micros();
+	bs.bytes_written += n_blocks * block_size;
+	bs.n_writes++;
+
+	return b->write_same(block_nr, n_blocks, pattern);
+}
+
+// caller must hold the range lock
+bool backend_writeback::read_overlay(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	uint32_t n_cached = 0;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		for(auto it = dirty.lower_bound(block_nr); it != dirty.end() && it->first < block_nr + n_blocks; it++)
+			n_cached++;
+
+		if (n_cached == n_blocks) {
+			for(uint32_t i=0; i<n_blocks; i++)
+				memcpy(&data[i * block_size], dirty.find(block_nr + i)->second.data, block_size);
+			return true;
+		}
+	}
+
+	uint64_t start = get_micros();
+	bool     rc    = b->read(block_nr, n_blocks, data);
+	bs.io_wait += get_micros() - start;
+	if (rc == false)
+		return false;
+
+	if (n_cached) {
+		std::unique_lock<std::mutex> lck(lock);
+		for(auto it = dirty.lower_bound(block_nr); it != dirty.end() && it->first < block_nr + n_blocks; it++)
+			memcpy(&data[(it->first - block_nr) * block_size], it->second.data, block_size);
+	}
+
+	return true;
+}
+
+bool backend_writeback::read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::read", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	bool rc = false;
+	{
+		range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_shared);
+		rc = read_overlay(block_nr, n_blocks, data);
+	}
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_blocks * block_size;
+	bs.n_reads++;
+
+	return rc;
+}
+
+backend::cmpwrite_result_t backend_writeback::cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare)
+{
+	DOLOG(logging::ll_debug, "backend_writeback::cmpwrite", identifier, "block %" PRIu64 ", %u blocks", block_nr, n_blocks);
+
+	size_t   n_bytes = n_blocks * block_size;
+	uint8_t *buffer  = new uint8_t[n_bytes];
+	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
+
+	range_lock_guard lck_range(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
+
+	if (read_overlay(block_nr, n_blocks, buffer) == false)
+		result = cmpwrite_result_t::CWR_READ_ERROR;
+	else if (memcmp(buffer, data_compare, n_bytes) != 0) {
+		DOLOG(logging::ll_debug, "backend_writeback::cmpwrite", identifier, "data does not match");
+		result = cmpwrite_result_t::CWR_MISMATCH;
+	}
+	else {
+		// written through: it is only a few blocks and waiting for cache space with the range lock held could deadlock
+		uint64_t start = get_micros();
+		bool     rc    = b->write(block_nr, n_blocks, data_write);
+		bs.io_wait += get_micros() - start;
+
+		if (rc) {
+			std::unique_lock<std::mutex> lck(lock);
+			drop(block_nr, n_blocks);
+			space_cv.notify_all();
+
+			bs.bytes_written += n_bytes;
+		}
+		else {
+			result = cmpwrite_result_t::CWR_WRITE_ERROR;
+		}
+	}
+
+	delete [] buffer;
+
+	ts_last_acces  = get_micros();
+	bs.bytes_read += n_bytes;
+	bs.n_reads++;
+	bs.n_writes++;
+
+	return result;
+}
+
+bool backend_writeback::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	return b->prefetch(block_nr, n_blocks, wait, fits);
+}
+
+bool backend_writeback::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	uint64_t next_cached = block_nr + max_n;
+	{
+		std::unique_lock<std::mutex> lck(lock);
+		auto it = dirty.lower_bound(block_nr);
+		if (it != dirty.end() && it->first == block_nr) {  // dirty blocks are mapped
+			uint64_t n = 0;
+			while(it != dirty.end() && it->first == block_nr + n && n < max_n)
+				it++, n++;
+
+			*status = LS_MAPPED;
+			*n_same = n;
+			return true;
+		}
+
+		if (it != dirty.end())
+			next_cached = std::min(next_cached, it->first);
+	}
+
+	return b->get_lba_status(block_nr, next_cached - block_nr, status, n_same);
+}
+
+bool backend_writeback::has_write_cache() const
+{
+	return true;
+}
+
+bool backend_writeback::get_write_cache() const
+{
+	return write_back;
+}
+
+bool backend_writeback::set_write_cache(const bool enable)
+{
+	DOLOG(logging::ll_info, "backend_writeback::set_write_cache", identifier, "write cache %s", enable ? "enabled" : "disabled");
+
+	write_back = enable;
+	if (enable == false)
+		return flush_all();
+
+	return true;
+}
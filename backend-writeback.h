@@ -0,0 +1,83 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "backend.h"
+
+
+// Keeps written blocks in RAM and writes them to the backend it wraps in
+// the background, merging adjacent blocks into large writes. A SYNCHRONIZE
+// CACHE flushes everything; FUA writes go straight to the backend.
+class backend_writeback : public backend
+{
+private:
+	struct dirty_block {
+		uint8_t *data        { nullptr };
+		uint64_t dirty_since { 0       };  // get_micros() of the first write since the last flush
+	};
+
+	backend *const   b              { nullptr };  // owned
+	const uint64_t   block_size     { 0       };
+	const size_t     max_blocks     { 0       };  // cache size
+	const uint64_t   max_age_us     { 0       };  // dirty blocks are written back after this
+	const size_t     dirty_limit    { 0       };  // start flushing (the oldest blocks) above this
+	std::atomic_bool write_back     { true    };  // WCE; false: write-through
+	std::atomic_bool stop_flag      { false   };
+
+	std::mutex       lock;  // protects the members below
+	std::map<uint64_t, dirty_block> dirty;
+	std::condition_variable flusher_cv;  // wakes up the flusher
+	std::condition_variable space_cv;  // blocks were written back
+	uint32_t         n_waiting      { 0       };  // writers waiting for space
+	bool             flush_failed   { false   };
+
+	std::mutex       flush_lock;  // one flush at a time
+	std::thread     *flusher        { nullptr };
+
+	void flusher_thread  ();
+	bool flush_run       (const uint64_t block_nr, const uint32_t n_blocks);
+	bool flush_all       ();
+	bool flush_background();
+	std::vector<std::pair<uint64_t, uint32_t> > get_runs(std::vector<uint64_t> *const ages);
+	void drop            (const uint64_t block_nr, const uint32_t n_blocks);
+	bool is_cached       (const uint64_t block_nr, const uint32_t n_blocks);
+	bool read_overlay    (const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data);
+	bool write_through   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua);
+
+public:
+	backend_writeback(backend *const b, const size_t cache_size, const uint32_t max_age_ms, const int dirty_ratio);
+	virtual ~backend_writeback();
+
+	bool begin() override;
+
+	std::string get_serial()         const override;
+	uint64_t    get_size_in_blocks() const override;
+	uint64_t    get_block_size()     const override;
+
+	uint8_t     get_free_space_percentage() override;
+	uint32_t    get_discard_granularity() const override;
+
+	bool sync() override;
+	void get_and_reset_stats(backend_stats_t *const target) override;
+
+	bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) override;
+	bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) override;
+	backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) override;
+
+	bool write_fua     (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override;
+	bool trim_fua      (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_zeroes  (const uint64_t block_nr, const uint32_t n_blocks) override;
+	bool write_same    (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern) override;
+	bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same) override;
+	bool prefetch      (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits) override;
+
+	bool has_write_cache() const override;
+	bool get_write_cache() const override;
+	bool set_write_cache(const bool enable) override;
+};
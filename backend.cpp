@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cstring>
 
 #include "backend.h"
@@ -15,12 +16,39 @@ backend::~backend()
 {
 }
 
+void add_backend_stats(backend_stats_t *const target, const backend_stats_t & add)
+{
+	target->bytes_read        += add.bytes_read;
+	target->n_reads           += add.n_reads;
+	target->bytes_written     += add.bytes_written;
+	target->n_writes          += add.n_writes;
+	target->n_syncs           += add.n_syncs;
+	target->n_trims           += add.n_trims;
+	target->n_cache_hits      += add.n_cache_hits;
+	target->n_cache_misses    += add.n_cache_misses;
+	target->n_cache_evictions += add.n_cache_evictions;
+	target->io_wait           += add.io_wait;
+	target->io_wait_ticks     += add.io_wait_ticks;
+}
+
 void backend::get_and_reset_stats(backend_stats_t *const target)
 {
 	memcpy(target, &bs, sizeof bs);
 	memset(&bs, 0x00, sizeof bs);
 }
 
+// the I/O counters of the top layer are those of the LUN, the cache
+// counters come from the layer that has the cache
+void backend::merge_child_stats(backend *const child, backend_stats_t *const target)
+{
+	backend_stats_t cs { };
+	child->get_and_reset_stats(&cs);
+
+	target->n_cache_hits      += cs.n_cache_hits;
+	target->n_cache_misses    += cs.n_cache_misses;
+	target->n_cache_evictions += cs.n_cache_evictions;
+}
+
 std::pair<uint64_t, uint32_t> backend::get_idle_state()
 {
 	return { ts_last_acces, 500000 };
@@ -37,7 +65,6 @@ uint8_t backend::get_free_space_percentage()
 		return 0;
 
 	uint8_t  *buffer = new uint8_t[block_size]();
-	uint8_t  *empty  = new uint8_t[block_size]();
 
 	for(int i=0; i<100; i++) {
 		uint64_t block_nr = 0;
@@ -57,39 +84,130 @@ uint8_t backend::get_free_space_percentage()
 			break;
 		}
 
-		if (memcmp(buffer, empty, block_size) == 0)
+		if (is_zero(buffer, block_size))
 			empty_count++;
 	}
 
 	delete [] buffer;
-	delete [] empty;
 
 	return empty_count;
 }
 
-std::set<size_t> backend::lock_range(const uint64_t block_nr, const uint32_t block_n)
+uint32_t backend::get_discard_granularity() const
+{
+	return 1;
+}
+
+bool backend::trim_reads_zeroes() const
+{
+	return false;
+}
+
+bool backend::write_fua(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
 {
-#if defined(ARDUINO) || defined(TEENSY4_1) || defined(RP2040W)
-	return { };  // no-op
+	return write(block_nr, n_blocks, data) && sync();
+}
+
+bool backend::trim_fua(const uint64_t block_nr, const uint32_t n_blocks)
+{
+	return trim(block_nr, n_blocks) && sync();
+}
+
+bool backend::write_zeroes(const uint64_t block_nr, const uint32_t n_blocks)
+{
+#if defined(ARDUINO)
+	constexpr const uint32_t max_chunk_n = 2;
 #else
-	std::set<size_t> indexes;
+	constexpr const uint32_t max_chunk_n = 256;
+#endif
+	uint32_t chunk_n = std::min(n_blocks, max_chunk_n);
+	uint8_t *zero    = new uint8_t[chunk_n * get_block_size()]();
+	bool     ok      = true;
+
+	for(uint32_t i=0; i<n_blocks && ok; i += chunk_n)
+		ok = write(block_nr + i, std::min(chunk_n, n_blocks - i), zero);
 
-	for(uint64_t i=block_nr; i<block_nr + block_n; i++)
-		indexes.insert(size_t((i * LOCK_SPREADER) % N_BACKEND_LOCKS));
+	delete [] zero;
 
-	for(auto nr: indexes)
-		locks[nr].lock();
+	return ok;
+}
 
-	return indexes;
+bool backend::write_same(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern)
+{
+#if defined(ARDUINO)
+	constexpr const uint32_t max_chunk_n = 2;
+#else
+	constexpr const uint32_t max_chunk_n = 256;
 #endif
+	auto     block_size = get_block_size();
+	uint32_t chunk_n    = std::min(n_blocks, max_chunk_n);
+	uint8_t *buffer     = new uint8_t[chunk_n * block_size];
+	bool     ok         = true;
+
+	for(uint32_t i=0; i<chunk_n; i++)
+		memcpy(&buffer[i * block_size], pattern, block_size);
+
+	for(uint32_t i=0; i<n_blocks && ok; i += chunk_n)
+		ok = write(block_nr + i, std::min(chunk_n, n_blocks - i), buffer);
+
+	delete [] buffer;
+
+	return ok;
 }
 
-void backend::unlock_range(const std::set<size_t> & locked_locks)
+bool backend::copy(const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks)
 {
-#if defined(ARDUINO) || defined(TEENSY4_1) || defined(RP2040W)
-	// no-op
+#if defined(ARDUINO)
+	constexpr const uint32_t max_chunk_n = 2;
 #else
-	for(auto nr: locked_locks)
-		locks[nr].unlock();
+	constexpr const uint32_t max_chunk_n = 256;
 #endif
+	uint32_t chunk_n   = std::min(n_blocks, max_chunk_n);
+	uint8_t *buffer    = new uint8_t[chunk_n * get_block_size()];
+	bool     ok        = true;
+	// when the destination overlaps the end of the source, start at the end so
+	// that no block is overwritten before it was copied
+	bool     backwards = dst_block_nr > src_block_nr && dst_block_nr - src_block_nr < n_blocks;
+
+	for(uint32_t i=0; i<n_blocks && ok;) {
+		uint32_t current_n = std::min(chunk_n, n_blocks - i);
+		uint32_t offset    = backwards ? n_blocks - i - current_n : i;
+
+		ok = read(src_block_nr + offset, current_n, buffer) && write(dst_block_nr + offset, current_n, buffer);
+		i += current_n;
+	}
+
+	delete [] buffer;
+
+	return ok;
+}
+
+bool backend::prefetch(const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	*fits = false;
+
+	return true;
+}
+
+bool backend::get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same)
+{
+	*status = LS_MAPPED;
+	*n_same = max_n;
+
+	return true;
+}
+
+bool backend::has_write_cache() const
+{
+	return false;
+}
+
+bool backend::get_write_cache() const
+{
+	return false;
+}
+
+bool backend::set_write_cache(const bool enable)
+{
+	return enable == false;
 }
@@ -1,20 +1,12 @@
 #pragma once
 #include <cstdint>
 #if !(defined(ARDUINO) || defined(TEENSY4_1))
-#include <array>
 #include <mutex>
 #endif
-#include <set>
 #include <string>
 
+#include "range-lock.h"
 
-#if defined(ESP32)
-#define N_BACKEND_LOCKS 4
-#define LOCK_SPREADER 3
-#else
-#define N_BACKEND_LOCKS 131
-#define LOCK_SPREADER 31
-#endif
 
 struct backend_stats_t {
 	uint64_t bytes_read;
@@ -23,10 +15,15 @@ struct backend_stats_t {
 	uint64_t n_writes;
 	uint64_t n_syncs;
 	uint64_t n_trims;
+	uint64_t n_cache_hits;  // blocks, backend_readcache
+	uint64_t n_cache_misses;
+	uint64_t n_cache_evictions;
 	uint32_t io_wait;  // total, in uS
 	uint32_t io_wait_ticks;  // updated by maintenance_thread
 };
 
+void add_backend_stats(backend_stats_t *const target, const backend_stats_t & add);
+
 class backend
 {
 protected:
@@ -34,12 +31,9 @@ protected:
 	backend_stats_t   bs            {   };
 	uint64_t          ts_last_acces { 0 };
 
-#if !(defined(ARDUINO) || defined(TEENSY4_1) || defined(RP2040W))
-	std::array<std::mutex, N_BACKEND_LOCKS> locks;
-#endif
+	range_lock        locks;
 
-	std::set<size_t> lock_range  (const uint64_t block_nr, const uint32_t block_n);
-	void             unlock_range(const std::set<size_t> & locked_locks);
+	void merge_child_stats(backend *const child, backend_stats_t *const target);
 
 public:
 	backend(const std::string & identifier);
@@ -53,17 +47,46 @@ public:
 
 	// mainly for thin provisioning
 	virtual uint8_t     get_free_space_percentage();
+	// trims of whole units of this many blocks (aligned) free the most space (default: 1)
+	virtual uint32_t    get_discard_granularity() const;
+	// trimmed blocks read as zeroes afterwards (default: not guaranteed)
+	virtual bool        trim_reads_zeroes() const;
 
 	virtual std::pair<uint64_t, uint32_t> get_idle_state();
 
 	virtual bool        sync() = 0;
 
-	void                get_and_reset_stats(backend_stats_t *const target);
+	// layers that wrap another backend also collect (and reset) its cache counters
+	virtual void        get_and_reset_stats(backend_stats_t *const target);
 
 	enum cmpwrite_result_t { CWR_OK, CWR_MISMATCH, CWR_READ_ERROR, CWR_WRITE_ERROR };
+	// values as in the SBC "PROVISIONING STATUS" field of GET LBA STATUS
+	enum lba_status_t { LS_MAPPED = 0, LS_DEALLOCATED = 1 };
 
 	virtual bool write   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) = 0;
 	virtual bool trim    (const uint64_t block_nr, const uint32_t n_blocks                           ) = 0;
 	virtual bool read    (const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data) = 0;
 	virtual backend::cmpwrite_result_t cmpwrite(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data_write, const uint8_t *const data_compare) = 0;
+
+	// the following have a generic implementation that backends can replace by something more efficient
+	// write that is on stable storage when it returns (default: write() + sync())
+	virtual bool write_fua   (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data);
+	// trim that is on stable storage when it returns (default: trim() + sync())
+	virtual bool trim_fua    (const uint64_t block_nr, const uint32_t n_blocks);
+	// (default: write() of a zero-filled buffer)
+	virtual bool write_zeroes(const uint64_t block_nr, const uint32_t n_blocks);
+	// 'pattern' (one block) written to each block of the range (default: write() of a buffer with repeated copies)
+	virtual bool write_same  (const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern);
+	// status of block_nr and how many blocks (at most max_n) after it (including block_nr) have the same status (default: everything is mapped)
+	virtual bool get_lba_status(const uint64_t block_nr, const uint64_t max_n, lba_status_t *const status, uint64_t *const n_same);
+	// copies n_blocks from src_block_nr to dst_block_nr, the ranges may overlap (default: read() + write() in chunks)
+	virtual bool copy        (const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks);
+	// bring the range into a cache; 'wait' = false: may return before that is done. 'fits' is set
+	// when the whole range will be in the cache (default: no cache, nothing happens)
+	virtual bool prefetch    (const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits);
+
+	// volatile write cache, the WCE bit of the caching mode page (default: none)
+	virtual bool has_write_cache() const;  // can be switched on/off
+	virtual bool get_write_cache() const;
+	virtual bool set_write_cache(const bool enable);
 };
@@ -105,7 +105,7 @@ com_client *com_sockets::accept()
 #if !defined(__MINGW32__)
 	for(;;) {
 		int rc = poll(fds, 1, 100);
-		if (rc == -1) {
+		if (rc == -1 && errno != EINTR) {  // EINTR: e.g. SIGUSR1 for a snapshot
 			DOLOG(logging::ll_error, "com_sockets::accept", get_local_address(), "poll failed with error %s", strerror(errno));
 			return nullptr;
 		}
@@ -141,6 +141,8 @@ com_client_sockets::~com_client_sockets()
 
 bool com_client_sockets::send(const uint8_t *const from, const size_t n)
 {
+	std::unique_lock lck(send_lock);
+
 #if defined(__MINGW32__)
 	size_t offset = 0;
 	size_t todo   = n;
@@ -183,7 +185,7 @@ bool com_client_sockets::recv(uint8_t *const to, const size_t n)
 		int rc = 1;  // uggly hack
 #else
 		int rc = poll(fds, 1, 100);
-		if (rc == -1) {
+		if (rc == -1 && errno != EINTR) {
 			DOLOG(logging::ll_error, "com_client_sockets::recv", get_endpoint_name(), "poll failed with error %s", strerror(errno));
 			return false;
 		}
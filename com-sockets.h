@@ -1,3 +1,5 @@
+#include <mutex>
+
 #include "com.h"
 #include "utils.h"
 
@@ -6,6 +8,7 @@ class com_client_sockets : public com_client
 {
 private:
 	const int               fd   { -1      };
+	std::mutex              send_lock;  // PDUs of several LUNs may be sent concurrently
 
 public:
 	com_client_sockets(const int fd, std::atomic_bool *const stop);
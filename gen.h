@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 
 #define DEFAULT_SERIAL "12345678"
@@ -13,16 +14,21 @@ struct data_descriptor {
 	uint32_t n_sectors;
 };
 
+// atomic: with multiple LUNs, the worker threads of a session update these
+// while the session thread reports and resets them
 struct io_stats_t {
-	uint64_t n_reads        { 0 };
-	uint64_t bytes_read     { 0 };
-	uint64_t n_writes       { 0 };
-	uint64_t bytes_written  { 0 };
-	uint64_t n_syncs        { 0 };
-	uint64_t blocks_trimmed { 0 };
+	std::atomic_uint64_t n_reads        { 0 };
+	std::atomic_uint64_t bytes_read     { 0 };
+	std::atomic_uint64_t n_writes       { 0 };
+	std::atomic_uint64_t bytes_written  { 0 };
+	std::atomic_uint64_t n_syncs        { 0 };
+	std::atomic_uint64_t blocks_trimmed { 0 };
 	// 1.3.6.1.4.1.2021.11.54: "The number of 'ticks' (typically 1/100s) spent waiting for IO."
 	// https://www.circitor.fr/Mibs/Html/U/UCD-SNMP-MIB.php#ssCpuRawWait
-	uint64_t io_wait        { 0 };
+	std::atomic_uint64_t io_wait        { 0 };
+	std::atomic_uint64_t n_cmpwrites    { 0 };  // COMPARE AND WRITE (ATS)
+	std::atomic_uint64_t cmpwrite_us    { 0 };  // total latency of those, in uS
+	std::atomic_uint64_t readahead_blks { 0 };  // blocks read ahead by the stream detector
 
 	io_stats_t() {
 	}
@@ -31,13 +37,17 @@ struct io_stats_t {
 		return n_reads + n_writes;
 	}
 
-	void reset() {
-		n_reads        = 0;
-		bytes_read     = 0;
-		n_writes       = 0;
-		bytes_written  = 0;
-		n_syncs        = 0;
-		blocks_trimmed = 0;
-		io_wait        = 0;
+	// moves the counters to 'target': what is counted meanwhile is not lost
+	void get_and_reset(io_stats_t *const target) {
+		target->n_reads        = n_reads       .exchange(0);
+		target->bytes_read     = bytes_read    .exchange(0);
+		target->n_writes       = n_writes      .exchange(0);
+		target->bytes_written  = bytes_written .exchange(0);
+		target->n_syncs        = n_syncs       .exchange(0);
+		target->blocks_trimmed = blocks_trimmed.exchange(0);
+		target->io_wait        = io_wait       .exchange(0);
+		target->n_cmpwrites    = n_cmpwrites   .exchange(0);
+		target->cmpwrite_us    = cmpwrite_us   .exchange(0);
+		target->readahead_blks = readahead_blks.exchange(0);
 	}
 };
@@ -0,0 +1,87 @@
+// throughput of the GF(2^8) kernels used by backend_erasure
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "gf256.h"
+
+
+static double now()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char *argv[])
+{
+	size_t chunk_size = argc >= 2 ? atoi(argv[1]) * 1024 : 64 * 1024;
+	int    k          = argc >= 3 ? atoi(argv[2]) : 4;
+	int    m          = argc >= 4 ? atoi(argv[3]) : 2;
+	double duration   = 1.;
+
+	if (chunk_size == 0 || k < 1 || m < 1 || k + m > 255) {
+		fprintf(stderr, "usage: %s [chunk-size-kB [k [m]]]\n", argv[0]);
+		return 1;
+	}
+
+	std::mt19937 g(1);
+
+	std::vector<std::vector<uint8_t> > data(k, std::vector<uint8_t>(chunk_size));
+	for(auto & d: data) {
+		for(auto & b: d)
+			b = g();
+	}
+
+	std::vector<uint8_t> reference(chunk_size);
+	std::vector<uint8_t> out(chunk_size);
+
+	gf_set_kernel("scalar");
+	gf_mul_region(0x8e, data[0].data(), reference.data(), chunk_size, false);
+	gf_mul_region(0x35, data[1 % k].data(), reference.data(), chunk_size, true);
+
+	printf("chunk size: %zu kB, %d data + %d parity chunks\n", chunk_size / 1024, k, m);
+
+	for(auto & name: gf_get_kernels()) {
+		gf_set_kernel(name);
+
+		gf_mul_region(0x8e, data[0].data(), out.data(), chunk_size, false);
+		gf_mul_region(0x35, data[1 % k].data(), out.data(), chunk_size, true);
+		bool ok = out == reference;
+
+		// multiply-accumulate of one region
+		uint64_t n     = 0;
+		double   start = now();
+		double   took  = 0.;
+		do {
+			for(int i=0; i<64; i++)
+				gf_mul_region(0x53 + i, data[0].data(), out.data(), chunk_size, true);
+			n += 64;
+			took = now() - start;
+		}
+		while(took < duration);
+		double mul_rate = n * chunk_size / took / 1048576.;
+
+		// encoding of full stripes: m parity chunks from k data chunks
+		n     = 0;
+		start = now();
+		do {
+			for(int p=0; p<m; p++) {
+				for(int c=0; c<k; c++) {
+					// 1...255: with many chunks 0x11 + p * k + c would wrap, to 0 even
+					uint8_t coef = 1 + (0x10 + p * k + c) % 255;
+					gf_mul_region(coef, data[c].data(), out.data(), chunk_size, c > 0);
+				}
+			}
+			n++;
+			took = now() - start;
+		}
+		while(took < duration);
+		double enc_rate = n * chunk_size * k / took / 1048576.;
+
+		printf("%-8s %s  multiply-add: %9.1f MB/s  encode: %9.1f MB/s (of data)\n", name.c_str(), ok ? "ok    " : "WRONG!", mul_rate, enc_rate);
+	}
+
+	return 0;
+}
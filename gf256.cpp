@@ -0,0 +1,226 @@
+#include <atomic>
+#include <cstring>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define GF_X86
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define GF_NEON
+#endif
+
+#include "gf256.h"
+
+
+namespace {
+
+// c * x = lo[x & 15] ^ hi[x >> 4]: two 16 byte tables per constant, these
+// fit in one (PSHUFB/TBL) register each
+struct gf_tables {
+	uint8_t exp[512];
+	uint8_t log[256];
+	alignas(32) uint8_t lo[256][16];
+	alignas(32) uint8_t hi[256][16];
+
+	gf_tables() {
+		unsigned x = 1;
+		for(int i=0; i<255; i++) {
+			exp[i] = exp[i + 255] = x;
+			log[x] = i;
+			x <<= 1;
+			if (x & 0x100)
+				x ^= 0x11d;
+		}
+		exp[510] = exp[511] = 0;
+		log[0]   = 0;
+
+		for(int c=0; c<256; c++) {
+			for(int n=0; n<16; n++) {
+				lo[c][n] = mul(c, n);
+				hi[c][n] = mul(c, n << 4);
+			}
+		}
+	}
+
+	uint8_t mul(const uint8_t a, const uint8_t b) const {
+		if (a == 0 || b == 0)
+			return 0;
+		return exp[log[a] + log[b]];
+	}
+};
+
+const gf_tables & tables()
+{
+	static const gf_tables t;
+	return t;
+}
+
+typedef void (*gf_kernel_t)(const uint8_t *const lo, const uint8_t *const hi, const uint8_t *const src, uint8_t *const dst, const size_t n, const bool add);
+
+void mul_scalar(const uint8_t *const lo, const uint8_t *const hi, const uint8_t *const src, uint8_t *const dst, const size_t n, const bool add)
+{
+	uint8_t t[256];
+	for(int i=0; i<256; i++)
+		t[i] = lo[i & 15] ^ hi[i >> 4];
+
+	if (add) {
+		for(size_t i=0; i<n; i++)
+			dst[i] ^= t[src[i]];
+	}
+	else {
+		for(size_t i=0; i<n; i++)
+			dst[i] = t[src[i]];
+	}
+}
+
+#if defined(GF_X86)
+__attribute__((target("ssse3")))
+void mul_ssse3(const uint8_t *const lo, const uint8_t *const hi, const uint8_t *const src, uint8_t *const dst, const size_t n, const bool add)
+{
+	const __m128i tl   = _mm_loadu_si128(reinterpret_cast<const __m128i *>(lo));
+	const __m128i th   = _mm_loadu_si128(reinterpret_cast<const __m128i *>(hi));
+	const __m128i mask = _mm_set1_epi8(0x0f);
+
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		__m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&src[i]));
+		__m128i l = _mm_and_si128(s, mask);
+		__m128i h = _mm_and_si128(_mm_srli_epi64(s, 4), mask);
+		__m128i p = _mm_xor_si128(_mm_shuffle_epi8(tl, l), _mm_shuffle_epi8(th, h));
+		if (add)
+			p = _mm_xor_si128(p, _mm_loadu_si128(reinterpret_cast<const __m128i *>(&dst[i])));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&dst[i]), p);
+	}
+
+	mul_scalar(lo, hi, &src[i], &dst[i], n - i, add);
+}
+
+__attribute__((target("avx2")))
+void mul_avx2(const uint8_t *const lo, const uint8_t *const hi, const uint8_t *const src, uint8_t *const dst, const size_t n, const bool add)
+{
+	const __m256i tl   = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(lo)));
+	const __m256i th   = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(hi)));
+	const __m256i mask = _mm256_set1_epi8(0x0f);
+
+	size_t i = 0;
+	for(; i + 32 <= n; i += 32) {
+		__m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&src[i]));
+		__m256i l = _mm256_and_si256(s, mask);
+		__m256i h = _mm256_and_si256(_mm256_srli_epi64(s, 4), mask);
+		__m256i p = _mm256_xor_si256(_mm256_shuffle_epi8(tl, l), _mm256_shuffle_epi8(th, h));
+		if (add)
+			p = _mm256_xor_si256(p, _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&dst[i])));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(&dst[i]), p);
+	}
+
+	mul_scalar(lo, hi, &src[i], &dst[i], n - i, add);
+}
+#elif defined(GF_NEON)
+void mul_neon(const uint8_t *const lo, const uint8_t *const hi, const uint8_t *const src, uint8_t *const dst, const size_t n, const bool add)
+{
+	const uint8x16_t tl   = vld1q_u8(lo);
+	const uint8x16_t th   = vld1q_u8(hi);
+	const uint8x16_t mask = vdupq_n_u8(0x0f);
+
+	size_t i = 0;
+	for(; i + 16 <= n; i += 16) {
+		uint8x16_t s = vld1q_u8(&src[i]);
+		uint8x16_t p = veorq_u8(vqtbl1q_u8(tl, vandq_u8(s, mask)), vqtbl1q_u8(th, vshrq_n_u8(s, 4)));
+		if (add)
+			p = veorq_u8(p, vld1q_u8(&dst[i]));
+		vst1q_u8(&dst[i], p);
+	}
+
+	mul_scalar(lo, hi, &src[i], &dst[i], n - i, add);
+}
+#endif
+
+struct kernel {
+	const char *name;
+	gf_kernel_t f;
+	bool      (*supported)();
+};
+
+const kernel kernels[] {
+	{ "scalar", mul_scalar, [] { return true; } },
+#if defined(GF_X86)
+	{ "ssse3",  mul_ssse3,  [] { __builtin_cpu_init(); return __builtin_cpu_supports("ssse3") != 0; } },
+	{ "avx2",   mul_avx2,   [] { __builtin_cpu_init(); return __builtin_cpu_supports("avx2")  != 0; } },
+#elif defined(GF_NEON)
+	{ "neon",   mul_neon,   [] { return true; } },
+#endif
+};
+
+const kernel *select_kernel()
+{
+	const kernel *best = &kernels[0];
+	for(auto & k: kernels) {
+		if (k.supported())
+			best = &k;
+	}
+
+	return best;
+}
+
+std::atomic<const kernel *> & current()
+{
+	static std::atomic<const kernel *> k { select_kernel() };
+	return k;
+}
+
+}
+
+uint8_t gf_mul(const uint8_t a, const uint8_t b)
+{
+	return tables().mul(a, b);
+}
+
+uint8_t gf_inv(const uint8_t a)
+{
+	const gf_tables & t = tables();
+	return t.exp[255 - t.log[a]];
+}
+
+void gf_mul_region(const uint8_t c, const uint8_t *const src, uint8_t *const dst, const size_t n, const bool add)
+{
+	if (c == 0) {
+		if (add == false)
+			memset(dst, 0x00, n);
+		return;
+	}
+
+	if (c == 1 && add == false) {
+		memcpy(dst, src, n);
+		return;
+	}
+
+	const gf_tables & t = tables();
+	current().load(std::memory_order_relaxed)->f(t.lo[c], t.hi[c], src, dst, n, add);
+}
+
+std::vector<std::string> gf_get_kernels()
+{
+	std::vector<std::string> out;
+	for(auto & k: kernels) {
+		if (k.supported())
+			out.push_back(k.name);
+	}
+
+	return out;
+}
+
+std::string gf_get_kernel()
+{
+	return current().load()->name;
+}
+
+bool gf_set_kernel(const std::string & name)
+{
+	for(auto & k: kernels) {
+		if (k.name == name && k.supported()) {
+			current() = &k;
+			return true;
+		}
+	}
+
+	return false;
+}
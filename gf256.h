@@ -0,0 +1,21 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+// arithmetic in GF(2^8) (polynomial 0x11d) for the Reed-Solomon code of
+// backend_erasure
+
+uint8_t gf_mul(const uint8_t a, const uint8_t b);
+uint8_t gf_inv(const uint8_t a);  // a != 0
+
+// dst = c * src or, when 'add', dst ^= c * src; uses the fastest kernel
+// this CPU supports (SSSE3/AVX2 PSHUFB or NEON TBL nibble lookups)
+void gf_mul_region(const uint8_t c, const uint8_t *const src, uint8_t *const dst, const size_t n, const bool add);
+
+// for benchmarking/testing: the kernels this CPU can run, fastest last
+std::vector<std::string> gf_get_kernels();
+std::string gf_get_kernel();
+bool gf_set_kernel(const std::string & name);
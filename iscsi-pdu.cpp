@@ -7,6 +7,7 @@
 #include "log.h"
 #include "random.h"
 #include "scsi.h"
+#include "target.h"
 #include "utils.h"
 
 
@@ -268,6 +269,8 @@ bool iscsi_pdu_login_request::set_data(const std::pair<const uint8_t *, size_t>
 			max_seg_len = std::min(max_seg_len, uint32_t(std::stoi(parts[1])));
 		else if (parts[0] == "InitiatorName")
 			initiator = parts[1];
+		else if (parts[0] == "TargetName")
+			target_name = parts[1];
 		else if (parts[0] == "HeaderDigest")
 			ses->set_header_digest(has_CRC32C(parts[1]));
 		else if (parts[0] == "DataDigest")
@@ -318,7 +321,14 @@ bool iscsi_pdu_login_reply::set(const iscsi_pdu_login_request & reply_to)
 {
 	bool discovery = reply_to.get_NSG() == 1;
 
-	if (discovery) {
+	// only the first login PDU of a session names the target
+	auto target_name = reply_to.get_target_name();
+	bool not_found   = target_name.has_value() && ses->select_target(target_name.value()) == false;
+
+	if (not_found) {
+		DOLOG(logging::ll_info, "iscsi_pdu_login_reply::set", ses->get_endpoint_name(), "target \"%s\" not found", target_name.value().c_str());
+	}
+	else if (discovery) {
 		DOLOG(logging::ll_debug, "iscsi_pdu_login_reply::set", ses->get_endpoint_name(), "discovery mode, CSG %d, NSG %d", reply_to.get_CSG(), reply_to.get_NSG());
 
 		const std::vector<std::string> kvs {
@@ -357,10 +367,10 @@ bool iscsi_pdu_login_reply::set(const iscsi_pdu_login_request & reply_to)
 	set_bits(&login_reply->b1, 6, 1, false);  // filler 0
 	set_bits(&login_reply->b1, 0, 6, o_login_resp);  // opcode
 
-	set_bits(&login_reply->b2, 7, 1, true);  // T
+	set_bits(&login_reply->b2, 7, 1, !not_found);  // T
 	set_bits(&login_reply->b2, 6, 1, false);  // C
 	set_bits(&login_reply->b2, 2, 2, reply_to.get_CSG());  // CSG
-	set_bits(&login_reply->b2, 0, 2, reply_to.get_NSG());  // NSG
+	set_bits(&login_reply->b2, 0, 2, not_found ? 0 : reply_to.get_NSG());  // NSG
 
 	login_reply->versionmax = reply_to.get_versionmin();
 	login_reply->versionact = reply_to.get_versionmin();
@@ -368,7 +378,7 @@ bool iscsi_pdu_login_reply::set(const iscsi_pdu_login_request & reply_to)
 	login_reply->datalenM   = login_reply_reply_data.second >>  8;
 	login_reply->datalenL   = login_reply_reply_data.second      ;
 	memcpy(login_reply->ISID, reply_to.get_ISID(), 6);
-	if (reply_to.get_NSG() == 3) {
+	if (reply_to.get_NSG() == 3 && not_found == false) {
 		while(login_reply->TSIH == 0) {
 			if (my_getrandom(&login_reply->TSIH, sizeof login_reply->TSIH) == false) {
 				DOLOG(logging::ll_error, "iscsi_pdu_login_reply::set", ses->get_endpoint_name(), "random generator returned an error");
@@ -380,6 +390,10 @@ bool iscsi_pdu_login_reply::set(const iscsi_pdu_login_request & reply_to)
 	login_reply->StatSN     = my_HTONL(reply_to.get_CSG() == 0 ? 0 : 1);
 	login_reply->ExpCmdSN   = my_HTONL(reply_to.get_CmdSN());
 	login_reply->MaxCmdSN   = my_HTONL(reply_to.get_CmdSN() + 1);
+	if (not_found) {
+		login_reply->statuscls = 0x02;  // initiator error
+		login_reply->statusdet = 0x03;  // not found
+	}
 
 	return true;
 }
@@ -439,7 +453,7 @@ std::optional<iscsi_response_set> iscsi_pdu_scsi_cmd::get_response(scsi *const s
 	DOLOG(logging::ll_debug, "iscsi_pdu_scsi_cmd::get_response", ses->get_endpoint_name(), "working on ITT %08x for LUN %" PRIu64, get_Itasktag(), lun);
 
 	uint64_t iscsi_expected = get_ExpDatLen();
-	auto     scsi_reply     = sd->send(ses->get_io_stats(), lun, get_CDB(), 16, data);
+	auto     scsi_reply     = sd->send(ses->get_io_stats(lun), lun, get_CDB(), 16, data);
 	if (scsi_reply.has_value() == false) {
 		DOLOG(logging::ll_warning, "iscsi_pdu_scsi_cmd::get_response", ses->get_endpoint_name(), "scsi::send returned nothing");
 		return { };
@@ -473,6 +487,8 @@ std::optional<iscsi_response_set> iscsi_pdu_scsi_cmd::get_response(scsi *const s
 			auto & sense_data = scsi_reply.value().sense_data;
 			if (sense_data == sd->error_reservation_conflict_1())
 				iscsi_status = 0x18;  // RESERVATION CONFLICT
+			else if (sense_data.empty() && scsi_reply.value().condition_met)
+				iscsi_status = 0x04;  // CONDITION MET
 
 			if (temp->set(*this, sense_data, { }, iscsi_status) == false) {
 				ok = false;
@@ -488,6 +504,8 @@ std::optional<iscsi_response_set> iscsi_pdu_scsi_cmd::get_response(scsi *const s
 		bool     r2t_would_under_or_overflow = scsi_expected != iscsi_expected;
 
 		if (r2t_would_under_or_overflow) {
+			delete [] scsi_reply.value().r2t.gather;
+
 			auto *temp = new iscsi_pdu_scsi_response(ses) /* 0x21 */;
 
 			std::pair<residual, uint32_t> residual_state { };
@@ -616,6 +634,9 @@ bool iscsi_pdu_scsi_response::set(const iscsi_pdu_scsi_cmd & reply_to, const std
 		pdu_response_data.first[1] = sense_data_size;
 		memcpy(pdu_response_data.first + 2, scsi_sense_data.data(), sense_data_size);
 	}
+	else if (iscsi_status.has_value()) {
+		pdu_response->status = iscsi_status.value();
+	}
 
 	return true;
 }
@@ -699,7 +720,7 @@ std::vector<blob_t> iscsi_pdu_scsi_data_in::get() const
 		pdu_data_in->StatSN     = my_HTONL(reply_to_copy->get_ExpStatSN());
 		pdu_data_in->ExpCmdSN   = my_HTONL(reply_to_copy->get_CmdSN() + 1);
 		pdu_data_in->MaxCmdSN   = my_HTONL(reply_to_copy->get_CmdSN() + max_msg_depth);
-		pdu_data_in->DataSN     = my_HTONL(ses->get_inc_datasn(reply_to_copy->get_Itasktag()));
+		pdu_data_in->DataSN     = my_HTONL(ses->get_inc_datasn(reply_to_copy->get_Itasktag(), count == 0, last_block));
 		pdu_data_in->bufferoff  = my_HTONL(i);
 		pdu_data_in->ResidualCt = my_HTONL(use_pdu_data_size - i);
 
@@ -730,7 +751,7 @@ std::pair<blob_t, uint8_t *> iscsi_pdu_scsi_data_in::gen_data_in_pdu(session *co
 	pdu_data_in.StatSN     = my_HTONL(reply_to.get_ExpStatSN());
 	pdu_data_in.ExpCmdSN   = my_HTONL(reply_to.get_CmdSN() + 1);
 	pdu_data_in.MaxCmdSN   = my_HTONL(reply_to.get_CmdSN() + max_msg_depth);
-	pdu_data_in.DataSN     = my_HTONL(ses->get_inc_datasn(reply_to.get_Itasktag()));
+	pdu_data_in.DataSN     = my_HTONL(ses->get_inc_datasn(reply_to.get_Itasktag(), offset_in_data == 0, is_last_block));
 	pdu_data_in.bufferoff  = my_HTONL(offset_in_data);
 
 	if (has_residual.has_value()) {
@@ -950,23 +971,31 @@ bool iscsi_pdu_text_reply::set(const iscsi_pdu_text_request & reply_to, scsi *co
 		return false;
 	auto kvs_in = data_to_text_array(data.value().first, data.value().second);
 	bool send_targets = false;
+	std::optional<std::string> send_target;  // only this one, else all
 
 	for(const auto & kv: kvs_in) {
 		auto parts = split(kv, "=");
 		if (parts.size() < 2)
 			return false;
 
-		if (parts[0] == "SendTargets" && parts[1] == "All")
+		if (parts[0] == "SendTargets") {
 			send_targets = true;
+			if (parts[1] != "All")
+				send_target = parts[1];
+		}
 
 		DOLOG(logging::ll_debug, "iscsi_pdu_text_reply::set", ses->get_endpoint_name(), "text request, responding to: %s", kv.c_str());
 	}
 
 	if (send_targets) {
-		const std::vector<std::string> kvs {
-			"TargetName=" + ses->get_target_name(),
-			"TargetAddress=" + ses->get_local_address() + ",1",
-		};
+		std::vector<std::string> kvs;
+		for(auto & t: ses->get_targets()) {
+			if (send_target.has_value() && send_target.value() != t->get_name())
+				continue;
+
+			kvs.push_back("TargetName=" + t->get_name());
+			kvs.push_back("TargetAddress=" + ses->get_local_address() + ",1");
+		}
 		auto temp = text_array_to_data(kvs);
 		text_reply_reply_data.first  = temp.first;
 		text_reply_reply_data.second = temp.second;
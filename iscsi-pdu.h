@@ -122,7 +122,7 @@ public:
 	size_t           get_ahs_length()  const { return bhs->ahslen * 4;                                              }
 	bool             set_ahs_segment(std::pair<const uint8_t *, size_t> ahs_in);
 
-	uint64_t         get_LUN_nr()      const { return *reinterpret_cast<const uint64_t *>(bhs->lunfields);          }
+	uint64_t         get_LUN_nr()      const { return decode_lun(bhs->lunfields);                                   }
 
 	bool             get_I_flag()      const { return get_bits(bhs->b1, 6, 1);                                      }
 	iscsi_bhs_opcode get_opcode()      const { return iscsi_bhs_opcode(get_bits(bhs->b1, 0, 6));                    }
@@ -181,6 +181,7 @@ public:
 	__login_req__ *login_req __attribute__((packed)) { reinterpret_cast<__login_req__ *>(pdu_bytes) };
 
 	std::optional<std::string> initiator;
+	std::optional<std::string> target_name;  // not in discovery sessions
 
 public:
 	iscsi_pdu_login_request(session *const ses);
@@ -200,6 +201,7 @@ public:
 	      uint32_t get_Itasktag()   const { return login_req->Itasktag;     }
 	      uint32_t get_ExpStatSN()  const { return my_NTOHL(login_req->ExpStatSN); }
 	std::optional<std::string> get_initiator() const { return initiator;    }
+	std::optional<std::string> get_target_name() const { return target_name; }
 
 	virtual bool   set_data(const std::pair<const uint8_t *, size_t> & data_in) override;
 	virtual std::optional<iscsi_response_set> get_response(scsi *const sd) override;
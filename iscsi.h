@@ -28,8 +28,10 @@ struct r2t_session {
 	uint32_t bytes_done;
 	blob_t   PDU_initiator;
 	bool     is_write_same;  // receive 1 block, write 1 or more times
+	uint32_t write_same_n_blocks;  // how many times
 	bool     write_same_is_unmap;
 	bool     fua;
+	uint8_t *gather;  // collects all data before the command runs (COMPARE AND WRITE), nullptr when data-out is written right away
 };
 
 typedef enum
@@ -3,6 +3,8 @@
 #include <cstdio>
 #include <cstring>
 #include <getopt.h>
+#include <map>
+#include <memory>
 #include <unistd.h>
 #if !defined(__MINGW32__)
 #include <sys/resource.h>
@@ -11,13 +13,26 @@
 #include <ws2tcpip.h>
 #endif
 
+#include "backend-bitmap.h"
+#include "backend-cow.h"
+#include "backend-discard.h"
+#include "backend-erasure.h"
 #include "backend-file.h"
+#include "backend-golden.h"
+#include "backend-memory.h"
 #include "backend-nbd.h"
+#include "backend-null.h"
+#include "backend-readcache.h"
+#include "backend-mirror.h"
+#include "backend-stream.h"
+#include "backend-stripe.h"
+#include "backend-writeback.h"
 #include "com-sockets.h"
 #include "log.h"
 #include "random.h"
 #include "server.h"
 #include "snmp.h"
+#include "target.h"
 #include "utils.h"
 #include "snmp/snmp.h"
 
@@ -30,6 +45,14 @@ void sigh(int sig)
 	DOLOG(logging::ll_info, "sigh", "-", "stop signal received");
 }
 
+std::atomic_bool snapshot_wanted { false };
+
+// the snapshot itself is started by maintenance_thread after syncing the LUNs
+void sigh_snapshot(int sig)
+{
+	snapshot_wanted = true;
+}
+
 uint64_t get_cpu_usage_us()
 {
 #if !defined(__MINGW32__)
@@ -46,7 +69,8 @@ uint64_t get_cpu_usage_us()
 	return 0;
 }
 
-void maintenance_thread(backend *const b, backend_stats_t *const bs, std::atomic_bool *const stop, int *const cpu_usage, int *const ram_free_kb)
+// 'bs': the sum over all LUNs of the last second, 'lun_bs': per LUN, since the start
+void maintenance_thread(const std::vector<backend *> *const backends, backend_stats_t *const bs, std::vector<backend_stats_t> *const lun_bs, std::atomic_bool *const stop, int *const cpu_usage, int *const ram_free_kb)
 {
 	uint64_t prev_w_poll   = 0;
 
@@ -73,8 +97,28 @@ void maintenance_thread(backend *const b, backend_stats_t *const bs, std::atomic
 			prev_w_poll = now;
 		}
 
-		b->get_and_reset_stats(bs);
-		bs->io_wait_ticks = bs->io_wait * 10000;
+		// write the data that layers above the cow (e.g. -w) still have, so that
+		// everything written before the signal is in the snapshot
+		if (snapshot_wanted.exchange(false)) {
+			for(auto & b: *backends) {
+				if (b->sync() == false)
+					DOLOG(logging::ll_error, "maintenance_thread", "-", "sync before snapshot failed");
+			}
+
+			cow_snapshot_requests++;
+		}
+
+		backend_stats_t total { };
+		for(size_t i=0; i<backends->size(); i++) {
+			backend_stats_t cur { };
+			backends->at(i)->get_and_reset_stats(&cur);
+
+			add_backend_stats(&total, cur);
+			add_backend_stats(&lun_bs->at(i), cur);
+		}
+
+		total.io_wait_ticks = total.io_wait * 10000;
+		*bs = total;
 	}
 }
 
@@ -85,11 +129,81 @@ int get_diskspace(void *const context)
 	return bf->get_free_space_percentage();
 }
 
+// nbd://host[:port][/export], nbd+unix:///export?socket=path, nbd+unix://path
+// or (the old format) host:port
+static bool parse_nbd_address(const std::string & in, std::string *const host, int *const port, std::string *const unix_socket, std::string *const export_name)
+{
+	export_name->clear();
+	unix_socket->clear();
+
+	if (in.substr(0, 11) == "nbd+unix://") {
+		std::string rest = in.substr(11);
+		std::string::size_type query = rest.find("?socket=");
+		if (query == std::string::npos)
+			*unix_socket = rest;
+		else {
+			*unix_socket = rest.substr(query + 8);
+			*export_name = rest.substr(0, query);
+			if (export_name->empty() == false && (*export_name)[0] == '/')
+				*export_name = export_name->substr(1);
+		}
+
+		return unix_socket->empty() == false;
+	}
+
+	std::string rest = in;
+	bool        uri  = rest.substr(0, 6) == "nbd://";
+	if (uri)
+		rest = rest.substr(6);
+
+	std::string::size_type slash = uri ? rest.find("/") : std::string::npos;
+	if (slash != std::string::npos) {
+		*export_name = rest.substr(slash + 1);
+		rest         = rest.substr(0, slash);
+	}
+
+	std::string::size_type colon = rest.find(":");
+	if (colon == std::string::npos) {
+		if (uri == false)
+			return false;
+
+		*host = rest;
+		*port = 10809;  // IANA assigned
+	}
+	else {
+		*host = rest.substr(0, colon);
+		*port = atoi(rest.substr(colon + 1).c_str());
+	}
+
+	return host->empty() == false && *port > 0;
+}
+
 void help()
 {
-	printf("-b x    backend type: file (default) or nbd (e.g. iscsi -> nbd proxy)\n");
+	printf("-b x    backend type: file (default), nbd (e.g. iscsi -> nbd proxy), memory (RAM-disk), null (for benchmarking), stripe (RAID-0 over files), mirror (RAID-1 over files), erasure (Reed-Solomon over files), cow (copy-on-write overlay with snapshots over a file), clone (cow over a base file shared with other clones) or stream (local copy of an NBD image, fetched while in use)\n");
 	printf("-d x    device/file/host:port to serve (device/file: -b file, host:port: -b nbd)\n");
-	printf("-t x    target name\n");
+	printf("        -b and -d can be given multiple times: every -d is a LUN (1, 2, ... of its target, see -t) of the backend type of the -b at the same position\n");
+	printf("        (or the last -b); -a, -w, -r and -u apply to each of them\n");
+	printf("        -b nbd: nbd://host[:port][/export], nbd+unix://socket-path or host:port, optionally followed by \",connections\", \",max-requests-in-flight\" (per connection),\n");
+	printf("                \",request-timeout\" (in seconds, 0 = wait forever) and \",max-reconnect-interval\" (in milliseconds)\n");
+	printf("        -b memory: size in MB, optionally followed by \",hugepages\"\n");
+	printf("        -b null: size in MB, optionally followed by \",latency\" and \",jitter\" (both in microseconds)\n");
+	printf("        -b stripe: files/devices separated by '+', optionally followed by \",stripe-unit\" (in kB, default 64)\n");
+	printf("        -b mirror: files/devices separated by '+', optionally followed by \",quorum\" (legs that must have a write, 0 = all (default)), \",drl-file\" (dirty-region log, else in RAM only) and \",region\" (in kB, default 1024)\n");
+	printf("        -b erasure: files/devices separated by '+', optionally followed by \",parity\" (how many of them hold parity, default 1), \",chunk\" (in kB, default 64)\n");
+	printf("                and \",state-file\" (which children failed and must be rebuilt, else in RAM only)\n");
+	printf("        -b cow: base-file,overlay-file, optionally followed by \",cluster\" (in kB, default 64) and \",revert-to\" (snapshot to start on; newer ones are removed,\n");
+	printf("                0 = the base itself); send SIGUSR1 to take a snapshot of every cow LUN\n");
+	printf("        -b clone: as cow; all clones of the same base file share one read cache for it (that of -r, else one of 256 MB) and read each block of it only once\n");
+	printf("        -b stream: local-file,nbd://host[:port][/export] (or nbd+unix://...), optionally followed by \",chunk\" (in kB, default 256), \",readahead\" (in chunks, default 4)\n");
+	printf("                and \",rate\" (MB/s for copying the rest in the background, 0 = no limit (default)); which chunks are local is kept in local-file.present\n");
+	printf("-a x    keep track of which blocks are in use in file x, optionally followed by \",cluster-size\" (in blocks, default 1)\n");
+	printf("        and \",empty\" when the backend was never written to (else everything is considered to be in use at the start)\n");
+	printf("-w x    RAM write-back cache of x MB in front of the backend, optionally followed by \",max-age\" (in milliseconds, default 1000)\n");
+	printf("        and \",dirty-ratio\" (percentage of the cache above which it is written back, default 50); can be switched off with MODE SELECT\n");
+	printf("-r x    RAM read cache of x MB (shared by all sessions and LUNs)\n");
+	printf("-u x    complete UNMAP right away and discard in the background, at most x MB/s (0 = no limit)\n");
+	printf("-t x    target name; can be given multiple times: the -d's after a -t are the LUNs of that target (those before the first -t too)\n");
 	printf("-i x    IP-address of adapter to listen on\n");
 	printf("-p x    TCP-port to listen on\n");
 	printf("-T x    trim level (0=disable, 1=normal (default), 2=auto)\n");
@@ -111,6 +225,9 @@ int main(int argc, char *argv[])
 #endif
 	signal(SIGINT,  sigh);
 	signal(SIGTERM, sigh);
+#if !defined(__MINGW32__)
+	signal(SIGUSR1, sigh_snapshot);
+#endif
 
 #if defined(__MINGW32__)
 	WSADATA wsaData { };
@@ -121,24 +238,34 @@ int main(int argc, char *argv[])
 	}
 #endif
 
-	enum backend_type_t { BT_FILE, BT_NBD };
+	enum backend_type_t { BT_FILE, BT_NBD, BT_MEMORY, BT_NULL, BT_STRIPE, BT_MIRROR, BT_ERASURE, BT_COW, BT_CLONE, BT_STREAM };
 
 	bool           do_daemon  = false;
 	std::string    pid_file;
 	std::string    ip_address = "0.0.0.0";
 	int            port       = 3260;
-	std::string    dev        = FILENAME;
-	std::string    target_name= "test";
+	std::vector<std::string> devs;  // one per LUN
+	std::vector<size_t> dev_targets;  // index in 'target_names' of each LUN
+	std::vector<std::string> target_names;
 	int            trim_level = 1;
 	bool           use_snmp   = false;
 	int            snmp_port  = 161;
 	bool           digest_chk = true;
-	backend_type_t bt         = backend_type_t::BT_FILE;
+	std::vector<backend_type_t> bts;  // of each LUN
 	const char    *logfile    = "/tmp/iesp.log";
 	logging::log_level_t ll_screen = logging::ll_error;
 	logging::log_level_t ll_file   = logging::ll_error;
+	std::string    bm_file;  // allocation bitmap
+	uint32_t       bm_cluster = 1;
+	bool           bm_empty   = false;
+	size_t         wb_size    = 0;  // write-back cache (bytes)
+	uint32_t       wb_max_age = 1000;
+	int            wb_ratio   = 50;
+	size_t         rc_size    = 0;  // read cache (bytes)
+	bool           bg_discard = false;  // UNMAP in the background
+	uint64_t       bg_rate    = 0;  // bytes per second
 	int o = -1;
-	while((o = getopt(argc, argv, "P:fS:Db:d:i:p:T:t:L:l:h")) != -1) {
+	while((o = getopt(argc, argv, "P:fS:Db:d:i:p:T:t:L:l:a:w:r:u:h")) != -1) {
 		if (o == 'P')
 			pid_file = optarg;  // used for scripting
 		else if (o == 'f')
@@ -151,16 +278,34 @@ int main(int argc, char *argv[])
 			digest_chk = false;
 		else if (o == 'b') {
 			if (strcasecmp(optarg, "file") == 0)
-				bt = backend_type_t::BT_FILE;
+				bts.push_back(backend_type_t::BT_FILE);
 			else if (strcasecmp(optarg, "nbd") == 0)
-				bt = backend_type_t::BT_NBD;
+				bts.push_back(backend_type_t::BT_NBD);
+			else if (strcasecmp(optarg, "memory") == 0)
+				bts.push_back(backend_type_t::BT_MEMORY);
+			else if (strcasecmp(optarg, "null") == 0)
+				bts.push_back(backend_type_t::BT_NULL);
+			else if (strcasecmp(optarg, "stripe") == 0)
+				bts.push_back(backend_type_t::BT_STRIPE);
+			else if (strcasecmp(optarg, "mirror") == 0)
+				bts.push_back(backend_type_t::BT_MIRROR);
+			else if (strcasecmp(optarg, "erasure") == 0)
+				bts.push_back(backend_type_t::BT_ERASURE);
+			else if (strcasecmp(optarg, "cow") == 0)
+				bts.push_back(backend_type_t::BT_COW);
+			else if (strcasecmp(optarg, "clone") == 0)
+				bts.push_back(backend_type_t::BT_CLONE);
+			else if (strcasecmp(optarg, "stream") == 0)
+				bts.push_back(backend_type_t::BT_STREAM);
 			else {
-				fprintf(stderr, "-b expects either \"file\" or \"nbd\"\n");
+				fprintf(stderr, "-b expects either \"file\", \"nbd\", \"memory\", \"null\", \"stripe\", \"mirror\", \"erasure\", \"cow\", \"clone\" or \"stream\"\n");
 				return 1;
 			}
 		}
-		else if (o == 'd')
-			dev = optarg;
+		else if (o == 'd') {
+			devs.push_back(optarg);
+			dev_targets.push_back(target_names.empty() ? 0 : target_names.size() - 1);
+		}
 		else if (o == 'i')
 			ip_address = optarg;
 		else if (o == 'p')
@@ -168,7 +313,7 @@ int main(int argc, char *argv[])
 		else if (o == 'T')
 			trim_level = atoi(optarg);
 		else if (o == 't')
-			target_name = optarg;
+			target_names.push_back(optarg);
 		else if (o == 'L') {
 			auto parts = split(optarg, ",");
 			if (parts.size() != 2) {
@@ -181,6 +326,40 @@ int main(int argc, char *argv[])
 		}
 		else if (o == 'l')
 			logfile = optarg;
+		else if (o == 'a') {
+			auto parts = split(optarg, ",");
+			bm_file    = parts[0];
+			if (parts.size() >= 2)
+				bm_cluster = atoi(parts[1].c_str());
+			bm_empty   = parts.size() >= 3 && parts[2] == "empty";
+			if (bm_file.empty() || bm_cluster == 0) {
+				fprintf(stderr, "-a expects a filename and optionally a cluster size\n");
+				return 1;
+			}
+		}
+		else if (o == 'r') {
+			rc_size = size_t(atoi(optarg)) * 1024 * 1024;
+			if (rc_size == 0) {
+				fprintf(stderr, "-r expects a size in MB\n");
+				return 1;
+			}
+		}
+		else if (o == 'u') {
+			bg_discard = true;
+			bg_rate    = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+		}
+		else if (o == 'w') {
+			auto parts = split(optarg, ",");
+			wb_size    = size_t(atoi(parts[0].c_str())) * 1024 * 1024;
+			if (parts.size() >= 2)
+				wb_max_age = atoi(parts[1].c_str());
+			if (parts.size() >= 3)
+				wb_ratio   = atoi(parts[2].c_str());
+			if (wb_size == 0) {
+				fprintf(stderr, "-w expects a size in MB\n");
+				return 1;
+			}
+		}
 		else {
 			help();
 			return o != 'h';
@@ -194,25 +373,228 @@ int main(int argc, char *argv[])
 
 	iscsi_stats_t is { };
 
-	backend *b = nullptr;
+	if (target_names.empty())
+		target_names.push_back("test");
+	if (devs.empty()) {
+		devs.push_back(FILENAME);
+		dev_targets.push_back(0);
+	}
+	if (bts.empty())
+		bts.push_back(backend_type_t::BT_FILE);
+
+	readcache_pool *rc_pool = nullptr;  // shared by all LUNs
+	if (rc_size) {
+		rc_pool = new readcache_pool(rc_size);
+		rc_pool->begin();
+	}
+
+	readcache_pool *golden_pool = nullptr;  // for the golden images when there's no -r
+	std::map<std::string, std::shared_ptr<golden_image> > golden_images;  // by base file
+	std::map<uint64_t, std::pair<backend_stripe *, std::vector<std::string> > > stripes;  // by LUN number, for the per child counters in SNMP
+
+	// 'unit': number of the LUN in this process (over all targets)
+	auto create_backend = [&](const backend_type_t bt, const std::string & dev, const uint64_t unit) -> backend * {
+		backend *b = nullptr;
+
+		if (bt == backend_type_t::BT_FILE)
+			b = new backend_file(dev);
+		else if (bt == backend_type_t::BT_NBD) {
+			auto        parts = split(dev, ",");
+			std::string host;
+			int         port  = 0;
+			std::string unix_socket;
+			std::string export_name;
+			if (parts.empty() || parse_nbd_address(parts[0], &host, &port, &unix_socket, &export_name) == false) {
+				fprintf(stderr, "NBD: expecting nbd://host[:port][/export], nbd+unix://path or host:port\n");
+				return nullptr;
+			}
 
-	if (bt == backend_type_t::BT_FILE)
-		b = new backend_file(dev);
-	else if (bt == backend_type_t::BT_NBD) {
-		std::string::size_type colon = dev.find(":");
-		if (colon == std::string::npos) {
-			fprintf(stderr, "NBD: port missing\n");
+			int      n_connections = parts.size() >= 2 ? atoi(parts[1].c_str()) : 1;
+			uint32_t max_in_flight = parts.size() >= 3 ? atoi(parts[2].c_str()) : 32;
+			uint32_t timeout_ms    = parts.size() >= 4 ? atoi(parts[3].c_str()) * 1000 : 30000;
+			uint32_t max_backoff   = parts.size() >= 5 ? atoi(parts[4].c_str()) : 5000;
+			b = new backend_nbd(host, port, unix_socket, export_name, n_connections, max_in_flight, timeout_ms, max_backoff);
+		}
+		else if (bt == backend_type_t::BT_MEMORY || bt == backend_type_t::BT_NULL) {
+			auto     parts = split(dev, ",");
+			uint64_t size  = parts.empty() ? 0 : strtoull(parts[0].c_str(), nullptr, 10) * 1024 * 1024;
+			if (size == 0) {
+				fprintf(stderr, "-d expects a size in MB for this backend type\n");
+				return nullptr;
+			}
+
+			if (bt == backend_type_t::BT_MEMORY)
+				b = new backend_memory(size, parts.size() >= 2 && parts[1] == "hugepages");
+			else
+				b = new backend_null(size, parts.size() >= 2 ? atoi(parts[1].c_str()) : 0, parts.size() >= 3 ? atoi(parts[2].c_str()) : 0);
+		}
+		else if (bt == backend_type_t::BT_STRIPE) {
+			auto     parts = split(dev, ",");
+			auto     files   = parts.empty() ? std::vector<std::string>() : split(parts[0], "+");
+			uint32_t unit_kB = parts.size() >= 2 ? atoi(parts[1].c_str()) : 64;
+			if (files.size() < 2 || unit_kB == 0) {
+				fprintf(stderr, "-b stripe: expecting file+file[+...][,stripe-unit]\n");
+				return nullptr;
+			}
+
+			std::vector<backend *> children;
+			for(auto & file: files)
+				children.push_back(new backend_file(file));
+			backend_stripe *stripe = new backend_stripe(children, std::max(unit_kB * 1024 / children.at(0)->get_block_size(), uint64_t(1)));
+			stripes[unit] = { stripe, files };
+			b = stripe;
+		}
+		else if (bt == backend_type_t::BT_MIRROR) {
+			auto     parts  = split(dev, ",");
+			auto     files  = parts.empty() ? std::vector<std::string>() : split(parts[0], "+");
+			int      quorum = parts.size() >= 2 ? atoi(parts[1].c_str()) : 0;
+			uint64_t region = parts.size() >= 4 ? strtoull(parts[3].c_str(), nullptr, 10) : 1024;  // kB
+			if (files.size() < 2 || quorum < 0 || quorum > int(files.size()) || region == 0) {
+				fprintf(stderr, "-b mirror: expecting file+file[+...][,quorum[,drl-file[,region]]]\n");
+				return nullptr;
+			}
+
+			std::string drl_file = parts.size() >= 3 ? parts[2] : "";
+			if (drl_file.empty() == false && unit > 1)
+				drl_file = myformat("%s.%" PRIu64, drl_file.c_str(), unit);
+
+			std::vector<backend *> children;
+			for(auto & file: files)
+				children.push_back(new backend_file(file));
+			b = new backend_mirror(children, quorum, drl_file, region * 1024);
+		}
+		else if (bt == backend_type_t::BT_ERASURE) {
+			auto     parts  = split(dev, ",");
+			auto     files  = parts.empty() ? std::vector<std::string>() : split(parts[0], "+");
+			int      parity = parts.size() >= 2 ? atoi(parts[1].c_str()) : 1;
+			uint32_t chunk  = parts.size() >= 3 ? atoi(parts[2].c_str()) : 64;  // kB
+			if (parity < 1 || files.size() < size_t(parity) + 1 || files.size() > 64 || chunk == 0) {
+				fprintf(stderr, "-b erasure: expecting file+file[+...][,parity[,chunk[,state-file]]] with at least parity + 1 and at most 64 files\n");
+				return nullptr;
+			}
+
+			std::string state_file = parts.size() >= 4 ? parts[3] : "";
+			if (state_file.empty() == false && unit > 1)
+				state_file = myformat("%s.%" PRIu64, state_file.c_str(), unit);
+
+			std::vector<backend *> children;
+			for(auto & file: files)
+				children.push_back(new backend_file(file));
+			b = new backend_erasure(children, parity, std::max(chunk * 1024 / children.at(0)->get_block_size(), uint64_t(1)), state_file);
+		}
+		else if (bt == backend_type_t::BT_COW) {
+			auto     parts   = split(dev, ",");
+			uint32_t cluster = parts.size() >= 3 ? atoi(parts[2].c_str()) : 64;  // kB
+			int64_t  revert  = parts.size() >= 4 ? atoll(parts[3].c_str()) : -1;
+			if (parts.size() < 2 || cluster == 0 || revert < -1) {
+				fprintf(stderr, "-b cow: expecting base-file,overlay-file[,cluster[,revert-to]]\n");
+				return nullptr;
+			}
+
+			backend *base = new backend_file(parts[0]);
+			b = new backend_cow(base, parts[1], std::max(cluster * 1024 / base->get_block_size(), uint64_t(1)), revert);
+		}
+		else if (bt == backend_type_t::BT_CLONE) {
+			auto     parts   = split(dev, ",");
+			uint32_t cluster = parts.size() >= 3 ? atoi(parts[2].c_str()) : 64;  // kB
+			int64_t  revert  = parts.size() >= 4 ? atoll(parts[3].c_str()) : -1;
+			if (parts.size() < 2 || cluster == 0 || revert < -1) {
+				fprintf(stderr, "-b clone: expecting base-file,delta-file[,cluster[,revert-to]]\n");
+				return nullptr;
+			}
+
+			auto & image = golden_images[parts[0]];
+			if (!image) {
+				if (rc_pool == nullptr && golden_pool == nullptr) {
+					golden_pool = new readcache_pool(size_t(256) * 1024 * 1024);
+					golden_pool->begin();
+				}
+
+				backend *base = new backend_file(parts[0]);
+				image = std::make_shared<golden_image>(base, rc_pool ? rc_pool : golden_pool, std::max(cluster * 1024 / base->get_block_size(), uint64_t(1)));
+			}
+
+			b = new backend_cow(new backend_golden(image), parts[1], std::max(cluster * 1024 / image->get_block_size(), uint64_t(1)), revert);
+		}
+		else if (bt == backend_type_t::BT_STREAM) {
+			auto        parts = split(dev, ",");
+			std::string host;
+			int         port  = 0;
+			std::string unix_socket;
+			std::string export_name;
+			if (parts.size() < 2 || parse_nbd_address(parts[1], &host, &port, &unix_socket, &export_name) == false) {
+				fprintf(stderr, "-b stream: expecting local-file,nbd://host[:port][/export][,chunk[,readahead[,rate]]]\n");
+				return nullptr;
+			}
+
+			uint32_t chunk     = parts.size() >= 3 ? atoi(parts[2].c_str()) : 256;  // kB
+			uint32_t readahead = parts.size() >= 4 ? atoi(parts[3].c_str()) : 4;
+			uint64_t rate      = parts.size() >= 5 ? strtoull(parts[4].c_str(), nullptr, 10) * 1024 * 1024 : 0;
+			if (chunk == 0) {
+				fprintf(stderr, "-b stream: chunk size must be at least 1 kB\n");
+				return nullptr;
+			}
+
+			backend *remote = new backend_nbd(host, port, unix_socket, export_name, 1, 32, 30000, 5000);
+			b = new backend_stream(remote, parts[0], parts[0] + ".present", std::max(chunk * 1024 / remote->get_block_size(), uint64_t(1)), readahead, rate);
+		}
+
+		if (bm_file.empty() == false)  // unit 2 and up get their number appended
+			b = new backend_bitmap(b, unit == 1 ? bm_file : myformat("%s.%" PRIu64, bm_file.c_str(), unit), bm_cluster, bm_empty);
+		if (wb_size)
+			b = new backend_writeback(b, wb_size, wb_max_age, wb_ratio);
+		if (rc_pool && bt != backend_type_t::BT_CLONE)  // the base of a clone is cached already, its delta is local
+			b = new backend_readcache(b, rc_pool);
+		if (bg_discard)
+			b = new backend_discard(b, bg_rate);
+
+		if (b->begin() == false) {
+			fprintf(stderr, "Failed to initialize storage backend %s\n", dev.c_str());
+			delete b;
+			return nullptr;
+		}
+
+		return b;
+	};
+
+	std::vector<backend *> backends;
+	std::vector<uint64_t>  backend_units;  // number of each LUN in this process
+	std::vector<scsi *>    units;
+	std::vector<target *>  targets;
+	for(size_t t=0; t<target_names.size(); t++) {
+		std::vector<scsi *>   luns;
+		std::vector<uint64_t> lun_list;
+
+		for(size_t i=0; i<devs.size(); i++) {
+			if (dev_targets.at(i) != t)
+				continue;
+
+			backend *b = create_backend(bts.at(std::min(i, bts.size() - 1)), devs.at(i), i + 1);
+			if (b == nullptr)
+				return 1;
+
+			backends.push_back(b);
+			backend_units.push_back(i + 1);
+			luns.push_back(new scsi(b, trim_level, i + 1));
+			lun_list.push_back(luns.size());
+		}
+
+		if (luns.empty()) {
+			fprintf(stderr, "Target \"%s\" has no LUNs (-d)\n", target_names.at(t).c_str());
 			return 1;
 		}
 
-		b = new backend_nbd(dev.substr(0, colon), std::stoi(dev.substr(colon + 1)));
-	}
+		for(auto & sd: luns)
+			sd->set_lun_list(lun_list);
 
-	if (b->begin() == false) {
-		fprintf(stderr, "Failed to initialize storage backend\n");
-		return 1;
+		units.insert(units.end(), luns.begin(), luns.end());
+		targets.push_back(new target(target_names.at(t), luns));
 	}
-	scsi sd(b, trim_level);
+
+	golden_images.clear();  // the clones keep them alive
+
+	backend *b = backends.at(0);  // the free space percentage (SNMP) is of the first LUN
+
 
 	com_sockets c(ip_address, port, &stop);
 	if (c.begin() == false) {
@@ -232,16 +614,26 @@ int main(int argc, char *argv[])
 #endif
 
 	backend_stats_t bs          {         };
+	std::vector<backend_stats_t> lun_bs(backends.size());
 	int             cpu_usage   { 0       };
 	int             ram_free_kb { 0       };
 	snmp           *snmp_       { nullptr };
 	snmp_data      *snmp_data_  { nullptr };
-	if (use_snmp)
+	if (use_snmp) {
 		init_snmp(&snmp_, &snmp_data_, &is, get_diskspace, b, &bs, &cpu_usage, &ram_free_kb, &stop, snmp_port);
 
-	server s(&sd, &c, &is, target_name, digest_chk);
+		for(size_t i=0; i<backends.size(); i++)
+			add_snmp_lun(snmp_data_, backend_units.at(i), devs.at(backend_units.at(i) - 1), &lun_bs.at(i));
+
+		for(auto & entry: stripes) {
+			for(size_t i=0; i<entry.second.second.size(); i++)
+				add_snmp_lun_child(snmp_data_, entry.first, i + 1, entry.second.second.at(i), entry.second.first->get_child_stats(i));
+		}
+	}
+
+	server s(targets, &c, &is, digest_chk);
 
-	std::thread *mth = new std::thread(maintenance_thread, b, &bs, &stop, &cpu_usage, &ram_free_kb);
+	std::thread *mth = new std::thread(maintenance_thread, &backends, &bs, &lun_bs, &stop, &cpu_usage, &ram_free_kb);
 
 	if (pid_file.empty() == false) {
 		FILE *fh = fopen(pid_file.c_str(), "w");
@@ -261,7 +653,14 @@ int main(int argc, char *argv[])
 	mth->join();
 	delete mth;
 
-	delete b;
+	for(auto & t: targets)
+		delete t;
+	for(auto & sd: units)
+		delete sd;
+	for(auto & b: backends)
+		delete b;
+	delete golden_pool;
+	delete rc_pool;
 
 	if (pid_file.empty() == false) {
 		if (unlink(pid_file.c_str()) == -1)
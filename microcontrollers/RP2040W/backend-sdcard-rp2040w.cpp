@@ -219,7 +219,7 @@ backend::cmpwrite_result_t backend_sdcard_rp2040w::cmpwrite(const uint64_t block
 {
 	write_led(led_read, HIGH);
 
-	auto lock_list  = lock_range(block_nr, n_blocks);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
 	auto block_size = get_block_size();
 
 	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
@@ -275,8 +275,6 @@ backend::cmpwrite_result_t backend_sdcard_rp2040w::cmpwrite(const uint64_t block
 
 	delete [] buffer;
 
-	unlock_range(lock_list);
-
 	write_led(led_read, LOW);
 
 	return result;
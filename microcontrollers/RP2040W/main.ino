@@ -81,7 +81,7 @@ void setup()
 		sd = new scsi(bs, 1);
 
 		Serial.println(F("Instantiate iSCSI server"));
-		s = new server(sd, c, &is, "test", false);
+		s = new server({ new target("test", { sd }) }, c, &is, false);
 
 		Serial.print(F("Free memory after full init: "));
 		Serial.println(rp2040.getFreeHeap());
@@ -0,0 +1 @@
+../range-lock.h
\ No newline at end of file
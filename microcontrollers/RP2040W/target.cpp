@@ -0,0 +1 @@
+../target.cpp
\ No newline at end of file
@@ -183,7 +183,7 @@ backend::cmpwrite_result_t backend_sdcard_teensy41::cmpwrite(const uint64_t bloc
 	write_led(led_read,  HIGH);
 	write_led(led_write, HIGH);
 
-	auto lock_list  = lock_range(block_nr, n_blocks);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
 	auto block_size = get_block_size();
 
 	cmpwrite_result_t result = cmpwrite_result_t::CWR_OK;
@@ -244,8 +244,6 @@ backend::cmpwrite_result_t backend_sdcard_teensy41::cmpwrite(const uint64_t bloc
 
 	delete [] buffer;
 
-	unlock_range(lock_list);
-
 	write_led(led_read,  LOW);
 	write_led(led_write, LOW);
 
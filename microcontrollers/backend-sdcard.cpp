@@ -277,7 +277,7 @@ backend::cmpwrite_result_t backend_sdcard::cmpwrite(const uint64_t block_nr, con
 #if defined(RP2040W)
 	mutex_enter_blocking(&serial_access_lock);
 #else
-	auto lock_list  = lock_range(block_nr, n_blocks);
+	range_lock_guard lck(&locks, block_nr, n_blocks, range_lock::rl_exclusive);
 #endif
 	auto block_size = get_block_size();
 
@@ -337,8 +337,6 @@ backend::cmpwrite_result_t backend_sdcard::cmpwrite(const uint64_t block_nr, con
 
 #if defined(RP2040W)
 	mutex_exit(&serial_access_lock);
-#else
-	unlock_range(lock_list);
 #endif
 
 	write_led(led_read,  LOW);
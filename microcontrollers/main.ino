@@ -735,7 +735,7 @@ void loop()
 		}
 
 		draw_status(220);
-		s = new server(scsi_dev, &c, &is, "test", false);
+		s = new server({ new target("test", { scsi_dev }) }, &c, &is, false);
 		Serial.printf("Free heap space: %u\r\n", get_free_heap_space());
 		Serial.println(F("Go!"));
 		draw_status(500);
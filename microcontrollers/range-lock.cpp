@@ -0,0 +1 @@
+../range-lock.cpp
\ No newline at end of file
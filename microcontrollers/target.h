@@ -0,0 +1 @@
+../target.h
\ No newline at end of file
@@ -0,0 +1,206 @@
+#! /usr/bin/python3
+
+# Minimal NBD server (RAM-backed) to test the NBD backend of iESP without
+# nbdkit or qemu-nbd. It replies out of order, splits reads in structured
+# chunks (holes as NBD_REPLY_TYPE_OFFSET_HOLE) and keeps track of which
+# blocks are allocated so that NBD_CMD_BLOCK_STATUS has something to report.
+#
+# ./nbd-stub.py -p 10809 -s 64      then: iesp -b nbd -d nbd://localhost/test
+# ./nbd-stub.py -u /tmp/nbd.sock    then: iesp -b nbd -d nbd+unix:///test?socket=/tmp/nbd.sock
+
+import getopt
+import os
+import random
+import socket
+import struct
+import sys
+import threading
+import time
+
+port = 10809
+unix_socket = None
+size = 64 * 1024 * 1024
+oldstyle = False
+structured = True
+block_size = 4096
+max_payload = 1024 * 1024
+
+def cmdline_help():
+    print(f'Usage: {sys.argv[0]} ...arguments...')
+    print('-p port:    port to listen on (default: 10809)')
+    print('-u path:    listen on a UNIX domain socket instead')
+    print('-s size:    size in MB (default: 64)')
+    print('-o:         oldstyle negotiation')
+    print('-n:         no structured replies')
+
+try:
+    opts, args = getopt.getopt(sys.argv[1:], 'p:u:s:onh')
+except getopt.GetoptError as err:
+    print(err)
+    cmdline_help()
+    sys.exit(1)
+
+for o, a in opts:
+    if o == '-p':
+        port = int(a)
+    elif o == '-u':
+        unix_socket = a
+    elif o == '-s':
+        size = int(a) * 1024 * 1024
+    elif o == '-o':
+        oldstyle = True
+    elif o == '-n':
+        structured = False
+    elif o == '-h':
+        cmdline_help()
+        sys.exit(0)
+
+data = bytearray(size)
+allocated = bytearray(size // block_size)
+lock = threading.Lock()
+
+# HAS_FLAGS, SEND_FLUSH, SEND_FUA, SEND_TRIM, SEND_WRITE_ZEROES, CAN_MULTI_CONN
+transmission_flags = 1 | 4 | 8 | 32 | 64 | 256
+
+def set_allocated(offset, length, state):
+    for b in range(offset // block_size, (offset + length) // block_size):
+        allocated[b] = state
+
+def handle_client(c):
+    write_lock = threading.Lock()
+
+    def receive(n):
+        b = b''
+        while len(b) < n:
+            chunk = c.recv(n - len(b))
+            if not chunk:
+                raise EOFError
+            b += chunk
+        return b
+
+    def option_reply(option, reply_type, payload=b''):
+        c.sendall(struct.pack('>QIII', 0x3e889045565a9, option, reply_type, len(payload)) + payload)
+
+    use_structured = False
+
+    if oldstyle:
+        c.sendall(b'NBDMAGIC' + struct.pack('>QQI', 0x00420281861253, size, transmission_flags) + b'\0' * 124)
+    else:
+        c.sendall(b'NBDMAGIC' + struct.pack('>QH', 0x49484156454F5054, 1 | 2))  # FIXED_NEWSTYLE, NO_ZEROES
+        client_flags = struct.unpack('>I', receive(4))[0]
+
+        while True:
+            magic, option, length = struct.unpack('>QII', receive(16))
+            payload = receive(length)
+
+            if option == 1:  # EXPORT_NAME
+                c.sendall(struct.pack('>QH', size, transmission_flags) + (b'' if client_flags & 2 else b'\0' * 124))
+                use_structured = False
+                break
+            elif option == 7:  # GO
+                option_reply(7, 3, struct.pack('>HQH', 0, size, transmission_flags))
+                option_reply(7, 3, struct.pack('>HIII', 3, 1, block_size, max_payload))
+                option_reply(7, 1)
+                break
+            elif option == 8 and structured:  # STRUCTURED_REPLY
+                use_structured = True
+                option_reply(8, 1)
+            elif option == 10 and use_structured:  # SET_META_CONTEXT, only base:allocation exists
+                option_reply(10, 4, struct.pack('>I', 1) + b'base:allocation')
+                option_reply(10, 1)
+            else:
+                option_reply(option, 0x80000001)  # ERR_UNSUP
+
+    def simple_reply(handle, error, payload=b''):
+        with write_lock:
+            c.sendall(struct.pack('>II', 0x67446698, error) + handle + payload)
+
+    def chunk(handle, flags, chunk_type, payload):
+        with write_lock:
+            c.sendall(struct.pack('>IHH', 0x668e33ef, flags, chunk_type) + handle + struct.pack('>I', len(payload)) + payload)
+
+    def work(flags, command, handle, offset, length, payload):
+        time.sleep(random.random() * 0.002)  # causes out of order replies
+
+        with lock:
+            if offset + length > size:
+                out = None
+            elif command == 0:  # READ
+                if use_structured:
+                    # second half first, as two chunks
+                    half = (length // 2) // block_size * block_size
+                    pieces = []
+                    for o, l in ((offset + half, length - half), (offset, half)):
+                        if l == 0:
+                            continue
+                        if any(allocated[o // block_size:(o + l) // block_size]):
+                            pieces.append((1, struct.pack('>Q', o) + bytes(data[o:o + l])))
+                        else:
+                            pieces.append((2, struct.pack('>QI', o, l)))
+                    for i, (chunk_type, chunk_payload) in enumerate(pieces):
+                        chunk(handle, 1 if i == len(pieces) - 1 else 0, chunk_type, chunk_payload)
+                    return
+                out = bytes(data[offset:offset + length])
+            elif command == 1:  # WRITE
+                data[offset:offset + length] = payload
+                set_allocated(offset, length, 1)
+                out = b''
+            elif command == 4 or command == 6:  # TRIM, WRITE_ZEROES
+                data[offset:offset + length] = b'\0' * length
+                set_allocated(offset, length, 1 if command == 6 and (flags & 2) else 0)
+                out = b''
+            elif command == 7:  # BLOCK_STATUS (only 1 extent, as if REQ_ONE was set)
+                first = offset // block_size
+                state = allocated[first]
+                n = 0
+                while first + n < (offset + length) // block_size and allocated[first + n] == state:
+                    n += 1
+                chunk(handle, 1, 5, struct.pack('>III', 1, max(n, 1) * block_size, 0 if state else 3))
+                return
+            else:  # FLUSH
+                out = b''
+
+        if out is None:
+            error = 22  # EINVAL
+            if use_structured:
+                chunk(handle, 1, 32769, struct.pack('>IH', error, 0))
+            else:
+                simple_reply(handle, error)
+        elif use_structured:
+            chunk(handle, 1, 0, b'')
+        else:
+            simple_reply(handle, 0, out)
+
+    try:
+        while True:
+            header = receive(28)
+            magic, flags, command = struct.unpack('>IHH', header[0:8])
+            handle = header[8:16]
+            offset, length = struct.unpack('>QI', header[16:28])
+
+            if command == 2:  # DISC
+                break
+
+            payload = receive(length) if command == 1 else b''
+            threading.Thread(target=work, args=(flags, command, handle, offset, length, payload)).start()
+    except (EOFError, ConnectionResetError):
+        pass
+
+    c.close()
+
+if unix_socket:
+    if os.path.exists(unix_socket):
+        os.unlink(unix_socket)
+    s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    s.bind(unix_socket)
+else:
+    s = socket.socket()
+    s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    s.bind(('', port))
+s.listen(10)
+
+while True:
+    c, a = s.accept()
+    if not unix_socket:
+        c.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    threading.Thread(target=handle_client, args=(c,), daemon=True).start()
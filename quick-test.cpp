@@ -4,6 +4,7 @@
 #include <cstring>
 #include <functional>
 #include <string>
+#include <vector>
 #include <iscsi/iscsi.h>
 #include <iscsi/scsi-lowlevel.h>
 
@@ -13,6 +14,52 @@ constexpr long int lba = 123;
 constexpr int      lun = 1;
 constexpr int      bc  = 2;  // block-count
 bool               ok  = true;
+constexpr int      condition_met = 0x04;
+
+// for commands that libiscsi has no function for; 'out' is the data-out
+// buffer, 'in_len' the allocation length for the data-in
+scsi_task *send_cdb(iscsi_context *const iscsi, const std::vector<uint8_t> & cdb, const std::vector<uint8_t> & out, const int in_len)
+{
+	int dir = out.empty() == false ? SCSI_XFER_WRITE : (in_len ? SCSI_XFER_READ : SCSI_XFER_NONE);
+
+	scsi_task *task = scsi_create_task(cdb.size(), const_cast<uint8_t *>(cdb.data()), dir, out.empty() ? in_len : out.size());
+	if (task == nullptr)
+		return nullptr;
+
+	iscsi_data data { };
+	data.size = out.size();
+	data.data = const_cast<uint8_t *>(out.data());
+
+	return iscsi_scsi_command_sync(iscsi, lun, task, out.empty() ? nullptr : &data);
+}
+
+// the status of the command (-1 when it did not complete), frees the task
+int get_status(scsi_task *const task)
+{
+	int status = task ? task->status : -1;
+	scsi_free_scsi_task(task);
+
+	return status;
+}
+
+bool write_blocks(iscsi_context *const iscsi, const uint64_t block_nr, const int n, const uint8_t fill)
+{
+	std::vector<uint8_t> buffer(n * bs, fill);
+
+	return get_status(iscsi_write16_sync(iscsi, lun, block_nr, buffer.data(), buffer.size(), bs, 0, 0, 0, 0, 0)) == SCSI_STATUS_GOOD;
+}
+
+bool blocks_are(iscsi_context *const iscsi, const uint64_t block_nr, const int n, const uint8_t fill)
+{
+	scsi_task *task = iscsi_read16_sync(iscsi, lun, block_nr, n * bs, bs, 0, 0, 0, 0, 0);
+	bool       rc   = task && task->status == SCSI_STATUS_GOOD && task->datain.size == n * bs;
+
+	for(int i=0; i<n * bs && rc; i++)
+		rc = task->datain.data[i] == fill;
+	scsi_free_scsi_task(task);
+
+	return rc;
+}
 
 void test_read_write(iscsi_context *const iscsi, const uint8_t fill)
 {
@@ -128,7 +175,7 @@ void test_prefetch(iscsi_context *const iscsi)
 
 	if (ok) {
 		scsi_task *task_p = iscsi_prefetch16_sync(iscsi, 1, lba, try_n, 0, 0);
-		if (task_p == NULL || task_p->status != SCSI_STATUS_GOOD) {
+		if (task_p == NULL || (task_p->status != SCSI_STATUS_GOOD && task_p->status != condition_met)) {
 			fprintf(stderr, "failed to send prefetch16 command: %s\n", iscsi_get_error(iscsi));
 			ok = false;
 		}
@@ -155,7 +202,7 @@ void test_prefetch(iscsi_context *const iscsi)
 	printf(" PREFETCH / WRITE / READ\n");
 	if (ok) {
 		scsi_task *task_p = iscsi_prefetch16_sync(iscsi, 1, lba, try_n, 0, 0);
-		if (task_p == NULL || task_p->status != SCSI_STATUS_GOOD) {
+		if (task_p == NULL || (task_p->status != SCSI_STATUS_GOOD && task_p->status != condition_met)) {
 			fprintf(stderr, "failed to send 2nd prefetch16 command: %s\n", iscsi_get_error(iscsi));
 			ok = false;
 		}
@@ -193,6 +240,339 @@ void test_prefetch(iscsi_context *const iscsi)
 		}
 	}
 
+	// IMMED: returns right away
+	printf(" PREFETCH with IMMED\n");
+	int status = get_status(iscsi_prefetch16_sync(iscsi, lun, lba, try_n, 1, 0));
+	if (status != SCSI_STATUS_GOOD && status != condition_met) {
+		printf("  prefetch16 with IMMED failed: %d\n", status);
+		ok = false;
+	}
+
+	// beyond the end of the LUN
+	printf(" PREFETCH out of range\n");
+	scsi_task *task_c = send_cdb(iscsi, { 0x9e, 0x10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 32, 0, 0 }, { }, 32);  // READ CAPACITY(16)
+	if (task_c == nullptr || task_c->status != SCSI_STATUS_GOOD || task_c->datain.size < 8) {
+		printf("  READ CAPACITY(16) failed: %s\n", iscsi_get_error(iscsi));
+		ok = false;
+	}
+	else {
+		uint64_t last_lba = 0;
+		for(int i=0; i<8; i++)
+			last_lba = (last_lba << 8) | task_c->datain.data[i];
+
+		status = get_status(iscsi_prefetch16_sync(iscsi, lun, last_lba + 1, 1, 0, 0));
+		if (status != SCSI_STATUS_CHECK_CONDITION) {
+			printf("  prefetch16 beyond the end: status %d\n", status);
+			ok = false;
+		}
+	}
+	scsi_free_scsi_task(task_c);
+
+	printf("\n");
+}
+
+// WCE in the caching mode page can be changed with MODE SELECT when the LUN
+// has a write-back cache ('-w'), else only the current value is accepted
+void test_write_cache(iscsi_context *const iscsi)
+{
+	printf("Write cache (MODE SENSE/SELECT) test\n");
+
+	// page control 0: current values, 1: changeable ones
+	auto mode_sense = [iscsi](const uint8_t page_control, uint8_t *const page) {
+		scsi_task *task = send_cdb(iscsi, { 0x1a, 0x08 /* DBD */, uint8_t((page_control << 6) | 0x08), 0x00, 0xff, 0x00 }, { }, 0xff);
+		bool       rc   = task && task->status == SCSI_STATUS_GOOD && task->datain.size >= 4 && task->datain.size >= 4 + task->datain.data[3] + 20;
+
+		if (rc) {
+			memcpy(page, &task->datain.data[4 + task->datain.data[3]], 20);
+			rc = (page[0] & 0x3f) == 0x08;
+		}
+		scsi_free_scsi_task(task);
+
+		return rc;
+	};
+
+	// with PF, without block descriptors
+	auto mode_select = [iscsi](const uint8_t *const page, const uint8_t len, const bool sp) {
+		std::vector<uint8_t> list(4 + len);
+		memcpy(&list[4], page, len);
+
+		return get_status(send_cdb(iscsi, { 0x15, uint8_t(0x10 | sp), 0x00, 0x00, uint8_t(list.size()), 0x00 }, list, 0));
+	};
+
+	uint8_t current[20]    { };
+	uint8_t changeable[20] { };
+	if (mode_sense(0, current) == false || mode_sense(1, changeable) == false) {
+		printf(" MODE SENSE of the caching page failed: %s\n", iscsi_get_error(iscsi));
+		ok = false;
+		return;
+	}
+
+	bool wce        = current[2] & 0x04;
+	bool can_change = changeable[2] & 0x04;
+	printf(" WCE: %d, changeable: %d\n", wce, can_change);
+
+	if (mode_select(current, sizeof current, false) != SCSI_STATUS_GOOD) {
+		printf(" MODE SELECT of the current values failed\n");
+		ok = false;
+	}
+
+	uint8_t toggled[20];
+	memcpy(toggled, current, sizeof toggled);
+	toggled[2] ^= 0x04;
+	int status = mode_select(toggled, sizeof toggled, false);
+	if (status != (can_change ? SCSI_STATUS_GOOD : SCSI_STATUS_CHECK_CONDITION)) {
+		printf(" MODE SELECT toggling WCE: status %d\n", status);
+		ok = false;
+	}
+	else if (can_change) {
+		uint8_t now[20] { };
+		if (mode_sense(0, now) == false || bool(now[2] & 0x04) == wce) {
+			printf(" WCE did not change\n");
+			ok = false;
+		}
+
+		if (mode_select(current, sizeof current, false) != SCSI_STATUS_GOOD) {
+			printf(" MODE SELECT restoring WCE failed\n");
+			ok = false;
+		}
+	}
+
+	// a page that does not fit in the parameter list, and saving pages
+	if (mode_select(current, 10, false) != SCSI_STATUS_CHECK_CONDITION) {
+		printf(" MODE SELECT of a truncated page was accepted\n");
+		ok = false;
+	}
+
+	if (mode_select(current, sizeof current, true) != SCSI_STATUS_CHECK_CONDITION) {
+		printf(" MODE SELECT with SP was accepted\n");
+		ok = false;
+	}
+
+	printf("\n");
+}
+
+// a written block is mapped; after an UNMAP it reads as zeros (and is
+// deallocated when the backend can punch holes)
+void test_lba_status(iscsi_context *const iscsi)
+{
+	printf("GET LBA STATUS test\n");
+
+	// the provisioning status of the descriptor that must start at 'block_nr'
+	auto get_lba_status = [iscsi](const uint64_t block_nr, int *const status) {
+		std::vector<uint8_t> cdb(16);
+		cdb[0]  = 0x9e;
+		cdb[1]  = 0x12;
+		for(int i=0; i<8; i++)
+			cdb[2 + i] = block_nr >> (56 - i * 8);
+		cdb[13] = 8 + 16;  // room for one descriptor
+
+		scsi_task *task = send_cdb(iscsi, cdb, { }, 8 + 16);
+		bool       rc   = task && task->status == SCSI_STATUS_GOOD && task->datain.size >= 8 + 16;
+		if (rc) {
+			const uint8_t *const d = &task->datain.data[8];
+			uint64_t first = 0;
+			for(int i=0; i<8; i++)
+				first = (first << 8) | d[i];
+
+			rc      = first == block_nr;
+			*status = d[12] & 0x0f;
+		}
+		scsi_free_scsi_task(task);
+
+		return rc;
+	};
+
+	std::vector<uint8_t> buffer(bs, 0x5a);
+	if (get_status(iscsi_write16_sync(iscsi, lun, lba, buffer.data(), bs, bs, 0, 0, 0, 0, 0)) != SCSI_STATUS_GOOD) {
+		printf(" write failed: %s\n", iscsi_get_error(iscsi));
+		ok = false;
+		return;
+	}
+
+	int status = -1;
+	if (get_lba_status(lba, &status) == false || status != 0) {
+		printf(" written block: GET LBA STATUS failed or not mapped (%d)\n", status);
+		ok = false;
+	}
+
+	std::vector<uint8_t> list(8 + 16);
+	list[1]  = list.size() - 2;  // UNMAP DATA LENGTH
+	list[3]  = 16;  // UNMAP BLOCK DESCRIPTOR DATA LENGTH
+	for(int i=0; i<8; i++)
+		list[8 + i] = uint64_t(lba) >> (56 - i * 8);
+	list[19] = 1;  // blocks
+	if (get_status(send_cdb(iscsi, { 0x42, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, uint8_t(list.size()), 0x00 }, list, 0)) != SCSI_STATUS_GOOD) {
+		printf(" UNMAP failed: %s\n", iscsi_get_error(iscsi));
+		ok = false;
+	}
+
+	scsi_task *task_r = iscsi_read16_sync(iscsi, lun, lba, bs, bs, 0, 0, 0, 0, 0);
+	bool zero = task_r && task_r->status == SCSI_STATUS_GOOD && task_r->datain.size == bs;
+	for(int i=0; i<bs && zero; i++)
+		zero = task_r->datain.data[i] == 0x00;
+	scsi_free_scsi_task(task_r);
+	if (!zero) {
+		printf(" unmapped block does not read as zeros\n");
+		ok = false;
+	}
+
+	if (get_lba_status(lba, &status) == false || (status != 0 && status != 1)) {
+		printf(" unmapped block: GET LBA STATUS failed (%d)\n", status);
+		ok = false;
+	}
+	else {
+		printf(" after UNMAP: %s\n", status ? "deallocated" : "mapped (the backend cannot deallocate)");
+	}
+
+	printf("\n");
+}
+
+// writes only when the compare data matches; 16 blocks need more data than
+// fits in the first burst (R2T)
+void test_compare_and_write(iscsi_context *const iscsi)
+{
+	printf("COMPARE AND WRITE test\n");
+
+	auto ats = [iscsi](const uint8_t n, const uint8_t compare, const uint8_t write, int *const sense_key) {
+		std::vector<uint8_t> cdb(16);
+		cdb[0]  = 0x89;
+		for(int i=0; i<8; i++)
+			cdb[2 + i] = uint64_t(lba) >> (56 - i * 8);
+		cdb[13] = n;
+
+		std::vector<uint8_t> data(2 * n * bs, write);
+		memset(data.data(), compare, n * bs);
+
+		scsi_task *task   = send_cdb(iscsi, cdb, data, 0);
+		int        status = task ? task->status : -1;
+		*sense_key = status == SCSI_STATUS_CHECK_CONDITION ? task->sense.key : -1;
+		scsi_free_scsi_task(task);
+
+		return status;
+	};
+
+	int sense_key = -1;
+	if (write_blocks(iscsi, lba, 1, 0x11) == false || ats(1, 0x11, 0x22, &sense_key) != SCSI_STATUS_GOOD || blocks_are(iscsi, lba, 1, 0x22) == false) {
+		printf(" matching compare data: not written\n");
+		ok = false;
+	}
+
+	if (ats(1, 0x11, 0x33, &sense_key) != SCSI_STATUS_CHECK_CONDITION || sense_key != SCSI_SENSE_MISCOMPARE || blocks_are(iscsi, lba, 1, 0x22) == false) {
+		printf(" other compare data: no MISCOMPARE (sense key %d) or written anyway\n", sense_key);
+		ok = false;
+	}
+
+	if (write_blocks(iscsi, lba, 16, 0x44) == false || ats(16, 0x44, 0x55, &sense_key) != SCSI_STATUS_GOOD || blocks_are(iscsi, lba, 16, 0x55) == false) {
+		printf(" 16 blocks: not written\n");
+		ok = false;
+	}
+
+	printf("\n");
+}
+
+// copies within the LUN: addressed as 'this device' (07FFh) and via an
+// identification descriptor from the device identification VPD page
+void test_extended_copy(iscsi_context *const iscsi)
+{
+	printf("EXTENDED COPY test\n");
+
+	constexpr int n = 4;
+
+	auto segment = [](const uint16_t src_id, const uint64_t src_lba, const uint64_t dst_lba) {
+		std::vector<uint8_t> d(28);
+		d[0]  = 0x02;  // block device to block device
+		d[3]  = 0x18;  // descriptor length
+		d[4]  = src_id >> 8;
+		d[5]  = src_id;
+		d[6]  = 0x07;  // destination: this device
+		d[7]  = 0xff;
+		d[11] = n;
+		for(int i=0; i<8; i++) {
+			d[12 + i] = src_lba >> (56 - i * 8);
+			d[20 + i] = dst_lba >> (56 - i * 8);
+		}
+		return d;
+	};
+
+	auto xcopy = [iscsi](const uint8_t list_id, const std::vector<uint8_t> & cscds, const std::vector<uint8_t> & segments) {
+		std::vector<uint8_t> list(16);
+		list[0]  = list_id;
+		list[3]  = cscds.size();
+		list[11] = segments.size();
+		list.insert(list.end(), cscds.begin(), cscds.end());
+		list.insert(list.end(), segments.begin(), segments.end());
+
+		std::vector<uint8_t> cdb(16);
+		cdb[0]  = 0x83;
+		cdb[13] = list.size();
+
+		return get_status(send_cdb(iscsi, cdb, list, 0));
+	};
+
+	// service action 0: copy status of a list, 3: operating parameters
+	auto receive_copy_results = [iscsi](const uint8_t service_action, const uint8_t list_id, std::vector<uint8_t> *const out) {
+		scsi_task *task = send_cdb(iscsi, { 0x84, service_action, list_id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 64, 0, 0 }, { }, 64);
+		bool       rc   = task && task->status == SCSI_STATUS_GOOD;
+		if (rc)
+			out->assign(task->datain.data, task->datain.data + task->datain.size);
+		scsi_free_scsi_task(task);
+
+		return rc;
+	};
+
+	if (write_blocks(iscsi, lba, n, 0x66) == false) {
+		printf(" write failed: %s\n", iscsi_get_error(iscsi));
+		ok = false;
+		return;
+	}
+
+	std::vector<uint8_t> result;
+	if (xcopy(7, { }, segment(0x07ff, lba, lba + 100)) != SCSI_STATUS_GOOD || blocks_are(iscsi, lba + 100, n, 0x66) == false) {
+		printf(" copy to this device failed\n");
+		ok = false;
+	}
+	else if (receive_copy_results(0x00, 7, &result) == false || result.size() < 12 || result[4] != 1 || ((result[5] << 8) | result[6]) != 1) {
+		printf(" RECEIVE COPY RESULTS: no or wrong copy status\n");
+		ok = false;
+	}
+
+	// the NAA designator, as the identification CSCD descriptor
+	std::vector<uint8_t> cscd(32);
+	scsi_task *task = send_cdb(iscsi, { 0x12, 0x01, 0x83, 0x00, 0xff, 0x00 }, { }, 0xff);
+	bool found = false;
+	for(int i=4; task && task->status == SCSI_STATUS_GOOD && i + 4 <= task->datain.size && !found; i += 4 + task->datain.data[i + 3]) {
+		const uint8_t *const d = &task->datain.data[i];
+		if ((d[1] & 0x0f) == 3 && 4 + d[3] <= 24 && i + 4 + d[3] <= task->datain.size) {
+			cscd[0] = 0xe4;
+			memcpy(&cscd[4], d, 4 + d[3]);
+			cscd[29] = bs >> 16;  // disk block length
+			cscd[30] = bs >> 8;
+			cscd[31] = uint8_t(bs);
+			found = true;
+		}
+	}
+	scsi_free_scsi_task(task);
+
+	if (!found) {
+		printf(" no NAA designator in the device identification VPD page\n");
+		ok = false;
+	}
+	else if (xcopy(8, cscd, segment(0, lba, lba + 200)) != SCSI_STATUS_GOOD || blocks_are(iscsi, lba + 200, n, 0x66) == false) {
+		printf(" copy via an identification descriptor failed\n");
+		ok = false;
+	}
+
+	// CSCD 5 does not exist
+	if (xcopy(9, { }, segment(5, lba, lba + 300)) != SCSI_STATUS_CHECK_CONDITION) {
+		printf(" copy from an unknown CSCD was accepted\n");
+		ok = false;
+	}
+
+	if (receive_copy_results(0x03, 0, &result) == false || result.size() < 46 || result[44] != 0x02 || result[45] != 0xe4) {
+		printf(" RECEIVE COPY RESULTS: no or wrong operating parameters\n");
+		ok = false;
+	}
+
 	printf("\n");
 }
 
@@ -256,6 +636,11 @@ void main_tests()
 	test_read_write(iscsi, 0x99);
 
 	test_prefetch(iscsi);
+
+	test_write_cache(iscsi);
+	test_lba_status(iscsi);
+	test_compare_and_write(iscsi);
+	test_extended_copy(iscsi);
 	
 	printf("SYNC test\n");
 	scsi_task *task_synchronizecache10 = iscsi_synchronizecache10_sync(iscsi, lun, lba, 1, 1, 1);
@@ -0,0 +1,70 @@
+#include <cstring>
+
+#include "radix-map.h"
+
+
+radix_map::radix_map(const uint64_t n_keys)
+{
+	while(levels < 64 / bits && (n_keys - 1) >> (levels * bits))
+		levels++;
+}
+
+radix_map::~radix_map()
+{
+	if (root)
+		free_node(root, 0);
+}
+
+void radix_map::free_node(node *const n, const int level)
+{
+	if (level < levels - 1) {
+		for(uint64_t i=0; i<fanout; i++) {
+			if (n->slot[i])
+				free_node(reinterpret_cast<node *>(uintptr_t(n->slot[i])), level + 1);
+		}
+	}
+
+	delete n;
+}
+
+uint64_t radix_map::get(const uint64_t key) const
+{
+	const node *n = root;
+
+	for(int level=0; level<levels - 1 && n; level++)
+		n = reinterpret_cast<const node *>(uintptr_t(n->slot[(key >> ((levels - 1 - level) * bits)) & (fanout - 1)]));
+
+	return n ? n->slot[key & (fanout - 1)] : 0;
+}
+
+void radix_map::set(const uint64_t key, const uint64_t value)
+{
+	if (root == nullptr) {
+		if (value == 0)  // nothing to clear
+			return;
+
+		root = new node();
+		n_nodes++;
+	}
+
+	node *n = root;
+	for(int level=0; level<levels - 1; level++) {
+		uint64_t & slot = n->slot[(key >> ((levels - 1 - level) * bits)) & (fanout - 1)];
+		if (slot == 0) {
+			if (value == 0)
+				return;
+
+			slot = reinterpret_cast<uintptr_t>(new node());
+			n_nodes++;
+		}
+
+		n = reinterpret_cast<node *>(uintptr_t(slot));
+	}
+
+	n->slot[key & (fanout - 1)] = value;
+}
+
+size_t radix_map::get_memory_usage() const
+{
+	return n_nodes * sizeof(node);
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+
+// Maps a dense range of 64 bit keys to 64 bit values (0: not set). A tree
+// of nodes of 512 entries (4 kB, one page each), with as many levels as
+// the number of keys needs; a lookup touches one node per level. Nodes are
+// allocated when something is first set in them. Not thread safe.
+class radix_map
+{
+private:
+	static constexpr const int      bits   = 9;
+	static constexpr const uint64_t fanout = uint64_t(1) << bits;
+
+	struct node {
+		uint64_t slot[fanout];  // a pointer to the next level or, in a leaf, a value
+	};
+
+	int      levels  { 1       };
+	node    *root    { nullptr };
+	size_t   n_nodes { 0       };
+
+	void free_node(node *const n, const int level);
+
+public:
+	radix_map(const uint64_t n_keys);
+	radix_map(const radix_map &) = delete;
+	radix_map & operator=(const radix_map &) = delete;
+	virtual ~radix_map();
+
+	uint64_t get(const uint64_t key) const;
+	void     set(const uint64_t key, const uint64_t value);
+
+	size_t   get_memory_usage() const;  // in bytes
+};
@@ -0,0 +1,138 @@
+#include <algorithm>
+
+#include "range-lock.h"
+
+
+range_lock::range_lock()
+{
+}
+
+range_lock::~range_lock()
+{
+}
+
+#if defined(ARDUINO) || defined(TEENSY4_1) || defined(RP2040W)
+void range_lock::acquire(entry *const e, const uint64_t block_nr, const uint32_t n_blocks, const lock_mode mode)
+{
+	// no-op
+}
+
+void range_lock::acquire(entry *const e1, const uint64_t block_nr1, const uint32_t n_blocks1, const lock_mode mode1,
+                         entry *const e2, const uint64_t block_nr2, const uint32_t n_blocks2, const lock_mode mode2)
+{
+	// no-op
+}
+
+void range_lock::release(entry *const e)
+{
+	// no-op
+}
+#else
+// may only be called with 'lock' held
+bool range_lock::may_proceed(const entry *const e) const
+{
+	// only requests that came in earlier can block this one
+	for(const entry *cur = head; cur != e; cur = cur->next) {
+		if (cur->start < e->end && e->start < cur->end && (cur->mode == rl_exclusive || e->mode == rl_exclusive))
+			return false;
+	}
+
+	return true;
+}
+
+// may only be called with 'lock' held
+void range_lock::enqueue(entry *const e, const uint64_t block_nr, const uint32_t n_blocks, const lock_mode mode)
+{
+	e->start = block_nr;
+	e->end   = block_nr + n_blocks;
+	e->mode  = mode;
+	e->next  = nullptr;
+
+	e->prev  = tail;
+	if (tail)
+		tail->next = e;
+	else
+		head = e;
+	tail     = e;
+}
+
+void range_lock::acquire(entry *const e, const uint64_t block_nr, const uint32_t n_blocks, const lock_mode mode)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	enqueue(e, block_nr, n_blocks, mode);
+
+	while(may_proceed(e) == false)
+		e->cv.wait(lck);
+}
+
+void range_lock::acquire(entry *const e1, const uint64_t block_nr1, const uint32_t n_blocks1, const lock_mode mode1,
+                         entry *const e2, const uint64_t block_nr2, const uint32_t n_blocks2, const lock_mode mode2)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	// adjacent in the queue: whatever e2 waits for came in before e1 as well,
+	// so holding e1 meanwhile cannot block it
+	enqueue(e1, block_nr1, n_blocks1, mode1);
+	enqueue(e2, block_nr2, n_blocks2, mode2);
+
+	while(may_proceed(e1) == false)
+		e1->cv.wait(lck);
+
+	while(may_proceed(e2) == false)
+		e2->cv.wait(lck);
+}
+
+void range_lock::release(entry *const e)
+{
+	std::unique_lock<std::mutex> lck(lock);
+
+	entry *next = e->next;
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		tail = e->prev;
+
+	// only later requests that overlap can have been waiting for this one
+	for(entry *cur = next; cur; cur = cur->next) {
+		if (cur->start < e->end && e->start < cur->end)
+			cur->cv.notify_one();
+	}
+}
+#endif
+
+range_lock_guard::range_lock_guard(range_lock *const rl, const uint64_t block_nr, const uint32_t n_blocks, const range_lock::lock_mode mode): rl(rl)
+{
+	rl->acquire(&e, block_nr, n_blocks, mode);
+}
+
+range_lock_guard::~range_lock_guard()
+{
+	rl->release(&e);
+}
+
+range_lock_copy_guard::range_lock_copy_guard(range_lock *const rl, const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks): rl(rl)
+{
+	uint64_t lowest  = std::min(src_block_nr, dst_block_nr);
+	uint64_t highest = std::max(src_block_nr, dst_block_nr);
+
+	if (highest - lowest < n_blocks)  // overlap; the union is less than 2 * n_blocks
+		rl->acquire(&e1, lowest, highest - lowest + n_blocks, range_lock::rl_exclusive);
+	else {
+		use_e2 = true;
+		rl->acquire(&e1, src_block_nr, n_blocks, range_lock::rl_shared, &e2, dst_block_nr, n_blocks, range_lock::rl_exclusive);
+	}
+}
+
+range_lock_copy_guard::~range_lock_copy_guard()
+{
+	if (use_e2)
+		rl->release(&e2);
+	rl->release(&e1);
+}
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#if !(defined(ARDUINO) || defined(TEENSY4_1) || defined(RP2040W))
+#include <condition_variable>
+#include <mutex>
+#endif
+
+
+// Reader/writer locks on ranges of blocks. Requests are granted in order of
+// arrival for overlapping ranges only: a writer waiting for readers blocks
+// new readers of the same range (so it does not starve) while unrelated
+// ranges never wait for each other.
+class range_lock
+{
+public:
+	enum lock_mode { rl_shared, rl_exclusive };
+
+	// owned by the caller (usually on its stack) so that locking does not
+	// allocate anything
+	struct entry {
+		uint64_t  start { 0       };
+		uint64_t  end   { 0       };  // first block after the range
+		lock_mode mode  { rl_exclusive };
+		entry    *prev  { nullptr };
+		entry    *next  { nullptr };
+#if !(defined(ARDUINO) || defined(TEENSY4_1) || defined(RP2040W))
+		std::condition_variable cv;
+#endif
+	};
+
+private:
+#if !(defined(ARDUINO) || defined(TEENSY4_1) || defined(RP2040W))
+	std::mutex lock;
+	entry     *head { nullptr };  // oldest request
+	entry     *tail { nullptr };
+
+	bool may_proceed(const entry *const e) const;
+	void enqueue(entry *const e, const uint64_t block_nr, const uint32_t n_blocks, const lock_mode mode);
+#endif
+
+public:
+	range_lock();
+	virtual ~range_lock();
+
+	void acquire(entry *const e, const uint64_t block_nr, const uint32_t n_blocks, const lock_mode mode);
+	// two ranges at once: taking them one after the other can deadlock
+	// against a request for a range covering both that came in between
+	void acquire(entry *const e1, const uint64_t block_nr1, const uint32_t n_blocks1, const lock_mode mode1,
+	             entry *const e2, const uint64_t block_nr2, const uint32_t n_blocks2, const lock_mode mode2);
+	void release(entry *const e);
+};
+
+class range_lock_guard
+{
+private:
+	range_lock       *const rl { nullptr };
+	range_lock::entry       e;
+
+public:
+	range_lock_guard(range_lock *const rl, const uint64_t block_nr, const uint32_t n_blocks, const range_lock::lock_mode mode);
+	range_lock_guard(const range_lock_guard &) = delete;
+	range_lock_guard & operator=(const range_lock_guard &) = delete;
+	virtual ~range_lock_guard();
+};
+
+// for copies: the source shared and the destination exclusive, or one
+// exclusive lock when they overlap
+class range_lock_copy_guard
+{
+private:
+	range_lock       *const rl     { nullptr };
+	range_lock::entry       e1;
+	range_lock::entry       e2;
+	bool                    use_e2 { false   };
+
+public:
+	range_lock_copy_guard(range_lock *const rl, const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks);
+	range_lock_copy_guard(const range_lock_copy_guard &) = delete;
+	range_lock_copy_guard & operator=(const range_lock_copy_guard &) = delete;
+	virtual ~range_lock_copy_guard();
+};
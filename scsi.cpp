@@ -1,6 +1,7 @@
 #if defined(TEENSY4_1)
 #include <Arduino.h>
 #endif
+#include <algorithm>
 #include <cassert>
 #include <cinttypes>
 #include <cstdio>
@@ -32,6 +33,7 @@ const std::map<scsi::scsi_opcode, scsi_opcode_details> scsi_a3_data {
 	{ scsi::scsi_opcode::o_reserve_6,	{ { 0xff, 0x00, 0x00, 0x00, 0x00, 0x07 }, 6, "reserve 6"       } },
 	{ scsi::scsi_opcode::o_release_6,	{ { 0xff, 0x00, 0x00, 0x00, 0x00, 0x07 }, 6, "release 6"       } },
 #endif
+	{ scsi::scsi_opcode::o_mode_select_6,	{ { 0xff, 0x11, 0x00, 0x00, 0xff, 0x07 }, 6, "mode select 6"   } },
 	{ scsi::scsi_opcode::o_mode_sense_6,	{ { 0xff, 0x08, 0xff, 0xff, 0xff, 0x07 }, 6, "mode sense 6"    } },
 	{ scsi::scsi_opcode::o_read_capacity_10,{ { 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07 }, 10, "read capacity 10" } },
 	{ scsi::scsi_opcode::o_read_10,		{ { 0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0x07 }, 10, "read 10"          } },
@@ -39,13 +41,19 @@ const std::map<scsi::scsi_opcode, scsi_opcode_details> scsi_a3_data {
 	{ scsi::scsi_opcode::o_write_same_10,	{ { 0xff, 0x08, 0xff, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0xff }, 10, "write same 10"    } },
 	{ scsi::scsi_opcode::o_write_same_16,	{ { 0xff, 0x08, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0xff }, 16, "write same 16" } },
 	{ scsi::scsi_opcode::o_write_verify_10,	{ { 0xff, 0xf2, 0xff, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0x07 }, 10, "write verify 10" } },
+	{ scsi::scsi_opcode::o_prefetch_10,	{ { 0xff, 0x02, 0xff, 0xff, 0xff, 0xff, 0x1f, 0xff, 0xff, 0x07 }, 10, "pre-fetch 10"    } },
 	{ scsi::scsi_opcode::o_sync_cache_10,	{ { 0xff, 0x06, 0xff, 0xff, 0xff, 0xff, 0x00, 0xff, 0xff, 0x07 }, 10, "sync cache 10"   } },
+	{ scsi::scsi_opcode::o_mode_select_10,	{ { 0xff, 0x11, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0x07 }, 10, "mode select 10"  } },
+	{ scsi::scsi_opcode::o_mode_sense_10,	{ { 0xff, 0x18, 0xff, 0xff, 0x00, 0x00, 0x00, 0xff, 0xff, 0x07 }, 10, "mode sense 10"   } },
 	{ scsi::scsi_opcode::o_unmap,           { { 0xff, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0x07 }, 10, "unmap"           } },
+	{ scsi::scsi_opcode::o_extended_copy,	{ { 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 16, "extended copy" } },
+	{ scsi::scsi_opcode::o_receive_copy_results, { { 0xff, 0x1f, 0xff, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 16, "receive copy results" } },
 	{ scsi::scsi_opcode::o_read_12,		{ { 0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 12, "read 12"  } },
 	{ scsi::scsi_opcode::o_write_12,	{ { 0xff, 0xfa, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 12, "write 12" } },
 	{ scsi::scsi_opcode::o_read_16,		{ { 0xff, 0xfe, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 16, "read 16" } },
 	{ scsi::scsi_opcode::o_compare_and_write, { { 0xff, 0xfa, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x00, 0x00, 0xff, 0x00, 0x07 }, 16, "compare and write" } },
 	{ scsi::scsi_opcode::o_write_16,	{ { 0x8a, 0xfa, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 16, "write 16" } },
+	{ scsi::scsi_opcode::o_prefetch_16,	{ { 0xff, 0x02, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x1f, 0x07 }, 16, "pre-fetch 16" } },
 	{ scsi::scsi_opcode::o_get_lba_status,	{ { 0xff, 0x1f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 16, "get lba status" } },
 	{ scsi::scsi_opcode::o_report_luns,	{ { 0xff, 0x00, 0xff, 0x00, 0x00, 0x00, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 12, "report luns" } },
 	{ scsi::scsi_opcode::o_rep_sup_oper,	{ { 0xff, 0x1f, 0x87, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x00, 0x07 }, 12, "report supported operations" } },
@@ -54,13 +62,41 @@ const std::map<scsi::scsi_opcode, scsi_opcode_details> scsi_a3_data {
 #if defined(ARDUINO)
 #define MAX_WS_LEN 2
 #else
-#define MAX_WS_LEN 256
+#define MAX_WS_LEN 65536
 #endif
 
+#if defined(ARDUINO)
+constexpr const uint16_t max_xcopy_cscds    = 2;
+constexpr const uint16_t max_xcopy_segments = 1;
+#else
+constexpr const uint16_t max_xcopy_cscds    = 16;
+constexpr const uint16_t max_xcopy_segments = 256;
+#endif
+constexpr const uint32_t max_xcopy_list_length = max_xcopy_cscds * 32 + max_xcopy_segments * 28;  // excluding the header
+
+#if defined(ARDUINO)
 constexpr const uint8_t max_compare_and_write_block_count = 1;
+#else
+constexpr const uint8_t max_compare_and_write_block_count = 255;  // the maximum that fits in the Block Limits VPD
+#endif
 
-scsi::scsi(backend *const b, const int trim_level) : b(b), trim_level(trim_level), serial(b->get_serial())
+// the serial of the first unit is that of the backend (as it was before
+// there were multiple LUNs and targets), the others get their number (in
+// this process, not the LUN) appended so that they are not taken for paths
+// to the same device
+scsi::scsi(backend *const b, const int trim_level, const uint64_t unit_nr) :
+	b(b),
+	trim_level(trim_level),
+	serial(unit_nr == 1 ? b->get_serial() : myformat("%s-%" PRIu64, b->get_serial().c_str(), unit_nr))
 {
+	// NAA 3 (locally assigned) from a FNV-1a hash of the serial: EXTENDED COPY
+	// initiators address the device by an NAA designator
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for(char c: serial)
+		hash = (hash ^ uint8_t(c)) * 0x100000001b3ull;
+	hash = (hash & 0x0fffffffffffffffull) | 0x3000000000000000ull;
+	for(int i=0; i<8; i++)
+		naa_id[i] = uint8_t(hash >> (56 - i * 8));
 }
 
 scsi::~scsi()
@@ -81,37 +117,186 @@ scsi_response scsi::test_unit_ready(const std::string & identifier, const uint64
 	return response;
 }
 
-scsi_response scsi::mode_sense_6(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data)
+// the caching mode page (08h); WCE reflects the write-back cache of the backend
+std::vector<uint8_t> scsi::get_mode_pages(const uint8_t page_code, const uint8_t page_control) const
+{
+	std::vector<uint8_t> pages;
+
+	if (page_code == 0x08 || page_code == 0x3f) {
+		uint8_t caching[20] { };
+		caching[0] = 0x08;  // page code, PS=0
+		caching[1] = sizeof(caching) - 2;  // page length
+		if (page_control == 1)  // changeable values
+			caching[2] = b->has_write_cache() ? 0x04 : 0x00;
+		else
+			caching[2] = b->get_write_cache() ? 0x04 : 0x00;  // WCE
+		pages.insert(pages.end(), caching, caching + sizeof caching);
+	}
+
+	return pages;
+}
+
+scsi_response scsi::mode_sense(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode)
 {
 	scsi_response response(ir_as_is);
 
+	bool is_10 = opcode == o_mode_sense_10;
+
 	if (locking_status() == l_locked_other) {
-		DOLOG(logging::ll_error, "scsi::mode_sense_6", identifier, "MODE SENSE 6 failed due to reservations");
+		DOLOG(logging::ll_error, "scsi::mode_sense", identifier, "MODE SENSE failed due to reservations");
 		response.sense_data = error_reservation_conflict_1();
 	}
 	else {
-		DOLOG(logging::ll_debug, "scsi::mode_sense_6", identifier, "MODE SENSE 6");
+		DOLOG(logging::ll_debug, "scsi::mode_sense", identifier, "MODE SENSE %d", is_10 ? 10 : 6);
 		if (CDB[1] & 8)
-			DOLOG(logging::ll_debug, "scsi::mode_sense_6", identifier, "MODE SENSE 6: DBD");
+			DOLOG(logging::ll_debug, "scsi::mode_sense", identifier, "MODE SENSE: DBD");
 		uint8_t page_control = CDB[2] >> 6;
 		const char *const pagecodes[] { "current values", "changeable values", "default values", "saved values " };
-		DOLOG(logging::ll_debug, "scsi::mode_sense_6", identifier, "MODE SENSE 6: PAGE CONTROL %s (%d)", pagecodes[page_control], page_control);
+		DOLOG(logging::ll_debug, "scsi::mode_sense", identifier, "MODE SENSE: PAGE CONTROL %s (%d)", pagecodes[page_control], page_control);
 		uint8_t page_code = CDB[2] & 0x3f;
-		DOLOG(logging::ll_debug, "scsi::mode_sense_6", identifier, "MODE SENSE 6: PAGE CODE %02xh", page_code);
-		DOLOG(logging::ll_debug, "scsi::mode_sense_6", identifier, "MODE SENSE 6: SUBPAGE CODE %02xh", CDB[3]);
-		DOLOG(logging::ll_debug, "scsi::mode_sense_6", identifier, "MODE SENSE 6: AllocationLength: %d", CDB[4]);
-		DOLOG(logging::ll_debug, "scsi::mode_sense_6", identifier, "MODE SENSE 6: Control: %02xh", CDB[5]);
+		DOLOG(logging::ll_debug, "scsi::mode_sense", identifier, "MODE SENSE: PAGE CODE %02xh", page_code);
+		DOLOG(logging::ll_debug, "scsi::mode_sense", identifier, "MODE SENSE: SUBPAGE CODE %02xh", CDB[3]);
+		uint16_t allocation_length = is_10 ? (CDB[7] << 8) | CDB[8] : CDB[4];
+		DOLOG(logging::ll_debug, "scsi::mode_sense", identifier, "MODE SENSE: AllocationLength: %d", allocation_length);
+		DOLOG(logging::ll_debug, "scsi::mode_sense", identifier, "MODE SENSE: Control: %02xh", CDB[is_10 ? 9 : 5]);
+
+		// subpages are not supported
+		auto   pages       = CDB[3] == 0x00 || CDB[3] == 0xff ? get_mode_pages(page_code, page_control) : std::vector<uint8_t>();
+		size_t header_size = is_10 ? 8 : 4;
+		size_t total_size  = header_size + pages.size();
+
 		response.io.is_inline          = true;
-		response.io.what.data.second   = 4;
-		response.io.what.data.first    = new uint8_t[response.io.what.data.second]();
-		response.io.what.data.first[0] = response.io.what.data.second - 1;  // length
-		response.io.what.data.first[1] = 0;  // medium type
-		response.io.what.data.first[2] = 16;  // DPOFUA
+		response.io.what.data.second   = std::min(total_size, size_t(allocation_length));
+		response.io.what.data.first    = new uint8_t[total_size]();
+		uint8_t *const out = response.io.what.data.first;
+		if (is_10) {
+			out[0] = (total_size - 2) >> 8;  // length
+			out[1] = total_size - 2;
+			out[2] = 0;  // medium type
+			out[3] = 16;  // DPOFUA
+		}
+		else {
+			out[0] = total_size - 1;  // length
+			out[1] = 0;  // medium type
+			out[2] = 16;  // DPOFUA
+		}
+		if (pages.empty() == false)
+			memcpy(&out[header_size], pages.data(), pages.size());
 	}
 
 	return response;
 }
 
+scsi_response scsi::mode_select(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode)
+{
+	scsi_response response(ir_as_is);
+
+	bool is_10 = opcode == o_mode_select_10;
+
+	DOLOG(logging::ll_debug, "scsi::mode_select", identifier, "MODE SELECT %d", is_10 ? 10 : 6);
+
+	if (locking_status() == l_locked_other) {
+		DOLOG(logging::ll_error, "scsi::mode_select", identifier, "MODE SELECT failed due to reservations");
+		response.sense_data = error_reservation_conflict_1();
+		return response;
+	}
+
+	if (CDB[1] & 1) {  // SP
+		DOLOG(logging::ll_debug, "scsi::mode_select", identifier, "MODE SELECT: saving pages not supported");
+		response.sense_data = error_invalid_field();
+		return response;
+	}
+
+	// the parameter list is expected to arrive as immediate data, as with UNMAP
+	const uint8_t *const pd          = data.first;
+	const size_t         list_length = is_10 ? (CDB[7] << 8) | CDB[8] : CDB[4];
+	const size_t         header_size = is_10 ? 8 : 4;
+
+	if (list_length == 0) {  // nothing to change
+		response.type = ir_empty_sense;
+		return response;
+	}
+
+	if (list_length < header_size || data.first == nullptr || data.second < list_length) {
+		DOLOG(logging::ll_debug, "scsi::mode_select", identifier, "MODE SELECT: parameter list incomplete (%zu of %zu bytes)", data.first ? data.second : 0, list_length);
+		response.sense_data = error_invalid_parameter_list();
+		return response;
+	}
+
+	size_t offset = header_size + (is_10 ? (pd[6] << 8) | pd[7] : pd[3]);  // skip block descriptors
+	while(offset + 2 <= list_length) {
+		uint8_t page_code   = pd[offset] & 0x3f;
+		bool    spf         = pd[offset] & 0x40;
+		size_t  page_length = spf ? (offset + 4 <= list_length ? ((pd[offset + 2] << 8) | pd[offset + 3]) + 4 : list_length) : pd[offset + 1] + 2;
+
+		if (offset + page_length > list_length) {
+			DOLOG(logging::ll_debug, "scsi::mode_select", identifier, "MODE SELECT: page %02xh truncated", page_code);
+			response.sense_data = error_invalid_parameter_list();
+			return response;
+		}
+
+		if (page_code == 0x08 && spf == false && page_length >= 3) {
+			bool wce = pd[offset + 2] & 0x04;
+			DOLOG(logging::ll_debug, "scsi::mode_select", identifier, "MODE SELECT: caching page, WCE=%d", wce);
+
+			if (wce != b->get_write_cache() && (b->has_write_cache() == false || b->set_write_cache(wce) == false)) {
+				DOLOG(logging::ll_warning, "scsi::mode_select", identifier, "MODE SELECT: cannot %s the write cache", wce ? "enable" : "disable");
+				response.sense_data = error_invalid_parameter_list();
+				return response;
+			}
+		}
+		else {
+			DOLOG(logging::ll_debug, "scsi::mode_select", identifier, "MODE SELECT: page %02xh not supported", page_code);
+			response.sense_data = error_invalid_parameter_list();
+			return response;
+		}
+
+		offset += page_length;
+	}
+
+	response.type = ir_empty_sense;
+
+	return response;
+}
+
+// the designation descriptors of the device identification VPD page
+std::vector<uint8_t> scsi::get_designators() const
+{
+	std::vector<uint8_t> out(4 + serial.size() + 4 + sizeof naa_id);
+
+	out[0] = 2 | (5 << 4);  // 2 = ascii, 5 = iscsi
+	out[1] = 128;  // PIV, vendor specific
+	out[3] = serial.size();
+	memcpy(&out[4], serial.c_str(), serial.size());
+
+	uint8_t *const naa = &out[4 + serial.size()];
+	naa[0] = 1;  // binary
+	naa[1] = 3;  // NAA
+	naa[3] = sizeof naa_id;
+	memcpy(&naa[4], naa_id, sizeof naa_id);
+
+	return out;
+}
+
+// is 'designator' (a designation descriptor, as found in an EXTENDED COPY
+// identification CSCD descriptor) one of those of get_designators()?
+bool scsi::is_own_designator(const uint8_t *const designator, const size_t max_size) const
+{
+	if (max_size < 4 || size_t(4 + designator[3]) > max_size)
+		return false;
+
+	auto designators = get_designators();
+	for(size_t i=0; i + 4 <= designators.size(); i += 4 + designators[i + 3]) {
+		const uint8_t *const cur = &designators[i];
+		if ((cur[0] & 0x0f) == (designator[0] & 0x0f) &&  // code set
+		    (cur[1] & 0x3f) == (designator[1] & 0x3f) &&  // association, designator type
+		    cur[3] == designator[3] && memcmp(&cur[4], &designator[4], cur[3]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
 scsi_response scsi::inquiry(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data)
 {
 	scsi_response response(ir_as_is);
@@ -128,7 +313,8 @@ scsi_response scsi::inquiry(const std::string & identifier, const uint64_t lun,
 	DOLOG(logging::ll_debug, "scsi::inquiry", identifier, "INQUIRY: ControlByte: %02xh", CDB[5]);
 	bool ok = true;
 	uint8_t device_type = lun == 0 ? 0x0c :  // storage array controller
-					 0x00;  // direct access block device
+			      is_valid_lun(lun) ? 0x00 :  // direct access block device
+					 0x7f;  // no logical unit at this LUN
 	if ((CDB[1] & 1) == 0) {  // requests standard inquiry data
 		if (CDB[2])
 			ok = false;
@@ -141,7 +327,7 @@ scsi_response scsi::inquiry(const std::string & identifier, const uint64_t lun,
 			response.io.what.data.first[2] = 5;  // VERSION
 			response.io.what.data.first[3] = 2;  // response data format
 			response.io.what.data.first[4] = response.io.what.data.second - 5;  // additional length
-			response.io.what.data.first[5] = 0;
+			response.io.what.data.first[5] = 0x08;  // 3PC: EXTENDED COPY
 			response.io.what.data.first[6] = 0;
 			response.io.what.data.first[7] = 0;
 			memcpy(&response.io.what.data.first[8],  "vnHeusdn", 8);
@@ -165,7 +351,7 @@ scsi_response scsi::inquiry(const std::string & identifier, const uint64_t lun,
 	else {
 		if (CDB[2] == 0x00) {  // supported vital product page
 			response.io.is_inline          = true;
-			response.io.what.data.second   = 9;
+			response.io.what.data.second   = 10;
 			response.io.what.data.first    = new uint8_t[response.io.what.data.second]();
 			response.io.what.data.first[0] = device_type;
 			response.io.what.data.first[1] = CDB[2];
@@ -174,8 +360,9 @@ scsi_response scsi::inquiry(const std::string & identifier, const uint64_t lun,
 			response.io.what.data.first[4] = 0x00;
 			response.io.what.data.first[5] = 0x80;
 			response.io.what.data.first[6] = 0x83;  // see CDB[2] below
-			response.io.what.data.first[7] = 0xb0;
-			response.io.what.data.first[8] = 0xb1;
+			response.io.what.data.first[7] = 0x8f;
+			response.io.what.data.first[8] = 0xb0;
+			response.io.what.data.first[9] = 0xb1;
 		}
 		else if (CDB[2] == 0x80) {  // unit serial number page
 			response.io.is_inline          = true;
@@ -187,16 +374,72 @@ scsi_response scsi::inquiry(const std::string & identifier, const uint64_t lun,
 			memcpy(&response.io.what.data.first[4], serial.c_str(), serial.size());
 		}
 		else if (CDB[2] == 0x83) {  // device identification page
+			auto designators = get_designators();
 			response.io.is_inline          = true;
-			response.io.what.data.second   = 8 + serial.size();
+			response.io.what.data.second   = 4 + designators.size();
 			response.io.what.data.first    = new uint8_t[response.io.what.data.second]();
 			response.io.what.data.first[0] = device_type;
 			response.io.what.data.first[1] = CDB[2];
+			response.io.what.data.first[2] = (response.io.what.data.second - 4) >> 8;
 			response.io.what.data.first[3] = response.io.what.data.second - 4;
-			response.io.what.data.first[4] = 2 | (5 << 4);  // 2 = ascii, 5 = iscsi
-			response.io.what.data.first[5] = 128;  // PIV
-			response.io.what.data.first[7] = serial.size();
-			memcpy(&response.io.what.data.first[8], serial.c_str(), serial.size());
+			memcpy(&response.io.what.data.first[4], designators.data(), designators.size());
+		}
+		else if (CDB[2] == 0x8f) {  // third-party copy page
+			// supported commands: EXTENDED COPY (LID1) and RECEIVE COPY RESULTS (copy status, operating parameters)
+			const uint8_t commands[] { 0x83, 1, 0x00, 0x84, 2, 0x00, 0x03 };
+			response.io.is_inline          = true;
+			response.io.what.data.second   = 4 + 12 + 32 + 8 + 8 + 36;
+			response.io.what.data.first    = new uint8_t[response.io.what.data.second]();
+			uint8_t *const p = response.io.what.data.first;
+			p[0] = device_type;
+			p[1] = CDB[2];
+			p[2] = (response.io.what.data.second - 4) >> 8;
+			p[3] = response.io.what.data.second - 4;
+
+			uint8_t *d = &p[4];  // supported commands descriptor
+			d[1] = 0x01;
+			d[3] = 8;
+			d[4] = sizeof commands;
+			memcpy(&d[5], commands, sizeof commands);
+
+			d += 12;  // parameter data descriptor
+			d[1] = 0x04;
+			d[3] = 0x1c;
+			d[6] = uint8_t(max_xcopy_cscds >> 8);  // MAXIMUM CSCD DESCRIPTOR COUNT
+			d[7] = uint8_t(max_xcopy_cscds);
+			d[8] = uint8_t(max_xcopy_segments >> 8);  // MAXIMUM SEGMENT DESCRIPTOR COUNT
+			d[9] = uint8_t(max_xcopy_segments);
+			d[10] = uint8_t(max_xcopy_list_length >> 24);  // MAXIMUM DESCRIPTOR LIST LENGTH
+			d[11] = uint8_t(max_xcopy_list_length >> 16);
+			d[12] = uint8_t(max_xcopy_list_length >> 8);
+			d[13] = uint8_t(max_xcopy_list_length);
+			// MAXIMUM INLINE DATA LENGTH: 0
+
+			d += 32;  // supported descriptors descriptor
+			d[1] = 0x08;
+			d[3] = 4;
+			d[4] = 2;
+			d[5] = 0x02;  // block device to block device segment
+			d[6] = 0xe4;  // identification CSCD
+
+			d += 8;  // supported CSCD IDs descriptor
+			d[1] = 0x0c;
+			d[3] = 4;
+			d[5] = 2;
+			d[6] = 0x07;  // the logical unit that received the command
+			d[7] = 0xff;
+
+			d += 8;  // general copy operations descriptor
+			d[0] = 0x80;
+			d[1] = 0x01;
+			d[3] = 0x20;
+			d[7]  = 1;  // TOTAL CONCURRENT COPIES
+			d[11] = 1;  // MAXIMUM IDENTIFIED CONCURRENT COPIES
+			uint32_t max_segment_bytes = 0xffff * b->get_block_size();
+			d[12] = uint8_t(max_segment_bytes >> 24);  // MAXIMUM SEGMENT LENGTH
+			d[13] = uint8_t(max_segment_bytes >> 16);
+			d[14] = uint8_t(max_segment_bytes >> 8);
+			d[15] = uint8_t(max_segment_bytes);
 		}
 		else if (CDB[2] == 0xb0) {  // block limits
 			response.io.is_inline          = true;
@@ -219,7 +462,11 @@ scsi_response scsi::inquiry(const std::string & identifier, const uint64_t lun,
 #endif
 			response.io.what.data.first[23] = 00;  // LSB of 'MAXIMUM UNMAP LBA COUNT'
 			response.io.what.data.first[27] = 8;  // LSB of 'MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT'
-			response.io.what.data.first[31] = 8;  // LSB of 'OPTIMAL UNMAP GRANULARITY'
+			uint32_t granularity = b->get_discard_granularity();
+			response.io.what.data.first[28] = uint8_t(granularity >> 24);  // 'OPTIMAL UNMAP GRANULARITY'
+			response.io.what.data.first[29] = uint8_t(granularity >> 16);
+			response.io.what.data.first[30] = uint8_t(granularity >> 8);
+			response.io.what.data.first[31] = uint8_t(granularity);
 			response.io.what.data.first[40] = uint8_t(MAX_WS_LEN >> 24);  // 'MAXIMUM WRITE SAME LENGTH'
 			response.io.what.data.first[41] = uint8_t(MAX_WS_LEN >> 16);
 			response.io.what.data.first[42] = uint8_t(MAX_WS_LEN >> 8);
@@ -342,15 +589,49 @@ scsi_response scsi::get_lba_status(const std::string & identifier, const uint64_
 			response.sense_data = vr.value();
 		}
 		else {
+			uint32_t allocation_length = get_uint32_t(&CDB[10]);
+			uint64_t size_in_blocks    = b->get_size_in_blocks();
+			// at least 1 descriptor, even if it does not fit in the allocation length
+			size_t   max_descriptors   = std::min(size_t(64), std::max(size_t(1), size_t(allocation_length - std::min(allocation_length, uint32_t(8))) / 16));
+
 			response.io.is_inline          = true;
-			response.io.what.data.second   = 24;
-			response.io.what.data.first    = new uint8_t[response.io.what.data.second]();
-			response.io.what.data.first[0] = 0;
-			response.io.what.data.first[1] = 0;
-			response.io.what.data.first[2] = 0;
-			response.io.what.data.first[3] = response.io.what.data.second - 3;
-			memcpy(&response.io.what.data.first[8], &CDB[2], 8);  // LBA STATUS LOGICAL BLOCK ADDRESS
-			memcpy(&response.io.what.data.first[16], &CDB[10], 4);  // ALLOCATION LENGTH
+			response.io.what.data.first    = new uint8_t[8 + max_descriptors * 16]();
+
+			size_t n_descriptors = 0;
+			bool   ok            = true;
+			while(n_descriptors < max_descriptors && lba < size_in_blocks) {
+				backend::lba_status_t status = backend::LS_MAPPED;
+				uint64_t              n_same = 0;
+				if (b->get_lba_status(lba, std::min(size_in_blocks - lba, uint64_t(0xffffffff)), &status, &n_same) == false || n_same == 0) {
+					ok = false;
+					break;
+				}
+
+				uint8_t *const p = &response.io.what.data.first[8 + n_descriptors * 16];
+				for(int i=0; i<8; i++)
+					p[i] = lba >> (56 - i * 8);  // LBA STATUS LOGICAL BLOCK ADDRESS
+				for(int i=0; i<4; i++)
+					p[8 + i] = n_same >> (24 - i * 8);  // NUMBER OF LOGICAL BLOCKS
+				p[12] = status;  // PROVISIONING STATUS
+
+				lba += n_same;
+				n_descriptors++;
+			}
+
+			if (ok) {
+				size_t total_size = 8 + n_descriptors * 16;
+				uint32_t parameter_data_length = total_size - 4;
+				for(int i=0; i<4; i++)
+					response.io.what.data.first[i] = parameter_data_length >> (24 - i * 8);
+				response.io.what.data.second = std::min(total_size, size_t(allocation_length));
+			}
+			else {
+				DOLOG(logging::ll_error, "scsi::get_lba_status", identifier, "GET LBA STATUS, backend error");
+				delete [] response.io.what.data.first;
+				response.io.is_inline      = false;
+				response.io.what.data      = { };
+				response.sense_data        = error_read_error();
+			}
 		}
 	}
 	else {
@@ -445,7 +726,9 @@ scsi_response scsi::write_verify(io_stats_t *const is, const std::string & ident
 
 		uint32_t work_n_blocks  = std::min(transfer_length, uint32_t(received_blocks));
 		if (received_blocks > 0) {
-			rc = write(is, lba, work_n_blocks, data.first);
+			// with FUA every part is written durably: the write of the data that
+			// follows via R2T only makes its own range durable
+			rc = write(is, lba, work_n_blocks, data.first, fua);
 			ok = rc == scsi_rw_result::rw_ok;
 		}
 
@@ -457,7 +740,7 @@ scsi_response scsi::write_verify(io_stats_t *const is, const std::string & ident
 			rc = read(is, lba + work_n_blocks, 1, temp_buffer);
 			if (rc == scsi_rw_result::rw_ok) {
 				memcpy(temp_buffer, &data.first[work_n_blocks * backend_block_size], fragment_size);
-				rc = write(is, lba + received_blocks, 1, temp_buffer);
+				rc = write(is, lba + received_blocks, 1, temp_buffer, fua);
 			}
 
 			ok = rc == scsi_rw_result::rw_ok;
@@ -480,9 +763,6 @@ scsi_response scsi::write_verify(io_stats_t *const is, const std::string & ident
 			if (received_size == expected_size) {
 				response.type = ir_empty_sense;
 				DOLOG(logging::ll_debug, "scsi::write_verify", identifier, "received_size == expected_size");
-
-				if (fua)
-					this->sync(is);
 			}
 			else {  // allow R2T packets to come in
 				response.type           = ir_r2t;
@@ -582,12 +862,18 @@ scsi_response scsi::report_luns(const std::string & identifier, const uint64_t l
 
 	DOLOG(logging::ll_debug, "scsi::report_luns", identifier, "REPORT_LUNS, report: %02xh", CDB[2]);
 
+	uint32_t list_length = luns.size() * 8;
+
 	response.io.is_inline           = true;
-	response.io.what.data.second    = 16;
+	response.io.what.data.second    = 8 + list_length;
 	response.io.what.data.first     = new uint8_t[response.io.what.data.second]();
-	response.io.what.data.first[3]  = 8;  // lun list length
+	response.io.what.data.first[0]  = list_length >> 24;  // lun list length
+	response.io.what.data.first[1]  = list_length >> 16;
+	response.io.what.data.first[2]  = list_length >> 8;
+	response.io.what.data.first[3]  = list_length;
 					      // 4...7 reserved
-	encode_lun(&response.io.what.data.first[8], 1);  // LUN1
+	for(size_t i=0; i<luns.size(); i++)
+		encode_lun(&response.io.what.data.first[8 + i * 8], luns[i]);
 
 	return response;
 }
@@ -615,8 +901,6 @@ scsi_response scsi::report_supported_operation_codes(const std::string & identif
 			response.io.what.data.first[2] = (total_size + 0) >>  8;
 			response.io.what.data.first[3] = (total_size + 0);
 
-			assert(total_size < 256);
-
 			size_t add_offset = 0;
 			for(auto & it: scsi_a3_data) {
 				size_t offset = 4 + add_offset;
@@ -655,6 +939,8 @@ scsi_response scsi::report_supported_operation_codes(const std::string & identif
 
 	if (!ok)
 		response.sense_data = error_not_implemented();
+	else
+		response.io.what.data.second = std::min(response.io.what.data.second, size_t(get_uint32_t(&CDB[6])));  // allocation length
 
 	return response;
 }
@@ -669,7 +955,7 @@ scsi_response scsi::compare_and_write(io_stats_t *const is, const std::string &
 
 	auto block_size         = b->get_block_size();
 	auto expected_data_size = block_size * block_count * 2;
-	if (expected_data_size != data.second)
+	if (data.second > expected_data_size)
 		DOLOG(logging::ll_warning, "scsi::compare_and_write", identifier, "COMPARE AND WRITE: data count mismatch (%zu versus %zu)", size_t(expected_data_size), data.second);
 
 	response.amount_of_data_expected = expected_data_size;
@@ -683,6 +969,20 @@ scsi_response scsi::compare_and_write(io_stats_t *const is, const std::string &
 		DOLOG(logging::ll_debug, "scsi::compare_and_write", identifier, "COMPARE AND WRITE: too many blocks in one go (%u versus %u)", block_count, max_compare_and_write_block_count);
 		response.sense_data = error_compare_and_write_count();
 	}
+	else if (data.second < expected_data_size) {
+		// more than fits in the first burst: collect the rest via R2T, the
+		// command runs again when all of it was received
+		uint32_t received = data.first ? data.second : 0;
+		DOLOG(logging::ll_debug, "scsi::compare_and_write", identifier, "COMPARE AND WRITE: %u of %zu bytes received, starting R2T", received, size_t(expected_data_size));
+
+		response.type           = ir_r2t;
+		response.r2t.buffer_lba = lba;
+		response.r2t.bytes_done = received;
+		response.r2t.bytes_left = expected_data_size - received;
+		response.r2t.gather     = new uint8_t[expected_data_size]();
+		if (received)
+			memcpy(response.r2t.gather, data.first, received);
+	}
 	else {
 		auto result = cmpwrite(is, lba, block_count, &data.first[block_count * block_size], &data.first[0]);
 
@@ -702,11 +1002,14 @@ scsi_response scsi::compare_and_write(io_stats_t *const is, const std::string &
 	return response;
 }
 
-scsi_response scsi::prefetch(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode)
+// asks the backend to read the range into a cache. with IMMED set it returns
+// right away. CONDITION MET means that the whole range will be in the cache.
+scsi_response scsi::prefetch(io_stats_t *const is, const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode)
 {
 	scsi_response response(ir_as_is);
 
-	DOLOG(logging::ll_debug, "scsi::prefetch", identifier, "PREFETCH 10/16");
+	bool immed = CDB[1] & 2;
+	DOLOG(logging::ll_debug, "scsi::prefetch", identifier, "PREFETCH 10/16, IMMED: %d", immed);
 
 	uint64_t lba             = 0;
 	uint32_t transfer_length = 0;
@@ -720,13 +1023,28 @@ scsi_response scsi::prefetch(const std::string & identifier, const uint64_t lun,
 		DOLOG(logging::ll_debug, "scsi::prefetch", identifier, "PREFETCH_10, LBA %" PRIu64 ", %u sectors", lba, transfer_length);
 	}
 
+	// 0: up to the end of the device
+	if (transfer_length == 0 && lba < get_size_in_blocks())
+		transfer_length = std::min(get_size_in_blocks() - lba, uint64_t(UINT32_MAX));
+
 	auto vr = validate_request(lba, transfer_length, nullptr);
 	if (vr.has_value()) {
 		DOLOG(logging::ll_debug, "scsi::prefetch", identifier, "PREFETCH parameters invalid");
 		response.sense_data = vr.value();
+		return response;
+	}
+
+	bool fits = false;
+	auto rc   = prefetch(is, lba, transfer_length, immed == false, &fits);
+	if (rc == rw_ok) {
+		response.type          = ir_empty_sense;
+		response.condition_met = fits;
 	}
+	else if (rc == rw_fail_locked)
+		response.sense_data = error_reservation_conflict_1();
 	else {
-		response.type = ir_empty_sense;
+		DOLOG(logging::ll_error, "scsi::prefetch", identifier, "PREFETCH failed");
+		response.sense_data = error_read_error();
 	}
 
 	return response;
@@ -774,32 +1092,65 @@ scsi_response scsi::unmap(io_stats_t *const is, const std::string & identifier,
 
 	DOLOG(logging::ll_debug, "scsi::unmap", identifier, "UNMAP");
 
+	// check all descriptors before trimming anything, then sort and merge them:
+	// after deleting files, guests send long lists of small, adjacent ranges
 	const uint8_t *const pd = data.first;
-	scsi_rw_result rc = rw_ok;
-	for(size_t i=8; i<data.second; i+= 16) {
+	std::vector<std::pair<uint64_t, uint64_t> > ranges;  // first block, first block after the range
+	for(size_t i=8; i + 16 <= data.second; i+= 16) {
 		uint64_t lba             = get_uint64_t(&pd[i]);
 		uint32_t transfer_length = get_uint32_t(&pd[i + 8]);
 
 		auto vr = validate_request(lba, transfer_length, nullptr);
-		if (vr.has_value() || transfer_length > MAX_UNMAP_BLOCKS) {
-			if (vr.has_value()) {
-				DOLOG(logging::ll_debug, "scsi::unmap", identifier,"UNMAP parameters invalid");
-				response.sense_data = vr.value();
-			}
-			else {
-				DOLOG(logging::ll_debug, "scsi::unmap", identifier,"UNMAP parameters out of range");
-				response.sense_data = error_out_of_range();
-			}
-			rc = rw_fail_general;
+		if (vr.has_value()) {
+			DOLOG(logging::ll_debug, "scsi::unmap", identifier,"UNMAP parameters invalid");
+			response.sense_data = vr.value();
+			return response;
+		}
+		if (transfer_length > MAX_UNMAP_BLOCKS) {
+			DOLOG(logging::ll_debug, "scsi::unmap", identifier,"UNMAP parameters out of range");
+			response.sense_data = error_out_of_range();
+			return response;
 		}
-		else if (transfer_length > 0) {  // 0 is not an error but the backend may not handle it well
-			DOLOG(logging::ll_debug, "scsi::unmap", identifier, "UNMAP trim LBA %" PRIu64 ", %u blocks", lba, transfer_length);
 
-			rc = trim(is, lba, transfer_length);
-			if (rc != rw_ok) {
-				DOLOG(logging::ll_error, "scsi::unmap", identifier, "UNMAP trim failed");
-				break;
-			}
+		if (transfer_length > 0)  // 0 is not an error but the backend may not handle it well
+			ranges.push_back({ lba, lba + transfer_length });
+	}
+
+	auto merged = merge_ranges(ranges);
+
+	DOLOG(logging::ll_debug, "scsi::unmap", identifier, "UNMAP %zu descriptors, %zu ranges after merging", ranges.size(), merged.size());
+
+	// only whole granules (the 'OPTIMAL UNMAP GRANULARITY' of the block limits
+	// VPD) are trimmed; the parts of a range before the first and after the
+	// last one are zeroed instead, as LBPRZ promises that they read as zeros
+	const uint64_t granularity = std::max(b->get_discard_granularity(), uint32_t(1));
+
+	scsi_rw_result rc = rw_ok;
+	for(auto & r: merged) {
+		uint64_t first = std::min((r.first + granularity - 1) / granularity * granularity, r.second);
+		uint64_t end   = std::max(r.second / granularity * granularity, first);
+
+		if (first > r.first) {
+			DOLOG(logging::ll_debug, "scsi::unmap", identifier, "UNMAP zero LBA %" PRIu64 ", %" PRIu64 " blocks", r.first, first - r.first);
+			rc = write_zeroes(is, r.first, first - r.first);
+		}
+
+		for(uint64_t lba = first; lba < end && rc == rw_ok;) {
+			uint32_t n = std::min(end - lba, uint64_t(UINT32_MAX) / granularity * granularity);
+			DOLOG(logging::ll_debug, "scsi::unmap", identifier, "UNMAP trim LBA %" PRIu64 ", %u blocks", lba, n);
+
+			rc = trim(is, lba, n);
+			lba += n;
+		}
+
+		if (end < r.second && rc == rw_ok) {
+			DOLOG(logging::ll_debug, "scsi::unmap", identifier, "UNMAP zero LBA %" PRIu64 ", %" PRIu64 " blocks", end, r.second - end);
+			rc = write_zeroes(is, end, r.second - end);
+		}
+
+		if (rc != rw_ok) {
+			DOLOG(logging::ll_error, "scsi::unmap", identifier, "UNMAP trim failed");
+			break;
 		}
 	}
 
@@ -840,86 +1191,287 @@ scsi_response scsi::write_same(io_stats_t *const is, const std::string & identif
 	auto backend_block_size = b->get_block_size();
 
 	response.r2t.is_write_same       = true;
-	response.amount_of_data_expected = transfer_length * backend_block_size;
-
-	size_t expected_size = backend_block_size;
+	response.amount_of_data_expected = backend_block_size;  // one block, written transfer_length times
 
 	auto vr = validate_request(lba, transfer_length, CDB);
 	if (vr.has_value()) {
 		DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME parameters invalid");
 		response.sense_data = vr.value();
+		return response;
 	}
-	else if (data.first) {
+
+	uint32_t n_blocks = transfer_length;
+	if (transfer_length == 0) {  // up to the end of the device
+		const uint64_t size_in_blocks = b->get_size_in_blocks();
+
+		if (size_in_blocks - lba > MAX_WS_LEN) {
+			DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME maximum number of blocks for TL=0");
+			response.sense_data = error_invalid_field();
+			return response;
+		}
+
+		n_blocks = size_in_blocks - lba;
+	}
+
+	if (data.first) {
 		DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE SAME command includes data (%zu bytes)", data.second);
 
-		size_t received_size   = data.second;
-		size_t received_blocks = received_size / backend_block_size;
+		size_t received_blocks = data.second / backend_block_size;
 
-		bool ok = true;
+		if (received_blocks != 1) {
+			DOLOG(logging::ll_info, "scsi::write_same", identifier, "WRITE_SAME received block count (%zu) != 1", received_blocks);
+			return response;
+		}
+
+		scsi::scsi_rw_result rc = write_same(is, lba, n_blocks, data.first, response.r2t.write_same_is_unmap);
 
-		if (received_blocks == 1)
-			DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME to LBA %" PRIu64 " is %zu in bytes", lba, backend_block_size);
+		if (rc == scsi_rw_result::rw_fail_rw || rc == scsi_rw_result::rw_fail_general) {
+			DOLOG(logging::ll_error, "scsi::write_same", identifier, "WRITE_SAME, general %s error", response.r2t.write_same_is_unmap ? "trim" : "write");
+			response.sense_data = error_write_error();
+		}
+		else if (rc == rw_fail_locked) {
+			DOLOG(logging::ll_error, "scsi::write_same", identifier, "WRITE_SAME, failed due to reservations");
+			response.sense_data = error_reservation_conflict_1();
+		}
 		else {
-			DOLOG(logging::ll_info, "scsi::write_same", identifier, "WRITE_SAME received block count (%u) != 1", received_blocks);
-			ok = false;
+			response.type = ir_empty_sense;
+			DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME of %u blocks done", n_blocks);
 		}
+	}
+	else if (n_blocks > 0) {
+		DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME without data");
 
-		if (ok) {
-			scsi::scsi_rw_result rc = rw_ok;
+		// allow R2T packets to come in: the one block is written in server::push_response
+		response.type                     = ir_r2t;
+		response.r2t.buffer_lba           = lba;
+		response.r2t.bytes_left           = backend_block_size;
+		response.r2t.bytes_done           = 0;
+		response.r2t.write_same_n_blocks  = n_blocks;
+	}
+	else {
+		response.type = ir_empty_sense;
+		DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME with 0 transfer_length");
+	}
 
-			const uint64_t size_in_blocks = b->get_size_in_blocks();
+	return response;
+}
 
-			if (transfer_length == 0) {
-				if (size_in_blocks - lba > MAX_WS_LEN) {
-					DOLOG(logging::ll_debug, "scsi::validate_request", "-", "WRITE_SAME maximum number of blocks for TL=0");
-					response.sense_data = error_invalid_field();
-					ok = false;
-				}
-				else {
-					for(uint64_t i=lba; i<b->get_size_in_blocks() && rc == rw_ok; i++) {
-						rc = response.r2t.write_same_is_unmap ?
-							trim(is, i, 1) :
-							write(is, i, 1, data.first);
-					}
-				}
+// EXTENDED COPY (LID1) with block device to block device segments: copies
+// within this device, offloaded to the backend, so that no data crosses the
+// network
+scsi_response scsi::extended_copy(io_stats_t *const is, const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data)
+{
+	scsi_response response(ir_as_is);
+
+	uint32_t list_length = get_uint32_t(&CDB[10]);
+	response.amount_of_data_expected = list_length;
+	DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY, service action %02xh, parameter list length %u", CDB[1] & 0x1f, list_length);
+
+	if (CDB[1] & 0x1f) {  // LID4
+		response.sense_data = error_invalid_field();
+		return response;
+	}
+
+	if (list_length == 0) {
+		response.type = ir_empty_sense;
+		return response;
+	}
+
+	if (data.first == nullptr || data.second < list_length || list_length < 16) {
+		DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: parameter list missing or too short");
+		response.sense_data = error_parameter_list_length();
+		return response;
+	}
+
+	const uint8_t *const p = data.first;
+	uint8_t  list_id        = p[0];
+	uint8_t  list_id_usage  = (p[1] >> 3) & 3;  // 3: no list identifier, results are not kept
+	uint32_t cscd_length    = (p[2] << 8) | p[3];
+	uint32_t segment_length = get_uint32_t(&p[8]);
+	uint32_t inline_length  = get_uint32_t(&p[12]);
+
+	if (uint64_t(16) + cscd_length + segment_length + inline_length > list_length) {
+		DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: descriptor lists do not fit in the parameter list");
+		response.sense_data = error_parameter_list_length();
+		return response;
+	}
+
+	if (cscd_length % 32 || cscd_length / 32 > max_xcopy_cscds || inline_length) {
+		DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: invalid CSCD list (%u bytes) or inline data (%u bytes)", cscd_length, inline_length);
+		response.sense_data = error_invalid_parameter_list();
+		return response;
+	}
+
+	// which of the copy targets are this logical unit
+	std::vector<bool> cscd_is_self;
+	auto block_size = b->get_block_size();
+	for(uint32_t i=16; i<16 + cscd_length; i += 32) {
+		const uint8_t *const d = &p[i];
+		if (d[0] != 0xe4) {  // identification CSCD descriptor
+			DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: CSCD descriptor type %02xh not supported", d[0]);
+			response.sense_data = error_invalid_parameter_list();
+			return response;
+		}
+
+		uint32_t disk_block_length = (d[29] << 16) | (d[30] << 8) | d[31];
+		bool     is_self           = (d[1] >> 6) == 0 /* LU ID TYPE: designator */ && is_own_designator(&d[4], 24) && (disk_block_length == 0 || disk_block_length == block_size);
+		DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: CSCD %zu is %s", cscd_is_self.size(), is_self ? "this device" : "unknown");
+		cscd_is_self.push_back(is_self);
+	}
+
+	struct segment {
+		uint64_t src_lba;
+		uint64_t dst_lba;
+		uint32_t n_blocks;
+	};
+	std::vector<segment> segments;
+	for(uint32_t i=16 + cscd_length; i<16 + cscd_length + segment_length;) {
+		const uint8_t *const d = &p[i];
+		uint32_t descriptor_length = i + 4 <= list_length ? (d[2] << 8) | d[3] : 0;
+		if (i + 4 > list_length || d[0] != 0x02 || descriptor_length != 0x18 || i + 4 + descriptor_length > 16 + cscd_length + segment_length || segments.size() >= max_xcopy_segments) {
+			DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: segment descriptor %zu (type %02xh) invalid or not supported", segments.size(), i + 4 <= list_length ? d[0] : 0);
+			response.sense_data = error_invalid_parameter_list();
+			return response;
+		}
+
+		uint16_t src_id = (d[4] << 8) | d[5];
+		uint16_t dst_id = (d[6] << 8) | d[7];
+		for(auto id: { src_id, dst_id }) {
+			if (id != 0x07ff /* the receiving logical unit */ && id >= cscd_is_self.size()) {
+				DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: CSCD %u does not exist", id);
+				response.sense_data = error_invalid_parameter_list();
+				return response;
 			}
-			else {
-				for(uint32_t i=0; i<transfer_length && rc == rw_ok; i++, lba++) {
-					rc = response.r2t.write_same_is_unmap ?
-						trim(is, lba, 1) :
-						write(is, lba, 1, data.first);
-				}
+			if (id != 0x07ff && cscd_is_self[id] == false) {
+				DOLOG(logging::ll_warning, "scsi::extended_copy", identifier, "EXTENDED COPY: only copies within this device are supported");
+				response.sense_data = error_unreachable_copy_target();
+				return response;
 			}
+		}
 
-			if (rc == scsi_rw_result::rw_fail_rw) {
-				DOLOG(logging::ll_error, "scsi::write_same", identifier, "WRITE_SAME, general %s error", response.r2t.write_same_is_unmap ? "trim" : "write");
-				response.sense_data = error_write_error();
-				ok = false;
-			}
-			else if (rc == rw_fail_locked) {
-				DOLOG(logging::ll_error, "scsi::write_same", identifier, "WRITE_SAME, failed due to reservations");
-				response.sense_data = error_reservation_conflict_1();
-				ok = false;
+		segment s { get_uint64_t(&d[12]), get_uint64_t(&d[20]), uint32_t((d[10] << 8) | d[11]) };
+		for(auto lba: { s.src_lba, s.dst_lba }) {
+			auto vr = validate_request(lba, s.n_blocks, nullptr);
+			if (vr.has_value()) {
+				DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: LBA %" PRIu64 " + %u blocks out of range", lba, s.n_blocks);
+				response.sense_data = vr.value();
+				return response;
 			}
 		}
 
-		if (ok) {
-			response.type = ir_empty_sense;
-			DOLOG(logging::ll_debug, "scsi::write_same", identifier, "received_size == expected_size");
+		if (s.n_blocks)
+			segments.push_back(s);
+		i += 4 + descriptor_length;
+	}
+
+	copy_result_t result { 1, 0, 0 };
+	scsi_rw_result rc = rw_ok;
+	for(auto & s: segments) {
+		DOLOG(logging::ll_debug, "scsi::extended_copy", identifier, "EXTENDED COPY: LBA %" PRIu64 " to %" PRIu64 ", %u blocks", s.src_lba, s.dst_lba, s.n_blocks);
+		rc = copy(is, s.src_lba, s.dst_lba, s.n_blocks);
+		if (rc != rw_ok) {
+			result.status = 2;
+			break;
 		}
+		result.segments_processed++;
+		result.bytes_copied += uint64_t(s.n_blocks) * block_size;
 	}
+
+	if (list_id_usage != 3) {
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+		std::unique_lock lck(copy_results_lock);
+#endif
+		copy_results[list_id] = result;
+	}
+
+	if (rc == rw_ok)
+		response.type = ir_empty_sense;
+	else if (rc == rw_fail_locked)
+		response.sense_data = error_reservation_conflict_1();
 	else {
-		DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME without data");
+		DOLOG(logging::ll_error, "scsi::extended_copy", identifier, "EXTENDED COPY failed after %u segments", result.segments_processed);
+		response.sense_data = error_copy_aborted();
+	}
 
-		if (transfer_length == expected_size)
-			response.type = ir_r2t;  // allow R2T packets to come in
-		else {
-			// TODO: error of transfer_length != 0?
-			response.type = ir_empty_sense;
-			DOLOG(logging::ll_debug, "scsi::write_same", identifier, "WRITE_SAME with 0 transfer_length");
+	return response;
+}
+
+scsi_response scsi::receive_copy_results(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data)
+{
+	scsi_response response(ir_as_is);
+
+	uint8_t  service_action    = CDB[1] & 0x1f;
+	uint8_t  list_id           = CDB[2];
+	uint32_t allocation_length = get_uint32_t(&CDB[10]);
+	DOLOG(logging::ll_debug, "scsi::receive_copy_results", identifier, "RECEIVE COPY RESULTS, service action %02xh, list identifier %u", service_action, list_id);
+
+	if (service_action == 0x00) {  // copy status
+		std::optional<copy_result_t> result;
+		{
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+			std::unique_lock lck(copy_results_lock);
+#endif
+			auto it = copy_results.find(list_id);
+			if (it != copy_results.end())
+				result = it->second;
 		}
+
+		if (result.has_value() == false) {
+			DOLOG(logging::ll_debug, "scsi::receive_copy_results", identifier, "no results for list identifier %u", list_id);
+			response.sense_data = error_invalid_field();
+			return response;
+		}
+
+		uint64_t kb = std::min(result.value().bytes_copied / 1024, uint64_t(UINT32_MAX));
+		response.io.is_inline          = true;
+		response.io.what.data.second   = 12;
+		response.io.what.data.first    = new uint8_t[response.io.what.data.second]();
+		uint8_t *const p = response.io.what.data.first;
+		p[3]  = response.io.what.data.second - 4;  // AVAILABLE DATA
+		p[4]  = result.value().status;  // COPY MANAGER STATUS, HDD = 0
+		p[5]  = result.value().segments_processed >> 8;
+		p[6]  = result.value().segments_processed;
+		p[7]  = 0x01;  // TRANSFER COUNT UNITS: kilobytes
+		p[8]  = kb >> 24;
+		p[9]  = kb >> 16;
+		p[10] = kb >> 8;
+		p[11] = kb;
+	}
+	else if (service_action == 0x03) {  // operating parameters
+		response.io.is_inline          = true;
+		response.io.what.data.second   = 46;
+		response.io.what.data.first    = new uint8_t[response.io.what.data.second]();
+		uint8_t *const p = response.io.what.data.first;
+		p[3]  = response.io.what.data.second - 4;  // AVAILABLE DATA
+		p[4]  = 1;  // SNLID: lists without identifier are accepted
+		p[8]  = uint8_t(max_xcopy_cscds >> 8);
+		p[9]  = uint8_t(max_xcopy_cscds);
+		p[10] = uint8_t(max_xcopy_segments >> 8);
+		p[11] = uint8_t(max_xcopy_segments);
+		p[12] = uint8_t(max_xcopy_list_length >> 24);
+		p[13] = uint8_t(max_xcopy_list_length >> 16);
+		p[14] = uint8_t(max_xcopy_list_length >> 8);
+		p[15] = uint8_t(max_xcopy_list_length);
+		uint32_t max_segment_bytes = 0xffff * b->get_block_size();
+		p[16] = uint8_t(max_segment_bytes >> 24);  // MAXIMUM SEGMENT LENGTH
+		p[17] = uint8_t(max_segment_bytes >> 16);
+		p[18] = uint8_t(max_segment_bytes >> 8);
+		p[19] = uint8_t(max_segment_bytes);
+		// MAXIMUM INLINE DATA LENGTH, HELD DATA LIMIT, MAXIMUM STREAM DEVICE TRANSFER SIZE: 0
+		p[35] = 1;  // TOTAL CONCURRENT COPIES
+		p[36] = 1;  // MAXIMUM CONCURRENT COPIES
+		p[43] = 2;  // IMPLEMENTED DESCRIPTOR LIST LENGTH
+		p[44] = 0x02;  // block device to block device segment
+		p[45] = 0xe4;  // identification CSCD
+	}
+	else {
+		DOLOG(logging::ll_warning, "scsi::receive_copy_results", identifier, "service action %02xh not implemented", service_action);
+		response.sense_data = error_invalid_field();
+		return response;
 	}
 
+	response.io.what.data.second = std::min(response.io.what.data.second, size_t(allocation_length));
+
 	return response;
 }
 
@@ -938,10 +1490,19 @@ std::optional<scsi_response> scsi::send(io_stats_t *const is, const uint64_t lun
 
 	scsi_response response(ir_as_is);
 
+	// INQUIRY and REPORT LUNS are valid for any LUN, see SPC-4 4.6.7
+	if (is_valid_lun(lun) == false && opcode != o_inquiry && opcode != o_report_luns) {
+		DOLOG(logging::ll_debug, "scsi::send", lun_identifier, "LUN not supported");
+		response.sense_data = error_lun_not_supported();
+		return response;
+	}
+
 	if (opcode == o_test_unit_ready)
 		response = test_unit_ready(lun_identifier, lun, CDB, size, data);
-	else if (opcode == o_mode_sense_6)  // 0x1a
-		response = mode_sense_6(lun_identifier, lun, CDB, size, data);
+	else if (opcode == o_mode_sense_6 || opcode == o_mode_sense_10)  // 0x1a & 0x5a
+		response = mode_sense(lun_identifier, lun, CDB, size, data, opcode);
+	else if (opcode == o_mode_select_6 || opcode == o_mode_select_10)  // 0x15 & 0x55
+		response = mode_select(lun_identifier, lun, CDB, size, data, opcode);
 	else if (opcode == o_inquiry)  // 0x12
 		response = inquiry(lun_identifier, lun, CDB, size, data);
 	else if (opcode == o_read_capacity_10)
@@ -961,7 +1522,7 @@ std::optional<scsi_response> scsi::send(io_stats_t *const is, const uint64_t lun
 	else if (opcode == o_compare_and_write)  // 0x89
 		response = compare_and_write(is, lun_identifier, lun, CDB, size, data);
 	else if (opcode == o_prefetch_10 || opcode == o_prefetch_16)  // 0x34 & 0x90
-		response = prefetch(lun_identifier, lun, CDB, size, data, opcode);
+		response = prefetch(is, lun_identifier, lun, CDB, size, data, opcode);
 	else if (opcode == o_reserve_6)
 		response = reserve(lun_identifier, lun, CDB, size, data);
 	else if (opcode == o_release_6)
@@ -970,6 +1531,10 @@ std::optional<scsi_response> scsi::send(io_stats_t *const is, const uint64_t lun
 		response = unmap(is, lun_identifier, lun, CDB, size, data);
 	else if (opcode == o_write_same_10 || opcode == o_write_same_16)  // 0x41 & 0x93
 		response = write_same(is, lun_identifier, lun, CDB, size, data, opcode);
+	else if (opcode == o_extended_copy)  // 0x83
+		response = extended_copy(is, lun_identifier, lun, CDB, size, data);
+	else if (opcode == o_receive_copy_results)  // 0x84
+		response = receive_copy_results(lun_identifier, lun, CDB, size, data);
 	else {
 		DOLOG(logging::ll_warning, "scsi::send", lun_identifier, "opcode %02xh not implemented", opcode);
 		response.sense_data = error_not_implemented();
@@ -980,6 +1545,12 @@ std::optional<scsi_response> scsi::send(io_stats_t *const is, const uint64_t lun
 	return response;
 }
 
+// LUN 0 is the storage array controller
+bool scsi::is_valid_lun(const uint64_t lun) const
+{
+	return lun == 0 || std::find(luns.begin(), luns.end(), lun) != luns.end();
+}
+
 // returns sense data in case of a problem
 std::optional<std::vector<uint8_t> > scsi::validate_request(const uint64_t lba, const uint32_t n_blocks, const uint8_t *const CDB) const
 {
@@ -1059,7 +1630,8 @@ scsi::scsi_rw_result scsi::sync(io_stats_t *const is)
 	return rw_fail_locked;
 }
 
-scsi::scsi_rw_result scsi::write(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data)
+// fua: data must be on stable storage when this returns
+scsi::scsi_rw_result scsi::write(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua)
 {
 	is->n_writes++;
 	is->bytes_written += n_blocks * b->get_block_size();
@@ -1068,24 +1640,32 @@ scsi::scsi_rw_result scsi::write(io_stats_t *const is, const uint64_t block_nr,
 		bool result = false;
 		auto start = get_micros();
 		if (trim_level == 2) {
-			bool     is_zero = true;
+			// zero blocks are trimmed instead of written so that thin images stay sparse.
+			// adjacent blocks of the same kind go to the backend in one call
 			auto     bs      = get_block_size();
-			uint8_t *zero    = new uint8_t[bs]();
-			for(uint32_t i=0; i<n_blocks; i++) {
-				if (memcmp(&data[i * bs], zero, bs) != 0) {
-					is_zero = false;
-					break;
-				}
+			bool     ok      = true;
+			uint32_t i       = 0;
+			bool     zero    = n_blocks > 0 && is_zero(data, bs);
+			while(i < n_blocks && ok) {
+				// each block is checked once: the one that ends a run starts the next
+				uint32_t n    = 1;
+				bool     next = zero;
+				while(i + n < n_blocks && (next = is_zero(&data[(i + n) * bs], bs)) == zero)
+					n++;
+
+				if (zero)
+					ok = fua ? b->trim_fua(block_nr + i, n) : b->trim(block_nr + i, n);
+				else
+					ok = fua ? b->write_fua(block_nr + i, n, &data[i * bs]) : b->write(block_nr + i, n, &data[i * bs]);
+
+				i   += n;
+				zero = next;
 			}
-			delete [] zero;
 
-			if (is_zero)
-				result = b->trim(block_nr, n_blocks);
-			else
-				result = b->write(block_nr, n_blocks, data);
+			result = ok;
 		}
 		else {
-			result = b->write(block_nr, n_blocks, data);
+			result = fua ? b->write_fua(block_nr, n_blocks, data) : b->write(block_nr, n_blocks, data);
 		}
 
 		is->io_wait += get_micros() - start;
@@ -1103,18 +1683,9 @@ scsi::scsi_rw_result scsi::trim(io_stats_t *const is, const uint64_t block_nr, c
 
 		auto start = get_micros();
 		if (trim_level == 0) {  // 0 = do not trim/unmap
-			scsi::scsi_rw_result rc   = rw_ok;
-			uint8_t             *zero = new uint8_t[get_block_size()]();
-			for(uint32_t i=0; i<n_blocks; i++) {
-				rc = write(is, block_nr + i, 1, zero);
-				if (rc != rw_ok)
-					break;
-			}
-			delete [] zero;
-
 			is->io_wait += get_micros() - start;
 
-			return rc;
+			return write_zeroes(is, block_nr, n_blocks);
 		}
 		else {
 			bool result  = b->trim(block_nr, n_blocks);
@@ -1129,6 +1700,44 @@ scsi::scsi_rw_result scsi::trim(io_stats_t *const is, const uint64_t block_nr, c
 	return rw_fail_locked;
 }
 
+// zeros the blocks while keeping them allocated
+scsi::scsi_rw_result scsi::write_zeroes(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks)
+{
+	is->n_writes++;
+	is->bytes_written += n_blocks * b->get_block_size();
+
+	if (locking_status() != l_locked_other) {  // locked by myself or not locked?
+		auto start   = get_micros();
+		bool result  = b->write_zeroes(block_nr, n_blocks);
+		is->io_wait += get_micros() - start;
+		return result ? rw_ok : rw_fail_general;
+	}
+
+	return rw_fail_locked;
+}
+
+// 'pattern' is one block. with 'unmap' the blocks are trimmed instead, but only when
+// that gives the same result as writing them: if the pattern is all zeros
+scsi::scsi_rw_result scsi::write_same(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern, const bool unmap)
+{
+	auto block_size = b->get_block_size();
+
+	if (is_zero(pattern, block_size))
+		return unmap ? trim(is, block_nr, n_blocks) : write_zeroes(is, block_nr, n_blocks);
+
+	is->n_writes++;
+	is->bytes_written += n_blocks * block_size;
+
+	if (locking_status() != l_locked_other) {  // locked by myself or not locked?
+		auto start   = get_micros();
+		bool result  = b->write_same(block_nr, n_blocks, pattern);
+		is->io_wait += get_micros() - start;
+		return result ? rw_ok : rw_fail_general;
+	}
+
+	return rw_fail_locked;
+}
+
 scsi::scsi_rw_result scsi::read(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data)
 {
 	is->n_reads++;
@@ -1144,6 +1753,18 @@ scsi::scsi_rw_result scsi::read(io_stats_t *const is, const uint64_t block_nr, c
 	return rw_fail_locked;
 }
 
+scsi::scsi_rw_result scsi::prefetch(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits)
+{
+	if (locking_status() != l_locked_other) {  // locked by myself or not locked?
+		auto start   = get_micros();
+		bool result  = b->prefetch(block_nr, n_blocks, wait, fits);
+		is->io_wait += get_micros() - start;
+		return result ? rw_ok : rw_fail_general;
+	}
+
+	return rw_fail_locked;
+}
+
 scsi::scsi_rw_result scsi::cmpwrite(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const write_data, const uint8_t *const compare_data)
 {
 	is->n_reads++;
@@ -1154,8 +1775,11 @@ scsi::scsi_rw_result scsi::cmpwrite(io_stats_t *const is, const uint64_t block_n
 	if (locking_status() != l_locked_other) {
 		auto start   = get_micros();
 		auto result  = b->cmpwrite(block_nr, n_blocks, write_data, compare_data);
+		auto took    = get_micros() - start;
 
-		is->io_wait += get_micros() - start;
+		is->io_wait     += took;
+		is->cmpwrite_us += took;
+		is->n_cmpwrites++;
 
 		if (result == backend::cmpwrite_result_t::CWR_OK)
 			return rw_ok;
@@ -1170,6 +1794,22 @@ scsi::scsi_rw_result scsi::cmpwrite(io_stats_t *const is, const uint64_t block_n
 	return rw_fail_locked;
 }
 
+// copy within the device, the backend decides how (e.g. a reflink)
+scsi::scsi_rw_result scsi::copy(io_stats_t *const is, const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks)
+{
+	is->n_writes++;
+	is->bytes_written += n_blocks * b->get_block_size();
+
+	if (locking_status() != l_locked_other) {  // locked by myself or not locked?
+		auto start   = get_micros();
+		bool result  = b->copy(src_block_nr, dst_block_nr, n_blocks);
+		is->io_wait += get_micros() - start;
+		return result ? rw_ok : rw_fail_general;
+	}
+
+	return rw_fail_locked;
+}
+
 scsi::scsi_lock_status scsi::reserve_device()
 {
 #if !defined(TEENSY4_1) && !defined(RP2040W)
@@ -1285,3 +1925,33 @@ std::vector<uint8_t> scsi::error_invalid_field() const
 	// ILLEGAL_REQUEST(0x05)/INVALID FIELD(0x2400)
 	return { 0x70, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x24, 0x00, 0x00, 0x00, 0x00, 0x00 };
 }
+
+std::vector<uint8_t> scsi::error_parameter_list_length() const
+{
+	// ILLEGAL_REQUEST(0x05)/PARAMETER LIST LENGTH ERROR(0x1a00)
+	return { 0x70, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x1a, 0x00, 0x00, 0x00, 0x00, 0x00 };
+}
+
+std::vector<uint8_t> scsi::error_invalid_parameter_list() const
+{
+	// ILLEGAL_REQUEST(0x05)/INVALID FIELD IN PARAMETER LIST(0x2600)
+	return { 0x70, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x26, 0x00, 0x00, 0x00, 0x00, 0x00 };
+}
+
+std::vector<uint8_t> scsi::error_unreachable_copy_target() const
+{
+	// COPY_ABORTED(0x0a)/UNREACHABLE COPY TARGET(0x0804)
+	return { 0x70, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00 };
+}
+
+std::vector<uint8_t> scsi::error_copy_aborted() const
+{
+	// COPY_ABORTED(0x0a)/THIRD PARTY DEVICE FAILURE(0x0d01)
+	return { 0x70, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x0d, 0x01, 0x00, 0x00, 0x00, 0x00 };
+}
+
+std::vector<uint8_t> scsi::error_lun_not_supported() const
+{
+	// ILLEGAL_REQUEST(0x05)/LOGICAL UNIT NOT SUPPORTED(0x2500)
+	return { 0x70, 0x00, 0x05, 0x00, 0x00, 0x00, 0x00, 0x0a, 0x00, 0x00, 0x00, 0x00, 0x25, 0x00, 0x00, 0x00, 0x00, 0x00 };
+}
@@ -1,6 +1,7 @@
 #pragma once
 #include <cstddef>
 #include <cstdint>
+#include <map>
 #if !defined(TEENSY4_1)
 #include <mutex>
 #endif
@@ -19,6 +20,7 @@ struct scsi_response
 	std::vector<uint8_t>         sense_data;  // error data
 	bool                         data_is_meta;  // scsi command reply data
 	std::optional<uint64_t>      amount_of_data_expected;  // needed for iSCSI to calculate residual count
+	bool                         condition_met;  // status CONDITION MET instead of GOOD (PRE-FETCH)
 
 	struct {
 		bool is_inline;  // if true, then next is valid
@@ -35,6 +37,7 @@ struct scsi_response
 
 	scsi_response(const iscsi_reacion_t type_in) : type(type_in) {
 		data_is_meta = true;
+		condition_met = false;
 		io.is_inline = false;
 		io.what.data = { };
 		io.what.location = { };
@@ -52,6 +55,8 @@ private:
 	backend    *const b          { nullptr };
 	const int         trim_level { 1       };
 	std::string       serial;
+	std::vector<uint64_t> luns   { 1       };  // of the target, for REPORT LUNS
+	uint8_t           naa_id[8]  {         };  // derived from the serial
 #if !defined(ARDUINO) && !defined(NDEBUG)
 	std::atomic_uint64_t cmd_use_count[256] { };
 #endif
@@ -61,8 +66,24 @@ private:
 	std::optional<std::thread::id> locked_by;
 #endif
 
+	// EXTENDED COPY results, for RECEIVE COPY RESULTS
+	struct copy_result_t {
+		uint8_t  status;  // 1: completed, 2: failed
+		uint16_t segments_processed;
+		uint64_t bytes_copied;
+	};
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	std::mutex copy_results_lock;
+#endif
+	std::map<uint8_t, copy_result_t> copy_results;  // by list identifier
+
+	std::vector<uint8_t> get_designators() const;
+	bool is_own_designator(const uint8_t *const designator, const size_t max_size) const;
+
 	scsi_response test_unit_ready(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
-	scsi_response mode_sense_6(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
+	std::vector<uint8_t> get_mode_pages(const uint8_t page_code, const uint8_t page_control) const;
+	scsi_response mode_sense(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode);
+	scsi_response mode_select(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode);
 	scsi_response inquiry(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 	scsi_response read_capacity_10(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 	scsi_response get_lba_status(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
@@ -72,17 +93,19 @@ private:
 	scsi_response report_luns(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 	scsi_response report_supported_operation_codes(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 	scsi_response compare_and_write(io_stats_t *const is, const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
-	scsi_response prefetch(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode);
+	scsi_response prefetch(io_stats_t *const is, const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode);
 	scsi_response reserve(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 	scsi_response release(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 	scsi_response unmap(io_stats_t *const is, const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 	scsi_response write_same(io_stats_t *const is, const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data, const uint8_t opcode);
+	scsi_response extended_copy(io_stats_t *const is, const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
+	scsi_response receive_copy_results(const std::string & identifier, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 
 	std::optional<std::vector<uint8_t> > validate_request(const uint64_t lba, const uint32_t n_blocks, const uint8_t *const CDB) const;
 	std::optional<std::vector<uint8_t> > validate_request(const uint64_t lba) const;
 
 public:
-	scsi(backend *const b, const int trim_level);
+	scsi(backend *const b, const int trim_level, const uint64_t unit_nr = 1);
 	virtual ~scsi();
 
 	enum scsi_opcode {
@@ -92,6 +115,7 @@ public:
 		o_write_6          = 0x0a,
 		o_seek             = 0x0b,
 		o_inquiry          = 0x12,
+		o_mode_select_6    = 0x15,
 		o_reserve_6        = 0x16,
 		o_release_6        = 0x17,
 		o_mode_sense_6     = 0x1a,
@@ -103,6 +127,10 @@ public:
 		o_sync_cache_10    = 0x35,
 		o_write_same_10    = 0x41,
 		o_unmap            = 0x42,
+		o_mode_select_10   = 0x55,
+		o_mode_sense_10    = 0x5a,
+		o_extended_copy    = 0x83,
+		o_receive_copy_results = 0x84,
 		o_read_16          = 0x88,
 		o_compare_and_write= 0x89,
 		o_write_16         = 0x8a,
@@ -132,15 +160,22 @@ public:
 	uint64_t get_size_in_blocks() const;
 	uint64_t get_block_size()     const;
 
+	void     set_lun_list(const std::vector<uint64_t> & luns_in) { luns = luns_in; }
+	bool     is_valid_lun(const uint64_t lun) const;
+
 	scsi_lock_status reserve_device();
 	bool             unlock_device();
 	scsi_lock_status locking_status();
 
 	scsi_rw_result sync    (io_stats_t *const is);
-	scsi_rw_result write   (io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data);
+	scsi_rw_result write   (io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data, const bool fua = false);
+	scsi_rw_result write_zeroes(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks);
+	scsi_rw_result write_same  (io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const pattern, const bool unmap);
 	scsi_rw_result trim    (io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks);
 	scsi_rw_result read    (io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks,       uint8_t *const data);
 	scsi_rw_result cmpwrite(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const write_data, const uint8_t *const compare_data);
+	scsi_rw_result copy    (io_stats_t *const is, const uint64_t src_block_nr, const uint64_t dst_block_nr, const uint32_t n_blocks);
+	scsi_rw_result prefetch(io_stats_t *const is, const uint64_t block_nr, const uint32_t n_blocks, const bool wait, bool *const fits);
 
 	std::optional<scsi_response> send(io_stats_t *const is, const uint64_t lun, const uint8_t *const CDB, const size_t size, std::pair<uint8_t *, size_t> data);
 
@@ -153,4 +188,9 @@ public:
 	std::vector<uint8_t> error_out_of_range()            const;
 	std::vector<uint8_t> error_miscompare()              const;
 	std::vector<uint8_t> error_invalid_field()           const;
+	std::vector<uint8_t> error_parameter_list_length()   const;
+	std::vector<uint8_t> error_invalid_parameter_list()  const;
+	std::vector<uint8_t> error_unreachable_copy_target() const;
+	std::vector<uint8_t> error_copy_aborted()            const;
+	std::vector<uint8_t> error_lun_not_supported()       const;
 };
@@ -4,6 +4,7 @@
 #include <WiFi.h>
 #endif
 #endif
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstdint>
@@ -27,11 +28,10 @@
 
 extern std::atomic_bool stop;
 
-server::server(scsi *const s, com *const c, iscsi_stats_t *is, const std::string & target_name, const bool digest_chk):
-	s(s),
+server::server(const std::vector<target *> & targets, com *const c, iscsi_stats_t *is, const bool digest_chk):
+	targets(targets),
 	c(c),
 	is(is),
-	target_name(target_name),
 	digest_chk(digest_chk)
 {
 }
@@ -50,11 +50,25 @@ server::~server()
 #endif
 }
 
+// discovery sessions (and initiators that do not send a TargetName) get
+// the first target
+target *server::get_target(const session *const ses) const
+{
+	target *t = ses->get_target();
+
+	return t ? t : targets[0];
+}
+
+scsi *server::get_scsi(const session *const ses, const uint64_t lun) const
+{
+	return get_target(ses)->get_lun(lun);
+}
+
 std::tuple<iscsi_pdu_bhs *, iscsi_fail_reason, uint64_t> server::receive_pdu(com_client *const cc, session **const ses)
 {
 	if (*ses == nullptr) {
-		*ses = new session(cc, target_name, digest_chk);
-		(*ses)->set_block_size(s->get_block_size());
+		*ses = new session(cc, targets, digest_chk);
+		(*ses)->set_block_size(targets[0]->get_lun(1)->get_block_size());
 	}
 
 	uint8_t pdu[48] { };
@@ -262,7 +276,9 @@ std::tuple<iscsi_pdu_bhs *, iscsi_fail_reason, uint64_t> server::receive_pdu(com
 
 iscsi_fail_reason server::push_response(com_client *const cc, session *const ses, iscsi_pdu_bhs *const pdu)
 {
-	auto opcode = pdu->get_opcode();
+	auto     opcode = pdu->get_opcode();
+	uint64_t lun    = pdu->get_LUN_nr();
+	scsi    *s      = get_scsi(ses, lun);
 
 	iscsi_fail_reason ifr = IFR_OK;
 	std::optional<iscsi_response_set> response_set;
@@ -286,6 +302,22 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 			DOLOG(logging::ll_debug, "server::push_response", cc->get_endpoint_name(), "DATA-OUT PDU references unknown TTT (%08x)", transfer_tag);
 			return IFR_INVALID_FIELD;
 		}
+
+		// the LUN field of DATA-OUT is reserved for unsollicited data
+		lun = decode_lun(&session->PDU_initiator.data[8]);
+		s   = get_scsi(ses, lun);
+
+		if (data.has_value() && data.value().second > 0 && session->gather) {
+			if (uint64_t(offset) + data.value().second > session->bytes_done + session->bytes_left) {
+				DOLOG(logging::ll_info, "server::push_response", cc->get_endpoint_name(), "DATA-OUT beyond the expected data");
+				return IFR_INVALID_FIELD;
+			}
+
+			memcpy(&session->gather[offset], data.value().first, data.value().second);
+
+			session->bytes_done += data.value().second;
+			session->bytes_left -= data.value().second;
+		}
 		else if (data.has_value() && data.value().second > 0) {
 			auto block_size = s->get_block_size();
 			DOLOG(logging::ll_debug, "server::push_response", cc->get_endpoint_name(), "writing %zu bytes to offset LBA %zu + offset %u => %zu (in bytes)", data.value().second, session->buffer_lba, offset, session->buffer_lba * block_size + offset);
@@ -303,22 +335,16 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 			scsi::scsi_rw_result rc  = scsi::scsi_rw_result::rw_ok;
 			uint64_t             lba = session->buffer_lba + offset / block_size;
 
-			if (session->is_write_same) {  // makes no sense to do this in R2T?
-				uint32_t n_blocks = session->bytes_left / block_size;
-
-				if (session->write_same_is_unmap) {
-					rc = s->trim(ses->get_io_stats(), session->buffer_lba, n_blocks);
-				}
-				else {
-					for(uint32_t i=0; i<n_blocks; i++) {
-						rc = s->write(ses->get_io_stats(), lba + i, 1, data.value().first);
-						if (rc != scsi::rw_ok)
-							break;
-					}
+			if (session->is_write_same) {
+				if (offset != 0 || data.value().second != block_size) {
+					DOLOG(logging::ll_info, "server::push_response", cc->get_endpoint_name(), "WRITE SAME expects exactly 1 block");
+					return IFR_INVALID_FIELD;
 				}
+
+				rc = s->write_same(ses->get_io_stats(lun), session->buffer_lba, session->write_same_n_blocks, data.value().first, session->write_same_is_unmap);
 			}
 			else {
-				rc = s->write(ses->get_io_stats(), lba, data.value().second / block_size, data.value().first);
+				rc = s->write(ses->get_io_stats(lun), lba, data.value().second / block_size, data.value().first, session->fua);
 			}
 
 			if (rc != scsi::rw_ok) {
@@ -326,13 +352,6 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 				return IFR_IO_ERROR;
 			}
 
-			if (session->fua) {
-				if (s->sync(ses->get_io_stats()) == false) {
-					DOLOG(logging::ll_error, "server::push_response", cc->get_endpoint_name(), "DATA-OUT problem syncing data");
-					return IFR_IO_ERROR;
-				}
-			}
-
 			session->bytes_done += data.value().second;
 			session->bytes_left -= data.value().second;
 		}
@@ -350,7 +369,22 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 				DOLOG(logging::ll_error, "server::push_response", cc->get_endpoint_name(), "response.set failed");
 				return IFR_MISC;
 			}
-			response_set = response.get_response(s, session->bytes_left);
+
+			if (session->gather && session->bytes_left == 0) {
+				// all data is there now: run the command with it
+				if (response.set_data({ session->gather, session->bytes_done }) == false) {
+					DOLOG(logging::ll_error, "server::push_response", cc->get_endpoint_name(), "response.set_data failed");
+					return IFR_MISC;
+				}
+
+				response_set = response.get_response(s);
+			}
+			else if (session->gather) {
+				response_set = iscsi_response_set();  // no status until the command ran
+			}
+			else {
+				response_set = response.get_response(s, session->bytes_left);
+			}
 
 			if (session->bytes_left == 0) {
 				DOLOG(logging::ll_debug, "server::push_response", cc->get_endpoint_name(), "end of task");
@@ -375,6 +409,18 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 		}
 	}
 	else {
+		if (opcode == iscsi_pdu_bhs::iscsi_bhs_opcode::o_scsi_taskman) {
+			uint8_t task_function = reinterpret_cast<iscsi_pdu_taskman_request *>(pdu)->get_task_func();
+
+			// target warm/cold reset: the other LUNs too
+			if (task_function == 6 || task_function == 7) {
+				for(auto & l: get_target(ses)->get_luns()) {
+					if (l != s)
+						l->unlock_device();
+				}
+			}
+		}
+
 		response_set = pdu->get_response(s);
 	}
 
@@ -466,6 +512,18 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 			delete temp;
 		}
 
+#if !defined(ARDUINO)
+		// sequential/strided streams: let the backend (or the read cache)
+		// fetch what will probably be asked for next while this is sent
+		auto readaheads = ses->get_stream_detector(lun)->access(stream_parameters.lba, offset_end / s->get_block_size(), s->get_size_in_blocks());
+		for(auto & ra: readaheads) {
+			DOLOG(logging::ll_debug, "server::push_response", cc->get_endpoint_name(), "read ahead %u blocks at LBA %" PRIu64, ra.n_blocks, ra.block_nr);
+			bool fits = false;
+			if (s->prefetch(ses->get_io_stats(lun), ra.block_nr, ra.n_blocks, false, &fits) == scsi::rw_ok)
+				ses->get_io_stats(lun)->readahead_blks += ra.n_blocks;
+		}
+#endif
+
 		while(offset < offset_end) {
 			uint64_t bytes_left  = offset_end - offset;
 			uint32_t current_n   = std::min(uint64_t(ses->get_max_seg_len()), std::min(bytes_left, buffer_n));
@@ -487,13 +545,13 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 
 			if (current_n < s->get_block_size()) {
 				uint8_t *temp_buffer = new uint8_t[s->get_block_size()];
-				rc = s->read(ses->get_io_stats(), current_lba, 1, temp_buffer);
+				rc = s->read(ses->get_io_stats(lun), current_lba, 1, temp_buffer);
 				if (rc == scsi::rw_ok)
 					memcpy(data_pointer, temp_buffer, current_n);
 				delete [] temp_buffer;
 			}
 			else {
-				rc = s->read(ses->get_io_stats(), current_lba, is_n_blocks, data_pointer);
+				rc = s->read(ses->get_io_stats(lun), current_lba, is_n_blocks, data_pointer);
 			}
 
 			if (rc != scsi::rw_ok) {
@@ -529,6 +587,170 @@ iscsi_fail_reason server::push_response(com_client *const cc, session *const ses
 	return ifr;
 }
 
+// sends a reject (or CHECK CONDITION for I/O errors) for a PDU that could not
+// be processed; returns false when the connection failed
+bool server::reject_pdu(com_client *const cc, session *const ses, iscsi_pdu_bhs *const pdu, const iscsi_fail_reason ifr)
+{
+	DOLOG(logging::ll_debug, "server::reject_pdu", cc->get_endpoint_name(), "invalid PDU");
+
+	std::optional<blob_t>  reject;
+	std::optional<uint8_t> reason;
+
+	if (ifr == IFR_INVALID_FIELD || ifr == IFR_MISC) {
+		is->iscsiInstSsnFormatErrors++;
+		reason = 0x09;
+	}
+	else if (ifr == IFR_IO_ERROR) {
+		if (pdu) {
+			auto *temp = new iscsi_pdu_scsi_response(ses) /* 0x21 */;
+
+			if (temp->set(*reinterpret_cast<iscsi_pdu_scsi_cmd *>(pdu), get_scsi(ses, pdu->get_LUN_nr())->error_read_error(), { }, 0x09) == false) {
+				// do not override ifr: IO error is far more important than any other error
+				DOLOG(logging::ll_info, "server::reject_pdu", ses->get_endpoint_name(), "iscsi_pdu_scsi_response::set returned error");
+			}
+
+			reject = temp->get()[0];
+			delete temp;
+		}
+		else {
+			DOLOG(logging::ll_info, "server::reject_pdu", ses->get_endpoint_name(), "No PDU to respond to");
+		}
+	}
+	else if (ifr == IFR_DIGEST) {
+		is->iscsiInstSsnDigestErrors++;
+		reason = 0x02;
+	}
+	else if (ifr == IFR_INVALID_COMMAND)
+		reason = 0x05;
+	else {
+		DOLOG(logging::ll_error, "server::reject_pdu", cc->get_endpoint_name(), "internal error, IFR %d not known", ifr);
+	}
+
+	if (reject.has_value() == false) {
+		if (pdu) {
+			reject = generate_reject_pdu(*pdu, reason);
+			if (reject.has_value() == false) {
+				DOLOG(logging::ll_error, "server::reject_pdu", cc->get_endpoint_name(), "cannot generate reject PDU");
+				return true;
+			}
+		}
+		else {
+			DOLOG(logging::ll_info, "server::reject_pdu", ses->get_endpoint_name(), "Unhandled error situation with no PDU to respond to");
+			return true;
+		}
+	}
+
+	bool rc = cc->send(reject.value().data, reject.value().n);
+	delete [] reject.value().data;
+	if (rc == false) {
+		DOLOG(logging::ll_error, "server::reject_pdu", cc->get_endpoint_name(), "cannot transmit reject PDU");
+		return false;
+	}
+	else {
+		is->iscsiSsnTxDataOctets += reject.value().n;
+		DOLOG(logging::ll_debug, "server::reject_pdu", cc->get_endpoint_name(), "transmitted reject PDU");
+	}
+
+	return true;
+}
+
+// flushes what this session wrote and releases its reservation
+void server::end_session(session *const ses, scsi *const s, const uint64_t lun)
+{
+	s->sync(ses->get_io_stats(lun));
+
+	if (s->locking_status() == scsi::l_locked) {
+		DOLOG(logging::ll_debug, "server::end_session", ses->get_endpoint_name(), "unlocking device");
+		s->unlock_device();
+	}
+}
+
+#if !defined(ARDUINO)
+void server::lun_worker_thread(com_client *const cc, session *const ses, lun_worker *const w)
+{
+	std::unique_lock<std::mutex> lck(w->lock);
+
+	for(;;) {
+		w->cv.wait(lck, [w] { return w->queue.empty() == false || w->stop; });
+		if (w->queue.empty())  // stop requested and nothing left to do
+			break;
+
+		iscsi_pdu_bhs *pdu = w->queue.front();
+		w->queue.pop_front();
+		lck.unlock();
+
+		iscsi_fail_reason ifr = push_response(cc, ses, pdu);
+		if (ifr != IFR_OK) {
+			is->iscsiInstSsnFailures++;
+			ses->inc_error_count();
+
+			if (ifr != IFR_CONNECTION)
+				reject_pdu(cc, ses, pdu, ifr);
+		}
+
+		delete pdu;
+
+		lck.lock();
+		w->n_busy--;
+		w->cv.notify_all();
+	}
+
+	lck.unlock();
+
+	// reservations are per I_T nexus, which is this thread for this LUN
+	end_session(ses, w->s, w->lun);
+}
+
+void server::queue_pdu(com_client *const cc, session *const ses, std::map<scsi *, lun_worker *> *const workers, iscsi_pdu_bhs *const pdu)
+{
+	auto &luns = get_target(ses)->get_luns();
+	scsi  *s   = get_scsi(ses, pdu->get_LUN_nr());
+	auto   it  = workers->find(s);
+
+	if (it == workers->end()) {
+		lun_worker *w = new lun_worker();
+		w->s   = s;
+		w->lun = std::find(luns.begin(), luns.end(), s) - luns.begin() + 1;
+		w->th  = new std::thread(&server::lun_worker_thread, this, cc, ses, w);
+
+		it = workers->insert({ s, w }).first;
+	}
+
+	lun_worker *w = it->second;
+	std::unique_lock<std::mutex> lck(w->lock);
+	w->queue.push_back(pdu);
+	w->n_busy++;
+	w->cv.notify_all();
+}
+
+void server::drain_workers(std::map<scsi *, lun_worker *> *const workers)
+{
+	for(auto & it: *workers) {
+		lun_worker *w = it.second;
+		std::unique_lock<std::mutex> lck(w->lock);
+		w->cv.wait(lck, [w] { return w->n_busy == 0; });
+	}
+}
+
+void server::stop_workers(std::map<scsi *, lun_worker *> *const workers)
+{
+	for(auto & it: *workers) {
+		lun_worker *w = it.second;
+
+		w->lock.lock();
+		w->stop = true;
+		w->cv.notify_all();
+		w->lock.unlock();
+
+		w->th->join();
+		delete w->th;
+		delete w;
+	}
+
+	workers->clear();
+}
+#endif
+
 bool server::is_active()
 {
 #if !defined(TEENSY4_1) && !defined(RP2040W)
@@ -584,7 +806,9 @@ void server::handler()
 			session       *ses          = nullptr;
 			bool           ok           = true;
 			int            fail_counter = 0;
-			auto           block_size   = s->get_block_size();
+#if !defined(ARDUINO)
+			std::map<scsi *, lun_worker *> workers;
+#endif
 
 			do {
 				auto incoming = receive_pdu(cc, &ses);
@@ -594,70 +818,31 @@ void server::handler()
 
 				iscsi_fail_reason ifr = std::get<1>(incoming);
 				if (ifr == IFR_OK) {
-					ifr = push_response(cc, ses, pdu);
-					if (ifr != IFR_OK)
-						is->iscsiInstSsnFailures++;
-				}
+#if !defined(ARDUINO)
+					auto opcode = pdu->get_opcode();
 
-				if (ifr != IFR_OK && ifr != IFR_CONNECTION) {  // something wrong with the received PDU?
-					DOLOG(logging::ll_debug, "server::handler", endpoint, "invalid PDU");
-
-					std::optional<blob_t>  reject;
-					std::optional<uint8_t> reason;
-
-					if (ifr == IFR_INVALID_FIELD || ifr == IFR_MISC) {
-						is->iscsiInstSsnFormatErrors++;
-						reason = 0x09;
-					}
-					else if (ifr == IFR_IO_ERROR) {
-						if (pdu) {
-							auto *temp = new iscsi_pdu_scsi_response(ses) /* 0x21 */;
-
-							if (temp->set(*reinterpret_cast<iscsi_pdu_scsi_cmd *>(pdu), s->error_read_error(), { }, 0x09) == false) {
-								// do not override ifr: IO error is far more important than any other error
-								DOLOG(logging::ll_info, "server::handler", ses->get_endpoint_name(), "iscsi_pdu_scsi_response::set returned error");
-							}
-
-							reject = temp->get()[0];
-							delete temp;
-						}
-						else {
-							DOLOG(logging::ll_info, "server::handler", ses->get_endpoint_name(), "No PDU to respond to");
-						}
+					if (get_target(ses)->get_luns().size() > 1 && (opcode == iscsi_pdu_bhs::iscsi_bhs_opcode::o_scsi_cmd || opcode == iscsi_pdu_bhs::iscsi_bhs_opcode::o_scsi_data_out)) {
+						queue_pdu(cc, ses, &workers, pdu);
+						pdu = nullptr;  // now owned by the worker
 					}
-					else if (ifr == IFR_DIGEST) {
-						is->iscsiInstSsnDigestErrors++;
-						reason = 0x02;
-					}
-					else if (ifr == IFR_INVALID_COMMAND)
-						reason = 0x05;
 					else {
-						DOLOG(logging::ll_error, "server::handler", endpoint, "internal error, IFR %d not known", ifr);
-					}
+						// e.g. a logout or task management request: first
+						// finish what was received before it
+						if (opcode != iscsi_pdu_bhs::iscsi_bhs_opcode::o_nop_out)
+							drain_workers(&workers);
 
-					if (reject.has_value() == false) {
-						if (pdu) {
-							reject = generate_reject_pdu(*pdu, reason);
-							if (reject.has_value() == false) {
-								DOLOG(logging::ll_error, "server::handler", endpoint, "cannot generate reject PDU");
-								continue;
-							}
-						}
-						else {
-							DOLOG(logging::ll_info, "server::handler", ses->get_endpoint_name(), "Unhandled error situation with no PDU to respond to");
-						}
+						ifr = push_response(cc, ses, pdu);
 					}
+#else
+					ifr = push_response(cc, ses, pdu);
+#endif
+					if (ifr != IFR_OK)
+						is->iscsiInstSsnFailures++;
+				}
 
-					bool rc = cc->send(reject.value().data, reject.value().n);
-					delete [] reject.value().data;
-					if (rc == false) {
-						DOLOG(logging::ll_error, "server::handler", endpoint, "cannot transmit reject PDU");
+				if (ifr != IFR_OK && ifr != IFR_CONNECTION) {  // something wrong with the received PDU?
+					if (reject_pdu(cc, ses, pdu, ifr) == false)
 						ok = false;
-					}
-					else {
-						is->iscsiSsnTxDataOctets += reject.value().n;
-						DOLOG(logging::ll_debug, "server::handler", endpoint, "transmitted reject PDU");
-					}
 				}
 
 				delete pdu;
@@ -687,27 +872,36 @@ void server::handler()
 				auto took = now - prev_output;
 				if (took >= interval) {
 					prev_output = now;
-					double                  dtook = took / 1000.;
-					double                  dkB   = dtook * 1024;
-					const io_stats_t *const is    = ses->get_io_stats();
+					double dtook = took / 1000.;
+					double dkB   = dtook * 1024;
 
 					DOLOG(logging::ll_info, "server::handler", endpoint,
-						"IOPS: %.2f "
 						"send: %.2f kB/s, recv: %.2f kB/s, "
-						"written: %.2f kB/s, read: %.2f kB/s, "
-						"syncs: %.2f/s, unmapped: %.2f kB/s, "
-						"io-wait: %.2f%%, "
 						"load: %.2f%%, errors: %u, mem: %u",
-						is->get_n_iops() / dtook,
-						ses->get_bytes_tx() / dkB, ses->get_bytes_rx() / dkB,
-						is->bytes_written / dkB, is->bytes_read / dkB,
-						is->n_syncs / dtook, is->blocks_trimmed * block_size / 1024 / 1024 / dtook,
-						is->io_wait * 100 / (dtook * 1000),  // io_wait is in uS
+						ses->get_and_reset_bytes_tx() / dkB, ses->get_and_reset_bytes_rx() / dkB,
 						busy * 0.1 / took, ses->get_error_count(), get_free_heap_space());
 
-					ses->reset_bytes_rx();
-					ses->reset_bytes_tx();
-					ses->reset_io_stats();
+					for(auto & it: ses->get_and_reset_io_stats()) {
+						const io_stats_t *const is         = &it.second;
+						auto                    block_size = get_scsi(ses, it.first)->get_block_size();
+
+						DOLOG(logging::ll_info, "server::handler", endpoint,
+							"LUN %" PRIu64 ": "
+							"IOPS: %.2f "
+							"written: %.2f kB/s, read: %.2f kB/s, "
+							"syncs: %.2f/s, unmapped: %.2f kB/s, "
+							"io-wait: %.2f%%, "
+							"ATS: %.2f/s (%.0f us), "
+							"read ahead: %.2f kB/s",
+							it.first,
+							is->get_n_iops() / dtook,
+							is->bytes_written / dkB, is->bytes_read / dkB,
+							is->n_syncs / dtook, is->blocks_trimmed * block_size / 1024 / 1024 / dtook,
+							is->io_wait * 100 / (dtook * 1000),  // io_wait is in uS
+							is->n_cmpwrites / dtook, is->n_cmpwrites ? double(is->cmpwrite_us) / is->n_cmpwrites : 0.,
+							is->readahead_blks * block_size / dkB);
+					}
+
 					busy = 0;
 				}
 			}
@@ -718,11 +912,11 @@ void server::handler()
 			DOLOG(logging::ll_debug, "server::handler", endpoint, "session finished");
 #endif
 
-			s->sync(ses->get_io_stats());
-			if (s->locking_status() == scsi::l_locked) {
-				DOLOG(logging::ll_debug, "server::handler", endpoint, "unlocking device");
-				s->unlock_device();
-			}
+#if !defined(ARDUINO)
+			stop_workers(&workers);  // these end the session for their LUN themselves
+#endif
+			if (get_target(ses)->get_luns().size() == 1)
+				end_session(ses, get_target(ses)->get_lun(1), 1);
 
 			delete cc;
 			delete ses;
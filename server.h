@@ -1,7 +1,11 @@
 #include <cstdint>
 #include <utility>
+#include <vector>
 #if !defined(TEENSY4_1) && !defined(RP2040W)
 #include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
 #include <mutex>
 #include <thread>
 #endif
@@ -9,6 +13,7 @@
 #include "com.h"
 #include "scsi.h"
 #include "session.h"
+#include "target.h"
 
 
 typedef struct
@@ -26,10 +31,9 @@ typedef struct
 class server
 {
 private:
-	scsi          *const s          { nullptr };
+	const std::vector<target *> targets;
 	com           *const c          { nullptr };
 	iscsi_stats_t *const is         { nullptr };
-	const std::string target_name;
 	const bool     digest_chk       { false   };
 #if !defined(ARDUINO) && !defined(NDEBUG)
 	std::atomic_uint64_t cmd_use_count[64] { };
@@ -41,12 +45,37 @@ private:
 	bool           active           { false   };
 #endif
 
+#if !defined(ARDUINO)
+	// with more than one LUN, the SCSI commands (and DATA-OUT PDUs) of a
+	// session are processed by a thread per LUN so that a slow LUN (e.g. an
+	// NBD proxy) does not hold up the others
+	struct lun_worker {
+		scsi                   *s      { nullptr };
+		uint64_t                lun    { 0       };
+		std::thread            *th     { nullptr };
+		std::mutex              lock;
+		std::condition_variable cv;
+		std::deque<iscsi_pdu_bhs *> queue;
+		int                     n_busy { 0       };  // queued or being processed
+		bool                    stop   { false   };
+	};
+
+	void              lun_worker_thread(com_client *const cc, session *const ses, lun_worker *const w);
+	void              queue_pdu    (com_client *const cc, session *const ses, std::map<scsi *, lun_worker *> *const workers, iscsi_pdu_bhs *const pdu);
+	void              drain_workers(std::map<scsi *, lun_worker *> *const workers);
+	void              stop_workers (std::map<scsi *, lun_worker *> *const workers);
+#endif
+
+	target           *get_target   (const session *const ses) const;
+	scsi             *get_scsi     (const session *const ses, const uint64_t lun) const;
 	std::tuple<iscsi_pdu_bhs *, iscsi_fail_reason, uint64_t>
 		          receive_pdu  (com_client *const cc, session **const s);
 	iscsi_fail_reason push_response(com_client *const cc, session *const s, iscsi_pdu_bhs *const pdu);
+	bool              reject_pdu   (com_client *const cc, session *const ses, iscsi_pdu_bhs *const pdu, const iscsi_fail_reason ifr);
+	void              end_session  (session *const ses, scsi *const s, const uint64_t lun);
 
 public:
-	server(scsi *const s, com *const c, iscsi_stats_t *is, const std::string & target_name, const bool digest_chk);
+	server(const std::vector<target *> & targets, com *const c, iscsi_stats_t *is, const bool digest_chk);
 	virtual ~server();
 
 	bool begin();
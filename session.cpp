@@ -2,11 +2,12 @@
 #include "log.h"
 #include "random.h"
 #include "session.h"
+#include "target.h"
 
 
-session::session(com_client *const connected_to, const std::string & target_name, const bool allow_digest):
+session::session(com_client *const connected_to, const std::vector<target *> & targets, const bool allow_digest):
 	connected_to(connected_to),
-	target_name(target_name),
+	targets(targets),
 	allow_digest(allow_digest)
 {
 }
@@ -15,26 +16,75 @@ session::~session()
 {
 	for(auto & it: r2t_sessions) {
 		delete [] it.second->PDU_initiator.data;
+		delete [] it.second->gather;
 		delete it.second;
 	}
+
+#if !defined(ARDUINO)
+	for(auto & it: stream_detectors)
+		delete it.second;
+#endif
+}
+
+// the TargetName of a login; returns false when it is not served here
+bool session::select_target(const std::string & name)
+{
+	for(auto & candidate: targets) {
+		if (candidate->get_name() == name) {
+			t = candidate;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// 'first'/'last': first/last DATA-IN PDU of the task
+uint32_t session::get_inc_datasn(const uint32_t data_sn_itt, const bool first, const bool last)
+{
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	std::unique_lock lck(lock);
+#endif
+	if (first)
+		data_sn[data_sn_itt] = 0;
+
+	uint32_t rc = data_sn[data_sn_itt]++;
+	if (last)
+		data_sn.erase(data_sn_itt);
+
+	return rc;
 }
 
-uint32_t session::get_inc_datasn(const uint32_t data_sn_itt)
+io_stats_t *session::get_io_stats(const uint64_t lun)
 {
-	if (data_sn_itt == this->data_sn_itt)
-		return data_sn++;
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	std::unique_lock lck(lock);
+#endif
+	return &statistics.is[lun];
+}
 
-	this->data_sn_itt = data_sn_itt;
-	this->data_sn     = 0;
+std::map<uint64_t, io_stats_t> session::get_and_reset_io_stats()
+{
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	std::unique_lock lck(lock);
+#endif
+	std::map<uint64_t, io_stats_t> out;
+	for(auto & it: statistics.is)
+		it.second.get_and_reset(&out[it.first]);
 
-	return data_sn++;
+	return out;
 }
 
 void session::init_r2t_session(const r2t_session & rs, const bool fua, iscsi_pdu_scsi_cmd *const pdu, const uint32_t transfer_tag)
 {
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	std::unique_lock lck(lock);
+#endif
 	auto it = r2t_sessions.find(transfer_tag);
-	if (it != r2t_sessions.end())
+	if (it != r2t_sessions.end()) {
+		delete [] rs.gather;
 		return;
+	}
 
 	r2t_session   *copy = new r2t_session;
 	*copy               = rs;
@@ -48,6 +98,9 @@ void session::init_r2t_session(const r2t_session & rs, const bool fua, iscsi_pdu
 r2t_session *session::get_r2t_sesion(const uint32_t ttt)
 {
 	DOLOG(logging::ll_debug, "session::get_r2t_session", get_endpoint_name(), "get TTT %08x", ttt);
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	std::unique_lock lck(lock);
+#endif
 	auto it = r2t_sessions.find(ttt);
 	if (it == r2t_sessions.end())
 		return nullptr;
@@ -57,6 +110,9 @@ r2t_session *session::get_r2t_sesion(const uint32_t ttt)
 
 void session::remove_r2t_session(const uint32_t ttt)
 {
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	std::unique_lock lck(lock);
+#endif
 	auto it = r2t_sessions.find(ttt);
 
 	if (it == r2t_sessions.end())
@@ -64,7 +120,23 @@ void session::remove_r2t_session(const uint32_t ttt)
 	else {
 		DOLOG(logging::ll_debug, "session::remove_r2t_session", get_endpoint_name(), "removing TTT %x", ttt);
 		delete [] it->second->PDU_initiator.data;
+		delete [] it->second->gather;
 		delete it->second;
 		r2t_sessions.erase(it);
 	}
 }
+
+#if !defined(ARDUINO)
+stream_detector *session::get_stream_detector(const uint64_t lun)
+{
+	std::unique_lock lck(lock);
+	auto it = stream_detectors.find(lun);
+	if (it != stream_detectors.end())
+		return it->second;
+
+	auto *sd = new stream_detector(block_size);
+	stream_detectors.insert({ lun, sd });
+
+	return sd;
+}
+#endif
@@ -1,31 +1,47 @@
 #pragma once
+#include <atomic>
 #include <cstdint>
 #include <map>
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+#include <mutex>
+#endif
 #include <optional>
+#include <string>
+#include <vector>
 
 #include "com.h"
 #include "gen.h"
 #include "iscsi.h"
+#if !defined(ARDUINO)
+#include "stream-detector.h"
+#endif
 
 
 class iscsi_pdu_scsi_cmd;
+class target;
 
 class session
 {
 private:
 	com_client *const connected_to  { nullptr };  // e.g. for retrieving the local address
-	const std::string target_name;
-	uint32_t          data_sn_itt   { 0       };  // itt == initiator transfer tag
-	uint32_t          data_sn       { 0       };
+	const std::vector<target *> & targets;  // all of the portal
+	target           *t             { nullptr };  // the one logged in to (not for discovery)
+	std::map<uint32_t, uint32_t> data_sn;  // DataSN by itt (initiator transfer tag)
 	uint32_t          block_size    { 0       };
 
 	struct {
-		uint64_t   bytes_rx     { 0       };
-		uint64_t   bytes_tx     { 0       };
-		unsigned   error_count  { 0       };
-		io_stats_t is;
+		std::atomic_uint64_t bytes_rx    { 0 };  // atomic: see io_stats_t
+		std::atomic_uint64_t bytes_tx    { 0 };
+		std::atomic_uint     error_count { 0 };
+		std::map<uint64_t, io_stats_t> is;  // by LUN
 	} statistics;
 
+#if !(defined(TEENSY4_1) || defined(RP2040W))
+	// with multiple LUNs, commands for different LUNs are processed in
+	// parallel; this protects the maps in this object
+	std::mutex        lock;
+#endif
+
 	uint32_t          max_seg_len   { MAX_DATA_SEGMENT_SIZE };
 
 	const bool        allow_digest  { false   };
@@ -36,11 +52,17 @@ private:
 
 	std::map<uint32_t, r2t_session *> r2t_sessions; // r2t sessions
 
+#if !defined(ARDUINO)
+	std::map<uint64_t, stream_detector *> stream_detectors;  // per LUN
+#endif
+
 public:
-	session(com_client *const connected_to, const std::string & target_name, const bool allow_digest);
+	session(com_client *const connected_to, const std::vector<target *> & targets, const bool allow_digest);
 	virtual ~session();
 
-	std::string get_target_name  () const { return target_name;                       }
+	const std::vector<target *> & get_targets() const { return targets; }
+	bool     select_target(const std::string & name);
+	target  *get_target() const { return t; }
 	std::string get_local_address() const { return connected_to->get_local_address(); }
 	std::string get_endpoint_name() const { return connected_to->get_endpoint_name(); }
 
@@ -53,17 +75,15 @@ public:
 	uint32_t get_max_seg_len() const { return max_seg_len; }
 
 	void     add_bytes_rx(const uint64_t n) { statistics.bytes_rx += n;      }
-	uint64_t get_bytes_rx() const           { return statistics.bytes_rx;    }
-	void     reset_bytes_rx()               { statistics.bytes_rx = 0;       }
+	uint64_t get_and_reset_bytes_rx()       { return statistics.bytes_rx.exchange(0); }
 	void     add_bytes_tx(const uint64_t n) { statistics.bytes_tx += n;      }
-	uint64_t get_bytes_tx() const           { return statistics.bytes_tx;    }
-	void     reset_bytes_tx()               { statistics.bytes_tx = 0;       }
-	io_stats_t *get_io_stats()              { return &statistics.is;         }
-	void     reset_io_stats()               { statistics.is.reset();         }
+	uint64_t get_and_reset_bytes_tx()       { return statistics.bytes_tx.exchange(0); }
+	io_stats_t *get_io_stats(const uint64_t lun);
+	std::map<uint64_t, io_stats_t> get_and_reset_io_stats();
 	void     inc_error_count()              { statistics.error_count++;      }
 	unsigned get_error_count() const        { return statistics.error_count; }
 
-	uint32_t get_inc_datasn(const uint32_t itt);
+	uint32_t get_inc_datasn(const uint32_t itt, const bool first, const bool last);
 
 	void     set_block_size(const uint32_t block_size_in) { block_size = block_size_in; }
 	uint32_t get_block_size() const { return block_size; }
@@ -74,4 +94,8 @@ public:
 	void     init_r2t_session(const r2t_session & rs, const bool fua, iscsi_pdu_scsi_cmd *const pdu, const uint32_t transfer_tag);
 	r2t_session *get_r2t_sesion(const uint32_t ttt);
 	void     remove_r2t_session(const uint32_t ttt);
+
+#if !defined(ARDUINO)
+	stream_detector *get_stream_detector(const uint64_t lun);
+#endif
 };
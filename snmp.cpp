@@ -1,10 +1,12 @@
 #include <atomic>
+#include <cinttypes>
 #include <functional>
 
 #include "backend.h"
 #include "log.h"
 #include "scsi.h"
 #include "server.h"
+#include "utils.h"
 #if defined(ARDUINO)
 #include "version.h"
 #endif
@@ -44,6 +46,10 @@ void init_snmp(snmp **const snmp_, snmp_data **const snmp_data_, iscsi_stats_t *
 	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.13.15.1.1.4", new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->bytes_written));
 	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.13.15.1.1.5", new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_reads      ));
 	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.13.15.1.1.6", new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_writes     ));
+	// read cache (-r)
+	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.100.10",      new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_cache_hits     ));
+	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.100.11",      new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_cache_misses   ));
+	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.100.12",      new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_cache_evictions));
 	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.4.11.0",      new snmp_data_type_stats_int(ram_free_kb));
 	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.9.1.9.1",     new snmp_data_type_stats_int_callback(get_percentage_diskspace, gpd_context));
 	(*snmp_data_)->register_oid("1.3.6.1.4.1.2021.11.9.0",      new snmp_data_type_stats_int(cpu_usage));
@@ -54,3 +60,31 @@ void init_snmp(snmp **const snmp_, snmp_data **const snmp_data_, iscsi_stats_t *
 	if ((*snmp_)->begin() == false)
 		DOLOG(logging::ll_error, "snmp", "-", "failed to initialize SNMP server");
 }
+
+// a table like diskIOTable of UCD-DISKIO-MIB (columns 1 - 6), with the other counters after it
+static void add_snmp_disk_io_row(snmp_data *const snmp_data_, const std::string & table, const std::string & idx, const int index, const std::string & name, backend_stats_t *const bs)
+{
+	std::string base = table + ".1.";
+
+	snmp_data_->register_oid(base + "1"  + idx, snmp_integer::snmp_integer_type::si_integer, index);
+	snmp_data_->register_oid(base + "2"  + idx, name);
+	snmp_data_->register_oid(base + "3"  + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->bytes_read       ));
+	snmp_data_->register_oid(base + "4"  + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->bytes_written    ));
+	snmp_data_->register_oid(base + "5"  + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_reads          ));
+	snmp_data_->register_oid(base + "6"  + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_writes         ));
+	snmp_data_->register_oid(base + "7"  + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_syncs          ));
+	snmp_data_->register_oid(base + "8"  + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_trims          ));
+	snmp_data_->register_oid(base + "9"  + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_cache_hits     ));
+	snmp_data_->register_oid(base + "10" + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_cache_misses   ));
+	snmp_data_->register_oid(base + "11" + idx, new snmp_data_type_stats(snmp_integer::snmp_integer_type::si_counter64, &bs->n_cache_evictions));
+}
+
+void add_snmp_lun(snmp_data *const snmp_data_, const uint64_t index, const std::string & name, backend_stats_t *const bs)
+{
+	add_snmp_disk_io_row(snmp_data_, "1.3.6.1.4.1.2021.100.20", myformat(".%" PRIu64, index), int(index), name, bs);
+}
+
+void add_snmp_lun_child(snmp_data *const snmp_data_, const uint64_t index, const uint64_t child, const std::string & name, backend_stats_t *const bs)
+{
+	add_snmp_disk_io_row(snmp_data_, "1.3.6.1.4.1.2021.100.21", myformat(".%" PRIu64 ".%" PRIu64, index, child), int(child), name, bs);
+}
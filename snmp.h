@@ -1,8 +1,14 @@
 #include <atomic>
 #include <functional>
+#include <string>
 
 #include "backend.h"
 #include "snmp/snmp.h"
 
 
 void init_snmp(snmp **const snmp_, snmp_data **const snmp_data_, iscsi_stats_t *const is, std::function<int(void *)> percentage_diskspace, void *const gpd_context, backend_stats_t *const bs, int *const cpu_usage, int *const ram_free_kb, std::atomic_bool *const stop, const int port);
+// the counters of one LUN, since the start; 'index' is the number of the LUN
+// in the process (over all targets)
+void add_snmp_lun(snmp_data *const snmp_data_, const uint64_t index, const std::string & name, backend_stats_t *const bs);
+// the same for a child (e.g. a disk of a stripe) of that LUN, numbered from 1
+void add_snmp_lun_child(snmp_data *const snmp_data_, const uint64_t index, const uint64_t child, const std::string & name, backend_stats_t *const bs);
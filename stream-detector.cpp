@@ -0,0 +1,125 @@
+#include <algorithm>
+
+#include "stream-detector.h"
+
+
+stream_detector::stream_detector(const uint32_t block_size):
+	min_window(std::max(uint32_t(1), min_window_kb * 1024 / block_size)),
+	max_window(std::max(uint32_t(1), max_window_kb * 1024 / block_size)),
+	max_stride(std::max(uint32_t(1), max_stride_kb * 1024 / block_size))
+{
+}
+
+stream_detector::~stream_detector()
+{
+}
+
+void stream_detector::predict(stream *const s, const uint64_t device_size, std::vector<readahead> *const out)
+{
+	uint64_t end = s->last_lba + s->last_n;
+
+	if (s->sequential) {
+		s->ra_end = std::max(s->ra_end, end);
+
+		// top up only when less than half of the window is left, else
+		// every request would result in a (tiny) readahead
+		uint64_t target = std::min(end + s->window, device_size);
+		if (s->ra_end >= target || s->ra_end - end >= s->window / 2)
+			return;
+
+		out->push_back({ s->ra_end, uint32_t(target - s->ra_end) });
+		s->ra_end = target;
+		return;
+	}
+
+	// strided: read the next few requests, the gaps in between are skipped
+	uint32_t n_ahead = std::clamp(s->window / s->last_n, uint32_t(1), max_strided);
+	for(uint32_t k=1; k<=n_ahead; k++) {
+		uint64_t start = s->last_lba + k * s->stride;
+		if (start + s->last_n > device_size)
+			break;
+		if (start + s->last_n <= s->ra_end)  // already done
+			continue;
+
+		out->push_back({ start, s->last_n });
+		s->ra_end = start + s->last_n;
+	}
+}
+
+std::vector<stream_detector::readahead> stream_detector::access(const uint64_t block_nr, const uint32_t n_blocks, const uint64_t device_size)
+{
+	std::vector<readahead> out;
+	if (n_blocks == 0)
+		return out;
+
+	clock++;
+
+	stream *hit    = nullptr;
+	stream *inside = nullptr;
+	stream *near   = nullptr;
+	stream *victim = nullptr;
+
+	for(auto & s: streams) {
+		if (s.in_use == false) {
+			if (victim == nullptr || victim->in_use)
+				victim = &s;
+			continue;
+		}
+
+		if (block_nr == s.last_lba + s.last_n || (s.stride && block_nr == s.last_lba + s.stride)) {
+			hit = &s;
+			break;
+		}
+
+		// out of order (e.g. with multiple commands in flight) but in what
+		// was read (ahead) already: not a reason to give up on the stream
+		if (s.sequential && block_nr + max_stride >= s.last_lba && block_nr < std::max(s.ra_end, s.last_lba + s.last_n))
+			inside = &s;
+		else if (block_nr > s.last_lba && block_nr - s.last_lba <= max_stride)
+			near = &s;
+
+		if (victim == nullptr || (victim->in_use && s.last_used < victim->last_used))
+			victim = &s;
+	}
+
+	if (hit) {
+		hit->sequential = block_nr == hit->last_lba + hit->last_n;
+		hit->stride     = block_nr - hit->last_lba;
+		hit->hits++;
+		if (hit->hits > min_hits)
+			hit->window = std::min(hit->window * 2, max_window);
+		hit->last_lba   = block_nr;
+		hit->last_n     = n_blocks;
+		hit->last_used  = clock;
+
+		if (hit->hits >= min_hits)
+			predict(hit, device_size, &out);
+	}
+	else if (inside) {
+		if (block_nr + n_blocks > inside->last_lba + inside->last_n) {
+			inside->last_lba = block_nr;
+			inside->last_n   = n_blocks;
+		}
+		inside->last_used = clock;
+	}
+	else if (near) {  // the pattern changed: maybe a new stride
+		near->sequential = false;
+		near->stride     = block_nr - near->last_lba;
+		near->hits       = 1;
+		near->window     = std::max(near->window / 2, min_window);
+		near->last_lba   = block_nr;
+		near->last_n     = n_blocks;
+		near->last_used  = clock;
+	}
+	else {
+		*victim = { };
+		victim->in_use    = true;
+		victim->last_lba  = block_nr;
+		victim->last_n    = n_blocks;
+		victim->hits      = 1;
+		victim->window    = std::clamp(n_blocks, min_window, max_window);
+		victim->last_used = clock;
+	}
+
+	return out;
+}
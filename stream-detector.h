@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+
+
+// Recognizes sequential and strided READs of one session on one LUN and
+// tells what to read ahead. A few streams are tracked at the same time
+// (e.g. a backup that reads several files interleaved). The readahead
+// window of a stream doubles with every hit and halves when the stream
+// breaks. Not thread safe: used by the thread of the session only.
+class stream_detector
+{
+public:
+	struct readahead {
+		uint64_t block_nr { 0 };
+		uint32_t n_blocks { 0 };
+	};
+
+private:
+	static constexpr const int      max_streams   = 8;
+	static constexpr const uint32_t min_hits      = 2;  // before readahead starts
+	static constexpr const uint32_t max_strided   = 8;  // requests predicted ahead of a strided stream
+	static constexpr const uint32_t min_window_kb = 128;
+	static constexpr const uint32_t max_window_kb = 8192;
+	static constexpr const uint32_t max_stride_kb = 1024;
+
+	struct stream {
+		bool     in_use     { false };
+		bool     sequential { false };  // last request started where the one before ended
+		uint64_t last_lba   { 0     };  // first block of the last request
+		uint32_t last_n     { 0     };
+		uint64_t stride     { 0     };  // distance between the starts of two requests
+		uint32_t hits       { 0     };
+		uint32_t window     { 0     };  // in blocks
+		uint64_t ra_end     { 0     };  // first block after what was read ahead
+		uint64_t last_used  { 0     };
+	};
+
+	const uint32_t min_window { 0 };  // in blocks
+	const uint32_t max_window { 0 };
+	const uint64_t max_stride { 0 };
+	stream         streams[max_streams];
+	uint64_t       clock      { 0 };
+
+	void predict(stream *const s, const uint64_t device_size, std::vector<readahead> *const out);
+
+public:
+	stream_detector(const uint32_t block_size);
+	virtual ~stream_detector();
+
+	// 'device_size' in blocks; returns the ranges to read ahead (if any)
+	std::vector<readahead> access(const uint64_t block_nr, const uint32_t n_blocks, const uint64_t device_size);
+};
@@ -0,0 +1,22 @@
+#include "target.h"
+
+
+target::target(const std::string & name, const std::vector<scsi *> & luns):
+	name(name),
+	luns(luns)
+{
+}
+
+target::~target()
+{
+}
+
+// LUN 0 (the storage array controller) and LUNs that do not exist are
+// handled by the first LUN: scsi::send() knows what to do with them
+scsi *target::get_lun(const uint64_t lun) const
+{
+	if (lun >= 1 && lun <= luns.size())
+		return luns[lun - 1];
+
+	return luns[0];
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "scsi.h"
+
+
+// An iSCSI target: a name and the logical units it exports (LUN 1 and up).
+// One process can serve multiple targets on the same portal; they share
+// the sessions' threads, the read cache and so on.
+class target
+{
+private:
+	const std::string         name;
+	const std::vector<scsi *> luns;  // not owned
+
+public:
+	target(const std::string & name, const std::vector<scsi *> & luns);
+	virtual ~target();
+
+	std::string get_name() const { return name; }
+	const std::vector<scsi *> & get_luns() const { return luns; }
+
+	scsi *get_lun(const uint64_t lun) const;
+};
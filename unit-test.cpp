@@ -0,0 +1,1111 @@
+// tests of the parts of iESP that can be tested without an initiator;
+// quick-test does the iSCSI/SCSI side against a running iESP
+#include <algorithm>
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "backend-bitmap.h"
+#include "backend-cow.h"
+#include "backend-discard.h"
+#include "backend-erasure.h"
+#include "backend-file.h"
+#include "backend-golden.h"
+#include "backend-memory.h"
+#include "backend-mirror.h"
+#include "backend-readcache.h"
+#include "backend-stream.h"
+#include "backend-stripe.h"
+#include "backend-writeback.h"
+#include "gf256.h"
+#include "log.h"
+#include "radix-map.h"
+#include "range-lock.h"
+#include "stream-detector.h"
+#include "utils.h"
+
+constexpr int bs = 4096;
+bool          ok = true;
+
+#define CHECK(x) do { if (!(x)) { printf("  FAILED: %s (line %d)\n", #x, __LINE__); ok = false; } } while(0)
+
+static std::string temp_file(const std::string & name)
+{
+	return myformat("/tmp/iesp-unit-test-%d-%s", getpid(), name.c_str());
+}
+
+static void fill_random(std::mt19937 & g, uint8_t *const p, const size_t n)
+{
+	for(size_t i=0; i<n; i++)
+		p[i] = g();
+}
+
+static bool write_file(const std::string & name, const std::vector<uint8_t> & data)
+{
+	FILE *fh = fopen(name.c_str(), "wb");
+	if (!fh)
+		return false;
+
+	bool rc = fwrite(data.data(), 1, data.size(), fh) == data.size();
+	fclose(fh);
+
+	return rc;
+}
+
+static std::vector<uint8_t> read_file(const std::string & name)
+{
+	std::vector<uint8_t> data;
+	FILE *fh = fopen(name.c_str(), "rb");
+	if (!fh)
+		return data;
+
+	uint8_t buffer[65536];
+	size_t  n = 0;
+	while((n = fread(buffer, 1, sizeof buffer, fh)) > 0)
+		data.insert(data.end(), buffer, buffer + n);
+	fclose(fh);
+
+	return data;
+}
+
+static bool backend_equals(backend *const b, const std::vector<uint8_t> & expected)
+{
+	std::vector<uint8_t> buffer(expected.size());
+	return b->read(0, expected.size() / bs, buffer.data()) && buffer == expected;
+}
+
+// counts what reaches the backend below the one that is tested, and can
+// make it fail
+template <typename T>
+class test_backend : public T
+{
+public:
+	std::atomic_bool     fail          { false };
+	std::atomic_uint64_t n_write_calls { 0     };
+	std::atomic_uint64_t n_blocks_read { 0     };
+
+	using T::T;
+
+	bool write(const uint64_t block_nr, const uint32_t n_blocks, const uint8_t *const data) override
+	{
+		if (fail)
+			return false;
+		n_write_calls++;
+		return T::write(block_nr, n_blocks, data);
+	}
+
+	bool read(const uint64_t block_nr, const uint32_t n_blocks, uint8_t *const data) override
+	{
+		if (fail)
+			return false;
+		n_blocks_read += n_blocks;
+		return T::read(block_nr, n_blocks, data);
+	}
+};
+
+// exclusive ranges are never held twice, shared ones never together with
+// an exclusive one
+void test_range_lock()
+{
+	printf("range lock\n");
+
+	constexpr int n_blocks = 256;
+	range_lock    rl;
+	std::atomic_int owner  [n_blocks] { };  // 0 free, -1 exclusive, else number of readers
+	std::atomic_int n_errors { 0 };
+
+	std::vector<std::thread> threads;
+	for(int t=0; t<8; t++) {
+		threads.emplace_back([&, t] {
+			std::mt19937 g(t);
+
+			for(int i=0; i<20000; i++) {
+				uint32_t n     = 1 + g() % 32;
+				uint64_t block = g() % (n_blocks - n);
+				bool     excl  = g() % 3 == 0;
+
+				range_lock_guard lck(&rl, block, n, excl ? range_lock::rl_exclusive : range_lock::rl_shared);
+				for(uint32_t b=0; b<n; b++) {
+					if (excl) {
+						int expected = 0;
+						n_errors += owner[block + b].compare_exchange_strong(expected, -1) == false;
+					}
+					else {
+						n_errors += owner[block + b]++ < 0;
+					}
+				}
+
+				std::this_thread::yield();
+
+				for(uint32_t b=0; b<n; b++) {
+					if (excl)
+						owner[block + b] = 0;
+					else
+						owner[block + b]--;
+				}
+			}
+		});
+	}
+
+	for(auto & th: threads)
+		th.join();
+
+	CHECK(n_errors == 0);
+
+	// a waiting writer blocks new readers of that range, but not of others
+	std::vector<int> order;
+	std::mutex order_lock;
+	auto log_step = [&](const int nr) { std::unique_lock<std::mutex> lck(order_lock); order.push_back(nr); };
+
+	range_lock::entry reader1;
+	rl.acquire(&reader1, 0, 10, range_lock::rl_shared);
+
+	std::thread writer([&] {
+		range_lock_guard lck(&rl, 5, 10, range_lock::rl_exclusive);
+		log_step(2);
+	});
+	usleep(100000);
+
+	std::thread reader2([&] {
+		range_lock_guard lck(&rl, 0, 10, range_lock::rl_shared);
+		log_step(3);
+	});
+	usleep(100000);
+
+	{
+		range_lock_guard lck(&rl, 100, 10, range_lock::rl_exclusive);  // unrelated
+		log_step(1);
+	}
+
+	rl.release(&reader1);
+	writer.join();
+	reader2.join();
+
+	CHECK((order == std::vector<int> { 1, 2, 3 }));
+}
+
+// written blocks are read back from the cache before they reach the
+// backend; only a sync (or FUA) gets them there, adjacent ones in one write
+void test_writeback()
+{
+	printf("write-back cache\n");
+
+	const uint64_t n_blocks = 256;
+	auto *mem = new test_backend<backend_memory>(n_blocks * bs, false);
+	backend_writeback wb(mem, 16 * bs, 3600 * 1000, 100);
+	CHECK(wb.begin());
+
+	std::mt19937 g(5);
+	std::vector<uint8_t> shadow(n_blocks * bs);
+	std::vector<uint8_t> buffer(bs);
+	const std::vector<uint8_t> zeros(bs);
+
+	fill_random(g, &shadow[5 * bs], bs);
+	CHECK(wb.write(5, 1, &shadow[5 * bs]));
+	CHECK(mem->read(5, 1, buffer.data()) && buffer == zeros);
+	CHECK(wb.read(5, 1, buffer.data()) && memcmp(buffer.data(), &shadow[5 * bs], bs) == 0);
+
+	// FUA goes through; the older cached version must not overwrite it later
+	fill_random(g, &shadow[5 * bs], bs);
+	CHECK(wb.write_fua(5, 1, &shadow[5 * bs]));
+	CHECK(mem->read(5, 1, buffer.data()) && memcmp(buffer.data(), &shadow[5 * bs], bs) == 0);
+	CHECK(wb.sync());
+	CHECK(mem->read(5, 1, buffer.data()) && memcmp(buffer.data(), &shadow[5 * bs], bs) == 0);
+
+	// a trim drops what was cached
+	fill_random(g, buffer.data(), bs);
+	CHECK(wb.write(6, 1, buffer.data()));
+	CHECK(wb.trim(6, 1));
+	CHECK(wb.sync());
+	CHECK(mem->read(6, 1, buffer.data()) && buffer == zeros);
+
+	// overwrites are merged: one write of the last version
+	mem->n_write_calls = 0;
+	for(int i=0; i<4; i++) {
+		fill_random(g, &shadow[8 * bs], 4 * bs);
+		CHECK(wb.write(8, 4, &shadow[8 * bs]));
+	}
+	CHECK(wb.sync());
+	CHECK(mem->n_write_calls == 1);
+	CHECK(backend_equals(mem, shadow));
+
+	// more than fits: writers wait for the flusher then
+	for(int i=0; i<2000; i++) {
+		uint32_t n     = 1 + g() % 8;
+		uint64_t block = g() % (n_blocks - n);
+		int      what  = g() % 4;
+
+		if (what == 0) {
+			CHECK(wb.trim(block, n));
+			memset(&shadow[block * bs], 0x00, n * bs);
+		}
+		else {
+			fill_random(g, &shadow[block * bs], n * bs);
+			CHECK(what == 1 ? wb.write_fua(block, n, &shadow[block * bs]) : wb.write(block, n, &shadow[block * bs]));
+		}
+	}
+
+	CHECK(backend_equals(&wb, shadow));
+	CHECK(wb.sync());
+	CHECK(backend_equals(mem, shadow));
+}
+
+// a block that is read again shortly after it left the FIFO of blocks read
+// once gets into the LRU, and then survives a scan larger than the cache;
+// writes and trims never leave a stale copy behind
+void test_readcache()
+{
+	printf("read cache\n");
+
+	readcache_pool pool(0);  // the minimum: 16 blocks per shard, 4 of them for blocks read once
+	CHECK(pool.begin());
+
+	const uint64_t n_blocks = 4096;
+	auto *mem = new test_backend<backend_memory>(n_blocks * bs, false);
+	backend_readcache rc(mem, &pool);
+	CHECK(rc.begin());
+
+	std::vector<uint8_t> buffer(bs);
+	// all blocks used here are a multiple of 16: they are in the same shard
+	auto is_hit = [&](const uint64_t block) {
+		uint64_t before = mem->n_blocks_read;
+		CHECK(rc.read(block, 1, buffer.data()));
+		return mem->n_blocks_read == before;
+	};
+
+	const uint64_t hot = 0;
+	CHECK(is_hit(hot) == false);
+	CHECK(is_hit(hot));
+	const uint64_t fifo_end = 320;
+	for(uint64_t block=16; block<=fifo_end; block += 16)  // pushes it out of the FIFO
+		CHECK(is_hit(block) == false);
+	CHECK(is_hit(hot) == false);  // remembered: into the LRU now
+	for(uint64_t block=fifo_end + 16; block<n_blocks; block += 16)
+		CHECK(is_hit(block) == false);
+	CHECK(is_hit(hot));
+	CHECK(is_hit(16) == false);
+
+	std::mt19937 g(6);
+	std::vector<uint8_t> data(bs);
+	fill_random(g, data.data(), bs);
+	CHECK(rc.write(hot, 1, data.data()));
+	CHECK(rc.read(hot, 1, buffer.data()) && buffer == data);
+	CHECK(rc.trim(hot, 1));
+	CHECK(rc.read(hot, 1, buffer.data()) && buffer == std::vector<uint8_t>(bs));
+
+	// another cache in the same pool has its own blocks
+	auto *mem2 = new backend_memory(n_blocks * bs, false);
+	backend_readcache rc2(mem2, &pool);
+	CHECK(rc2.begin());
+	CHECK(rc.write(hot, 1, data.data()));
+	CHECK(rc.read(hot, 1, buffer.data()) && buffer == data);
+	CHECK(rc2.read(hot, 1, buffer.data()) && buffer == std::vector<uint8_t>(bs));
+}
+
+// clusters that were never written read as zeros, whatever the backend
+// holds; which ones are allocated survives a restart
+void test_bitmap()
+{
+	printf("allocation bitmap (the error about the size of the bitmap is expected)\n");
+
+	const std::string data_file   = temp_file("bitmap-data");
+	const std::string bitmap_file = temp_file("bitmap");
+	const uint64_t    n_blocks    = 64;
+	const uint32_t    cluster     = 4;
+	std::mt19937      g(7);
+
+	std::vector<uint8_t> garbage(n_blocks * bs);
+	fill_random(g, garbage.data(), garbage.size());
+	CHECK(write_file(data_file, garbage));
+
+	auto open_bitmap = [&](const uint32_t cluster_blocks) -> backend_bitmap * {
+		backend_bitmap *b = new backend_bitmap(new backend_file(data_file), bitmap_file, cluster_blocks, true);
+		if (b->begin())
+			return b;
+		delete b;
+		return nullptr;
+	};
+
+	backend_bitmap *b = open_bitmap(cluster);
+	CHECK(b);
+	if (!b)
+		return;
+
+	std::vector<uint8_t> shadow(n_blocks * bs);
+	CHECK(backend_equals(b, shadow));
+	CHECK(b->get_free_space_percentage() == 100);
+
+	// the rest of its cluster reads as zeros too
+	fill_random(g, &shadow[1 * bs], bs);
+	CHECK(b->write(1, 1, &shadow[1 * bs]));
+	CHECK(backend_equals(b, shadow));
+
+	for(int i=0; i<200; i++) {
+		uint32_t n     = 1 + g() % 6;
+		uint64_t block = 2 * cluster + g() % (n_blocks - 2 * cluster - n);
+
+		if (g() % 3 == 0) {
+			CHECK(b->trim(block, n));
+			memset(&shadow[block * bs], 0x00, n * bs);
+		}
+		else {
+			fill_random(g, &shadow[block * bs], n * bs);
+			CHECK(b->write(block, n, &shadow[block * bs]));
+		}
+	}
+
+	CHECK(backend_equals(b, shadow));
+	uint8_t free_space = b->get_free_space_percentage();
+	delete b;
+
+	b = open_bitmap(cluster);
+	CHECK(b && backend_equals(b, shadow));
+	if (b) {
+		CHECK(b->get_free_space_percentage() == free_space);
+
+		backend::lba_status_t status = backend::LS_MAPPED;
+		uint64_t              n_same = 0;
+		CHECK(b->get_lba_status(0, n_blocks, &status, &n_same) && status == backend::LS_MAPPED && n_same == cluster);
+		CHECK(b->get_lba_status(cluster, n_blocks - cluster, &status, &n_same) && status == backend::LS_DEALLOCATED && n_same == cluster);
+		delete b;
+	}
+
+	// a bitmap is made for one cluster size
+	b = open_bitmap(cluster * 2);
+	CHECK(b == nullptr);
+	delete b;
+
+	unlink(data_file.c_str());
+	unlink(bitmap_file.c_str());
+}
+
+void test_merge_ranges()
+{
+	printf("UNMAP descriptor merging\n");
+
+	typedef std::vector<std::pair<uint64_t, uint64_t> > ranges_t;
+
+	CHECK(merge_ranges({ }).empty());
+	CHECK((merge_ranges({ { 10, 20 } }) == ranges_t { { 10, 20 } }));
+	// unsorted, adjacent and overlapping
+	CHECK((merge_ranges({ { 30, 40 }, { 10, 20 }, { 20, 30 } }) == ranges_t { { 10, 40 } }));
+	CHECK((merge_ranges({ { 10, 25 }, { 20, 30 } }) == ranges_t { { 10, 30 } }));
+	// contained in another
+	CHECK((merge_ranges({ { 10, 100 }, { 20, 30 }, { 50, 60 } }) == ranges_t { { 10, 100 } }));
+	// a gap of one block stays a gap
+	CHECK((merge_ranges({ { 21, 30 }, { 10, 20 }, { 0, 5 } }) == ranges_t { { 0, 5 }, { 10, 20 }, { 21, 30 } }));
+	// the same range multiple times
+	CHECK((merge_ranges({ { 7, 8 }, { 7, 8 }, { 7, 8 } }) == ranges_t { { 7, 8 } }));
+
+	// many single blocks, as after deleting many small files
+	std::mt19937 g(3);
+	ranges_t in;
+	std::vector<bool> set(10000);
+	for(int i=0; i<5000; i++) {
+		uint64_t b = g() % set.size();
+		in.push_back({ b, b + 1 });
+		set[b] = true;
+	}
+
+	auto merged = merge_ranges(in);
+	std::vector<bool> check(set.size());
+	bool disjoint = true;
+	for(size_t i=0; i<merged.size(); i++) {
+		for(uint64_t b=merged[i].first; b<merged[i].second; b++)
+			check[b] = true;
+		if (i > 0 && merged[i - 1].second >= merged[i].first)
+			disjoint = false;  // should have been merged
+	}
+	CHECK(check == set);
+	CHECK(disjoint);
+}
+
+// ranges that were trimmed read as zeros right away, also when they are
+// partially overwritten while they are still pending; a sync passes all
+// of them on
+void test_discard()
+{
+	printf("background discard\n");
+
+	const uint64_t n_blocks = 1024;
+	auto *mem = new test_backend<backend_memory>(n_blocks * bs, false);
+	backend_discard d(mem, bs);  // one block per second: nearly everything stays pending
+	CHECK(d.begin());
+
+	std::mt19937 g(8);
+	std::vector<uint8_t> shadow(n_blocks * bs);
+	fill_random(g, shadow.data(), shadow.size());
+	CHECK(d.write(0, n_blocks, shadow.data()));
+
+	// the discarder takes the lowest range first, then waits a second
+	CHECK(d.trim(0, 1));
+	memset(&shadow[0], 0x00, bs);
+	CHECK(d.trim(1000, 8));
+	memset(&shadow[1000 * bs], 0x00, 8 * bs);
+
+	backend::lba_status_t status = backend::LS_MAPPED;
+	uint64_t              n_same = 0;
+	CHECK(d.get_lba_status(1000, 24, &status, &n_same) && status == backend::LS_DEALLOCATED && n_same == 8);
+
+	// compares against the zeros that a read returns
+	const std::vector<uint8_t> zeros(bs);
+	fill_random(g, &shadow[1003 * bs], bs);
+	CHECK(d.cmpwrite(1003, 1, &shadow[1003 * bs], zeros.data()) == backend::CWR_OK);
+	CHECK(d.cmpwrite(1003, 1, &shadow[1003 * bs], zeros.data()) == backend::CWR_MISMATCH);
+	CHECK(backend_equals(&d, shadow));
+
+	for(int i=0; i<2000; i++) {
+		uint32_t n     = 1 + g() % 16;
+		uint64_t block = g() % (n_blocks - n);
+		int      what  = g() % 3;
+
+		if (what == 0) {
+			CHECK(d.trim(block, n));
+			memset(&shadow[block * bs], 0x00, n * bs);
+		}
+		else if (what == 1) {
+			std::vector<uint8_t> compare(&shadow[block * bs], &shadow[(block + n) * bs]);
+			fill_random(g, &shadow[block * bs], n * bs);
+			CHECK(d.cmpwrite(block, n, &shadow[block * bs], compare.data()) == backend::CWR_OK);
+		}
+		else {
+			fill_random(g, &shadow[block * bs], n * bs);
+			CHECK(d.write(block, n, &shadow[block * bs]));
+		}
+	}
+
+	CHECK(backend_equals(&d, shadow));
+	CHECK(d.sync());
+	CHECK(backend_equals(mem, shadow));
+}
+
+// sequential and strided readers get what they read next before they ask
+// for it, random reads get no readahead at all
+void test_stream_detector()
+{
+	printf("stream detector\n");
+
+	const uint64_t device_size = 1 << 20;  // blocks
+
+	{
+		stream_detector sd(bs);
+		std::mt19937_64 g(9);
+		size_t n = 0;
+		for(int i=0; i<10000; i++)
+			n += sd.access(g() % (device_size - 8), 8, device_size).size();
+		CHECK(n == 0);
+	}
+
+	// from the 3rd read on, each one was read ahead; the window grows
+	{
+		stream_detector sd(bs);
+		uint64_t ra_end     = 0;
+		uint32_t max_n      = 0;
+		bool     contiguous = true;
+		bool     in_time    = true;
+		for(uint64_t block=0; block<100000; block += 8) {
+			if (block >= 16 && block + 8 > ra_end)
+				in_time = false;
+
+			for(auto & ra: sd.access(block, 8, device_size)) {
+				if (ra_end && ra.block_nr != ra_end)
+					contiguous = false;
+				ra_end = ra.block_nr + ra.n_blocks;
+				max_n  = std::max(max_n, ra.n_blocks);
+			}
+		}
+		CHECK(contiguous);
+		CHECK(in_time);
+		CHECK(max_n > 32 && max_n <= 2048);
+	}
+
+	// never beyond the end of the device
+	{
+		stream_detector sd(bs);
+		bool inside = true;
+		for(uint64_t block=device_size - 4000; block + 8 <= device_size; block += 8) {
+			for(auto & ra: sd.access(block, 8, device_size))
+				inside &= ra.n_blocks > 0 && ra.block_nr + ra.n_blocks <= device_size;
+		}
+		CHECK(inside);
+	}
+
+	// 4 blocks every 64: only those are read ahead, not the gaps
+	{
+		stream_detector sd(bs);
+		std::set<uint64_t> predicted;
+		bool   only_next = true;
+		size_t n_in_time = 0;
+		for(uint64_t i=0; i<1000; i++) {
+			uint64_t block = i * 64;
+			n_in_time += predicted.count(block);
+
+			for(auto & ra: sd.access(block, 4, device_size)) {
+				only_next &= ra.n_blocks == 4 && ra.block_nr % 64 == 0 && ra.block_nr > block;
+				predicted.insert(ra.block_nr);
+			}
+		}
+		CHECK(only_next);
+		CHECK(n_in_time >= 990);
+	}
+
+	// two interleaved readers (e.g. a copy of two files) both get readahead
+	{
+		stream_detector sd(bs);
+		uint64_t n_ra[2] { };
+		for(uint64_t i=0; i<1000; i++) {
+			for(uint64_t s=0; s<2; s++) {
+				for(auto & ra: sd.access(s * device_size / 2 + i * 8, 8, device_size))
+					n_ra[ra.block_nr >= device_size / 2] += ra.n_blocks;
+			}
+		}
+		CHECK(n_ra[0] > 0 && n_ra[1] > 0);
+	}
+}
+
+// block b is on child (b / unit) % n, at (b / unit / n) * unit + b % unit
+void test_stripe()
+{
+	printf("striping\n");
+
+	const uint32_t unit         = 4;
+	const uint64_t child_blocks = 30;  // not a multiple of the unit: the rest is not used
+	std::vector<test_backend<backend_memory> *> children;
+	std::vector<backend *> as_backend;
+	for(int i=0; i<3; i++) {
+		children.push_back(new test_backend<backend_memory>(child_blocks * bs, false));
+		as_backend.push_back(children.back());
+	}
+
+	backend_stripe s(as_backend, unit);
+	CHECK(s.begin());
+	CHECK(s.get_size_in_blocks() == child_blocks / unit * unit * children.size());
+
+	const uint64_t n_blocks = s.get_size_in_blocks();
+	std::mt19937 g(10);
+	std::vector<uint8_t> shadow(n_blocks * bs);
+	fill_random(g, shadow.data(), shadow.size());
+	CHECK(s.write(0, n_blocks, shadow.data()));
+
+	bool mapped = true;
+	std::vector<uint8_t> buffer(bs);
+	for(uint64_t block=0; block<n_blocks; block++) {
+		uint64_t unit_nr = block / unit;
+		auto    *child   = children[unit_nr % children.size()];
+		mapped &= child->read(unit_nr / children.size() * unit + block % unit, 1, buffer.data()) && memcmp(buffer.data(), &shadow[block * bs], bs) == 0;
+	}
+	CHECK(mapped);
+
+	// any size and alignment
+	for(int i=0; i<500; i++) {
+		uint32_t n     = 1 + g() % 20;
+		uint64_t block = g() % (n_blocks - n);
+		int      what  = g() % 4;
+
+		if (what == 0) {
+			CHECK(s.trim(block, n));
+			memset(&shadow[block * bs], 0x00, n * bs);
+		}
+		else if (what == 1) {
+			CHECK(s.write_zeroes(block, n));
+			memset(&shadow[block * bs], 0x00, n * bs);
+		}
+		else {
+			fill_random(g, &shadow[block * bs], n * bs);
+			CHECK(what == 2 ? s.write_fua(block, n, &shadow[block * bs]) : s.write(block, n, &shadow[block * bs]));
+		}
+
+		if (i % 50 == 0)
+			CHECK(backend_equals(&s, shadow));
+	}
+
+	CHECK(backend_equals(&s, shadow));
+}
+
+// a leg that was dropped gets, when it is back, only the regions that were
+// written in the mean time (also over a restart), then the legs are equal
+void test_mirror()
+{
+	printf("mirror (the errors about a failed leg are expected)\n");
+
+	const uint64_t    n_blocks  = 64;
+	const uint32_t    region    = 4;  // blocks
+	const std::string leg_files[] { temp_file("mirror-leg0"), temp_file("mirror-leg1") };
+	const std::string drl_file  = temp_file("mirror-drl");
+	std::mt19937      g(11);
+
+	for(auto & f: leg_files)
+		CHECK(write_file(f, std::vector<uint8_t>(n_blocks * bs)));
+
+	test_backend<backend_file> *legs[2] { };
+	auto open_mirror = [&]() -> backend_mirror * {
+		for(int i=0; i<2; i++)
+			legs[i] = new test_backend<backend_file>(leg_files[i]);
+
+		backend_mirror *m = new backend_mirror({ legs[0], legs[1] }, 0, drl_file, region * bs);
+		if (m->begin())
+			return m;
+		delete m;
+		return nullptr;
+	};
+
+	std::vector<uint8_t> shadow(n_blocks * bs);
+	fill_random(g, shadow.data(), shadow.size());
+
+	backend_mirror *m = open_mirror();
+	CHECK(m);
+	if (!m)
+		return;
+	CHECK(m->write(0, n_blocks, shadow.data()));
+	delete m;
+
+	// leg 1 fails at the first of these writes: only leg 0 gets them
+	m = open_mirror();
+	CHECK(m);
+	if (!m)
+		return;
+	legs[1]->fail = true;
+	const uint64_t dirty[] { 4, 20, 44 };
+	for(auto block: dirty) {
+		fill_random(g, &shadow[block * bs], region * bs);
+		CHECK(m->write(block, region, &shadow[block * bs]));
+	}
+	CHECK(backend_equals(m, shadow));
+	delete m;
+
+	// back again, after a restart: resynced in the background
+	m = open_mirror();
+	CHECK(m);
+	if (!m)
+		return;
+
+	bool in_sync = false;
+	for(int i=0; i<100 && !in_sync; i++) {
+		usleep(100000);
+		in_sync = read_file(leg_files[1]) == shadow;
+	}
+	CHECK(in_sync);
+
+	backend_stats_t stats { };
+	legs[1]->get_and_reset_stats(&stats);
+	CHECK(stats.bytes_written == sizeof(dirty) / sizeof(dirty[0]) * region * bs);
+	CHECK(backend_equals(m, shadow));
+	delete m;
+
+	for(auto & f: leg_files)
+		unlink(f.c_str());
+	unlink(drl_file.c_str());
+}
+
+// every kernel against the byte-wise multiplication, also for lengths
+// and alignments that are not a multiple of the vector size
+void test_gf256()
+{
+	printf("GF(2^8)\n");
+
+	for(int a=1; a<256; a++)
+		CHECK(gf_mul(a, gf_inv(a)) == 1);
+
+	std::mt19937 g(1);
+	std::vector<uint8_t> src(4096 + 64);
+	std::vector<uint8_t> dst(src.size());
+	std::vector<uint8_t> expected(src.size());
+
+	for(auto & kernel: gf_get_kernels()) {
+		printf(" kernel %s\n", kernel.c_str());
+		CHECK(gf_set_kernel(kernel));
+
+		for(int c=0; c<256; c++) {
+			size_t n      = g() % 4096;
+			size_t offset = g() % 64;
+			bool   add    = c & 1;
+			fill_random(g, src.data(), src.size());
+			fill_random(g, dst.data(), dst.size());
+			expected = dst;
+
+			for(size_t i=0; i<n; i++)
+				expected[offset + i] = gf_mul(c, src[offset + i]) ^ (add ? expected[offset + i] : 0);
+
+			gf_mul_region(c, &src[offset], &dst[offset], n, add);
+			if (dst != expected) {
+				printf("  FAILED: kernel %s, constant %d, %zu bytes at offset %zu, add: %d\n", kernel.c_str(), c, n, offset, add);
+				ok = false;
+			}
+		}
+	}
+
+	gf_set_kernel(gf_get_kernels().back());
+}
+
+// encodes, then loses every possible set of at most m children: all data
+// must still read back, also after writes in the degraded state
+void test_erasure()
+{
+	printf("erasure coding (the errors about failed children are expected)\n");
+
+	const std::vector<std::pair<uint32_t, uint32_t> > geometries { { 2, 1 }, { 4, 2 }, { 3, 3 }, { 5, 3 } };  // k, m
+	std::mt19937 g(2);
+
+	for(auto & geometry: geometries) {
+		const uint32_t k = geometry.first;
+		const uint32_t m = geometry.second;
+		const uint32_t n = k + m;
+		printf(" %u data + %u parity children\n", k, m);
+
+		for(uint32_t lost=1; lost<(1u << n); lost++) {
+			if (__builtin_popcount(lost) > int(m))
+				continue;
+
+			std::vector<backend *> children;
+			std::vector<test_backend<backend_memory> *> flaky;
+			for(uint32_t i=0; i<n; i++) {
+				flaky.push_back(new test_backend<backend_memory>(16 * 4 * bs, false));
+				children.push_back(flaky.back());
+			}
+
+			backend_erasure e(children, m, 4, "");
+			if (e.begin() == false) {
+				CHECK(false);
+				continue;
+			}
+
+			uint64_t n_blocks = e.get_size_in_blocks();
+			std::vector<uint8_t> shadow(n_blocks * bs);
+			std::vector<uint8_t> buffer(n_blocks * bs);
+			fill_random(g, shadow.data(), shadow.size());
+			CHECK(e.write(0, n_blocks, shadow.data()));
+
+			for(uint32_t i=0; i<n; i++)
+				flaky[i]->fail = lost & (1 << i);
+
+			bool read_ok = e.read(0, n_blocks, buffer.data()) && buffer == shadow;
+
+			// read-modify-write and full stripe writes with children missing
+			for(int i=0; i<8; i++) {
+				uint32_t cur_n = 1 + g() % 12;
+				uint64_t block = g() % (n_blocks - cur_n);
+				fill_random(g, &shadow[block * bs], cur_n * bs);
+				CHECK(e.write(block, cur_n, &shadow[block * bs]));
+			}
+
+			bool degraded_ok = e.read(0, n_blocks, buffer.data()) && buffer == shadow;
+
+			if (!read_ok || !degraded_ok) {
+				printf("  FAILED: children lost: %x, read: %d, after degraded writes: %d\n", lost, read_ok, degraded_ok);
+				ok = false;
+			}
+		}
+	}
+}
+
+void test_radix_map()
+{
+	printf("radix map\n");
+
+	for(uint64_t n_keys: { uint64_t(100), uint64_t(512), uint64_t(513), uint64_t(1) << 30, uint64_t(1) << 40 }) {
+		radix_map rm(n_keys);
+		std::map<uint64_t, uint64_t> reference;
+		std::mt19937_64 g(n_keys);
+
+		for(int i=0; i<20000; i++) {
+			uint64_t key   = g() % n_keys;
+			uint64_t value = g() % 4 == 0 ? 0 : g();
+			rm.set(key, value);
+			reference[key] = value;
+		}
+
+		// the first and the last key are the edges of the levels
+		rm.set(0, 1);
+		reference[0] = 1;
+		rm.set(n_keys - 1, 2);
+		reference[n_keys - 1] = 2;
+
+		bool equal = true;
+		for(auto & entry: reference)
+			equal &= rm.get(entry.first) == entry.second;
+
+		for(int i=0; i<20000; i++) {
+			uint64_t key = g() % n_keys;
+			auto     it  = reference.find(key);
+			equal &= rm.get(key) == (it == reference.end() ? 0 : it->second);
+		}
+
+		if (!equal) {
+			printf("  FAILED: %" PRIu64 " keys\n", n_keys);
+			ok = false;
+		}
+
+		CHECK(rm.get_memory_usage() > 0);
+	}
+}
+
+static backend_cow *open_cow(const std::string & base_file, const std::string & overlay_file, const int64_t revert_to)
+{
+	backend_cow *b = new backend_cow(new backend_file(base_file), overlay_file, 2, revert_to);
+	if (b->begin() == false) {
+		delete b;
+		return nullptr;
+	}
+
+	return b;
+}
+
+// the map of the overlay must come back from the journal after a restart,
+// also for a journal with a torn last record and when reverting
+void test_cow_journal()
+{
+	printf("copy-on-write journal\n");
+
+	const std::string base_file    = temp_file("cow-base");
+	const std::string overlay_file = temp_file("cow-overlay");
+	const uint64_t    n_blocks     = 64;
+	std::mt19937      g(4);
+
+	std::vector<uint8_t> base(n_blocks * bs);
+	fill_random(g, base.data(), base.size());
+	CHECK(write_file(base_file, base));
+
+	std::vector<std::vector<uint8_t> > generations { base };  // the contents per snapshot
+	std::vector<uint8_t> shadow = base;
+
+	backend_cow *b = open_cow(base_file, overlay_file, -1);
+	CHECK(b);
+	if (!b)
+		return;
+
+	for(int gen=1; gen<=3; gen++) {
+		for(int i=0; i<20; i++) {
+			uint32_t n     = 1 + g() % 5;
+			uint64_t block = g() % (n_blocks - n);
+			int      what  = g() % 4;
+
+			if (what == 0) {
+				CHECK(b->trim(block, n));
+				memset(&shadow[block * bs], 0x00, n * bs);
+			}
+			else if (what == 1) {
+				CHECK(b->write_zeroes(block, n));
+				memset(&shadow[block * bs], 0x00, n * bs);
+			}
+			else {
+				fill_random(g, &shadow[block * bs], n * bs);
+				CHECK(b->write(block, n, &shadow[block * bs]));
+			}
+		}
+
+		if (gen < 3) {
+			CHECK(b->take_snapshot());
+			generations.push_back(shadow);
+		}
+	}
+
+	CHECK(backend_equals(b, shadow));
+	delete b;
+
+	// replay
+	b = open_cow(base_file, overlay_file, -1);
+	CHECK(b && backend_equals(b, shadow));
+	delete b;
+
+	// a record that was half written when iESP stopped is ignored
+	FILE *fh = fopen((overlay_file + ".map").c_str(), "ab");
+	CHECK(fh && fwrite("torn", 1, 4, fh) == 4);
+	if (fh)
+		fclose(fh);
+
+	b = open_cow(base_file, overlay_file, -1);
+	CHECK(b && backend_equals(b, shadow));
+	delete b;
+
+	// back to snapshot 2, then 1, then the base itself
+	for(int gen=2; gen>=0; gen--) {
+		b = open_cow(base_file, overlay_file, gen);
+		CHECK(b && backend_equals(b, generations.at(gen)));
+		delete b;
+
+		b = open_cow(base_file, overlay_file, -1);
+		CHECK(b && backend_equals(b, generations.at(gen)));
+		delete b;
+	}
+
+	unlink(base_file.c_str());
+	unlink(overlay_file.c_str());
+	unlink((overlay_file + ".map").c_str());
+}
+
+// clones that all read the whole image at the same time: each block of the
+// base is read only once, and each clone sees its own writes only
+void test_golden()
+{
+	printf("linked clones\n");
+
+	const uint64_t n_blocks = 512;
+	const uint32_t chunk    = 4;
+	const int      n_clones = 8;
+	std::mt19937   g(12);
+
+	readcache_pool pool(64 * 1024 * 1024);
+	CHECK(pool.begin());
+
+	std::vector<uint8_t> contents(n_blocks * bs);
+	fill_random(g, contents.data(), contents.size());
+
+	auto *base  = new test_backend<backend_memory>(n_blocks * bs, false);
+	auto  image = std::make_shared<golden_image>(base, &pool, chunk);
+	CHECK(image->begin());
+	CHECK(base->write(0, n_blocks, contents.data()));  // below the cache, it is still empty
+
+	std::vector<backend_cow *> clones;
+	for(int i=0; i<n_clones; i++) {
+		clones.push_back(new backend_cow(new backend_golden(image), temp_file(myformat("clone-%d", i)), chunk, -1));
+		CHECK(clones.back()->begin());
+	}
+
+	std::atomic_int n_errors { 0 };
+	std::vector<std::thread> threads;
+	for(int i=0; i<n_clones; i++) {
+		threads.emplace_back([&, i] {
+			backend_cow *const c = clones[i];
+			std::mt19937 rnd(i);
+
+			std::vector<uint8_t> own(bs, 'a' + i);
+			if (c->write(i, 1, own.data()) == false)
+				n_errors++;
+
+			std::vector<uint64_t> order;
+			for(uint64_t block=0; block<n_blocks; block += 8)
+				order.push_back(block);
+			std::shuffle(order.begin(), order.end(), rnd);
+
+			std::vector<uint8_t> buffer(8 * bs);
+			for(auto block: order) {
+				if (c->read(block, 8, buffer.data()) == false) {
+					n_errors++;
+					continue;
+				}
+
+				for(uint64_t k=0; k<8; k++) {
+					const uint8_t *expected = block + k == uint64_t(i) ? own.data() : &contents[(block + k) * bs];
+					n_errors += memcmp(&buffer[k * bs], expected, bs) != 0;
+				}
+			}
+		});
+	}
+
+	for(auto & th: threads)
+		th.join();
+
+	CHECK(n_errors == 0);
+	CHECK(base->n_blocks_read == n_blocks);
+
+	for(int i=0; i<n_clones; i++) {
+		delete clones[i];
+		unlink(temp_file(myformat("clone-%d", i)).c_str());
+		unlink(temp_file(myformat("clone-%d.map", i)).c_str());
+	}
+}
+
+// which chunks are local survives a restart: with the remote gone, those
+// still read back, and only those
+void test_stream()
+{
+	printf("streaming (the errors about the remote are expected)\n");
+
+	const std::string remote_file  = temp_file("stream-remote");
+	const std::string local_file   = temp_file("stream-local");
+	const std::string present_file = temp_file("stream-present");
+	const uint64_t    n_blocks     = 256;
+	const uint32_t    chunk        = 4;
+	std::mt19937      g(13);
+
+	std::vector<uint8_t> shadow(n_blocks * bs);
+	fill_random(g, shadow.data(), shadow.size());
+	CHECK(write_file(remote_file, shadow));
+
+	test_backend<backend_file> *remote = nullptr;
+	auto open_stream = [&](const uint32_t chunk_blocks) -> backend_stream * {
+		remote = new test_backend<backend_file>(remote_file);
+		// a chunk per 4 seconds: the background copy hardly gets anywhere
+		backend_stream *s = new backend_stream(remote, local_file, present_file, chunk_blocks, 0, bs);
+		if (s->begin())
+			return s;
+		delete s;
+		return nullptr;
+	};
+
+	backend_stream *s = open_stream(chunk);
+	CHECK(s);
+	if (!s)
+		return;
+
+	std::vector<uint8_t> buffer(16 * bs);
+	CHECK(s->read(40, 10, buffer.data()) && memcmp(buffer.data(), &shadow[40 * bs], 10 * bs) == 0);
+	// a part of a chunk: the rest of it comes from the remote
+	fill_random(g, &shadow[101 * bs], bs);
+	CHECK(s->write(101, 1, &shadow[101 * bs]));
+	CHECK(s->trim(120, 4));
+	memset(&shadow[120 * bs], 0x00, 4 * bs);
+	CHECK(s->read(100, 4, buffer.data()) && memcmp(buffer.data(), &shadow[100 * bs], 4 * bs) == 0);
+	delete s;
+
+	s = open_stream(chunk);
+	CHECK(s);
+	if (!s)
+		return;
+	remote->fail = true;
+
+	const std::pair<uint64_t, uint32_t> local[] { { 40, 12 }, { 100, 4 }, { 120, 4 } };  // whole chunks
+	for(auto & r: local)
+		CHECK(s->read(r.first, r.second, buffer.data()) && memcmp(buffer.data(), &shadow[r.first * bs], r.second * bs) == 0);
+	CHECK(s->read(n_blocks - chunk, chunk, buffer.data()) == false);
+	delete s;
+
+	// the present file is made for one chunk size
+	s = open_stream(chunk * 2);
+	CHECK(s == nullptr);
+	delete s;
+
+	unlink(remote_file.c_str());
+	unlink(local_file.c_str());
+	unlink(present_file.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+	logging::initlogger();
+	logging::setlog(temp_file("log").c_str(), logging::ll_error, logging::ll_error);
+
+	test_range_lock();
+	test_writeback();
+	test_readcache();
+	test_bitmap();
+	test_merge_ranges();
+	test_discard();
+	test_stream_detector();
+	test_stripe();
+	test_mirror();
+	test_gf256();
+	test_erasure();
+	test_radix_map();
+	test_cow_journal();
+	test_golden();
+	test_stream();
+
+	unlink(temp_file("log").c_str());
+
+	printf("%s\n", ok ? "all ok" : "FAILED");
+
+	return !ok;
+}
@@ -1,8 +1,10 @@
+#include <algorithm>
 #include <cstdarg>
 #include <cstdint>
 #include <cstring>
 #include <string>
 #include <unistd.h>
+#include <utility>
 #include <vector>
 #if defined(RP2040W) || defined(ARDUINO)
 #include <Arduino.h>
@@ -16,6 +18,12 @@
 #endif
 #include <time.h>
 #include <sys/types.h>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define ZERO_X86  // AVX2 is selected at runtime, the build need not enable it
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 #if !defined(__MINGW32__)
 #if !defined(TEENSY4_1) && !defined(RP2040W)
 #include <arpa/inet.h>
@@ -226,15 +234,27 @@ void encode_lun(uint8_t *const target, const uint64_t lun_nr)
 		target[1] = lun_nr;
 	}
 	else if (lun_nr < 0x4000) {
-		target[0] = 1;
-		target[1] = lun_nr >> 8;
-		target[2] = lun_nr;
+		target[0] = 0x40 | (lun_nr >> 8);  // flat space addressing
+		target[1] = lun_nr;
 	}
 	else {
 		memcpy(target, &lun_nr, 8);  // TODO
 	}
 }
 
+uint64_t decode_lun(const uint8_t *const source)
+{
+	if (source[0] == 0)  // peripheral device addressing, bus 0
+		return source[1];
+
+	if ((source[0] >> 6) == 1)  // flat space addressing
+		return ((source[0] & 0x3f) << 8) | source[1];
+
+	uint64_t lun_nr = 0;
+	memcpy(&lun_nr, source, 8);  // TODO
+	return lun_nr;
+}
+
 uint16_t my_HTONS(const uint16_t x)
 {
 	constexpr const uint16_t e = 1;
@@ -270,6 +290,94 @@ uint8_t * duplicate_new(const void *const in, const size_t n)
 	return out;
 }
 
+static bool is_zero_tail(const uint8_t *const p, size_t i, const size_t n)
+{
+	for(; i + 8 <= n; i += 8) {
+		uint64_t w = 0;
+		memcpy(&w, &p[i], sizeof w);
+		if (w)
+			return false;
+	}
+
+	for(; i < n; i++) {
+		if (p[i])
+			return false;
+	}
+
+	return true;
+}
+
+#if defined(ZERO_X86)
+__attribute__((target("avx2")))
+static bool is_zero_avx2(const uint8_t *const p, const size_t n)
+{
+	size_t i = 0;
+	for(; i + 128 <= n; i += 128) {
+		__m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i +  0]));
+		__m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i + 32]));
+		__m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i + 64]));
+		__m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&p[i + 96]));
+		__m256i o = _mm256_or_si256(_mm256_or_si256(a, b), _mm256_or_si256(c, d));
+		if (_mm256_testz_si256(o, o) == 0)
+			return false;
+	}
+
+	return is_zero_tail(p, i, n);
+}
+#endif
+
+// true when all 'n' bytes are 0x00
+// 64 or 128 bytes are OR-ed together per test so that the loop is bound by
+// memory bandwidth instead of by the branches
+bool is_zero(const uint8_t *const p, const size_t n)
+{
+#if defined(ZERO_X86)
+	static const bool has_avx2 = [] { __builtin_cpu_init(); return __builtin_cpu_supports("avx2") != 0; }();
+	if (has_avx2)
+		return is_zero_avx2(p, n);
+#endif
+
+	size_t i = 0;
+#if defined(__SSE2__)
+	for(; i + 64 <= n; i += 64) {
+		__m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i +  0]));
+		__m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i + 16]));
+		__m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i + 32]));
+		__m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i *>(&p[i + 48]));
+		__m128i o = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(o, _mm_setzero_si128())) != 0xffff)
+			return false;
+	}
+#elif defined(__ARM_NEON)
+	for(; i + 64 <= n; i += 64) {
+		uint8x16_t a = vld1q_u8(&p[i +  0]);
+		uint8x16_t b = vld1q_u8(&p[i + 16]);
+		uint8x16_t c = vld1q_u8(&p[i + 32]);
+		uint8x16_t d = vld1q_u8(&p[i + 48]);
+		uint64x2_t o = vreinterpretq_u64_u8(vorrq_u8(vorrq_u8(a, b), vorrq_u8(c, d)));
+		if ((vgetq_lane_u64(o, 0) | vgetq_lane_u64(o, 1)) != 0)
+			return false;
+	}
+#endif
+
+	return is_zero_tail(p, i, n);
+}
+
+std::vector<std::pair<uint64_t, uint64_t> > merge_ranges(std::vector<std::pair<uint64_t, uint64_t> > ranges)
+{
+	std::sort(ranges.begin(), ranges.end());
+
+	std::vector<std::pair<uint64_t, uint64_t> > merged;
+	for(auto & r: ranges) {
+		if (merged.empty() == false && r.first <= merged.back().second)
+			merged.back().second = std::max(merged.back().second, r.second);
+		else
+			merged.push_back(r);
+	}
+
+	return merged;
+}
+
 #if defined(__MINGW32__)
 // https://stackoverflow.com/questions/40159892/using-asprintf-on-windows
 #ifndef _vscprintf
@@ -3,6 +3,7 @@
 #include <cstdarg>
 #include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
 
 #if defined(__MINGW32__)
@@ -31,8 +32,12 @@ uint64_t get_micros();
 uint64_t get_millis();
 void teensyMAC(uint8_t *const mac);
 void encode_lun(uint8_t *const target, const uint64_t lun_nr);
+uint64_t decode_lun(const uint8_t *const source);
 
 uint8_t * duplicate_new(const void *const in, const size_t n);
+bool is_zero(const uint8_t *const p, const size_t n);
+// sorts the [first, end) ranges and merges those that overlap or touch
+std::vector<std::pair<uint64_t, uint64_t> > merge_ranges(std::vector<std::pair<uint64_t, uint64_t> > ranges);
 
 std::string to_hex(const uint8_t *const in, const size_t n);
 